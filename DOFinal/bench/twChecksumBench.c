@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Benchmark of file checksums in the file transfer manager
+ *
+ *  Times twFileManager_GetChecksum on a 16 MB file at rest: the first call reads and hashes
+ *  the file, later calls come from the (path, size, mtime) cache.  Then it writes a second
+ *  file block by block the way a transfer does, keeping the running checksum up to date,
+ *  and times the checksum of the finished file.
+ *
+ *  Build from DOFinal/bench:
+ *    gcc -std=gnu99 -O2 -I../src twChecksumBench.c ../src/[a-z]*.c -lpthread -lm -o twChecksumBench
+ *  Run it with a directory on the flash to measure, /tmp by default.  The file manager creates
+ *  its staging directory, FILE_XFER_STAGING_DIR, so its parent has to exist and be writable.
+ */
+
+#include "twFileManager.h"
+#include "twLogger.h"
+#include "twMD5.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE 6400
+#define NUM_BLOCKS 2560
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void toHex(const unsigned char * digest, char * hex) {
+	int i = 0;
+	for (i = 0; i < 16; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+int main(int argc, char ** argv) {
+	const char * dir = (argc > 1) ? argv[1] : "/tmp";
+	char atRest[512];
+	char received[64];
+	char block[BLOCK_SIZE];
+	char hex[33];
+	unsigned char digest[16];
+	FILE * f = NULL;
+	twFile * file = NULL;
+	double start = 0;
+	int i = 0;
+	snprintf(atRest, sizeof(atRest), "%s/twChecksumBench.rest", dir);
+	snprintf(received, sizeof(received), "twChecksumBench.recv");
+	for (i = 0; i < BLOCK_SIZE; i++) block[i] = (char)(i * 31);
+	twLogger_SetLevel(TW_WARN);
+	if (twFileManager_Create() || twFileManager_AddVirtualDir("bench", "bench", (char *)dir) != TWX_SUCCESS) {
+		printf("Error creating the file manager\n");
+		return 1;
+	}
+	/* A file at rest */
+	f = fopen(atRest, "wb");
+	if (!f) {
+		printf("Error creating %s\n", atRest);
+		return 1;
+	}
+	for (i = 0; i < NUM_BLOCKS; i++) fwrite(block, 1, BLOCK_SIZE, f);
+	fclose(f);
+	start = now();
+	if (twFileManager_GetChecksum(NULL, atRest, digest)) return 1;
+	toHex(digest, hex);
+	printf("at rest, first call   %8.3f ms  %s\n", (now() - start) * 1e3, hex);
+	start = now();
+	for (i = 0; i < 100; i++) twFileManager_GetChecksum(NULL, atRest, digest);
+	printf("at rest, cached       %8.3f ms\n", (now() - start) * 1e3 / 100);
+	/* A file received block by block */
+	file = twFileManager_OpenFile("bench", "/bench", received, "w");
+	if (!file) {
+		printf("Error opening %s/%s\n", dir, received);
+		return 1;
+	}
+	for (i = 0; i < NUM_BLOCKS; i++) {
+		fwrite(block, 1, BLOCK_SIZE, file->handle);
+		twFileManager_UpdateChecksum(file, (uint64_t)i * BLOCK_SIZE, block, BLOCK_SIZE);
+	}
+	start = now();
+	if (twFileManager_GetChecksum(file, file->realPath, digest)) return 1;
+	toHex(digest, hex);
+	printf("received, running     %8.3f ms  %s\n", (now() - start) * 1e3, hex);
+	twFileManager_CloseFile(file);
+	remove(atRest);
+	snprintf(atRest, sizeof(atRest), "%s/twChecksumBench.recv", dir);
+	remove(atRest);
+	twFileManager_Delete();
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Benchmark of the logging on the websocket send path at the default WARN level
+ *
+ *  Each iteration logs what twWs_SendMessage and twMessage_Send log for one message:
+ *  a TW_LOG_HEX of a 1 KB frame, a TW_LOG_MSG of a request with an infotable and a
+ *  TW_LOG(TW_DEBUG).  None of it is written at WARN, so the time is pure overhead.
+ *
+ *  Build from DOFinal/bench:
+ *    gcc -std=gnu99 -O2 -DDEBUG -I../src twLogBench.c ../src/[a-z]*.c -lpthread -lm -o twLogBench
+ *  Add -DTW_LOG_LEVEL_MIN=TW_WARN to compile the DEBUG and TRACE logging out altogether.
+ *  Build against a tree from before the log gating change to compare.
+ */
+
+#include "twLogger.h"
+#include "twMessages.h"
+#include "twInfoTable.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define ITERATIONS 1000000
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main() {
+	char frame[1024];
+	twMessage * msg = NULL;
+	double start = 0;
+	int i = 0;
+	for (i = 0; i < (int)sizeof(frame); i++) frame[i] = (char)i;
+	twLogger_SetLevel(TW_WARN);
+	twLogger_SetIsVerbose(TRUE);
+	msg = twMessage_CreateRequestMsg(TWX_PUT);
+	if (!msg) {
+		printf("Error creating message\n");
+		return 1;
+	}
+	twRequestBody_SetParams((twRequestBody *)msg->body, twInfoTable_CreateFromNumber("x", 1.5));
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		TW_LOG_HEX(frame, "Sent Message >>>>\n", sizeof(frame));
+		TW_LOG_MSG(msg, "Sending Msg >>>>>>>>>");
+		TW_LOG(TW_DEBUG, "twWs_SendMessage: Sent %d bytes using %d frames.", i, 1);
+	}
+	printf("%.1f ns per message\n", (now() - start) * 1e9 / ITERATIONS);
+	twMessage_Delete(msg);
+	return 0;
+}
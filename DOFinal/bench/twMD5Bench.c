@@ -0,0 +1,84 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Benchmark of the MD5 block function
+ *
+ *  Checks the RFC 1321 test vectors, then hashes 128 MB in FILE_XFER_MD5_BLOCK_SIZE
+ *  appends from an aligned and an unaligned buffer.
+ *
+ *  Build from DOFinal/bench:
+ *    gcc -O2 -I../src twMD5Bench.c ../src/twMD5.c -o twMD5Bench
+ *  Build against an older twMD5.c to compare.
+ */
+
+#include "twMD5.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE 6400
+#define ITERATIONS 20000
+
+static const char * vectors[][2] = {
+	{ "", "d41d8cd98f00b204e9800998ecf8427e" },
+	{ "a", "0cc175b9c0f1b6a831c399e269772661" },
+	{ "abc", "900150983cd24fb0d6963f7d28e17f72" },
+	{ "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+	{ "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+	{ "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789", "d174ab98d277d9f5a5611c2c9f419d9f" },
+	{ "12345678901234567890123456789012345678901234567890123456789012345678901234567890", "57edf4a22be3c955ac49da2e2107b67a" }
+};
+
+static double now() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void toHex(const md5_byte_t * digest, char * hex) {
+	int i = 0;
+	for (i = 0; i < 16; i++) sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static void run(const char * name, const md5_byte_t * data) {
+	md5_state_t state;
+	md5_byte_t digest[16];
+	char hex[33];
+	double start = now();
+	int i = 0;
+	md5_init(&state);
+	for (i = 0; i < ITERATIONS; i++) md5_append(&state, data, BLOCK_SIZE);
+	md5_finish(&state, digest);
+	toHex(digest, hex);
+	printf("%-10s %7.1f MB/s  %s\n", name, (double)BLOCK_SIZE * ITERATIONS / (now() - start) / 1e6, hex);
+}
+
+int main() {
+	md5_state_t state;
+	md5_byte_t digest[16];
+	md5_byte_t * buf = NULL;
+	char hex[33];
+	int failed = 0;
+	int i = 0;
+	for (i = 0; i < (int)(sizeof(vectors) / sizeof(vectors[0])); i++) {
+		md5_init(&state);
+		md5_append(&state, (const md5_byte_t *)vectors[i][0], (int)strlen(vectors[i][0]));
+		md5_finish(&state, digest);
+		toHex(digest, hex);
+		if (strcmp(hex, vectors[i][1])) {
+			printf("MD5(\"%s\") = %s, expected %s\n", vectors[i][0], hex, vectors[i][1]);
+			failed = 1;
+		}
+	}
+	if (failed) return 1;
+	printf("RFC 1321 test vectors OK\n");
+	buf = (md5_byte_t *)malloc(BLOCK_SIZE + 1);
+	if (!buf) return 1;
+	for (i = 0; i <= BLOCK_SIZE; i++) buf[i] = (md5_byte_t)(i * 31);
+	run("aligned", buf);
+	run("unaligned", buf + 1);
+	free(buf);
+	return 0;
+}
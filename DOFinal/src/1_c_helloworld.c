@@ -8,6 +8,8 @@
  ============================================================================
  */
 
+#define TW_LOG_MODULE TW_MODULE_APP
+
 #include "mraa/gpio.h"
 
 #include <stdio.h>
@@ -361,18 +363,11 @@ int read_bias_files (Triplet *a_bias, Triplet *g_bias, Triplet *m_bias, FTriplet
 
 
 void sendPropertyUpdate() {
-  /* Create the property list */
- propertyList * proplist = twApi_CreatePropertyList("x_acc",twPrimitive_CreateFromNumber(properties.x_acc), 0);
-	if (!proplist) {
-		TW_LOG(TW_ERROR,"sendPropertyUpdate: Error allocating property list");
-		return;
-	}
-	//add other properties to TW list
-  twApi_AddPropertyToList(proplist,"y_acc",twPrimitive_CreateFromNumber(properties.y_acc), 0);
-  twApi_AddPropertyToList(proplist,"z_acc",twPrimitive_CreateFromNumber(properties.z_acc), 0);
-  twApi_AddPropertyToList(proplist,"button",twPrimitive_CreateFromNumber(properties.push_button), 0);
-  twApi_PushProperties(TW_THING, thingName, proplist, -1, FALSE);
-  twApi_DeletePropertyList(proplist);
+  /* Queue the new values.  The api sends them all in one request at the next flush */
+  twApi_SetSubscribedProperty(thingName, "x_acc", twPrimitive_CreateFromNumber(properties.x_acc), 0, FALSE);
+  twApi_SetSubscribedProperty(thingName, "y_acc", twPrimitive_CreateFromNumber(properties.y_acc), 0, FALSE);
+  twApi_SetSubscribedProperty(thingName, "z_acc", twPrimitive_CreateFromNumber(properties.z_acc), 0, FALSE);
+  twApi_SetSubscribedProperty(thingName, "button", twPrimitive_CreateFromNumber(properties.push_button), 0, FALSE);
 }
 
 
@@ -446,10 +441,10 @@ int main(int argc, char **argv) {
 	  twApi_SetSelfSignedOk();
 
 	  /* Regsiter our properties */
-	   twApi_RegisterProperty(TW_THING, thingName, "x_acc", TW_NUMBER, NULL, "ALWAYS", 0, propertyHandler,NULL);
-	   twApi_RegisterProperty(TW_THING, thingName, "y_acc", TW_NUMBER, NULL, "ALWAYS", 0, propertyHandler,NULL);
-	   twApi_RegisterProperty(TW_THING, thingName, "z_acc", TW_NUMBER, NULL, "ALWAYS", 0, propertyHandler,NULL);
-	   twApi_RegisterProperty(TW_THING, thingName, "button", TW_NUMBER, NULL, "ALWAYS", 0, propertyHandler,NULL);
+	   twApi_RegisterProperty(TW_THING, thingName, "x_acc", TW_NUMBER, NULL, "VALUE", 5, propertyHandler,NULL);
+	   twApi_RegisterProperty(TW_THING, thingName, "y_acc", TW_NUMBER, NULL, "VALUE", 5, propertyHandler,NULL);
+	   twApi_RegisterProperty(TW_THING, thingName, "z_acc", TW_NUMBER, NULL, "VALUE", 5, propertyHandler,NULL);
+	   twApi_RegisterProperty(TW_THING, thingName, "button", TW_NUMBER, NULL, "VALUE", 0, propertyHandler,NULL);
 
 	  /* Bind our thing */
 	  twApi_BindThing(thingName);
@@ -7,6 +7,40 @@
 #include "list.h"
 #include "twOSPort.h"
 
+/* A removed entry points its prev pointer at itself */
+#define ENTRY_IS_REMOVED(e) ((e)->prev == (e))
+
+/* Entry pool helpers - must be called with the list mutex held */
+static ListEntry * twList_GetPooledEntry(twList * list) {
+	ListEntry * entry = list->poolFirst;
+	if (!entry) {
+		entry = (ListEntry *)TW_CALLOC(sizeof(ListEntry), 1);
+		if (entry) entry->owner = list;
+		return entry;
+	}
+	/* Pooled entries are chained through their value pointer, oldest first */
+	list->poolFirst = (ListEntry *)entry->value;
+	if (!list->poolFirst) list->poolLast = NULL;
+	entry->value = NULL;
+	entry->next = NULL;
+	entry->prev = NULL;
+	return entry;
+}
+
+/*
+Removed entries are only freed with the list, so an iterator still holding one can't
+touch freed memory.  The entry keeps its next pointer so twList_Next can carry on from
+it to the first entry after it that is still in the list.
+*/
+static void twList_PoolEntry(twList * list, ListEntry * entry) {
+	/* Mark the entry as removed so a second twList_Remove is rejected */
+	entry->prev = entry;
+	entry->value = NULL;
+	if (list->poolLast) list->poolLast->value = entry;
+	else list->poolFirst = entry;
+	list->poolLast = entry;
+}
+
 twList * twList_Create(del_func delete_function) {
 	twList * list = (twList *)TW_CALLOC(sizeof(twList), 1);
 	if (list) {
@@ -22,7 +56,15 @@ twList * twList_Create(del_func delete_function) {
 
 int twList_Delete(struct twList * list) {
 	if (list) {
+		ListEntry * entry = NULL;
 		twList_Clear(list);
+		/* Release the pooled entries */
+		entry = list->poolFirst;
+		while (entry) {
+			ListEntry * tmp = (ListEntry *)entry->value;
+			TW_FREE(entry);
+			entry = tmp;
+		}
 		twMutex_Delete(list->mtx);
 		TW_FREE(list);
 		return TW_OK;
@@ -41,7 +83,7 @@ int twList_Clear(struct twList *list) {
 			if (list->delete_function) {
 				list->delete_function(entry->value);
 			} else TW_FREE(entry->value);
-			TW_FREE(entry);
+			twList_PoolEntry(list, entry);
 			entry = tmp;
 		}
 		list->count = 0;
@@ -56,11 +98,13 @@ int twList_Clear(struct twList *list) {
 int twList_Add(struct twList *list, void *value) {
 	struct ListEntry * newEntry = NULL;
 	if (list) {
-		newEntry = (ListEntry *)TW_CALLOC(sizeof(ListEntry), 1);
-		if (!newEntry) return TW_ERROR_ALLOCATING_MEMORY;
-		newEntry->value = value;
-		/* Find the last entry */
 		twMutex_Lock(list->mtx);
+		newEntry = twList_GetPooledEntry(list);
+		if (!newEntry) {
+			twMutex_Unlock(list->mtx);
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+		newEntry->value = value;
 		if (!list->first) {
 			/* This will be the first entry in the list */
 			list->first = newEntry;
@@ -81,51 +125,40 @@ int twList_Add(struct twList *list, void *value) {
 }
 
 int twList_Remove(struct twList *list, struct ListEntry * entry, char deleteValue) {
-	struct ListEntry * node = NULL;
 	void * val = NULL;
 	if (!list || !entry) return TW_INVALID_PARAM;
-	/* find the entry */
 	twMutex_Lock(list->mtx);
-	node = list->first;
-	while (node) {
-		if (node == entry) { 
-			val = node->value;
-			if (node == list->first) list->first = node->next;
-			if (node == list->last) list->last = node->prev;
-			if (node->prev) node->prev->next = node->next;
-			if (node->next) node->next->prev = node->prev;
-			break;
-		}
-		node = node->next;
+	if (entry->owner != list || ENTRY_IS_REMOVED(entry)) {
+		/* Not ours or already removed */
+		twMutex_Unlock(list->mtx);
+		return TW_INVALID_PARAM;
 	}
+	val = entry->value;
+	if (entry == list->first) list->first = entry->next;
+	if (entry == list->last) list->last = entry->prev;
+	if (entry->prev) entry->prev->next = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	list->count--;
+	twList_PoolEntry(list, entry);
+	twMutex_Unlock(list->mtx);
 	if (deleteValue) {
 		if (list->delete_function) {
 			list->delete_function(val);
 		} else TW_FREE(val);
 	}
-	TW_FREE (entry);
-	list->count--;
-	twMutex_Unlock(list->mtx);
 	return TW_OK;
 }
 
 ListEntry * twList_Next(twList *list, ListEntry * entry) {
 	struct ListEntry * node = NULL;
-	if (!list || list->count == 0) return NULL;
-	/* find the entry */
+	if (!list) return NULL;
 	twMutex_Lock(list->mtx);
-	node = list->first;
 	/* If entry is NULL just return the first entry in the list */
-	/* seems simple, but if this or the "next" element has been removed, it isn't */
-	if (entry) {
-		while (node) {
-			if (node == entry) { 
-				/* the passed in entry still exists */
-				node = node->next;
-				break;
-			}
-			node = node->next;
-		}
+	if (!entry) node = list->first;
+	else if (entry->owner == list) {
+		/* Only a removed entry can be followed by removed ones, skip to one still in the list */
+		node = entry->next;
+		while (node && ENTRY_IS_REMOVED(node)) node = node->next;
 	}
 	twMutex_Unlock(list->mtx);
 	return node;
@@ -133,26 +166,28 @@ ListEntry * twList_Next(twList *list, ListEntry * entry) {
 
 ListEntry * twList_GetByIndex(struct twList *list, int index) {
 	ListEntry * le = NULL;
-	int count = 0;
-	if (!list) return NULL;
-	if (index >= list->count) return NULL;
-	le = twList_Next(list,NULL);
-	while (le) {
-		if (count++ == index) return le;
-		le = twList_Next(list,le);
+	int i = 0;
+	if (!list || index < 0) return NULL;
+	twMutex_Lock(list->mtx);
+	if (index < list->count) {
+		if (index < list->count / 2) {
+			le = list->first;
+			for (i = 0; le && i < index; i++) le = le->next;
+		} else {
+			le = list->last;
+			for (i = list->count - 1; le && i > index; i--) le = le->prev;
+		}
 	}
-	return NULL;
+	twMutex_Unlock(list->mtx);
+	return le;
 }
 
 int twList_GetCount(struct twList *list) {
 	int count = 0;
 	if (list) {
-		ListEntry * le = NULL;
-		le = twList_Next(list,NULL);
-		while (le) {
-			count++;
-			le = twList_Next(list,le);
-		}
+		twMutex_Lock(list->mtx);
+		count = list->count;
+		twMutex_Unlock(list->mtx);
 	}
 	return count;
 }
@@ -30,10 +30,17 @@ typedef void (*del_func) (void * item);
 /**************************/
 /*   Generic List Entry   */
 /**************************/
+/*
+A removed entry is parked in the owning list's entry pool with its
+prev pointer aimed at itself until it is reused.  Entries are only
+freed with the list, so an entry can still be passed to twList_Next
+after it has been removed.
+*/
 typedef struct ListEntry {
     struct ListEntry *next;
     struct ListEntry *prev;
     void *value;
+    struct twList *owner;
 } ListEntry;
 
 /**************************/
@@ -45,6 +52,8 @@ typedef struct twList {
 	struct ListEntry *last;
 	TW_MUTEX mtx;
 	del_func delete_function;
+	struct ListEntry *poolFirst;   /* Removed entries, kept for reuse until the list is deleted */
+	struct ListEntry *poolLast;
 } twList;
 
 /*
@@ -87,11 +96,13 @@ Return:
 int twList_Add(twList *list, void *value);
 
 /*
-twList_Remove - Removes an entry from a list.  The ListEntry structure is deleted, the
-	value contained in the ListEntry is optionally deleted.
+twList_Remove - Removes an entry from a list.  The ListEntry structure is returned to the
+	list's entry pool, the value contained in the ListEntry is optionally deleted.  Iterating
+	can carry on from the removed entry with twList_Next, even if another thread removed it.
 Parameters:
     list - pointer to the list to operate on
-	entry - pointer to the entry to remove
+	entry - pointer to the entry to remove.  An entry from another list or one that was
+		already removed is rejected.
 	deleteValue - boolean, if TRUE deletes the value using the function supplied when the 
 		list was created, if FALSE the value is not deleted
 Return:
@@ -102,9 +113,11 @@ int twList_Remove(struct twList *list, struct ListEntry * entry, char deleteValu
 /*
 twList_Next - Used to iterate through a list. Returns ListEntry that is the next entry 
 	after the supplied ListEntry.  If entry is 0 the the first ListEntry is returned.
+	Runs in constant time.
 Parameters:
     list - pointer to the list to operate on
-	entry - pointer to the current entry.  May be NULL in which case the first ListEntry is returned. 
+	entry - pointer to the current entry.  May be NULL in which case the first ListEntry is returned.
+		If it has been removed, the first entry after it that is still in the list is returned.
 Return:
 	ListEntry * - the next entry in the list or a NULL if we are at the end of the list or an error
 		occurred.  The list still owns this pointer so do NOT delete it.
@@ -112,7 +125,8 @@ Return:
 ListEntry * twList_Next(struct twList *list, struct ListEntry * entry);
 
 /*
-twList_GetByIndex - Gets the Nth entry from the list.
+twList_GetByIndex - Gets the Nth entry from the list.  Walks from whichever end
+	of the list is closer to the index.
 Parameters:
     list - pointer to the list to operate on
 	index - the zero based index in the list to retrieve 
@@ -123,7 +137,7 @@ Return:
 ListEntry * twList_GetByIndex(struct twList *list, int index);
 
 /*
-twList_GetCount - returns the number of entries in the list.
+twList_GetCount - returns the number of entries in the list.  Runs in constant time.
 Parameters:
     list - pointer to the list to operate on
 Return:
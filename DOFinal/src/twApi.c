@@ -4,6 +4,8 @@
  *  Portable ThingWorx C SDK API layer
  */
 
+#define TW_LOG_MODULE TW_MODULE_API
+
 #include "twConfig.h"
 #include "twOSPort.h"
 #include "twLogger.h"
@@ -18,6 +20,7 @@
 #include "twServices.h"
 #include "jsonUtils.h"
 #include "twVersion.h"
+#include "twSubscribedProps.h"
 #ifdef ENABLE_FILE_XFER
 #include "twFileManager.h"
 #endif
@@ -54,8 +57,90 @@ void deleteCallbackInfo(void * info) {
 	}
 }
 
+/* Cached GetMetadata result for one entity */
+typedef struct metadataInfo {
+	char * entityName;
+	char * json;
+} metadataInfo;
+
+void deleteMetadataInfo(void * info) {
+	if (info) {
+		metadataInfo * tmp = (metadataInfo *)info;
+		TW_FREE(tmp->entityName);
+		if (tmp->json) TW_FREE(tmp->json);
+		TW_FREE(tmp);
+	}
+}
+
+/* Drops the cached metadata of an entity whose properties or services have changed */
+void invalidateMetadata(const char * entityName) {
+	ListEntry * le = NULL;
+	if (!tw_api || !tw_api->metadataCache || !entityName) return;
+	twMutex_Lock(tw_api->metadataMtx);
+	le = twList_Next(tw_api->metadataCache, NULL);
+	while (le && le->value) {
+		if (!strcmp(((metadataInfo *)le->value)->entityName, entityName)) {
+			twList_Remove(tw_api->metadataCache, le, TRUE);
+			break;
+		}
+		le = twList_Next(tw_api->metadataCache, le);
+	}
+	twMutex_Unlock(tw_api->metadataMtx);
+}
+
 /****************************************/
 /** Helper functions **/
+int addCallbackInfo(callbackInfo * info) {
+	/* Index the callback for request dispatch, then keep it in the list which owns it */
+	int res = twCallbackRegistry_Add(tw_api->callbackIndex, info->entityType, info->entityName, info->characteristicType, info->charateristicName, info);
+	if (res) {
+		TW_LOG(TW_ERROR, "addCallbackInfo: Error indexing callback for %s:%s", info->entityName, info->charateristicName);
+		deleteCallbackInfo(info);
+		return res;
+	}
+	res = twList_Add(tw_api->callbackList, info);
+	if (res) {
+		twCallbackRegistry_Remove(tw_api->callbackIndex, info->entityType, info->entityName, info->characteristicType, info->charateristicName, info);
+		deleteCallbackInfo(info);
+		return res;
+	}
+	invalidateMetadata(info->entityName);
+	return res;
+}
+
+twStream * createPushPropertiesTemplate() {
+	twDataShape * values = NULL;
+	twDataShape * ds = NULL;
+	twStream * s = NULL;
+	char rowHeader[4] = { 1, 0, 1, (char)TW_INFOTABLE };
+	/*
+	The UpdateSubscribedPropertyValues params are a single row infotable with one 
+	"values" infotable field.  Everything up to the first row of that inner infotable
+	is the same for every push so serialize it once.
+	*/
+	values = twDataShape_Create(twDataShapeEntry_Create("values", NULL, TW_INFOTABLE));
+	ds = twDataShape_Create(twDataShapeEntry_Create("name", NULL, TW_STRING));
+	if (!values || !ds) {
+		TW_LOG(TW_ERROR,"createPushPropertiesTemplate: Error allocating data shape");
+		twDataShape_Delete(values);
+		twDataShape_Delete(ds);
+		return NULL;
+	}
+	twDataShape_AddEntry(ds,twDataShapeEntry_Create("value", NULL, TW_VARIANT));
+	twDataShape_AddEntry(ds,twDataShapeEntry_Create("time", NULL, TW_DATETIME));
+	twDataShape_AddEntry(ds,twDataShapeEntry_Create("quality", NULL, TW_STRING));
+	s = twStream_Create();
+	if (s) {
+		twDataShape_ToStream(values, s);
+		/* Row marker, field count and the type of the only field */
+		twStream_AddBytes(s, rowHeader, 4);
+		twDataShape_ToStream(ds, s);
+	} else TW_LOG(TW_ERROR,"createPushPropertiesTemplate: Error allocating stream");
+	twDataShape_Delete(values);
+	twDataShape_Delete(ds);
+	return s;
+}
+
 int convertMsgCodeToErrorCode(enum msgCodeEnum code) {
 	int err;
 	switch (code) {
@@ -114,27 +199,19 @@ int convertMsgCodeToErrorCode(enum msgCodeEnum code) {
 	return err;
 }
 
-void * getCallbackFromList(twList * list, enum entityTypeEnum entityType, char * entityName, 
+void * getCallbackFromList(twCallbackRegistry * index, enum entityTypeEnum entityType, char * entityName, 
 						   enum characteristicEnum charateristicType, char * characteristicName, void ** userdata) {
 	/* Get based on entity/characteristic pair */
-	ListEntry * le = NULL;
-	if (!list || !entityName || !characteristicName) {
-		TW_LOG(TW_ERROR, "isEntyInList: NULL input parameter found");
+	callbackInfo * tmp = NULL;
+	if (!index || !entityName || !characteristicName) {
+		TW_LOG(TW_ERROR, "getCallbackFromList: NULL input parameter found");
 		return 0;
 	}
-	le = twList_Next(list, NULL);
-	while (le) {
-		if (le->value) {
-			callbackInfo * tmp = (callbackInfo *)(le->value);
-			if (tmp->entityType != entityType || tmp->characteristicType != charateristicType || 
-				strcmp(entityName, tmp->entityName) || strcmp(characteristicName, tmp->charateristicName)) {
-				le = twList_Next(list, le);
-				continue;
-			}
-			/* Return the callback */
-			*userdata = tmp->userdata;
-			return tmp->cb;
-		}
+	tmp = (callbackInfo *)twCallbackRegistry_Get(index, entityType, entityName, charateristicType, characteristicName);
+	if (tmp) {
+		/* Return the callback */
+		*userdata = tmp->userdata;
+		return tmp->cb;
 	}
 	/* If file transfer is enabled let that system handle any file transfer services */
 	#ifdef ENABLE_FILE_XFER
@@ -160,7 +237,10 @@ enum msgCodeEnum sendMessageBlocking(twMessage * msg, int32_t timeout, twInfoTab
 	expirationTime = twGetSystemMillisecondCount();
 	expirationTime = twAddMilliseconds(expirationTime, timeout);
 	/* Register the response before we send to prevent a race condition */
-	twMessageHandler_RegisterResponseCallback(tw_api->mh, 0, msg->requestId, expirationTime);
+	if (twMessageHandler_RegisterResponseCallback(tw_api->mh, 0, msg->requestId, expirationTime)) {
+		TW_LOG(TW_ERROR, "api:sendMessageBlocking: Unable to track response for message %d", msg->requestId);
+		return TWX_SERVICE_UNAVAILABLE;
+	}
 	/* Send the message and wait for it to be received */
 	if (twMessage_Send(msg, tw_api->mh->ws) == TW_OK) {
 		twResponseCallbackStruct * cb = 0;
@@ -182,7 +262,10 @@ enum msgCodeEnum sendMessageBlocking(twMessage * msg, int32_t timeout, twInfoTab
 		} else {
 			enum msgCodeEnum code = cb->code;
 			TW_LOG(TW_WARN,"api:sendMessageBlocking: Received Response to Message %d.  Code: %d", msg->requestId, code);
-			if (result) *result = cb->content;
+			if (result) {
+				*result = cb->content;
+				cb->content = NULL;
+			}
 			/* If this was an auth request we need to grab the session ID */
 			if (msg->type == TW_AUTH) {
 				if (code == TWX_SUCCESS) { 
@@ -192,7 +275,8 @@ enum msgCodeEnum sendMessageBlocking(twMessage * msg, int32_t timeout, twInfoTab
 					TW_LOG(TW_WARN,"api:sendMessageBlocking: AUTH Message %d failed.  Code:", msg->requestId, code);
 				}
 			}
-			twMessageHandler_UnegisterResponseCallback(tw_api->mh, msg->requestId);
+			/* Already out of the response table */
+			twResponseCallbackStruct_Delete(cb);
 			return code;
 		}
 	} else {
@@ -202,45 +286,99 @@ enum msgCodeEnum sendMessageBlocking(twMessage * msg, int32_t timeout, twInfoTab
 	}
 }
 
-enum msgCodeEnum makeRequest(enum msgCodeEnum method, enum entityTypeEnum entityType, char * entityName, 
+twMessage * createRequest(enum msgCodeEnum method, enum entityTypeEnum entityType, char * entityName, 
 	                         enum characteristicEnum characteristicType, char * characteristicName, 
-							 twInfoTable * params, twInfoTable ** result, int32_t timeout, char forceConnect) {
-	enum msgCodeEnum res = TWX_PRECONDITION_FAILED;
+							 twInfoTable * params, char forceConnect, enum msgCodeEnum * err) {
 	twMessage * msg = NULL;
-	if (!tw_api || !entityName || !characteristicName || !result) {
-		TW_LOG(TW_ERROR, "api:makeRequest: NULL tw_api, entityName, charateristicName or result pointer");
-		return res;
-	}
+	*err = TWX_PRECONDITION_FAILED;
 	/* Check to see if we are offline and should attempt to reconnect */
 	if (!twApi_isConnected()) {
 		if (forceConnect) {
 			if (twApi_Connect(CONNECT_TIMEOUT, CONNECT_RETRIES)) {
-				TW_LOG(TW_ERROR, "api:makeRequest: Error trying to force a reconnect");
-				return TWX_SERVICE_UNAVAILABLE;
+				TW_LOG(TW_ERROR, "api:createRequest: Error trying to force a reconnect");
+				*err = TWX_SERVICE_UNAVAILABLE;
+				return NULL;
 			}
 		} else if (!tw_api->offlineMsgEnabled) {
-			TW_LOG(TW_INFO, "api:makeRequest: Currently offline and 'forceConnect' is FALSE");
-			return TWX_SERVICE_UNAVAILABLE;
+			TW_LOG(TW_INFO, "api:createRequest: Currently offline and 'forceConnect' is FALSE");
+			*err = TWX_SERVICE_UNAVAILABLE;
+			return NULL;
 		}
 	}
 	/* Create the Request message */
 	msg = twMessage_CreateRequestMsg(method);
 	if (!msg) {
-		TW_LOG(TW_ERROR, "api:makeRequest: Error creating request message");
-		return res;
+		TW_LOG(TW_ERROR, "api:createRequest: Error creating request message");
+		return NULL;
 	}
-	if (timeout < 0) timeout = DEFAULT_MESSAGE_TIMEOUT;
 	/* Set the body of the message */
 	twRequestBody_SetEntity((twRequestBody *)(msg->body), entityType, entityName);
 	twRequestBody_SetCharateristic((twRequestBody *)(msg->body), characteristicType, characteristicName);
 	twRequestBody_SetParams((twRequestBody *)(msg->body), twInfoTable_ZeroCopy(params));
+	*err = TWX_SUCCESS;
+	return msg;
+}
+
+enum msgCodeEnum sendRequest(twMessage * msg, twInfoTable ** result, int32_t timeout) {
+	enum msgCodeEnum res = TWX_PRECONDITION_FAILED;
+	if (timeout < 0) timeout = DEFAULT_MESSAGE_TIMEOUT;
 	twMutex_Lock(tw_api->mtx);
 	res = sendMessageBlocking(msg, timeout, result);
 	twMutex_Unlock(tw_api->mtx);
-	if (msg) twMessage_Delete(msg);
 	return res;
 }
 
+enum msgCodeEnum makeRequest(enum msgCodeEnum method, enum entityTypeEnum entityType, char * entityName, 
+	                         enum characteristicEnum characteristicType, char * characteristicName, 
+							 twInfoTable * params, twInfoTable ** result, int32_t timeout, char forceConnect) {
+	enum msgCodeEnum res = TWX_PRECONDITION_FAILED;
+	twMessage * msg = NULL;
+	if (!tw_api || !entityName || !characteristicName || !result) {
+		TW_LOG(TW_ERROR, "api:makeRequest: NULL tw_api, entityName, charateristicName or result pointer");
+		return res;
+	}
+	msg = createRequest(method, entityType, entityName, characteristicType, characteristicName, params, forceConnect, &res);
+	if (!msg) return res;
+	res = sendRequest(msg, result, timeout);
+	twMessage_Delete(msg);
+	return res;
+}
+
+int sendAsyncRequest(twMessage * msg, response_cb cb, int32_t timeout, uint32_t * requestId) {
+	DATETIME expirationTime;
+	int err = TW_OK;
+	if (timeout < 0) timeout = DEFAULT_MESSAGE_TIMEOUT;
+	expirationTime = twAddMilliseconds(twGetSystemMillisecondCount(), timeout);
+	/* 
+	Register the response before we send to prevent a race condition.  We don't
+	take the api mutex since we aren't going to wait for the response.
+	*/
+	err = twMessageHandler_RegisterResponseCallback(tw_api->mh, cb, msg->requestId, expirationTime);
+	if (!err) {
+		err = twMessage_Send(msg, tw_api->mh->ws);
+		if (err) twMessageHandler_UnegisterResponseCallback(tw_api->mh, msg->requestId);
+		else if (requestId) *requestId = msg->requestId;
+	}
+	return err;
+}
+
+int makeAsyncRequest(enum msgCodeEnum method, enum entityTypeEnum entityType, char * entityName, 
+	                         enum characteristicEnum characteristicType, char * characteristicName, 
+							 twInfoTable * params, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId) {
+	enum msgCodeEnum res = TWX_PRECONDITION_FAILED;
+	twMessage * msg = NULL;
+	int err = TW_OK;
+	if (!tw_api || !tw_api->mh || !entityName || !characteristicName) {
+		TW_LOG(TW_ERROR, "api:makeAsyncRequest: NULL tw_api, entityName or charateristicName");
+		return TW_INVALID_PARAM;
+	}
+	msg = createRequest(method, entityType, entityName, characteristicType, characteristicName, params, forceConnect, &res);
+	if (!msg) return convertMsgCodeToErrorCode(res);
+	err = sendAsyncRequest(msg, cb, timeout, requestId);
+	twMessage_Delete(msg);
+	return err;
+}
+
 enum msgCodeEnum makePropertyRequest(enum msgCodeEnum method, enum entityTypeEnum entityType, char * entityName, 
 	                         char * propertyName, twPrimitive * value, twPrimitive ** result, int32_t timeout, char forceConnect) {
 	twInfoTable * value_it = NULL;
@@ -291,7 +429,7 @@ int api_requesthandler(struct twWs * ws, struct twMessage * msg) {
 		TW_LOG(TW_ERROR,"api_requesthandler: No valid message body found");
 		return TW_INVALID_MSG_BODY;
 	}
-	cb = getCallbackFromList(tw_api->callbackList, b->entityType, b->entityName, b->characteristicType, b->characteristicName, &userdata);
+	cb = getCallbackFromList(tw_api->callbackIndex, b->entityType, b->entityName, b->characteristicType, b->characteristicName, &userdata);
 	if (cb) {
 		switch (b->characteristicType) {
 			case TW_PROPERTIES:
@@ -352,74 +490,87 @@ int api_requesthandler(struct twWs * ws, struct twMessage * msg) {
 }
 
 
-enum msgCodeEnum getMetadataService(const char * entityName, const char * serviceName, twInfoTable * params, twInfoTable ** content, void * userdata) {
+/* Builds the metadata JSON for an entity from its registered properties and services */
+char * createMetadataJson(const char * entityName) {
 	ListEntry * le = NULL;
-	twStream * propJson = NULL;
-	twStream * svcJson = NULL;
-	propJson = twStream_Create();
-	svcJson = twStream_Create();
-	TW_LOG(TW_TRACE,"getMetadataService - Function called");
-	if (!content || !propJson || !svcJson ||!tw_api || !tw_api->callbackList || !entityName) {
-		TW_LOG(TW_ERROR,"getMetadataService - NULL stream,callback, params or content pointer");
+	twStream * propJson = twStream_Create();
+	twStream * svcJson = twStream_Create();
+	char firstProp = TRUE;
+	char firstSvc = TRUE;
+	char * json = NULL;
+	if (!propJson || !svcJson) {
 		twStream_Delete(propJson);
 		twStream_Delete(svcJson);
-		return TWX_BAD_REQUEST;
+		return NULL;
 	}
-	/* Prep the JSON string */
 	addStringsToStream(propJson, "{\"name\":\"", entityName, "\",\"description\":\"\",\"isSystemObject\":false,\"propertyDefinitions\":{", NULL);
 	le = twList_Next(tw_api->callbackList, NULL);
 	while (le) {
-		if (le->value) {
-			callbackInfo * tmp = (callbackInfo *)(le->value);
-			if (strcmp(entityName, tmp->entityName) == 0) {
-				/* If this is a property add it to the stream */
-				if (tmp->charateristicDefinition) {
-					if (tmp->characteristicType == TW_PROPERTIES) {
-						addPropertyDefJsonToStream((twPropertyDef *)tmp->charateristicDefinition, propJson);
-						le = twList_Next(tw_api->callbackList, le);
-						if (le) addStringsToStream(propJson, ",",NULL);
-					} else if (tmp->characteristicType == TW_SERVICES) {
-						addServiceDefJsonToStream((twServiceDef *)tmp->charateristicDefinition, svcJson);
-						le = twList_Next(tw_api->callbackList, le);
-						if (le) addStringsToStream(svcJson, ",",NULL);
-					} else {
-                            // nothing of interest, move on
-                            le = twList_Next( tw_api->callbackList, le ) ;
-					} 
-				} else {
-                        // No charateristic definition, move on
-                        le = twList_Next( tw_api->callbackList, le ) ;
-                }
-            } else {
-                    // not the value we are looking for? NEXT!
-                    le = twList_Next( tw_api->callbackList, le ) ;
-            }
-        } else {
-                // no eternal loops when empty value please
-                le = twList_Next( tw_api->callbackList, le ) ;
-        }
-	}
-	/* need to remove any trailing commas from the stream */
-	if (propJson->data[propJson->length-1] == ',') {
-		propJson->data[propJson->length-1] = 0x00;
-		propJson->length--;
-		propJson->ptr--;
-	}
-	if (svcJson->data[svcJson->length-1] == ',') {
-		svcJson->data[svcJson->length-1] = 0x00;
-		svcJson->length--;
+		callbackInfo * tmp = (callbackInfo *)(le->value);
+		le = twList_Next(tw_api->callbackList, le);
+		if (!tmp || !tmp->charateristicDefinition || strcmp(entityName, tmp->entityName)) continue;
+		if (tmp->characteristicType == TW_PROPERTIES) {
+			if (!firstProp) addStringsToStream(propJson, ",", NULL);
+			addPropertyDefJsonToStream((twPropertyDef *)tmp->charateristicDefinition, propJson);
+			firstProp = FALSE;
+		} else if (tmp->characteristicType == TW_SERVICES) {
+			if (!firstSvc) addStringsToStream(svcJson, ",", NULL);
+			addServiceDefJsonToStream((twServiceDef *)tmp->charateristicDefinition, svcJson);
+			firstSvc = FALSE;
+		}
 	}
 	/* Combine the two streams and terminate the JSON */
-	addStringsToStream(propJson, "},\"serviceDefinitions\":{",NULL);
+	addStringsToStream(propJson, "},\"serviceDefinitions\":{", NULL);
 	twStream_AddBytes(propJson, svcJson->data, svcJson->length);
-	addStringsToStream(propJson, "}}",NULL);
-	/* Create the result infotable */
-	*content = twInfoTable_CreateFromPrimitive("result", twPrimitive_CreateFromVariable(propJson->data, TW_JSON, TRUE, 0));
+	addStringsToStream(propJson, "}}", NULL);
+	json = (char *)TW_MALLOC(propJson->length + 1);
+	if (json) {
+		memcpy(json, propJson->data, propJson->length);
+		json[propJson->length] = 0;
+	}
 	twStream_Delete(propJson);
 	twStream_Delete(svcJson);
+	return json;
+}
+
+enum msgCodeEnum getMetadataService(const char * entityName, const char * serviceName, twInfoTable * params, twInfoTable ** content, void * userdata) {
+	ListEntry * le = NULL;
+	metadataInfo * info = NULL;
+	twPrimitive * result = NULL;
+	TW_LOG(TW_TRACE,"getMetadataService - Function called");
+	if (!content || !tw_api || !tw_api->callbackList || !tw_api->metadataCache || !entityName) {
+		TW_LOG(TW_ERROR,"getMetadataService - NULL stream,callback, params or content pointer");
+		return TWX_BAD_REQUEST;
+	}
+	/* The metadata only changes when properties or services are registered or unregistered */
+	twMutex_Lock(tw_api->metadataMtx);
+	le = twList_Next(tw_api->metadataCache, NULL);
+	while (le && le->value) {
+		if (!strcmp(((metadataInfo *)le->value)->entityName, entityName)) {
+			info = (metadataInfo *)le->value;
+			break;
+		}
+		le = twList_Next(tw_api->metadataCache, le);
+	}
+	if (!info) {
+		info = (metadataInfo *)TW_CALLOC(sizeof(metadataInfo), 1);
+		if (info) {
+			info->entityName = duplicateString(entityName);
+			info->json = createMetadataJson(entityName);
+			if (!info->entityName || !info->json || twList_Add(tw_api->metadataCache, info)) {
+				deleteMetadataInfo(info);
+				info = NULL;
+			}
+		}
+	}
+	if (info) result = twPrimitive_CreateFromVariable(info->json, TW_JSON, TRUE, 0);
+	twMutex_Unlock(tw_api->metadataMtx);
+	/* Create the result infotable */
+	*content = twInfoTable_CreateFromPrimitive("result", result);
 	if (*content) {
 		return TWX_SUCCESS;
 	}
+	TW_LOG(TW_ERROR,"getMetadataService - Error creating metadata for %s", entityName);
 	return TWX_INTERNAL_SERVER_ERROR;
 }
 
@@ -462,9 +613,14 @@ int twApi_Initialize(char * host, uint16_t port, char * resource, char * app_key
 	tw_api->mh = twMessageHandler_Instance(ws);
 	tw_api->mtx = twMutex_Create();
 	tw_api->callbackList = twList_Create(deleteCallbackInfo);
+	tw_api->callbackIndex = twCallbackRegistry_Create(0);
 	tw_api->bindEventCallbackList = twList_Create(deleteCallbackInfo);
 	tw_api->boundList = twList_Create(0);
-	if (!tw_api->mh || !tw_api->mtx || !tw_api->callbackList || !tw_api->boundList || !tw_api->bindEventCallbackList) {
+	tw_api->pushPropertiesTemplate = createPushPropertiesTemplate();
+	tw_api->metadataCache = twList_Create(deleteMetadataInfo);
+	tw_api->metadataMtx = twMutex_Create();
+	if (!tw_api->mh || !tw_api->mtx || !tw_api->callbackList || !tw_api->callbackIndex || !tw_api->boundList || !tw_api->bindEventCallbackList || !tw_api->pushPropertiesTemplate ||
+		!tw_api->metadataCache || !tw_api->metadataMtx) {
 		TW_LOG(TW_ERROR, "twApi_Initialize: Error initializing api");
 		twApi_Delete();
 		return TW_ERROR_INITIALIZING_API;
@@ -479,12 +635,16 @@ int twApi_Initialize(char * host, uint16_t port, char * resource, char * app_key
 	tw_api->ping_rate = PING_RATE;
 	tw_api->handle_pongs = TRUE;
 	twMessageHandler_RegisterPongCallback(tw_api->mh, pong_handler);
+	/* Set up the managed property update queue */
+	if (twSubscribedPropsMgr_Initialize()) {
+		TW_LOG(TW_ERROR, "twApi_Initialize: Error initializing subscribed property manager");
+	}
 
 #ifdef OFFLINE_MSG_STORE
 	tw_api->offlineMsgEnabled = TRUE;
 #if (OFFLINE_MSG_STORE == 1) 
-	tw_api->offlineMsgList = twList_Create(twStream_Delete);
-	if (!tw_api->offlineMsgList) {
+	tw_api->offlineMsgQueue = twOfflineMsgQueue_Create(OFFLINE_MSG_QUEUE_SIZE, OFFLINE_MSG_QUEUE_DROP_OLDEST);
+	if (!tw_api->offlineMsgQueue) {
 		TW_LOG(TW_ERROR, "twApi_Initialize: Error allocating offline message store queue");
 	}
 #endif
@@ -492,26 +652,17 @@ int twApi_Initialize(char * host, uint16_t port, char * resource, char * app_key
 	if (twDirectory_CreateDirectory(OFFLINE_MSG_STORE_DIR)) {
 		TW_LOG(TW_ERROR, "twApi_Initialize: Error creating offline message directory %s",OFFLINE_MSG_STORE_DIR);
 	} else {
-		tw_api->offlineMsgFile = (char *)TW_CALLOC(strlen(OFFLINE_MSG_STORE_DIR) + strlen("offline_msgs.bin") + 2, 1);
-		if (tw_api->offlineMsgFile) {
-			uint64_t size = 0;
-			DATETIME lastModified;
-			char isDir;
-			char isReadOnly;
-			strcpy(tw_api->offlineMsgFile, OFFLINE_MSG_STORE_DIR);
-			strcat(tw_api->offlineMsgFile,"/");
-			strcat(tw_api->offlineMsgFile,"offline_msgs.bin");
-			/* Get the size of the file in case there are some persisted messages */
-			twDirectory_GetFileInfo(tw_api->offlineMsgFile, &size, &lastModified, &isDir, &isReadOnly);
-			tw_api->offlineMsgSize = size;
-		} else TW_LOG(TW_ERROR, "twApi_Initialize: Error allocating offline message file name");
+		/* Pick up any messages persisted before we were restarted */
+		tw_api->offlineMsgStore = twOfflineMsgStore_Create(OFFLINE_MSG_STORE_DIR);
+		if (tw_api->offlineMsgStore) tw_api->offlineMsgSize = twOfflineMsgStore_GetSize(tw_api->offlineMsgStore);
+		else TW_LOG(TW_ERROR, "twApi_Initialize: Error opening offline message store");
 	}
 #endif
 #endif
 
 #ifdef ENABLE_TASKER
 	/* Initalize our tasker */
-	twTasker_CreateTask(5, &twApi_TaskerFunction);
+	twTasker_CreateIoTask(TW_IO_TASK_IDLE_RATE, &twApi_TaskerFunction);
 	twTasker_Start();
 #endif
 	return TW_OK;
@@ -529,11 +680,16 @@ int twApi_Delete() {
 	tw_api = NULL;
 
 	if (tmp->mh) twMessageHandler_Delete(NULL);
+	twSubscribedPropsMgr_Delete();
+	if (tmp->callbackIndex) twCallbackRegistry_Delete(tmp->callbackIndex);
 	if (tmp->callbackList) twList_Delete(tmp->callbackList);
 	if (tmp->bindEventCallbackList) twList_Delete(tmp->bindEventCallbackList);
 	if (tmp->boundList) twList_Delete(tmp->boundList);
-	if (tmp->offlineMsgList) twList_Delete(tmp->offlineMsgList);
-	if (tmp->offlineMsgFile) TW_FREE(tmp->offlineMsgFile);
+	if (tmp->pushPropertiesTemplate) twStream_Delete(tmp->pushPropertiesTemplate);
+	if (tmp->metadataCache) twList_Delete(tmp->metadataCache);
+	if (tmp->metadataMtx) twMutex_Delete(tmp->metadataMtx);
+	if (tmp->offlineMsgQueue) twOfflineMsgQueue_Delete(tmp->offlineMsgQueue);
+	if (tmp->offlineMsgStore) twOfflineMsgStore_Delete(tmp->offlineMsgStore);
     twMutex_Unlock(tmp->mtx);
 	twMutex_Delete(tmp->mtx);
 	twMutex_Unlock(twInitMutex);
@@ -759,6 +915,7 @@ void twApi_TaskerFunction(DATETIME now, void * params) {
 	static DATETIME expectedPongTime;
 	static DATETIME nextCleanupTime;
 	static DATETIME nextDutyCycleEvent;
+	static DATETIME nextPropertyFlushTime;
 
 	/* This is the main "loop" of the api */
 	if (tw_api && tw_api->mh && tw_api->mh->ws) {
@@ -781,11 +938,17 @@ void twApi_TaskerFunction(DATETIME now, void * params) {
 				nextPingTime = 0;
 			}
 		}
+		/* Expire pending responses every pass so async requests time out promptly.  This is cheap when nothing has expired */
+		twMessageHandler_CleanupOldMessages(tw_api->mh);
 		if (twTimeGreaterThan(now, nextCleanupTime)) {
-			twMessageHandler_CleanupOldMessages(tw_api->mh);
 			twMultipartMessageStore_RemoveStaleMessages();
 			nextCleanupTime = twAddMilliseconds(now, STALE_MSG_CLEANUP_RATE);
 		}
+		if (twTimeGreaterThan(now, nextPropertyFlushTime)) {
+			/* Send any queued managed property values */
+			twSubscribedPropsMgr_PushSubscribedProperties(NULL, FALSE);
+			nextPropertyFlushTime = twAddMilliseconds(now, MANAGED_PROPERTY_FLUSH_RATE);
+		}
 		if (tw_api->duty_cycle_period && twTimeGreaterThan(now, nextDutyCycleEvent)) {
 			if (twApi_isConnected()) {
 				TW_LOG(TW_INFO,"apiThread: Entering Duty Cycle OFF state.");
@@ -824,7 +987,7 @@ int twApi_RegisterProperty(enum entityTypeEnum entityType, char * entityName, ch
 		info->charateristicDefinition = property;
 		info->cb = cb;
 		info->userdata = userdata;
-		return (twList_Add(tw_api->callbackList, info));
+		return addCallbackInfo(info);
 	}
 	TW_LOG(TW_ERROR, "twApi_RegisterProperty: Invalid params or missing api pointer");
 	return TW_INVALID_PARAM;
@@ -850,7 +1013,7 @@ int twApi_RegisterService(enum entityTypeEnum entityType, char * entityName, cha
 		info->charateristicDefinition = service;
 		info->cb = cb;
 		info->userdata = userdata;
-		return twList_Add(tw_api->callbackList, info);
+		return addCallbackInfo(info);
 	}
 	TW_LOG(TW_ERROR, "twApi_RegisterService: Invalid params or missing api pointer");
 	return TW_INVALID_PARAM;
@@ -862,17 +1025,18 @@ int twApi_UnregisterThing(char * entityName) {
 		ListEntry * le = NULL;
 		le = twList_Next(tw_api->callbackList, NULL);
 		while (le) {
-			if (le->value) {
-				callbackInfo * tmp = (callbackInfo *)(le->value);
-				if (strcmp(entityName, tmp->entityName)) {
-					le = twList_Next(tw_api->callbackList, le);
-					continue;
-				}
+			/* Step off the entry before it is removed */
+			ListEntry * entry = le;
+			le = twList_Next(tw_api->callbackList, le);
+			if (entry->value) {
+				callbackInfo * tmp = (callbackInfo *)(entry->value);
+				if (strcmp(entityName, tmp->entityName)) continue;
 				/* Delete this entry */
-				twList_Remove(tw_api->callbackList, le, TRUE);
-				le = twList_Next(tw_api->callbackList, le->prev);
+				twCallbackRegistry_Remove(tw_api->callbackIndex, tmp->entityType, tmp->entityName, tmp->characteristicType, tmp->charateristicName, tmp);
+				twList_Remove(tw_api->callbackList, entry, TRUE);
 			}
 		}
+		invalidateMetadata(entityName);
 		return 0;
 	}
 	TW_LOG(TW_ERROR, "twApi_UnregisterThing: Invalid params or missing api pointer");
@@ -922,58 +1086,168 @@ int twApi_WriteProperty(enum entityTypeEnum entityType, char * entityName, char
 	return convertMsgCodeToErrorCode(res);
 }
 
-int twApi_PushProperties(enum entityTypeEnum entityType, char * entityName, propertyList * properties, int32_t timeout, char forceConnect) {
-	twDataShape* ds = NULL;
-	twInfoTable * it = NULL;
-	twInfoTable * values = NULL;
-	twInfoTable * result = NULL;
+twPropertyDef * getPropertyDef(enum entityTypeEnum entityType, char * entityName, char * propertyName) {
+	callbackInfo * info = NULL;
+	if (!tw_api || !tw_api->callbackIndex || !entityName || !propertyName) return NULL;
+	info = (callbackInfo *)twCallbackRegistry_Get(tw_api->callbackIndex, entityType, entityName, TW_PROPERTIES, propertyName);
+	/* Ignore wildcard matches, only a property's own definition carries its push policy */
+	if (!info || !info->charateristicDefinition || strcmp(info->charateristicName, propertyName)) return NULL;
+	return (twPropertyDef *)info->charateristicDefinition;
+}
+
+/* Values that passed their property's push filter.  They are set as pushed once the push has gone out */
+typedef struct pushCandidates {
+	twPropertyDef ** defs;
+	twPrimitive ** values;
+	int count;
+} pushCandidates;
+
+/* Finds the latest value of a property in this push, searching back from the end since that's where it usually is */
+static twPrimitive * findPushCandidate(pushCandidates * c, twPropertyDef * def) {
+	int i = c->count;
+	while (i-- > 0) {
+		if (c->defs[i] == def) return c->values[i];
+	}
+	return NULL;
+}
+
+static void commitPushCandidates(pushCandidates * c) {
+	int i = 0;
+	for (i = 0; i < c->count; i++) twPropertyDef_SetPushed(c->defs[i], c->values[i]);
+}
+
+static void freePushCandidates(pushCandidates * c) {
+	if (c->defs) TW_FREE(c->defs);
+	if (c->values) TW_FREE(c->values);
+	memset(c, 0, sizeof(pushCandidates));
+}
+
+twStream * createPushPropertiesParams(enum entityTypeEnum entityType, char * entityName, propertyList * properties, int * count, pushCandidates * candidates) {
+	twStream * s = NULL;
 	ListEntry * le = NULL;
-	int res = TW_UNKNOWN_ERROR;
-	/* Validate the inoputs */
-	if (!entityName || !properties) {
-		TW_LOG(TW_ERROR,"twApi_PushProperties: Missing inputs");
-		return TWX_BAD_REQUEST;
+	uint32_t size = 0;
+	uint32_t len = 0;
+	char rowHeader[3] = { 1, 0, 4 };
+	char terminators[2] = { 0, 0 };
+	twPrimitive name, value, time, quality;
+	twPropertyDef * def = NULL;
+	*count = 0;
+	if (!tw_api || !tw_api->pushPropertiesTemplate) {
+		TW_LOG(TW_ERROR,"twApi_PushProperties: Push properties template not initialized");
+		return NULL;
 	}
-	/* Create the data shape */
-	ds = twDataShape_Create(twDataShapeEntry_Create("name", NULL, TW_STRING));
-	if (!ds) {
-		TW_LOG(TW_ERROR,"twApi_PushProperties: Error allocating data shape");
-		return TWX_INTERNAL_SERVER_ERROR;
+	/* Work out the largest size we could need so the stream is only allocated once */
+	size = twStream_GetLength(tw_api->pushPropertiesTemplate) + sizeof(terminators);
+	le = twList_Next(properties, NULL);
+	while (le) {
+		twProperty * prop = (twProperty *)le->value;
+		if (prop && prop->name && prop->value) {
+			len = strlen(prop->name);
+			size += sizeof(rowHeader) + 1 + (len > 127 ? 4 : 1) + len;
+			size += 2 + prop->value->length;
+			size += 1 + 8;
+			size += 1 + 1 + 4;
+		}
+		le = twList_Next(properties, le);
 	}
-	twDataShape_AddEntry(ds,twDataShapeEntry_Create("value", NULL, TW_VARIANT));
-	twDataShape_AddEntry(ds,twDataShapeEntry_Create("time", NULL, TW_DATETIME));
-	twDataShape_AddEntry(ds,twDataShapeEntry_Create("quality", NULL, TW_STRING));
-	/* Create the infotable */
-	it = twInfoTable_Create(ds);
-	if (!it) {
-		TW_LOG(TW_ERROR,"twApi_PushProperties: Error creating infotable");
-		twDataShape_Delete(ds);
-		return TWX_INTERNAL_SERVER_ERROR;
+	s = twStream_CreateWithCapacity(size);
+	candidates->defs = (twPropertyDef **)TW_CALLOC(sizeof(twPropertyDef *), twList_GetCount(properties) + 1);
+	candidates->values = (twPrimitive **)TW_CALLOC(sizeof(twPrimitive *), twList_GetCount(properties) + 1);
+	if (!s || !candidates->defs || !candidates->values) {
+		TW_LOG(TW_ERROR,"twApi_PushProperties: Error allocating stream");
+		twStream_Delete(s);
+		freePushCandidates(candidates);
+		return NULL;
 	}
-	/* Loop through the list and create a row per entry */
+	twStream_AddBytes(s, twStream_GetData(tw_api->pushPropertiesTemplate), twStream_GetLength(tw_api->pushPropertiesTemplate));
+	/* Serialize the row fields straight from the property list without building any infotable objects */
+	memset(&name, 0, sizeof(twPrimitive));
+	name.type = name.typeFamily = TW_STRING;
+	memset(&value, 0, sizeof(twPrimitive));
+	value.type = value.typeFamily = TW_VARIANT;
+	memset(&time, 0, sizeof(twPrimitive));
+	time.type = time.typeFamily = TW_DATETIME;
+	memset(&quality, 0, sizeof(twPrimitive));
+	quality.type = quality.typeFamily = TW_STRING;
+	quality.val.bytes.data = "GOOD";
+	quality.val.bytes.len = 4;
 	le = twList_Next(properties, NULL);
 	while (le) {
 		twProperty * prop = (twProperty *)le->value;
-		twInfoTableRow * row = NULL;
-		row = twInfoTableRow_Create(twPrimitive_CreateFromString(prop->name, TRUE));
-		if (!row) {
-			TW_LOG(TW_ERROR,"twApi_PushProperties: Error creating infotable row");
-			break;
-		}
-		twInfoTableRow_AddEntry(row, twPrimitive_CreateVariant(twPrimitive_ZeroCopy(prop->value)));
-		twInfoTableRow_AddEntry(row,twPrimitive_CreateFromDatetime(prop->timestamp));
-		twInfoTableRow_AddEntry(row,twPrimitive_CreateFromString("GOOD",TRUE));
-		twInfoTable_AddRow(it,row);
 		le = twList_Next(properties, le);
+		if (!prop || !prop->name || !prop->value) continue;
+		/* Drop values the property's push type and threshold say the server doesn't need */
+		def = getPropertyDef(entityType, entityName, prop->name);
+		if (!twPropertyDef_ShouldPush(def, prop->value, def ? findPushCandidate(candidates, def) : NULL)) continue;
+		if (def) {
+			candidates->defs[candidates->count] = def;
+			candidates->values[candidates->count++] = prop->value;
+		}
+		name.val.bytes.data = prop->name;
+		name.val.bytes.len = strlen(prop->name);
+		value.val.variant = prop->value;
+		time.val.datetime = prop->timestamp;
+		twStream_AddBytes(s, rowHeader, sizeof(rowHeader));
+		twPrimitive_ToStream(&name, s);
+		twPrimitive_ToStream(&value, s);
+		twPrimitive_ToStream(&time, s);
+		twPrimitive_ToStream(&quality, s);
+		(*count)++;
+	}
+	/* End of the inner and outer infotable rows */
+	twStream_AddBytes(s, terminators, sizeof(terminators));
+	return s;
+}
+
+twMessage * createPushPropertiesRequest(enum entityTypeEnum entityType, char * entityName, propertyList * properties, 
+										char forceConnect, int * count, pushCandidates * candidates, enum msgCodeEnum * err) {
+	twMessage * msg = NULL;
+	twStream * values = createPushPropertiesParams(entityType, entityName, properties, count, candidates);
+	*err = TWX_INTERNAL_SERVER_ERROR;
+	if (!values) return NULL;
+	if (!*count) {
+		/* Everything was filtered out, nothing to send */
+		twStream_Delete(values);
+		freePushCandidates(candidates);
+		*err = TWX_SUCCESS;
+		return NULL;
+	}
+	msg = createRequest(TWX_POST, entityType, entityName, TW_SERVICES, "UpdateSubscribedPropertyValues", NULL, forceConnect, err);
+	if (!msg || twRequestBody_SetRawParams((twRequestBody *)(msg->body), values)) {
+		twStream_Delete(values);
+		freePushCandidates(candidates);
+		if (msg) {
+			twMessage_Delete(msg);
+			*err = TWX_INTERNAL_SERVER_ERROR;
+		}
+		return NULL;
 	}
+	return msg;
+}
+
+int twApi_PushProperties(enum entityTypeEnum entityType, char * entityName, propertyList * properties, int32_t timeout, char forceConnect) {
+	twMessage * msg = NULL;
+	twInfoTable * result = NULL;
+	enum msgCodeEnum res = TWX_PRECONDITION_FAILED;
+	int count = 0;
+	pushCandidates candidates;
+	/* Validate the inoputs */
+	if (!tw_api || !entityName || !properties) {
+		TW_LOG(TW_ERROR,"twApi_PushProperties: Missing inputs");
+		return TWX_BAD_REQUEST;
+	}
+	memset(&candidates, 0, sizeof(pushCandidates));
+	msg = createPushPropertiesRequest(entityType, entityName, properties, forceConnect, &count, &candidates, &res);
+	/* A NULL message with TWX_SUCCESS means everything was filtered out */
+	if (!msg) return convertMsgCodeToErrorCode(res);
 	/* Make the service request */
-	values = twInfoTable_Create(twDataShape_Create(twDataShapeEntry_Create("values", NULL, TW_INFOTABLE)));
-	twInfoTable_AddRow(values, twInfoTableRow_Create(twPrimitive_CreateFromInfoTable(it)));
-	res = twApi_InvokeService(entityType, entityName, "UpdateSubscribedPropertyValues", values, &result, timeout, forceConnect);
-	twInfoTable_Delete(it);
-	twInfoTable_Delete(values);
+	res = sendRequest(msg, &result, timeout);
+	/* Only filter against values the server actually has */
+	if (res == TWX_SUCCESS) commitPushCandidates(&candidates);
+	freePushCandidates(&candidates);
+	twMessage_Delete(msg);
 	twInfoTable_Delete(result);
-	return res;
+	return convertMsgCodeToErrorCode(res);
 }
 
 int twApi_InvokeService(enum entityTypeEnum entityType, char * entityName, char * serviceName, twInfoTable * params, twInfoTable ** result, int32_t timeout, char forceConnect) {
@@ -989,6 +1263,76 @@ int twApi_FireEvent(enum entityTypeEnum entityType, char * entityName, char * ev
 	return convertMsgCodeToErrorCode(res);
 }
 
+int twApi_ReadPropertyAsync(enum entityTypeEnum entityType, char * entityName, char * propertyName, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId) {
+	return makeAsyncRequest(TWX_GET, entityType, entityName, TW_PROPERTIES, propertyName, NULL, cb, timeout, forceConnect, requestId);
+}
+
+int twApi_PushPropertiesAsync(enum entityTypeEnum entityType, char * entityName, propertyList * properties, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId) {
+	twMessage * msg = NULL;
+	enum msgCodeEnum res = TWX_PRECONDITION_FAILED;
+	int err = TW_OK;
+	int count = 0;
+	pushCandidates candidates;
+	if (!tw_api || !tw_api->mh || !entityName || !properties) {
+		TW_LOG(TW_ERROR,"twApi_PushPropertiesAsync: Missing inputs");
+		return TW_INVALID_PARAM;
+	}
+	memset(&candidates, 0, sizeof(pushCandidates));
+	msg = createPushPropertiesRequest(entityType, entityName, properties, forceConnect, &count, &candidates, &res);
+	if (!msg) {
+		/* If everything was filtered out there is nothing to send and no callback to make */
+		if (res == TWX_SUCCESS && requestId) *requestId = 0;
+		return convertMsgCodeToErrorCode(res);
+	}
+	err = sendAsyncRequest(msg, cb, timeout, requestId);
+	/* The values are on their way once the request is on the socket or in the offline store */
+	if (!err) commitPushCandidates(&candidates);
+	freePushCandidates(&candidates);
+	twMessage_Delete(msg);
+	return err;
+}
+
+int twApi_InvokeServiceAsync(enum entityTypeEnum entityType, char * entityName, char * serviceName, twInfoTable * params, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId) {
+	return makeAsyncRequest(TWX_POST, entityType, entityName, TW_SERVICES, serviceName, params, cb, timeout, forceConnect, requestId);
+}
+
+int twApi_FireEventAsync(enum entityTypeEnum entityType, char * entityName, char * eventName, twInfoTable * params, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId) {
+	return makeAsyncRequest(TWX_POST, entityType, entityName, TW_EVENTS, eventName, params, cb, timeout, forceConnect, requestId);
+}
+
+int twApi_GetAsyncResult(uint32_t requestId, twInfoTable ** result) {
+	twResponseCallbackStruct * r = NULL;
+	char pending = FALSE;
+	int res = TW_OK;
+	if (!tw_api || !tw_api->mh || !requestId) {
+		TW_LOG(TW_ERROR,"twApi_GetAsyncResult: NULL api singleton or invalid request Id");
+		return TW_INVALID_PARAM;
+	}
+	r = twResponseTable_RemoveCompleted(tw_api->mh->responseTable, requestId, twGetSystemMillisecondCount(), &pending);
+	if (!r) return pending ? TW_REQUEST_PENDING : TW_ERROR_CALLBACK_NOT_FOUND;
+	if (r->received) {
+		res = convertMsgCodeToErrorCode(r->code);
+		if (result && !res) {
+			*result = r->content;
+			r->content = NULL;
+		}
+	} else {
+		TW_LOG(TW_WARN,"twApi_GetAsyncResult: Message %d timed out", requestId);
+		res = TW_GATEWAY_TIMEOUT;
+	}
+	twResponseCallbackStruct_Delete(r);
+	return res;
+}
+
+int twApi_CancelAsyncRequest(uint32_t requestId) {
+	twResponseCallbackStruct * r = NULL;
+	if (!tw_api || !tw_api->mh || !requestId) return TW_INVALID_PARAM;
+	r = twResponseTable_Remove(tw_api->mh->responseTable, requestId);
+	if (!r) return TW_ERROR_CALLBACK_NOT_FOUND;
+	twResponseCallbackStruct_Delete(r);
+	return TW_OK;
+}
+
 int twApi_RegisterConnectCallback(eventcb cb) {
 	if (tw_api && tw_api->mh) return twMessageHandler_RegisterConnectCallback(tw_api->mh, cb);
 	return TW_NULL_OR_INVALID_API_SINGLETON;
@@ -1038,6 +1382,18 @@ int twApi_UnregisterBindEventCallback(char * entityName, bindEvent_cb cb, void *
 	return TW_NOT_FOUND;
 }
 
+int twApi_SetSubscribedProperty(char * entityName, char * propertyName, twPrimitive * value, DATETIME timestamp, char pushUpdate) {
+	return twSubscribedPropsMgr_SetPropertyValue(entityName, propertyName, value, timestamp, pushUpdate);
+}
+
+int twApi_PushSubscribedProperties(char * entityName, char forceConnect) {
+	return twSubscribedPropsMgr_PushSubscribedProperties(entityName, forceConnect);
+}
+
+int twApi_SetSubscribedPropertyFolding(char fold) {
+	return twSubscribedPropsMgr_SetFolding(fold);
+}
+
 int twApi_CleanupOldMessages() {
 	if (tw_api && tw_api->mh) return twMessageHandler_CleanupOldMessages(tw_api->mh);
 	return TW_NULL_OR_INVALID_API_SINGLETON;
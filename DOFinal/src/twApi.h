@@ -15,10 +15,13 @@
 #include "twLogger.h"
 #include "twBaseTypes.h"
 #include "twMessaging.h"
+#include "twCallbackRegistry.h"
 #include "twInfoTable.h"
 #include "twTasker.h"
 #include "twProperties.h"
 #include "twServices.h"
+#include "twOfflineMsgStore.h"
+#include "twOfflineMsgQueue.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -94,8 +97,12 @@ need to manipulate this structure directly.
 typedef struct twApi {
 	twMessageHandler * mh;
 	twList * callbackList;
+	twCallbackRegistry * callbackIndex;
 	twList * boundList;
 	twList * bindEventCallbackList;
+	twStream * pushPropertiesTemplate;
+	twList * metadataCache;
+	TW_MUTEX metadataMtx;
 	genericRequest_cb defaultRequestHandler;
 	char autoreconnect;
 	int8_t manuallyDisconnected;
@@ -104,9 +111,9 @@ typedef struct twApi {
 	uint32_t duty_cycle_period;
 	TW_MUTEX mtx;
 	char offlineMsgEnabled;
-	twList * offlineMsgList;
+	twOfflineMsgQueue * offlineMsgQueue;
 	uint32_t offlineMsgSize;
-	char * offlineMsgFile;
+	twOfflineMsgStore * offlineMsgStore;
 	uint32_t ping_rate;
 	char handle_pongs;
 	uint32_t connect_timeout;
@@ -357,7 +364,8 @@ Parameters:
 	entityName - the name of the entity that the property belongs to.
 	propertyName - the name of the property.
 	propertyType - the BaseType of the property.  See BaseTypes definition in  twDefinitions.h.
-	propertyPushType - tells the server the push type of the property.  Can be NEVER, ALWAYS, VALUE (on change).
+	propertyPushType - the push type of the property.  Can be NEVER, ALWAYS, VALUE (on change).  Pushed values are
+		filtered on the edge according to this setting.
 	propertyPushThreshold - the amount the property has to change (if the type is TW_NUMBER or TW_INTEGER) before pushing the new value.
 	cb - pointer to the property callback function.  Function signature is found in this file.
 	userdata (Input) - a generic pointer that is passed back to the callback function when it is invoked.
@@ -470,7 +478,8 @@ Return:
 int twApi_WriteProperty(enum entityTypeEnum entityType, char * entityName, char * propertyName, twPrimitive * value, int32_t timeout, char forceConnect);
 
 /*
-twApi_PushProperties - writes a set of values of various properties to the server.  
+twApi_PushProperties - writes a set of values of various properties to the server.  Values of registered
+properties are filtered by their push type and threshold first.  If every value is filtered out nothing is sent.
 Parameters:
 	entityType - the type of entity that the property belongs to. Enum can be found in twDefinitions.h
 	entityName - the name of the entity that the properties belong to.
@@ -511,6 +520,153 @@ Return:
 */
 int twApi_FireEvent(enum entityTypeEnum entityType, char * entityName, char * eventName, twInfoTable * params, int32_t timeout, char forceConnect);
 
+/*******************************************/
+/*    Asynchronous Server Property/Service */
+/*       /Event Accessor Functions         */
+/*******************************************/
+/*
+These functions send the request and return immediately without waiting for the
+server to respond.  Any number of requests can be in flight at once, up to
+MAX_PENDING_RESPONSES.  Each request is identified by the request ID returned in
+requestId. Completion is reported one of two ways:
+	- If cb is not NULL it is called from the message handler task when the response
+	  arrives or with a code of TWX_GATEWAY_TIMEOUT if the timeout expires first.  The
+	  content infotable passed to the callback is deleted when the callback returns.
+	  Use twInfoTable_FullCopy if it is needed later.  Function signature of response_cb
+	  can be found in twMessaging.h.
+	- If cb is NULL the request acts as a future.  Poll it with twApi_GetAsyncResult.
+	  If the result is never collected the request is discarded once its timeout expires.
+The responses are only processed while the message handler task and api tasker function
+are running, which the built in tasker takes care of when ENABLE_TASKER is defined.
+*/
+
+/*
+twApi_ReadPropertyAsync - requests the current value of a property from the server without waiting for the response.  
+Parameters:
+	entityType - the type of entity that the property belongs to. Enum can be found in twDefinitions.h
+	entityName - the name of the entity that the property belongs to.
+	propertyName - name of the property to get
+	cb - function to call when the request completes or NULL to poll for the result.  The property value is
+		in the field named propertyName of the content infotable.
+	timeout - time (in milliseconds) to wait for a response from the server. -1 uses DEFAULT_MESSAGE_TIMEOUT
+	forceConnect - (boolean) if in the disconnected state of the duty cycle, force a reconnect to send the message
+	requestId - pointer to a uint32_t that receives the request ID of the request.  May be NULL if cb is not NULL.
+Return:
+	int - 0 if the request was sent, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twApi_ReadPropertyAsync(enum entityTypeEnum entityType, char * entityName, char * propertyName, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId);
+
+/*
+twApi_PushPropertiesAsync - writes a set of values of various properties to the server without waiting for the response.  
+Values are filtered the same way as twApi_PushProperties.  If every value is filtered out nothing is sent, the callback
+is never called and the request ID is set to 0.
+Parameters:
+	entityType - the type of entity that the property belongs to. Enum can be found in twDefinitions.h
+	entityName - the name of the entity that the properties belong to.
+	properties - a twList (see utils/list.h) of twProperty pointers containing the values of the properties to write.  Caller owns the list pointer and must delete it.
+	cb - function to call when the request completes or NULL to poll for the result
+	timeout - time (in milliseconds) to wait for a response from the server. -1 uses DEFAULT_MESSAGE_TIMEOUT
+	forceConnect - (boolean) if in the disconnected state of the duty cycle, force a reconnect to send the message
+	requestId - pointer to a uint32_t that receives the request ID of the request.  May be NULL if cb is not NULL.
+Return:
+	int - 0 if the request was sent, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twApi_PushPropertiesAsync(enum entityTypeEnum entityType, char * entityName, propertyList * properties, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId);
+
+/*
+twApi_InvokeServiceAsync - invokes a service on the server without waiting for the response.  
+Parameters:
+	entityType - the type of entity that the service belongs to. Enum can be found in twDefinitions.h
+	entityName - the name of the entity that the service belongs to.
+	serviceName - the name of the service to invoke
+	params - a pointer to an infoTable containing the service parameters.  Caller owns this pointer and must delete it.
+	cb - function to call when the request completes or NULL to poll for the result
+	timeout - time (in milliseconds) to wait for a response from the server. -1 uses DEFAULT_MESSAGE_TIMEOUT
+	forceConnect - (boolean) if in the disconnected state of the duty cycle, force a reconnect to send the message
+	requestId - pointer to a uint32_t that receives the request ID of the request.  May be NULL if cb is not NULL.
+Return:
+	int - 0 if the request was sent, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twApi_InvokeServiceAsync(enum entityTypeEnum entityType, char * entityName, char * serviceName, twInfoTable * params, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId);
+
+/*
+twApi_FireEventAsync - trigers an event on the server without waiting for the response.  
+Parameters:
+	entityType - the type of entity that the event belongs to. Enum can be found in twDefinitions.h
+	entityName - the name of the entity that the event belongs to.
+	eventName - the name of the event to trigger
+	params - a pointer to an infoTable containing the event data values.  Caller owns this pointer and must delete it.
+	cb - function to call when the request completes or NULL to poll for the result
+	timeout - time (in milliseconds) to wait for a response from the server. -1 uses DEFAULT_MESSAGE_TIMEOUT
+	forceConnect - (boolean) if in the disconnected state of the duty cycle, force a reconnect to send the message
+	requestId - pointer to a uint32_t that receives the request ID of the request.  May be NULL if cb is not NULL.
+Return:
+	int - 0 if the request was sent, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twApi_FireEventAsync(enum entityTypeEnum entityType, char * entityName, char * eventName, twInfoTable * params, response_cb cb, int32_t timeout, char forceConnect, uint32_t * requestId);
+
+/*
+twApi_GetAsyncResult - polls for the result of an asynchronous request that was made without a callback.
+Once this returns anything other than TW_REQUEST_PENDING the request ID is no longer valid.
+Parameters:
+	requestId - the request ID returned by the asynchronous call
+	result - optional pointer to an infoTable pointer that will contain the response content if the request 
+		succeeded.  Caller owns the returned pointer and must delete it.
+Return:
+	int - 0 if the request succeeded, TW_REQUEST_PENDING if no response has been received yet, TW_GATEWAY_TIMEOUT
+		if the request timed out, TW_ERROR_CALLBACK_NOT_FOUND if the request ID is unknown or has already been
+		collected, otherwise the error code (see twErrors.h) returned by the server
+*/
+int twApi_GetAsyncResult(uint32_t requestId, twInfoTable ** result);
+
+/*
+twApi_CancelAsyncRequest - stops tracking an asynchronous request.  Any response that arrives later is ignored
+and the callback, if any, will not be called.
+Parameters:
+	requestId - the request ID returned by the asynchronous call
+Return:
+	int - 0 if successful, TW_ERROR_CALLBACK_NOT_FOUND if the request ID is unknown
+*/
+int twApi_CancelAsyncRequest(uint32_t requestId);
+
+/*******************************************/
+/*     Managed Property Update Functions   */
+/*******************************************/
+/*
+twApi_SetSubscribedProperty - queues a new property value to be sent to the server.  Queued values are sent
+as one UpdateSubscribedPropertyValues request per entity every MANAGED_PROPERTY_FLUSH_RATE msec, or sooner
+if the queue grows past MAX_MANAGED_PROPERTY_Q_SIZE.
+Parameters:
+	entityName - the name of the entity the property belongs to
+	propertyName - the name of the property
+	value - pointer to the new value.  The queue owns this pointer and will delete it.
+	timestamp - timestamp of the new value.  0 uses the current time.
+	pushUpdate - (boolean) send the queued values for this entity immediately
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twApi_SetSubscribedProperty(char * entityName, char * propertyName, twPrimitive * value, DATETIME timestamp, char pushUpdate);
+
+/*
+twApi_PushSubscribedProperties - sends all queued property values to the server without waiting for the next flush.
+Parameters:
+	entityName - the entity to send the values of or NULL to send for all entities
+	forceConnect - (boolean) if in the disconnected state of the duty cycle, force a reconnect to send the message
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twApi_PushSubscribedProperties(char * entityName, char forceConnect);
+
+/*
+twApi_SetSubscribedPropertyFolding - turns property folding on or off.  When folding is on only the most
+recent value of each queued property is sent.
+Parameters:
+	fold - (boolean) TRUE to fold updates to the same property
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twApi_SetSubscribedPropertyFolding(char fold);
+
 /*******************************************/
 /*          Keep Alive Functions           */
 /*******************************************/
@@ -546,7 +702,7 @@ int twApi_RegisterPongCallback(eventcb cb);
 /*            Tasker Functions             */
 /*******************************************/
 /*
-twApi_CreateTask - adds a new task to the round robin scheduler.  
+twApi_CreateTask - adds a new periodic task to the task scheduler (see twTasker.h).  
 Parameters:
 	runTimeIntervalMsec - Time (in milliseconds) to wait between calls to the task function specified.
 	func - pointer to the function to call.  Function signature can be found in utils/twTasker.h.
@@ -0,0 +1,138 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Bump allocator for incoming message object graphs
+ */
+
+#include "twArena.h"
+#include "twOSPort.h"
+
+#include <string.h>
+
+/* Every allocation is preceded by its size so it can be reallocated */
+#define ARENA_ALIGN 8
+#define ARENA_HEADER_SIZE 8
+#define ARENA_ROUND(x) (((x) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+#define ARENA_MIN_BLOCK_SIZE 256
+#define BLOCK_DATA(b) ((char *)(b) + ARENA_ROUND(sizeof(twArenaBlock)))
+
+/* Arena state of the calling thread */
+static TW_THREAD_LOCAL twArena * ownerArena = NULL;
+static TW_THREAD_LOCAL twArena * allocArena = NULL;
+
+static twArenaBlock * addBlock(twArena * a, size_t size) {
+	twArenaBlock * b = NULL;
+	if (size < a->nextBlockSize) size = a->nextBlockSize;
+	b = (twArenaBlock *)TW_SYS_MALLOC(ARENA_ROUND(sizeof(twArenaBlock)) + size);
+	if (!b) return NULL;
+	b->size = size;
+	b->used = 0;
+	b->next = a->blocks;
+	a->blocks = b;
+	a->nextBlockSize = size * 2;
+	return b;
+}
+
+twArena * twArena_Create(size_t sizeHint) {
+	twArena * a = (twArena *)TW_SYS_CALLOC(sizeof(twArena), 1);
+	if (!a) return NULL;
+	a->nextBlockSize = ARENA_ROUND(sizeHint < ARENA_MIN_BLOCK_SIZE ? ARENA_MIN_BLOCK_SIZE : sizeHint);
+	if (!addBlock(a, 0)) {
+		TW_SYS_FREE(a);
+		return NULL;
+	}
+	return a;
+}
+
+void twArena_Delete(twArena * a) {
+	twArenaBlock * b = NULL;
+	if (!a) return;
+	if (ownerArena == a) ownerArena = NULL;
+	if (allocArena == a) allocArena = NULL;
+	b = a->blocks;
+	while (b) {
+		twArenaBlock * next = b->next;
+		TW_SYS_FREE(b);
+		b = next;
+	}
+	TW_SYS_FREE(a);
+}
+
+void * twArena_Alloc(twArena * a, size_t size) {
+	twArenaBlock * b = NULL;
+	char * p = NULL;
+	size_t needed = ARENA_HEADER_SIZE + ARENA_ROUND(size);
+	if (!a) return NULL;
+	b = a->blocks;
+	if (b->size - b->used < needed) {
+		/* Start a new block, the rest of the current one is wasted */
+		b = addBlock(a, needed);
+		if (!b) return NULL;
+	}
+	p = BLOCK_DATA(b) + b->used;
+	b->used += needed;
+	a->allocated += size;
+	*(size_t *)p = size;
+	p += ARENA_HEADER_SIZE;
+	/* Blocks are not zeroed when they are allocated */
+	memset(p, 0, size);
+	return p;
+}
+
+char twArena_Owns(twArena * a, void * p) {
+	twArenaBlock * b = NULL;
+	if (!a || !p) return FALSE;
+	b = a->blocks;
+	while (b) {
+		if ((char *)p >= BLOCK_DATA(b) && (char *)p < BLOCK_DATA(b) + b->used) return TRUE;
+		b = b->next;
+	}
+	return FALSE;
+}
+
+twArenaScope twArena_Enter(twArena * a, char allocate) {
+	twArenaScope prev;
+	prev.owner = ownerArena;
+	prev.alloc = allocArena;
+	ownerArena = a;
+	allocArena = allocate ? a : NULL;
+	return prev;
+}
+
+void twArena_Leave(twArenaScope scope) {
+	ownerArena = scope.owner;
+	allocArena = scope.alloc;
+}
+
+char twArena_IsBorrowed(void * p) {
+	return (ownerArena && !allocArena && twArena_Owns(ownerArena, p));
+}
+
+void * twArena_Calloc(size_t count, size_t size) {
+	if (allocArena) return twArena_Alloc(allocArena, count * size);
+	return TW_SYS_CALLOC(count, size);
+}
+
+void * twArena_Malloc(size_t size) {
+	if (allocArena) return twArena_Alloc(allocArena, size);
+	return TW_SYS_MALLOC(size);
+}
+
+void * twArena_Realloc(void * p, size_t size) {
+	if (p && ownerArena && twArena_Owns(ownerArena, p)) {
+		/* Can't grow in place, move it to wherever new allocations are going */
+		size_t oldSize = *(size_t *)((char *)p - ARENA_HEADER_SIZE);
+		void * tmp = twArena_Malloc(size);
+		if (tmp) memcpy(tmp, p, oldSize < size ? oldSize : size);
+		return tmp;
+	}
+	if (!p && allocArena) return twArena_Alloc(allocArena, size);
+	return TW_SYS_REALLOC(p, size);
+}
+
+void twArena_Free(void * p) {
+	if (!p) return;
+	/* Arena memory is released with the arena */
+	if (ownerArena && twArena_Owns(ownerArena, p)) return;
+	TW_SYS_FREE(p);
+}
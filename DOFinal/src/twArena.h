@@ -0,0 +1,141 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Bump allocator for incoming message object graphs
+ */
+
+#ifndef TW_ARENA_H
+#define TW_ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***************************************/
+/*          Message Arenas             */
+/* When ENABLE_MSG_ARENA is defined    */
+/* each incoming message is decoded    */
+/* into a single arena.  Every object  */
+/* in the message (primitives, rows,   */
+/* data shapes, lists and strings) is  */
+/* carved out of the arena and the     */
+/* whole graph is released at once     */
+/* when the message is deleted.        */
+/*                                     */
+/* The TW_CALLOC/TW_MALLOC/TW_REALLOC/ */
+/* TW_FREE macros are routed through   */
+/* the twArena_Calloc etc. hooks below */
+/* which allocate from the arena that  */
+/* is current for the calling thread   */
+/* and ignore frees of memory it owns. */
+/*                                     */
+/* Anything that takes ownership of    */
+/* part of a message with one of the   */
+/* _ZeroCopy functions gets a full     */
+/* copy on the heap instead, so        */
+/* existing ownership rules still hold */
+/***************************************/
+
+typedef struct twArenaBlock {
+	struct twArenaBlock * next;
+	size_t size;
+	size_t used;
+} twArenaBlock;
+
+typedef struct twArena {
+	twArenaBlock * blocks;
+	size_t nextBlockSize;
+	size_t allocated;
+} twArena;
+
+/* Saved arena state of the calling thread, see twArena_Enter */
+typedef struct twArenaScope {
+	twArena * owner;
+	twArena * alloc;
+} twArenaScope;
+
+/*
+twArena_Create - Creates an empty arena.
+Parameters:
+	sizeHint - size in bytes of the first block.  Later blocks double in size.
+Return:
+	twArena * - pointer to the arena or NULL if an error occurred
+*/
+twArena * twArena_Create(size_t sizeHint);
+
+/*
+twArena_Delete - Releases an arena and everything allocated from it.  If the arena is
+current for the calling thread it is no longer current.
+Parameters:
+	a - pointer to the arena to delete
+Return:
+	Nothing
+*/
+void twArena_Delete(twArena * a);
+
+/*
+twArena_Alloc - Allocates zeroed memory from an arena.  The memory is only released
+when the arena is deleted.
+Parameters:
+	a - pointer to the arena to allocate from
+	size - number of bytes to allocate
+Return:
+	void * - pointer to the memory or NULL if an error occurred
+*/
+void * twArena_Alloc(twArena * a, size_t size);
+
+/*
+twArena_Owns - Checks if memory was allocated from an arena.
+Parameters:
+	a - pointer to the arena
+	p - pointer to check
+Return:
+	char - TRUE if p was allocated from the arena
+*/
+char twArena_Owns(twArena * a, void * p);
+
+/*
+twArena_Enter - Makes an arena current for the calling thread.  Frees of memory owned
+by the arena are ignored while it is current.
+Parameters:
+	a - pointer to the arena, may be NULL
+	allocate - (boolean) if TRUE allocations are also made from the arena
+Return:
+	twArenaScope - the previous state, pass it to twArena_Leave to restore it
+*/
+twArenaScope twArena_Enter(twArena * a, char allocate);
+
+/*
+twArena_Leave - Restores the arena state saved by twArena_Enter.
+Parameters:
+	scope - the state returned by twArena_Enter
+Return:
+	Nothing
+*/
+void twArena_Leave(twArenaScope scope);
+
+/*
+twArena_IsBorrowed - Checks if memory belongs to the current arena while the arena is
+not being allocated from.  Such memory is only on loan and must be copied before it
+can be owned by anyone else.
+Parameters:
+	p - pointer to check
+Return:
+	char - TRUE if p must be copied rather than taken over
+*/
+char twArena_IsBorrowed(void * p);
+
+/* Allocation hooks used by the TW_CALLOC/TW_MALLOC/TW_REALLOC/TW_FREE macros */
+void * twArena_Calloc(size_t count, size_t size);
+void * twArena_Malloc(size_t size);
+void * twArena_Realloc(void * p, size_t size);
+void twArena_Free(void * p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,6 +8,7 @@
 #include "twInfoTable.h"
 #include "twLogger.h"
 #include "stringUtils.h"
+#include "twArena.h"
 
 #include "string.h"
 
@@ -263,7 +264,7 @@ twStream * twStream_Create() {
 	}
 	s->data = (char *)TW_CALLOC(STREAM_BLOCK_SIZE, 1);
 	if (!s->data) {
-		free(s);
+		TW_FREE(s);
 		return NULL;
 	}
 	s->ptr = s->data;
@@ -273,6 +274,26 @@ twStream * twStream_Create() {
 	return s;
 }
 
+twStream * twStream_CreateWithCapacity(uint32_t capacity) {
+	twStream * s = NULL;
+	if (capacity < STREAM_BLOCK_SIZE) return twStream_Create();
+	s = (twStream *)TW_CALLOC(sizeof(twStream), 1);
+	if (!s) {
+		TW_LOG(TW_ERROR,"twStream_CreateWithCapacity: Error allocating stream");
+		return NULL;
+	}
+	s->data = (char *)TW_CALLOC(capacity, 1);
+	if (!s->data) {
+		TW_FREE(s);
+		return NULL;
+	}
+	s->ptr = s->data;
+	s->length = 0;
+	s->maxlength = capacity;
+	s->ownsData = TRUE;
+	return s;
+}
+
 twStream * twStream_CreateFromCharArray(const char * data, uint32_t length) {
 	twStream * s = NULL;
 	if (!data) {
@@ -286,7 +307,7 @@ twStream * twStream_CreateFromCharArray(const char * data, uint32_t length) {
 	}
 	s->data = (char *)TW_CALLOC(length, 1);
 	if (!s->data) {
-		free(s);
+		TW_FREE(s);
 		return NULL;
 	}
 	memcpy(s->data, data, length);
@@ -341,33 +362,50 @@ int32_t twStream_GetLength(struct twStream * s) {
 	return s->length;
 }
 
-int twStream_AddBytes(struct twStream * s, void * b, uint32_t count) {
-	if (!s || !b) { 
-		TW_LOG(TW_ERROR,"twStream_AddBytes: NULL Pointer passed in"); 
+int twStream_Reserve(struct twStream * s, uint32_t count) {
+	if (!s) { 
+		TW_LOG(TW_ERROR,"twStream_Reserve: NULL Pointer passed in"); 
 		return TW_INVALID_PARAM; 
 	}
 	if (s->length + count > s->maxlength) {
 		char * newData = NULL;
-		TW_LOG(TW_TRACE,"twStream_AddBytes: adding %d bytes would exceed the length of %d. Expanding stream.", 
+		uint32_t newLength = s->maxlength ? s->maxlength : STREAM_BLOCK_SIZE;
+		TW_LOG(TW_TRACE,"twStream_Reserve: adding %d bytes would exceed the length of %d. Expanding stream.", 
 			count, s->maxlength); 
-		/* add enough storage to hold the additonal bytes */
-		while (s->length + count > s->maxlength) s->maxlength += STREAM_BLOCK_SIZE;
-		newData = (char *)TW_CALLOC(s->maxlength, 1);
+		/* Double the storage so that building a large stream only copies it a logarithmic number of times */
+		while (s->length + count > newLength) newLength *= 2;
+		if (s->ownsData) {
+			newData = (char *)TW_REALLOC(s->data, newLength);
+		} else {
+			newData = (char *)TW_MALLOC(newLength);
+			/* Copy the existing data */
+			if (newData) memcpy(newData, s->data, s->length);
+		}
 		if (!newData) {
-			TW_LOG(TW_ERROR, "twStream_AddBytes: Error allocating new storage for stream");
+			TW_LOG(TW_ERROR, "twStream_Reserve: Error allocating new storage for stream");
 			return TW_ERROR_ALLOCATING_MEMORY;
 		}
-		/* Copy the existing data */
-		memcpy(newData, s->data, s->length);
+		/* Keep the unused tail zeroed like a freshly allocated stream */
+		memset(newData + s->length, 0, newLength - s->length);
 		/* Adjust the pointer */
 		s->ptr = newData + (s->ptr - s->data);
-		/* Free up the old data if we owned it */
-		if (s->ownsData) TW_FREE(s->data);
 		/* Set the new data */
 		s->data = newData;
+		s->maxlength = newLength;
 		/* We now own this even if we didn't before */
 		s->ownsData = TRUE;
 	}
+	return TW_OK;
+}
+
+int twStream_AddBytes(struct twStream * s, void * b, uint32_t count) {
+	int res = TW_OK;
+	if (!s || !b) { 
+		TW_LOG(TW_ERROR,"twStream_AddBytes: NULL Pointer passed in"); 
+		return TW_INVALID_PARAM; 
+	}
+	res = twStream_Reserve(s, count);
+	if (res) return res;
 	memcpy(s->ptr, b, count);
 	s->ptr += count;
 	s->length += count;
@@ -431,6 +469,7 @@ twPrimitive * twPrimitive_CreateFromStreamTyped( twStream * s, enum BaseType typ
 	/* Actions are based on the type */
 	switch (type) {
 	case 	TW_NOTHING:
+		p->typeFamily = TW_NOTHING;
 		break;
 	case 	TW_STRING:
 	case	TW_XML:
@@ -777,6 +816,8 @@ int twPrimitive_Compare(twPrimitive * p1, twPrimitive * p2) {
 
 twPrimitive * twPrimitive_ZeroCopy(twPrimitive * p) {
 	twPrimitive * copy = NULL;
+	/* A primitive in a message arena goes away with the message so it can't be taken over */
+	if (twArena_IsBorrowed(p)) return twPrimitive_FullCopy(p);
 	copy = twPrimitive_Create();
 	if (!p || !copy) return NULL;
 	copy->type = p->type;
@@ -1042,6 +1083,7 @@ char * twPrimitive_DecoupleStringAndDelete(twPrimitive * p) {
 	char * tmp;
 	if (!p || p->typeFamily != TW_STRING) return NULL;
 	tmp = p->val.bytes.data;
+	if (twArena_IsBorrowed(tmp)) tmp = duplicateString(tmp);
 	p->typeFamily = TW_NOTHING;
 	twPrimitive_Delete(p);
 	return tmp;
@@ -33,6 +33,7 @@ typedef struct twStream {
 } twStream;
 
 twStream * twStream_Create();
+twStream * twStream_CreateWithCapacity(uint32_t capacity); /* Empty stream with room for capacity bytes before it has to grow */
 twStream * twStream_CreateFromCharArray(const char * data, uint32_t length);  /* COPY - stream will own the data */
 twStream * twStream_CreateFromCharArrayZeroCopy(const char * data, uint32_t length); /* No copy - steam doesn't own data */
 void twStream_Delete(void* s);
@@ -40,6 +41,7 @@ char * twStream_GetData(struct twStream * s);
 int32_t twStream_GetIndex(struct twStream * s);
 int32_t twStream_GetLength(struct twStream * s);
 int twStream_AddBytes(struct twStream * s, void * b, uint32_t count);
+int twStream_Reserve(struct twStream * s, uint32_t count); /* Makes room for count more bytes without adding them */
 int twStream_GetBytes(struct twStream * s, void * b, uint32_t count);
 int twStream_Reset(struct twStream * s);
 
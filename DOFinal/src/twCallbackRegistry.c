@@ -0,0 +1,187 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Hashed index of entity/characteristic callbacks
+ */
+
+#define TW_LOG_MODULE TW_MODULE_API
+
+#include "twCallbackRegistry.h"
+#include "twLogger.h"
+#include "twDefaultSettings.h"
+
+#include <string.h>
+
+/* FNV-1a over the four key components */
+static uint32_t hashString(uint32_t h, const char * s) {
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	/* Separate the fields so "ab"+"c" and "a"+"bc" hash differently */
+	h ^= 0xff;
+	h *= 16777619u;
+	return h;
+}
+
+static uint32_t hashKey(enum entityTypeEnum entityType, const char * entityName,
+						enum characteristicEnum characteristicType, const char * characteristicName) {
+	uint32_t h = 2166136261u;
+	h ^= (uint32_t)entityType;
+	h *= 16777619u;
+	h ^= (uint32_t)characteristicType;
+	h *= 16777619u;
+	h = hashString(h, entityName);
+	return hashString(h, characteristicName);
+}
+
+/* Must be called with the registry mutex held */
+static twCallbackRegistryEntry * findEntry(twCallbackRegistry * reg, enum entityTypeEnum entityType, const char * entityName,
+						enum characteristicEnum characteristicType, const char * characteristicName) {
+	uint32_t h = hashKey(entityType, entityName, characteristicType, characteristicName);
+	twCallbackRegistryEntry * e = reg->buckets[h % reg->numBuckets];
+	while (e) {
+		if (e->hash == h && e->entityType == entityType && e->characteristicType == characteristicType &&
+			!strcmp(e->entityName, entityName) && !strcmp(e->characteristicName, characteristicName)) return e;
+		e = e->next;
+	}
+	return NULL;
+}
+
+/* Must be called with the registry mutex held */
+static void growRegistry(twCallbackRegistry * reg) {
+	uint32_t i = 0;
+	uint32_t newSize = reg->numBuckets * 2;
+	twCallbackRegistryEntry ** newBuckets = (twCallbackRegistryEntry **)TW_CALLOC(sizeof(twCallbackRegistryEntry *), newSize);
+	if (!newBuckets) {
+		/* Not fatal, we just get longer chains */
+		TW_LOG(TW_WARN,"twCallbackRegistry: Unable to grow registry to %d buckets", newSize);
+		return;
+	}
+	for (i = 0; i < reg->numBuckets; i++) {
+		twCallbackRegistryEntry * e = reg->buckets[i];
+		while (e) {
+			twCallbackRegistryEntry * next = e->next;
+			/* Append to keep the original registration order in each chain */
+			twCallbackRegistryEntry ** tail = &newBuckets[e->hash % newSize];
+			while (*tail) tail = &(*tail)->next;
+			e->next = NULL;
+			*tail = e;
+			e = next;
+		}
+	}
+	TW_FREE(reg->buckets);
+	reg->buckets = newBuckets;
+	reg->numBuckets = newSize;
+}
+
+twCallbackRegistry * twCallbackRegistry_Create(uint32_t numBuckets) {
+	twCallbackRegistry * reg = (twCallbackRegistry *)TW_CALLOC(sizeof(twCallbackRegistry), 1);
+	if (!reg) {
+		TW_LOG(TW_ERROR,"twCallbackRegistry_Create: Error allocating registry");
+		return NULL;
+	}
+	reg->numBuckets = numBuckets ? numBuckets : CALLBACK_REGISTRY_BUCKETS;
+	reg->buckets = (twCallbackRegistryEntry **)TW_CALLOC(sizeof(twCallbackRegistryEntry *), reg->numBuckets);
+	reg->mtx = twMutex_Create();
+	if (!reg->buckets || !reg->mtx) {
+		TW_LOG(TW_ERROR,"twCallbackRegistry_Create: Error allocating buckets or mutex");
+		twCallbackRegistry_Delete(reg);
+		return NULL;
+	}
+	return reg;
+}
+
+int twCallbackRegistry_Delete(twCallbackRegistry * reg) {
+	uint32_t i = 0;
+	if (!reg) return TW_INVALID_PARAM;
+	if (reg->buckets) {
+		for (i = 0; i < reg->numBuckets; i++) {
+			twCallbackRegistryEntry * e = reg->buckets[i];
+			while (e) {
+				twCallbackRegistryEntry * next = e->next;
+				TW_FREE(e);
+				e = next;
+			}
+		}
+		TW_FREE(reg->buckets);
+	}
+	if (reg->mtx) twMutex_Delete(reg->mtx);
+	TW_FREE(reg);
+	return TW_OK;
+}
+
+int twCallbackRegistry_Add(twCallbackRegistry * reg, enum entityTypeEnum entityType, const char * entityName,
+						   enum characteristicEnum characteristicType, const char * characteristicName, void * value) {
+	twCallbackRegistryEntry * entry = NULL;
+	twCallbackRegistryEntry ** tail = NULL;
+	if (!reg || !entityName || !characteristicName || !value) {
+		TW_LOG(TW_ERROR,"twCallbackRegistry_Add: NULL input parameter found");
+		return TW_INVALID_PARAM;
+	}
+	entry = (twCallbackRegistryEntry *)TW_CALLOC(sizeof(twCallbackRegistryEntry), 1);
+	if (!entry) {
+		TW_LOG(TW_ERROR,"twCallbackRegistry_Add: Error allocating registry entry");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	entry->hash = hashKey(entityType, entityName, characteristicType, characteristicName);
+	entry->entityType = entityType;
+	entry->entityName = entityName;
+	entry->characteristicType = characteristicType;
+	entry->characteristicName = characteristicName;
+	entry->value = value;
+	twMutex_Lock(reg->mtx);
+	if (reg->count >= reg->numBuckets * 2) growRegistry(reg);
+	tail = &reg->buckets[entry->hash % reg->numBuckets];
+	while (*tail) tail = &(*tail)->next;
+	*tail = entry;
+	reg->count++;
+	twMutex_Unlock(reg->mtx);
+	return TW_OK;
+}
+
+int twCallbackRegistry_Remove(twCallbackRegistry * reg, enum entityTypeEnum entityType, const char * entityName,
+						   enum characteristicEnum characteristicType, const char * characteristicName, void * value) {
+	uint32_t h = 0;
+	twCallbackRegistryEntry ** link = NULL;
+	if (!reg || !entityName || !characteristicName) {
+		TW_LOG(TW_ERROR,"twCallbackRegistry_Remove: NULL input parameter found");
+		return TW_INVALID_PARAM;
+	}
+	h = hashKey(entityType, entityName, characteristicType, characteristicName);
+	twMutex_Lock(reg->mtx);
+	link = &reg->buckets[h % reg->numBuckets];
+	while (*link) {
+		twCallbackRegistryEntry * e = *link;
+		if (e->hash == h && e->entityType == entityType && e->characteristicType == characteristicType &&
+			!strcmp(e->entityName, entityName) && !strcmp(e->characteristicName, characteristicName) &&
+			(!value || e->value == value)) {
+			*link = e->next;
+			reg->count--;
+			twMutex_Unlock(reg->mtx);
+			TW_FREE(e);
+			return TW_OK;
+		}
+		link = &e->next;
+	}
+	twMutex_Unlock(reg->mtx);
+	return TW_ERROR_CALLBACK_NOT_FOUND;
+}
+
+void * twCallbackRegistry_Get(twCallbackRegistry * reg, enum entityTypeEnum entityType, const char * entityName,
+						   enum characteristicEnum characteristicType, const char * characteristicName) {
+	twCallbackRegistryEntry * e = NULL;
+	void * value = NULL;
+	if (!reg || !entityName || !characteristicName) {
+		TW_LOG(TW_ERROR,"twCallbackRegistry_Get: NULL input parameter found");
+		return NULL;
+	}
+	twMutex_Lock(reg->mtx);
+	e = findEntry(reg, entityType, entityName, characteristicType, characteristicName);
+	if (!e) e = findEntry(reg, entityType, entityName, characteristicType, TW_REGISTRY_WILDCARD);
+	if (!e) e = findEntry(reg, entityType, TW_REGISTRY_WILDCARD, characteristicType, characteristicName);
+	if (!e) e = findEntry(reg, entityType, TW_REGISTRY_WILDCARD, characteristicType, TW_REGISTRY_WILDCARD);
+	if (e) value = e->value;
+	twMutex_Unlock(reg->mtx);
+	return value;
+}
@@ -0,0 +1,121 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Hashed index of entity/characteristic callbacks
+ */
+
+#ifndef TW_CALLBACK_REGISTRY_H
+#define TW_CALLBACK_REGISTRY_H
+
+#include "twOSPort.h"
+#include "twDefinitions.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/********************************/
+/*      Callback Registry       */
+/* Thread safe hash table keyed */
+/*  on entity type, entity name */
+/*  characteristic type and     */
+/*     characteristic name      */
+/********************************/
+
+/*
+An entity name or characteristic name registered as
+this string matches any name during lookups
+*/
+#define TW_REGISTRY_WILDCARD "*"
+
+typedef struct twCallbackRegistryEntry {
+	struct twCallbackRegistryEntry * next;
+	uint32_t hash;
+	enum entityTypeEnum entityType;
+	const char * entityName;
+	enum characteristicEnum characteristicType;
+	const char * characteristicName;
+	void * value;
+} twCallbackRegistryEntry;
+
+typedef struct twCallbackRegistry {
+	uint32_t numBuckets;
+	uint32_t count;
+	twCallbackRegistryEntry ** buckets;
+	TW_MUTEX mtx;
+} twCallbackRegistry;
+
+/*
+twCallbackRegistry_Create - Create a callback registry.  The registry is an index only,
+	it never owns or deletes the values added to it.
+Parameters:
+    numBuckets - initial number of hash buckets.  The table doubles in size whenever
+		the number of entries exceeds twice the number of buckets.  0 selects the default.
+Return:
+	twCallbackRegistry * - pointer to the allocated registry or a NULL if an error occurred.
+*/
+twCallbackRegistry * twCallbackRegistry_Create(uint32_t numBuckets);
+
+/*
+twCallbackRegistry_Delete - Deletes a registry.  Values in the registry are not deleted.
+Parameters:
+    reg - pointer to the registry to delete
+Return:
+	int - zero if successful, non-zero if an error occurred
+*/
+int twCallbackRegistry_Delete(twCallbackRegistry * reg);
+
+/*
+twCallbackRegistry_Add - Adds a value to the registry.  The registry does NOT copy the
+	entity and characteristic names, they must stay valid until the value is removed.
+	If the same key is added more than once, lookups return the value added first.
+Parameters:
+    reg - pointer to the registry to add to
+	entityType - the type of entity
+	entityName - the name of the entity or TW_REGISTRY_WILDCARD
+	characteristicType - the type of characteristic
+	characteristicName - the name of the characteristic or TW_REGISTRY_WILDCARD
+	value - the value to index
+Return:
+	int - zero if successful, non-zero if an error occurred
+*/
+int twCallbackRegistry_Add(twCallbackRegistry * reg, enum entityTypeEnum entityType, const char * entityName,
+						   enum characteristicEnum characteristicType, const char * characteristicName, void * value);
+
+/*
+twCallbackRegistry_Remove - Removes a value from the registry.
+Parameters:
+    reg - pointer to the registry to operate on
+	entityType - the type of entity
+	entityName - the name of the entity
+	characteristicType - the type of characteristic
+	characteristicName - the name of the characteristic
+	value - the value to remove.  If NULL the first value registered with this key is removed.
+Return:
+	int - zero if successful, TW_ERROR_CALLBACK_NOT_FOUND if there was no matching entry
+*/
+int twCallbackRegistry_Remove(twCallbackRegistry * reg, enum entityTypeEnum entityType, const char * entityName,
+						   enum characteristicEnum characteristicType, const char * characteristicName, void * value);
+
+/*
+twCallbackRegistry_Get - Looks up a value in the registry.  If there is no exact match
+	the lookup falls back, in order, to entries registered with a wildcard characteristic
+	name, a wildcard entity name, and finally both names as wildcards.
+Parameters:
+    reg - pointer to the registry to search
+	entityType - the type of entity
+	entityName - the name of the entity
+	characteristicType - the type of characteristic
+	characteristicName - the name of the characteristic
+Return:
+	void * - the registered value or NULL if no match was found.  The registry does not own
+		this pointer.
+*/
+void * twCallbackRegistry_Get(twCallbackRegistry * reg, enum entityTypeEnum entityType, const char * entityName,
+						   enum characteristicEnum characteristicType, const char * characteristicName);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,503 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Column oriented InfoTable
+ */
+
+#include "twColumnTable.h"
+#include "twInfoTableCodec.h"
+#include "twLogger.h"
+#include "twErrors.h"
+#include "twDefaultSettings.h"
+#include "stringUtils.h"
+
+#include <string.h>
+
+/* Row marker and field count */
+#define ROW_HEADER_SIZE 3
+
+static uint32_t elementSize(enum BaseType type) {
+	switch (type) {
+	case TW_NUMBER:
+		return sizeof(double);
+	case TW_INTEGER:
+		return sizeof(int32_t);
+	case TW_BOOLEAN:
+		return sizeof(char);
+	case TW_DATETIME:
+		return sizeof(DATETIME);
+	case TW_LOCATION:
+		return sizeof(twLocation);
+	case TW_STRING:
+		return sizeof(char *);
+	default:
+		return 0;
+	}
+}
+
+static char * cell(twColumnTable * t, int column, uint32_t row) {
+	return (char *)t->columns[column].data + (size_t)row * t->columns[column].elementSize;
+}
+
+/* Returns the cell if the column has the type and the row exists */
+static char * checkCell(twColumnTable * t, int column, uint32_t row, enum BaseType type, void * value) {
+	if (!t || !value || column < 0 || column >= t->numColumns || row >= t->numRows) return NULL;
+	if (t->columns[column].type != type) return NULL;
+	return cell(t, column, row);
+}
+
+static char isNull(twColumnTable * t, int column, uint32_t row) {
+	unsigned char * nulls = t->columns[column].nulls;
+	return (nulls && (nulls[row >> 3] & (1 << (row & 7)))) ? TRUE : FALSE;
+}
+
+/* Marks a cell as null or not.  A column's bitmap is only allocated once it has a null */
+static int setNull(twColumnTable * t, int column, uint32_t row, char null) {
+	twColumn * col = &t->columns[column];
+	if (!col->nulls) {
+		if (!null) return TW_OK;
+		col->nulls = (unsigned char *)TW_CALLOC((t->capacity + 7) / 8, 1);
+		if (!col->nulls) {
+			TW_LOG(TW_ERROR,"twColumnTable: Error allocating null bitmap");
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+	}
+	if (null) col->nulls[row >> 3] |= (unsigned char)(1 << (row & 7));
+	else col->nulls[row >> 3] &= (unsigned char)~(1 << (row & 7));
+	return TW_OK;
+}
+
+static int grow(twColumnTable * t, uint32_t capacity) {
+	uint16_t i = 0;
+	if (capacity <= t->capacity) return TW_OK;
+	for (i = 0; i < t->numColumns; i++) {
+		void * data = TW_REALLOC(t->columns[i].data, (size_t)capacity * t->columns[i].elementSize);
+		if (!data) {
+			TW_LOG(TW_ERROR,"twColumnTable: Error allocating room for %u rows", capacity);
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+		t->columns[i].data = data;
+		if (t->columns[i].nulls) {
+			uint32_t oldSize = (t->capacity + 7) / 8;
+			uint32_t newSize = (capacity + 7) / 8;
+			unsigned char * nulls = (unsigned char *)TW_REALLOC(t->columns[i].nulls, newSize);
+			if (!nulls) {
+				TW_LOG(TW_ERROR,"twColumnTable: Error allocating null bitmap for %u rows", capacity);
+				return TW_ERROR_ALLOCATING_MEMORY;
+			}
+			memset(nulls + oldSize, 0, newSize - oldSize);
+			t->columns[i].nulls = nulls;
+		}
+	}
+	t->capacity = capacity;
+	return TW_OK;
+}
+
+/* Makes room for one more row */
+static int reserveRow(twColumnTable * t) {
+	if (t->numRows < t->capacity) return TW_OK;
+	return grow(t, t->capacity ? t->capacity * 2 : COLUMN_TABLE_INITIAL_ROWS);
+}
+
+/* Frees the strings in the first numColumns columns of a row */
+static void freeRowStrings(twColumnTable * t, uint32_t row, uint16_t numColumns) {
+	uint16_t i = 0;
+	for (i = 0; i < numColumns; i++) {
+		char * str = NULL;
+		if (t->columns[i].type != TW_STRING) continue;
+		memcpy(&str, cell(t, i, row), sizeof(str));
+		if (str) TW_FREE(str);
+	}
+}
+
+twColumnTable * twColumnTable_Create(twDataShape * shape, uint32_t capacity) {
+	twColumnTable * t = NULL;
+	ListEntry * le = NULL;
+	uint16_t i = 0;
+	if (!shape || !shape->entries || !shape->numEntries || shape->numEntries > 0xFFFF) {
+		TW_LOG(TW_ERROR,"twColumnTable_Create: NULL or empty data shape");
+		if (shape) twDataShape_Delete(shape);
+		return NULL;
+	}
+	t = (twColumnTable *)TW_CALLOC(sizeof(twColumnTable), 1);
+	if (!t) {
+		TW_LOG(TW_ERROR,"twColumnTable_Create: Error allocating table");
+		twDataShape_Delete(shape);
+		return NULL;
+	}
+	t->ds = shape;
+	t->numColumns = (uint16_t)shape->numEntries;
+	t->columns = (twColumn *)TW_CALLOC(sizeof(twColumn), t->numColumns);
+	if (!t->columns) {
+		TW_LOG(TW_ERROR,"twColumnTable_Create: Error allocating columns");
+		twColumnTable_Delete(t);
+		return NULL;
+	}
+	le = twList_Next(shape->entries, NULL);
+	while (le && i < t->numColumns) {
+		twDataShapeEntry * entry = (twDataShapeEntry *)le->value;
+		t->columns[i].type = entry ? entry->type : TW_NOTHING;
+		t->columns[i].elementSize = elementSize(t->columns[i].type);
+		if (!t->columns[i].elementSize) {
+			TW_LOG(TW_ERROR,"twColumnTable_Create: Column %s has a type that isn't supported", (entry && entry->name) ? entry->name : "NULL");
+			twColumnTable_Delete(t);
+			return NULL;
+		}
+		i++;
+		le = twList_Next(shape->entries, le);
+	}
+	if (i != t->numColumns) {
+		TW_LOG(TW_ERROR,"twColumnTable_Create: Data shape has %d entries but only %d were found", t->numColumns, i);
+		twColumnTable_Delete(t);
+		return NULL;
+	}
+	if (capacity && grow(t, capacity)) {
+		twColumnTable_Delete(t);
+		return NULL;
+	}
+	return t;
+}
+
+/* Sets a cell of a new row from a primitive */
+static int setFromPrimitive(twColumnTable * t, int column, uint32_t row, twPrimitive * p) {
+	char * c = cell(t, column, row);
+	enum BaseType family = p ? p->typeFamily : TW_NOTHING;
+	int res = setNull(t, column, row, family == TW_NOTHING);
+	if (res) return res;
+	if (family == TW_NOTHING) {
+		memset(c, 0, t->columns[column].elementSize);
+		return TW_OK;
+	}
+	switch (t->columns[column].type) {
+	case TW_NUMBER:
+		{
+		double d = 0;
+		if (family == TW_NUMBER) d = p->val.number;
+		else if (family == TW_INTEGER) d = p->val.integer;
+		else break;
+		memcpy(c, &d, sizeof(d));
+		return TW_OK;
+		}
+	case TW_INTEGER:
+		{
+		int32_t n = 0;
+		if (family == TW_INTEGER) n = p->val.integer;
+		else if (family == TW_NUMBER) n = (int32_t)p->val.number;
+		else break;
+		memcpy(c, &n, sizeof(n));
+		return TW_OK;
+		}
+	case TW_BOOLEAN:
+		if (family != TW_BOOLEAN) break;
+		*c = p->val.boolean;
+		return TW_OK;
+	case TW_DATETIME:
+		if (family != TW_DATETIME) break;
+		memcpy(c, &p->val.datetime, sizeof(DATETIME));
+		return TW_OK;
+	case TW_LOCATION:
+		if (family != TW_LOCATION) break;
+		memcpy(c, &p->val.location, sizeof(twLocation));
+		return TW_OK;
+	case TW_STRING:
+		{
+		char * str = NULL;
+		if (family != TW_STRING) break;
+		if (p->val.bytes.data) {
+			str = duplicateString(p->val.bytes.data);
+			if (!str) return TW_ERROR_ALLOCATING_MEMORY;
+		}
+		memcpy(c, &str, sizeof(str));
+		return TW_OK;
+		}
+	default:
+		break;
+	}
+	return TW_INVALID_BASE_TYPE;
+}
+
+twColumnTable * twColumnTable_CreateFromInfoTable(twInfoTable * it) {
+	twColumnTable * t = NULL;
+	twDataShape * ds = NULL;
+	twStream * s = NULL;
+	ListEntry * rowEntry = NULL;
+	int res = TW_OK;
+	if (!it || !it->ds || !it->rows) {
+		TW_LOG(TW_ERROR,"twColumnTable_CreateFromInfoTable: NULL InfoTable, data shape or row list");
+		return NULL;
+	}
+	/* Copy the data shape */
+	s = twStream_Create();
+	if (!s) return NULL;
+	twMutex_Lock(it->mtx);
+	twDataShape_ToStream(it->ds, s);
+	twStream_Reset(s);
+	ds = twDataShape_CreateFromStream(s);
+	twStream_Delete(s);
+	t = twColumnTable_Create(ds, twList_GetCount(it->rows));
+	if (!t) {
+		twMutex_Unlock(it->mtx);
+		return NULL;
+	}
+	rowEntry = twList_Next(it->rows, NULL);
+	while (rowEntry && !res) {
+		twInfoTableRow * row = (twInfoTableRow *)rowEntry->value;
+		ListEntry * field = (row && row->fieldEntries) ? twList_Next(row->fieldEntries, NULL) : NULL;
+		uint16_t i = 0;
+		res = reserveRow(t);
+		for (i = 0; i < t->numColumns && !res; i++) {
+			res = setFromPrimitive(t, i, t->numRows, field ? (twPrimitive *)field->value : NULL);
+			if (res) {
+				TW_LOG(TW_ERROR,"twColumnTable_CreateFromInfoTable: Row %u column %d doesn't match the data shape", t->numRows, i);
+				freeRowStrings(t, t->numRows, i);
+			}
+			if (field) field = twList_Next(row->fieldEntries, field);
+		}
+		if (!res) t->numRows++;
+		rowEntry = twList_Next(it->rows, rowEntry);
+	}
+	twMutex_Unlock(it->mtx);
+	if (res) {
+		twColumnTable_Delete(t);
+		return NULL;
+	}
+	return t;
+}
+
+void twColumnTable_Delete(twColumnTable * t) {
+	uint32_t r = 0;
+	uint16_t i = 0;
+	if (!t) return;
+	if (t->columns) {
+		for (r = 0; r < t->numRows; r++) freeRowStrings(t, r, t->numColumns);
+		for (i = 0; i < t->numColumns; i++) {
+			if (t->columns[i].data) TW_FREE(t->columns[i].data);
+			if (t->columns[i].nulls) TW_FREE(t->columns[i].nulls);
+		}
+		TW_FREE(t->columns);
+	}
+	if (t->ds) twDataShape_Delete(t->ds);
+	TW_FREE(t);
+}
+
+int twColumnTable_GetColumnIndex(twColumnTable * t, const char * name) {
+	int index = -1;
+	if (!t || !name) return -1;
+	twDataShape_GetEntryIndex(t->ds, name, &index);
+	return index;
+}
+
+int twColumnTable_AddRow(twColumnTable * t, const void * const * values) {
+	uint16_t i = 0;
+	int res = TW_OK;
+	if (!t || !values) {
+		TW_LOG(TW_ERROR,"twColumnTable_AddRow: NULL table or values");
+		return TW_INVALID_PARAM;
+	}
+	res = reserveRow(t);
+	if (res) return res;
+	for (i = 0; i < t->numColumns; i++) {
+		char * c = cell(t, i, t->numRows);
+		res = setNull(t, i, t->numRows, values[i] ? FALSE : TRUE);
+		if (res) {
+			freeRowStrings(t, t->numRows, i);
+			return res;
+		}
+		if (!values[i]) {
+			memset(c, 0, t->columns[i].elementSize);
+		} else if (t->columns[i].type == TW_STRING) {
+			const char * src = NULL;
+			char * str = NULL;
+			memcpy(&src, values[i], sizeof(src));
+			if (src && !(str = duplicateString(src))) {
+				freeRowStrings(t, t->numRows, i);
+				return TW_ERROR_ALLOCATING_MEMORY;
+			}
+			memcpy(c, &str, sizeof(str));
+		} else memcpy(c, values[i], t->columns[i].elementSize);
+	}
+	t->numRows++;
+	return TW_OK;
+}
+
+int twColumnTable_AddNumberRow(twColumnTable * t, const double * values) {
+	uint16_t i = 0;
+	int res = TW_OK;
+	if (!t || !values) {
+		TW_LOG(TW_ERROR,"twColumnTable_AddNumberRow: NULL table or values");
+		return TW_INVALID_PARAM;
+	}
+	for (i = 0; i < t->numColumns; i++) {
+		enum BaseType type = t->columns[i].type;
+		if (type != TW_NUMBER && type != TW_INTEGER && type != TW_DATETIME && type != TW_BOOLEAN) {
+			TW_LOG(TW_ERROR,"twColumnTable_AddNumberRow: Column %d isn't numeric", i);
+			return TW_INVALID_BASE_TYPE;
+		}
+	}
+	res = reserveRow(t);
+	if (res) return res;
+	for (i = 0; i < t->numColumns; i++) {
+		char * c = cell(t, i, t->numRows);
+		setNull(t, i, t->numRows, FALSE);
+		switch (t->columns[i].type) {
+		case TW_NUMBER:
+			memcpy(c, &values[i], sizeof(double));
+			break;
+		case TW_INTEGER:
+			{
+			int32_t n = (int32_t)values[i];
+			memcpy(c, &n, sizeof(n));
+			break;
+			}
+		case TW_DATETIME:
+			{
+			DATETIME d = (DATETIME)values[i];
+			memcpy(c, &d, sizeof(d));
+			break;
+			}
+		default:
+			*c = values[i] ? TRUE : FALSE;
+			break;
+		}
+	}
+	t->numRows++;
+	return TW_OK;
+}
+
+void * twColumnTable_GetColumn(twColumnTable * t, int column, enum BaseType type) {
+	if (!t || column < 0 || column >= t->numColumns || t->columns[column].type != type) return NULL;
+	return t->columns[column].data;
+}
+
+int twColumnTable_GetNumber(twColumnTable * t, int column, uint32_t row, double * value) {
+	char * c = checkCell(t, column, row, TW_NUMBER, value);
+	if (!c) {
+		int32_t n = 0;
+		if (twColumnTable_GetInteger(t, column, row, &n)) return TW_INVALID_PARAM;
+		*value = n;
+		return TW_OK;
+	}
+	memcpy(value, c, sizeof(double));
+	return TW_OK;
+}
+
+int twColumnTable_GetInteger(twColumnTable * t, int column, uint32_t row, int32_t * value) {
+	char * c = checkCell(t, column, row, TW_INTEGER, value);
+	if (!c) return TW_INVALID_PARAM;
+	memcpy(value, c, sizeof(int32_t));
+	return TW_OK;
+}
+
+int twColumnTable_GetBoolean(twColumnTable * t, int column, uint32_t row, char * value) {
+	char * c = checkCell(t, column, row, TW_BOOLEAN, value);
+	if (!c) return TW_INVALID_PARAM;
+	*value = *c;
+	return TW_OK;
+}
+
+int twColumnTable_GetDatetime(twColumnTable * t, int column, uint32_t row, DATETIME * value) {
+	char * c = checkCell(t, column, row, TW_DATETIME, value);
+	if (!c) return TW_INVALID_PARAM;
+	memcpy(value, c, sizeof(DATETIME));
+	return TW_OK;
+}
+
+int twColumnTable_GetLocation(twColumnTable * t, int column, uint32_t row, twLocation * value) {
+	char * c = checkCell(t, column, row, TW_LOCATION, value);
+	if (!c) return TW_INVALID_PARAM;
+	memcpy(value, c, sizeof(twLocation));
+	return TW_OK;
+}
+
+int twColumnTable_GetString(twColumnTable * t, int column, uint32_t row, const char ** value) {
+	char * c = checkCell(t, column, row, TW_STRING, value);
+	if (!c) return TW_INVALID_PARAM;
+	memcpy(value, c, sizeof(*value));
+	return TW_OK;
+}
+
+int twColumnTable_IsNull(twColumnTable * t, int column, uint32_t row) {
+	if (!t || column < 0 || column >= t->numColumns || row >= t->numRows) return FALSE;
+	return isNull(t, column, row);
+}
+
+int twColumnTable_SetNumber(twColumnTable * t, int column, uint32_t row, double value) {
+	char * c = checkCell(t, column, row, TW_NUMBER, &value);
+	if (!c) return TW_INVALID_PARAM;
+	memcpy(c, &value, sizeof(double));
+	setNull(t, column, row, FALSE);
+	return TW_OK;
+}
+
+int twColumnTable_ToStream(twColumnTable * t, twStream * s) {
+	uint64_t total = 1;
+	uint32_t startLength = 0;
+	uint32_t startOffset = 0;
+	uint32_t rowsLength = 0;
+	uint32_t r = 0;
+	uint16_t i = 0;
+	char * p = NULL;
+	int res = TW_OK;
+	if (!t || !s) {
+		TW_LOG(TW_ERROR,"twColumnTable_ToStream: NULL table or stream");
+		return TW_INVALID_PARAM;
+	}
+	/* Work out the exact size of the rows so they are written in place */
+	total += (uint64_t)ROW_HEADER_SIZE * t->numRows;
+	for (i = 0; i < t->numColumns; i++) {
+		twColumn * col = &t->columns[i];
+		if (col->type != TW_STRING && !col->nulls) {
+			total += (uint64_t)twInfoTableCodec_ValueLength(col->type, NULL) * t->numRows;
+			continue;
+		}
+		/* A null cell is just the TW_NOTHING type byte */
+		for (r = 0; r < t->numRows; r++) total += isNull(t, i, r) ? 1 : twInfoTableCodec_ValueLength(col->type, cell(t, i, r));
+	}
+	if (total > 0x7FFFFFFF) {
+		TW_LOG(TW_ERROR,"twColumnTable_ToStream: %u rows are too large to serialize", t->numRows);
+		return TW_INVALID_PARAM;
+	}
+	rowsLength = (uint32_t)total;
+	/* Nothing is left behind in the stream if the data shape or the rows don't fit */
+	startLength = s->length;
+	startOffset = (uint32_t)(s->ptr - s->data);
+	res = twDataShape_ToStream(t->ds, s);
+	if (!res) res = twStream_Reserve(s, rowsLength);
+	if (res) {
+		s->length = startLength;
+		s->ptr = s->data + startOffset;
+		return res;
+	}
+	p = s->ptr;
+	for (r = 0; r < t->numRows; r++) {
+		*p++ = 1;
+		*p++ = (char)(t->numColumns >> 8);
+		*p++ = (char)t->numColumns;
+		for (i = 0; i < t->numColumns; i++) {
+			if (isNull(t, i, r)) *p++ = (char)TW_NOTHING;
+			else p = twInfoTableCodec_EncodeValue(p, t->columns[i].type, cell(t, i, r));
+		}
+	}
+	/* Terminating row marker */
+	*p++ = 0;
+	s->ptr = p;
+	s->length += rowsLength;
+	return TW_OK;
+}
+
+twInfoTable * twColumnTable_ToInfoTable(twColumnTable * t) {
+	twInfoTable * it = NULL;
+	twStream * s = NULL;
+	if (!t) {
+		TW_LOG(TW_ERROR,"twColumnTable_ToInfoTable: NULL table");
+		return NULL;
+	}
+	s = twStream_Create();
+	if (!s) return NULL;
+	if (!twColumnTable_ToStream(t, s)) {
+		twStream_Reset(s);
+		it = twInfoTable_CreateFromStream(s);
+	}
+	twStream_Delete(s);
+	return it;
+}
@@ -0,0 +1,190 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Column oriented InfoTable
+ */
+
+#ifndef TW_COLUMN_TABLE_H
+#define TW_COLUMN_TABLE_H
+
+#include "twOSPort.h"
+#include "twBaseTypes.h"
+#include "twInfoTable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***************************************/
+/*        Column Oriented Table        */
+/* Each column of the data shape is    */
+/* one contiguous array of its C type  */
+/* (see twInfoTableCodec.h for the     */
+/* supported types), so a table takes  */
+/* one allocation per column instead   */
+/* of a list of primitives per row.    */
+/* Cells are accessed by column index  */
+/* in constant time.  Tables convert   */
+/* to and from twInfoTable and         */
+/* serialize to the same bytes.  Null  */
+/* cells read as 0 or NULL and are     */
+/* written as TW_NOTHING.              */
+/* Tables are not thread safe.         */
+/***************************************/
+
+typedef struct twColumn {
+	enum BaseType type;
+	uint32_t elementSize;
+	void * data;          /* capacity elements of the column's C type.  Strings are owned by the table */
+	unsigned char * nulls; /* A bit per row set for null cells, NULL until the column has one */
+} twColumn;
+
+typedef struct twColumnTable {
+	twDataShape * ds;
+	uint16_t numColumns;
+	twColumn * columns;
+	uint32_t numRows;
+	uint32_t capacity;
+} twColumnTable;
+
+/*
+twColumnTable_Create - Creates an empty table.
+Parameters:
+	shape - the data shape.  The table takes ownership of it, even if an error occurs.
+	capacity - number of rows to allocate room for up front.  The columns grow as needed.
+Return:
+	twColumnTable * - pointer to the table or NULL if the shape has a field type that isn't
+	supported or an error occurred
+*/
+twColumnTable * twColumnTable_Create(twDataShape * shape, uint32_t capacity);
+
+/*
+twColumnTable_CreateFromInfoTable - Creates a table with a copy of an InfoTable's data shape and rows.
+Parameters:
+	it - the InfoTable.  It is not modified.
+Return:
+	twColumnTable * - pointer to the table or NULL if a type isn't supported or an error occurred
+*/
+twColumnTable * twColumnTable_CreateFromInfoTable(twInfoTable * it);
+
+/*
+twColumnTable_Delete - Deletes a table, its data shape and its strings.
+Parameters:
+	t - pointer to the table
+Return:
+	Nothing
+*/
+void twColumnTable_Delete(twColumnTable * t);
+
+/*
+twColumnTable_GetColumnIndex - Looks up a column by name.  Look columns up once and use the index.
+Parameters:
+	t - pointer to the table
+	name - the data shape entry name
+Return:
+	int - the column index or -1 if there is no such column
+*/
+int twColumnTable_GetColumnIndex(twColumnTable * t, const char * name);
+
+/*
+twColumnTable_AddRow - Appends a row.
+Parameters:
+	t - pointer to the table
+	values - one pointer per column to the value as the column's C type, NULL for a null cell.
+	Strings are copied.
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twColumnTable_AddRow(twColumnTable * t, const void * const * values);
+
+/*
+twColumnTable_AddNumberRow - Appends a row to a table whose columns are all TW_NUMBER,
+TW_INTEGER, TW_DATETIME or TW_BOOLEAN.
+Parameters:
+	t - pointer to the table
+	values - one value per column, converted to the column's type
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twColumnTable_AddNumberRow(twColumnTable * t, const double * values);
+
+/*
+twColumnTable_GetColumn - Gets a column's array for bulk access.  The pointer is only good
+until the next row is added.
+Parameters:
+	t - pointer to the table
+	column - the column index
+	type - the column's type, checked against the data shape
+Return:
+	void * - pointer to the first element of the column, NULL if the index or type is wrong
+*/
+void * twColumnTable_GetColumn(twColumnTable * t, int column, enum BaseType type);
+
+/*
+twColumnTable_Get... - Gets a cell.  TW_INTEGER columns can also be read with GetNumber.
+Strings are not copied and belong to the table.
+Parameters:
+	t - pointer to the table
+	column - the column index
+	row - the row index
+	value - pointer to the value to fill in
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twColumnTable_GetNumber(twColumnTable * t, int column, uint32_t row, double * value);
+int twColumnTable_GetInteger(twColumnTable * t, int column, uint32_t row, int32_t * value);
+int twColumnTable_GetBoolean(twColumnTable * t, int column, uint32_t row, char * value);
+int twColumnTable_GetDatetime(twColumnTable * t, int column, uint32_t row, DATETIME * value);
+int twColumnTable_GetLocation(twColumnTable * t, int column, uint32_t row, twLocation * value);
+int twColumnTable_GetString(twColumnTable * t, int column, uint32_t row, const char ** value);
+
+/*
+twColumnTable_IsNull - Checks whether a cell is null.  The Get functions read null cells as
+0 or a NULL string.
+Parameters:
+	t - pointer to the table
+	column - the column index
+	row - the row index
+Return:
+	int - TRUE if the cell is null, FALSE if it has a value or doesn't exist
+*/
+int twColumnTable_IsNull(twColumnTable * t, int column, uint32_t row);
+
+/*
+twColumnTable_SetNumber - Sets a cell in a TW_NUMBER column.
+Parameters:
+	t - pointer to the table
+	column - the column index
+	row - the row index
+	value - the new value
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twColumnTable_SetNumber(twColumnTable * t, int column, uint32_t row, double value);
+
+/*
+twColumnTable_ToStream - Serializes the table, byte for byte the same as twInfoTable_ToStream
+would for the same data shape and rows.
+Parameters:
+	t - pointer to the table
+	s - the stream to append the InfoTable to.  Nothing is appended if an error occurs.
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twColumnTable_ToStream(twColumnTable * t, twStream * s);
+
+/*
+twColumnTable_ToInfoTable - Creates an InfoTable with a copy of the table's data shape and rows
+for the APIs that take one.
+Parameters:
+	t - pointer to the table
+Return:
+	twInfoTable * - pointer to the InfoTable or NULL if an error occurred.  The caller owns it.
+*/
+twInfoTable * twColumnTable_ToInfoTable(twColumnTable * t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -41,6 +41,27 @@ Request messages that occur when offline
 */
 #define OFFLINE_MSG_STORE 1
 
+/*********************************/
+/*    Incoming Message Arenas    */
+/*********************************/
+/*
+If defined, each incoming message is decoded into a single
+arena (see twArena.h) that is released in one call when the
+message is deleted instead of freeing every object in it.
+*/
+/* #define ENABLE_MSG_ARENA 1 */
+
+/*********************************/
+/*     Asynchronous Logging      */
+/*********************************/
+/*
+If defined, twLog only packs the level, time, format string and
+arguments into a ring buffer owned by the calling thread.  A
+background thread formats the records and passes them to the
+logging function (see twLogger.h).
+*/
+/* #define ENABLE_ASYNC_LOGGING 1 */
+
 #ifdef __cplusplus
 }
 #endif
@@ -45,6 +45,33 @@ in milliseconds.
 */
 #define DEFAULT_MESSAGE_TIMEOUT		10000		
 
+/* 
+Maximum number of requests that can be waiting for a response from the server
+at the same time.  Pending responses are held in a fixed size table indexed
+by request ID.
+*/
+#define MAX_PENDING_RESPONSES		32
+
+/*
+Maximum number of multipart messages that can be reassembled at the same
+time.  Partially received messages are held in a fixed size table indexed
+by request ID.  Chunks of any further messages are discarded.
+*/
+#define MAX_MULTIPART_MESSAGES		8
+
+/*
+Size of the first arena block used to decode an incoming message, as a
+multiple of the message length.  Only used if ENABLE_MSG_ARENA is defined.
+*/
+#define MSG_ARENA_SIZE_FACTOR		4
+
+/*
+When the TLS library can't do gathered writes the pieces of a websocket
+frame are copied together so they go out as one TLS record.  Frames up to
+this size are copied on the stack.  Measured in Bytes.
+*/
+#define TLS_COALESCE_BUFFER_SIZE	1024
+
 /* 
 Websocket keep alive rate.  Used to ensure the connection stays open.  Measured
 in milliseconds.  This value should never be greater than the server side setting
@@ -88,10 +115,58 @@ bytes to a stream, this is the size of memory allocated if more memory is needed
 */
 #define STREAM_BLOCK_SIZE			256
 
+/*
+Number of rows a column table that was created without a capacity allocates
+when the first row is added.  The columns double in size as rows are added.
+*/
+#define COLUMN_TABLE_INITIAL_ROWS	64
+
+/*
+Size in bytes of the ring buffer each thread logs into when
+ENABLE_ASYNC_LOGGING is defined.  Must be a power of 2.  Records that don't
+fit are dropped and counted.
+*/
+#define TW_LOGGER_RING_SIZE 16384
+
+/*
+Longest time in milliseconds a record waits in a ring before the log writer
+thread formats it.  The writer is woken early for errors and when a ring is
+half full.
+*/
+#define TW_LOGGER_FLUSH_RATE 100
+
 /* 
-Maximum number of tasks allowed for the built in round robin task execution engine.
+Initial number of hash buckets used to index registered property, service and
+request callbacks.  The index doubles in size as more callbacks are registered.
 */
-#define TW_MAX_TASKS 5
+#define CALLBACK_REGISTRY_BUCKETS	64
+
+/* 
+Number of task slots the built in task scheduler starts with.  It doubles
+in size as more tasks are created.
+*/
+#define TW_TASKER_INITIAL_SIZE 8
+
+/*
+Number of worker threads that run tasks created with TW_TASK_USE_WORKER so
+long running tasks don't hold up the API keep alive.  With 0 workers all
+tasks run on the tasker thread.
+*/
+#define TW_TASKER_WORKER_THREADS 2
+
+/*
+Number of lanes incoming requests are spread over by entity name.  Each lane
+is drained by a worker task so requests for different entities are handled
+at the same time while requests for one entity stay in order.  With 0 all
+messages are handled on the message handler task.
+*/
+#define MSG_HANDLER_LANES 0
+
+/*
+Rate at which the API and message handler tasks run when there is no network
+activity.  Incoming data wakes them immediately.  Measured in milliseconds.
+*/
+#define TW_IO_TASK_IDLE_RATE 100
 
 /*
 Enable property folding of Managed properties
@@ -104,10 +179,23 @@ Maximun size of Managed Property update queue (in Bytes)
 #define MAX_MANAGED_PROPERTY_Q_SIZE 2048
 
 /*
-File transfer Block size (in Bytes)
+Rate at which queued Managed Property updates are sent to the server (in msec)
+*/
+#define MANAGED_PROPERTY_FLUSH_RATE 1000
+
+/*
+Largest file transfer block size (in Bytes).  The block size given to the
+server is the largest size up to this whose ReadFromBinaryFile response
+fills whole message chunks.
 */
 #define FILE_XFER_BLOCK_SIZE 8000
 
+/*
+Number of blocks of a file being sent that are read ahead of the server's
+requests.  Only used if the tasker is enabled.
+*/
+#define FILE_XFER_WINDOW_SIZE 4
+
 /*
 File transfer Max file size (in Bytes)
 */
@@ -118,6 +206,12 @@ File transfer MD5 Buffer size (in Bytes - shouldbe multiple of 64)
 */
 #define FILE_XFER_MD5_BLOCK_SIZE 6400
 
+/*
+Number of file checksums kept by the file manager.  A cached checksum is
+used as long as the file's size and modification time haven't changed.
+*/
+#define FILE_XFER_CHECKSUM_CACHE_SIZE 16
+
 /*
 File transfer timeout for stalled transfers (in milliseconds)
 */
@@ -134,10 +228,37 @@ Offline message queue max size
 #define OFFLINE_MSG_QUEUE_SIZE 16384
 
 /*
-Offline message store file
+What to do when the memory resident offline message queue is full
+0 - discard the new message
+1 - discard the oldest messages to make room for the new one
+*/
+#define OFFLINE_MSG_QUEUE_DROP_OLDEST 0
+
+/*
+Maximum number of offline messages sent per batch when the
+connection comes back.  The queue is only locked between batches.
+*/
+#define OFFLINE_MSG_DRAIN_BATCH 64
+
+/*
+Offline message store directory
 */
 #define OFFLINE_MSG_STORE_DIR "/opt/thingworx"
 
+/*
+Size at which the persisted offline message store starts a new segment
+file.  Segments are deleted as soon as all of their messages have been sent.
+Measured in Bytes.
+*/
+#define OFFLINE_MSG_SEGMENT_SIZE 65536
+
+/*
+Number of messages the persisted offline message store sends between saves of
+its replay position.  If the device dies during a flush at most this many
+messages are sent again on the next one.
+*/
+#define OFFLINE_MSG_CHECKPOINT_RATE 16
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,6 +42,8 @@ Messaging Errors 3xx
 #define TW_INVALID_MSG_TYPE 304
 #define TW_ERROR_SENDING_MSG 305
 #define TW_ERROR_WRITING_OFFLINE_MSG_STORE 306
+#define TW_RESPONSE_TABLE_FULL 307
+#define TW_ERROR_READING_OFFLINE_MSG_STORE 308
 
 /*
 Primitive/Infotable Errors 4xx
@@ -50,6 +52,7 @@ Primitive/Infotable Errors 4xx
 #define TW_INDEX_NOT_FOUND 401
 #define TW_ERROR_GETTING_PRIMITIVE 402
 #define TW_INVALID_BASE_TYPE 403
+#define TW_DATASHAPE_MISMATCH 404
 
 /*
 List Errors 5xx
@@ -66,6 +69,7 @@ API Errors 6xx
 #define TW_NULL_API_SINGLETON 605
 #define TW_ERROR_CREATING_MSG 606
 #define TW_ERROR_INITIALIZING_API 607
+#define TW_REQUEST_PENDING 608
 
 /*
 Tasker Errors 7xx
@@ -77,6 +81,8 @@ Tasker Errors 7xx
 Logger Errors 8xx
 */
 #define TW_NULL_OR_INVALID_LOGGER_SINGLETON 800
+#define TW_ERROR_OPENING_LOG_FILE 801
+#define TW_ASYNC_LOGGING_NOT_ENABLED 802
 
 /* 
 Utils Errors 9xx
@@ -132,4 +138,5 @@ File Transfer Errors 13xx
 #define TW_ERROR_CREATING_STAGING_DIR 1301
 #define TW_FILE_NOT_FOUND 1302
 #define FILE_TRANSFER_FAILED 1303
+#define TW_ERROR_READING_FILE 1304
 #endif
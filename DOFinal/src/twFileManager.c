@@ -4,6 +4,8 @@
  *  Portable ThingWorx File Transfer
  */
 
+#define TW_LOG_MODULE TW_MODULE_FILE_XFER
+
 #include "twFileManager.h"
 #include "twFileTransferCallbacks.h"
 #include "twLogger.h"
@@ -12,6 +14,8 @@
 #include "twApi.h"
 #include "stringUtils.h"
 #include "wildcard.h"
+#include "twTasker.h"
+#include "twMD5.h"
 
 /***************************************/
 /*   Singleton File Manager Structure  */
@@ -21,6 +25,7 @@ typedef struct twFileManager {
 	twList * virtualDirs;
 	twList * openFiles;
 	twList * callbacks;
+	twList * checksums;
 } twFileManager;
 
 twFileManager * fm = NULL;
@@ -79,15 +84,361 @@ void twFileTransferInfo_Delete(void * transferInfo) {
 	TW_FREE(ft);
 }
 
+/********************************/
+/*      Read Ahead Window       */
+/********************************/
+typedef struct twFileBlock {
+	uint64_t offset;
+	int32_t length;      /* -1 if the slot is empty */
+	char * data;
+} twFileBlock;
+
+typedef struct twFileWindow {
+	twFileBlock blocks[FILE_XFER_WINDOW_SIZE];
+	int32_t blockSize;
+	uint64_t nextOffset;    /* Where the next block will be read ahead from */
+	uint64_t position;      /* Where the file handle is */
+	TW_FILE_HANDLE handle;
+	TW_MUTEX mtx;
+	char filling;           /* A read ahead task is scheduled or running */
+	char closing;           /* The file has been closed, whoever is last frees the window */
+	char eof;
+} twFileWindow;
+
+static void destroyWindow(twFileWindow * w) {
+	int i;
+	for (i = 0; i < FILE_XFER_WINDOW_SIZE; i++) {
+		if (w->blocks[i].data) TW_FREE(w->blocks[i].data);
+	}
+	if (w->mtx) twMutex_Delete(w->mtx);
+	TW_FREE(w);
+}
+
+static void emptyWindow(twFileWindow * w) {
+	int i;
+	for (i = 0; i < FILE_XFER_WINDOW_SIZE; i++) w->blocks[i].length = -1;
+}
+
+/* Must be called with the window mutex held */
+static int32_t readAt(twFileWindow * w, uint64_t offset, char * buffer, int32_t count) {
+	int32_t res = 0;
+	/* Sequential reads don't need a seek, which would throw away the stdio buffer */
+	if (w->position != offset) {
+		if (TW_FSEEK(w->handle, offset, SEEK_SET)) return -1;
+		w->position = offset;
+	}
+	res = TW_FREAD(buffer, 1, count, w->handle);
+	if (res < count && TW_FERROR(w->handle)) return -1;
+	w->position += res;
+	return res;
+}
+
+/* Runs on a tasker worker thread.  Reads one block at a time so requests aren't held up for long */
+static void fillWindow(uint64_t now, void * params) {
+	twFileWindow * w = (twFileWindow *)params;
+	while (1) {
+		int i;
+		int32_t res = 0;
+		twFileBlock * b = NULL;
+		twMutex_Lock(w->mtx);
+		if (w->closing) {
+			twMutex_Unlock(w->mtx);
+			destroyWindow(w);
+			return;
+		}
+		for (i = 0; i < FILE_XFER_WINDOW_SIZE && !w->eof; i++) {
+			if (w->blocks[i].length < 0) {
+				b = &w->blocks[i];
+				break;
+			}
+		}
+		if (!b) {
+			w->filling = FALSE;
+			twMutex_Unlock(w->mtx);
+			return;
+		}
+		if (!b->data) b->data = (char *)TW_MALLOC(w->blockSize);
+		res = b->data ? readAt(w, w->nextOffset, b->data, w->blockSize) : -1;
+		if (res > 0) {
+			b->offset = w->nextOffset;
+			b->length = res;
+			w->nextOffset += res;
+		}
+		if (res < w->blockSize) w->eof = TRUE;
+		twMutex_Unlock(w->mtx);
+	}
+}
+
+/* Must be called with the window mutex held */
+static void startFill(twFileWindow * w) {
+	if (w->filling || w->eof || w->closing) return;
+#ifdef ENABLE_TASKER
+	w->filling = TRUE;
+	if (twTasker_CreateTaskEx(0, 0, fillWindow, w, TW_TASK_ONE_SHOT | TW_TASK_USE_WORKER) < 0) w->filling = FALSE;
+#endif
+}
+
+static void twFileWindow_Delete(twFileWindow * w) {
+	char filling = FALSE;
+	if (!w) return;
+	twMutex_Lock(w->mtx);
+	/* The file handle is about to be closed */
+	w->closing = TRUE;
+	filling = w->filling;
+	twMutex_Unlock(w->mtx);
+	if (!filling) destroyWindow(w);
+}
+
+int32_t twFileManager_ReadBlock(twFile * f, uint64_t offset, int32_t count, char * buffer) {
+	twFileWindow * w = NULL;
+	int32_t res = -1;
+	int i;
+	if (!f || !f->handle || !buffer || count <= 0) return -1;
+	if (!f->window) {
+		w = (twFileWindow *)TW_CALLOC(sizeof(twFileWindow), 1);
+		if (!w) return -1;
+		w->mtx = twMutex_Create();
+		if (!w->mtx) {
+			TW_FREE(w);
+			return -1;
+		}
+		w->handle = f->handle;
+		w->position = (uint64_t)-1;
+		w->blockSize = count;
+		emptyWindow(w);
+		f->window = w;
+	}
+	w = f->window;
+	twMutex_Lock(w->mtx);
+	for (i = 0; i < FILE_XFER_WINDOW_SIZE; i++) {
+		twFileBlock * b = &w->blocks[i];
+		if (b->length < 0) continue;
+		if (b->offset == offset && count == w->blockSize) {
+			memcpy(buffer, b->data, b->length);
+			res = b->length;
+		} else if (b->offset < offset) {
+			/* The server has moved past this one */
+			b->length = -1;
+		}
+	}
+	if (res < 0) {
+		/* Not read ahead, read it now and start the window over from here */
+		if (count != w->blockSize) {
+			for (i = 0; i < FILE_XFER_WINDOW_SIZE; i++) {
+				if (w->blocks[i].data) TW_FREE(w->blocks[i].data);
+				w->blocks[i].data = NULL;
+			}
+			w->blockSize = count;
+		}
+		emptyWindow(w);
+		res = readAt(w, offset, buffer, count);
+		w->nextOffset = offset + (res > 0 ? res : 0);
+		w->eof = (res < count);
+		if (res > 0 && count == w->blockSize) {
+			/* Keep it in case the request is repeated */
+			twFileBlock * b = &w->blocks[0];
+			if (!b->data) b->data = (char *)TW_MALLOC(w->blockSize);
+			if (b->data) {
+				memcpy(b->data, buffer, res);
+				b->offset = offset;
+				b->length = res;
+			}
+		}
+	}
+	startFill(w);
+	twMutex_Unlock(w->mtx);
+	return res;
+}
+
+/********************************/
+/*       Checksum Tracking      */
+/********************************/
+typedef struct twFileDigest {
+	md5_state_t md5;        /* Covers the file up to offset */
+	md5_state_t prev;       /* Covers the file up to prevOffset, before the last block */
+	uint64_t offset;
+	uint64_t prevOffset;
+	uint64_t size;          /* End of the furthest block written */
+	char valid;             /* FALSE once a block is written out of order */
+} twFileDigest;
+
+typedef struct twChecksum {
+	char * realPath;
+	uint64_t size;
+	DATETIME lastModified;
+	md5_byte_t digest[16];
+} twChecksum;
+
+void twChecksum_Delete(void * c) {
+	twChecksum * tmp = (twChecksum *)c;
+	if (!tmp) return;
+	if (tmp->realPath) TW_FREE(tmp->realPath);
+	TW_FREE(tmp);
+}
+
+/* Must be called with the file manager mutex held */
+static twChecksum * findChecksum(const char * realPath) {
+	ListEntry * le = twList_Next(fm->checksums, NULL);
+	while (le && le->value) {
+		twChecksum * c = (twChecksum *)le->value;
+		if (!strcmp(c->realPath, realPath)) return c;
+		le = twList_Next(fm->checksums, le);
+	}
+	return NULL;
+}
+
+/* Must be called with the file manager mutex held */
+static void cacheChecksum(const char * realPath, uint64_t size, DATETIME lastModified, md5_byte_t * digest) {
+	twChecksum * c = findChecksum(realPath);
+	if (!c) {
+		/* Make room by dropping the oldest */
+		if (twList_GetCount(fm->checksums) >= FILE_XFER_CHECKSUM_CACHE_SIZE) {
+			twList_Remove(fm->checksums, twList_Next(fm->checksums, NULL), TRUE);
+		}
+		c = (twChecksum *)TW_CALLOC(sizeof(twChecksum), 1);
+		if (!c) return;
+		c->realPath = duplicateString(realPath);
+		if (!c->realPath || twList_Add(fm->checksums, c)) {
+			twChecksum_Delete(c);
+			return;
+		}
+	}
+	c->size = size;
+	c->lastModified = lastModified;
+	memcpy(c->digest, digest, sizeof(c->digest));
+}
+
+/* Must be called with the file manager mutex held.  Caches the running checksum of a file that is being closed */
+static void saveDigest(twFile * f) {
+	uint64_t size = 0;
+	DATETIME lastModified = 0;
+	char isDir = FALSE;
+	char isReadOnly = FALSE;
+	twFileDigest * d = f->digest;
+	if (!d) return;
+	if (d->valid && d->offset == d->size && f->realPath &&
+		!twDirectory_GetFileInfo(f->realPath, &size, &lastModified, &isDir, &isReadOnly) && size == d->size) {
+		md5_byte_t digest[16];
+		md5_finish(&d->md5, digest);
+		cacheChecksum(f->realPath, size, lastModified, digest);
+	}
+	TW_FREE(d);
+	f->digest = NULL;
+}
+
+static int hashFile(char * realPath, md5_byte_t * digest) {
+	md5_state_t md5;
+	int bytesRead = 0;
+	int res = TW_OK;
+	md5_byte_t * buffer = NULL;
+	TW_FILE_HANDLE f = TW_FOPEN(realPath, "rb");
+	if (!f) return TW_FILE_NOT_FOUND;
+	buffer = (md5_byte_t *)TW_MALLOC(FILE_XFER_MD5_BLOCK_SIZE);
+	if (!buffer) {
+		TW_FCLOSE(f);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	md5_init(&md5);
+	bytesRead = TW_FREAD(buffer, 1, FILE_XFER_MD5_BLOCK_SIZE, f);
+	while (bytesRead > 0) {
+		md5_append(&md5, buffer, bytesRead);
+		bytesRead = TW_FREAD(buffer, 1, FILE_XFER_MD5_BLOCK_SIZE, f);
+	}
+	md5_finish(&md5, digest);
+	if (TW_FERROR(f)) {
+		TW_LOG(TW_ERROR, "twFileManager_GetChecksum: Error reading from file %s", realPath);
+		res = TW_ERROR_READING_FILE;
+	}
+	TW_FCLOSE(f);
+	TW_FREE(buffer);
+	return res;
+}
+
+void twFileManager_UpdateChecksum(twFile * f, uint64_t offset, const char * data, int32_t length) {
+	twFileDigest * d = NULL;
+	if (!f || !fm || !data || length < 0) return;
+	twMutex_Lock(fm->mtx);
+	if (!f->digest && offset == 0) {
+		f->digest = (twFileDigest *)TW_CALLOC(sizeof(twFileDigest), 1);
+		if (f->digest) {
+			md5_init(&f->digest->md5);
+			f->digest->valid = TRUE;
+		}
+	}
+	d = f->digest;
+	if (!d) {
+		twMutex_Unlock(fm->mtx);
+		return;
+	}
+	if (d->valid && offset != d->offset) {
+		if (offset == d->prevOffset) {
+			/* The last block was written again, back it out */
+			d->md5 = d->prev;
+		} else {
+			/* Out of order, the file will have to be read */
+			d->valid = FALSE;
+		}
+	}
+	if (d->valid) {
+		d->prev = d->md5;
+		d->prevOffset = offset;
+		md5_append(&d->md5, (const md5_byte_t *)data, length);
+		d->offset = offset + length;
+	}
+	if (offset + length > d->size) d->size = offset + length;
+	twMutex_Unlock(fm->mtx);
+}
+
+int twFileManager_GetChecksum(twFile * f, char * realPath, unsigned char * digest) {
+	uint64_t size = 0;
+	DATETIME lastModified = 0;
+	char isDir = FALSE;
+	char isReadOnly = FALSE;
+	twChecksum * c = NULL;
+	int res = TW_OK;
+	if (!realPath || !digest) return TW_INVALID_PARAM;
+	if (!fm || !fm->mtx || !fm->checksums) return TW_FILE_XFER_MANAGER_NOT_INITIALIZED;
+	twMutex_Lock(fm->mtx);
+	/* Anything still buffered has to be on disk for the size to match */
+	if (f && f->handle && !f->openForRead) TW_FFLUSH(f->handle);
+	if (twDirectory_GetFileInfo(realPath, &size, &lastModified, &isDir, &isReadOnly) || isDir) {
+		twMutex_Unlock(fm->mtx);
+		return TW_FILE_NOT_FOUND;
+	}
+	if (f && f->digest && f->digest->valid && f->digest->offset == size && f->digest->size == size) {
+		md5_state_t md5 = f->digest->md5;
+		md5_finish(&md5, digest);
+		twMutex_Unlock(fm->mtx);
+		return TW_OK;
+	}
+	c = findChecksum(realPath);
+	if (c && c->size == size && c->lastModified == lastModified) {
+		memcpy(digest, c->digest, sizeof(c->digest));
+		twMutex_Unlock(fm->mtx);
+		return TW_OK;
+	}
+	twMutex_Unlock(fm->mtx);
+	/* Don't hold everyone else up while we read the file */
+	res = hashFile(realPath, digest);
+	if (res) return res;
+	twMutex_Lock(fm->mtx);
+	cacheChecksum(realPath, size, lastModified, digest);
+	twMutex_Unlock(fm->mtx);
+	return TW_OK;
+}
+
 /********************************/
 /*      twFile Functions        */
 /********************************/
 void twFile_Delete(void * f) {
 	twFile * tmp = (twFile *) f;
+	twFileWindow_Delete(tmp->window);
+	if (tmp->digest) TW_FREE(tmp->digest);
 	if (tmp->handle) TW_FCLOSE(tmp->handle);
 	if (tmp->name) TW_FREE(tmp->name);
 	if (tmp->realPath) TW_FREE(tmp->realPath);
 	if (tmp->virtualPath) TW_FREE(tmp->virtualPath);
+	if (tmp->tid) TW_FREE(tmp->tid);
 	TW_FREE(tmp);
 }
 
@@ -232,7 +583,8 @@ int twFileManager_Create() {
 	fm->virtualDirs = twList_Create(twVirtualDir_Delete);
 	fm->openFiles = twList_Create(twFile_Delete);
 	fm->callbacks = twList_Create(twFileXferCallback_Delete);
-	if (!fm->mtx || !fm->virtualDirs || !fm->openFiles || !fm->callbacks) {
+	fm->checksums = twList_Create(twChecksum_Delete);
+	if (!fm->mtx || !fm->virtualDirs || !fm->openFiles || !fm->callbacks || !fm->checksums) {
 		TW_LOG(TW_ERROR,"twFileManager_Create: Error allocating mutex or tracking list");
 		twFileManager_Delete();
 		return TW_ERROR_ALLOCATING_MEMORY;
@@ -266,6 +618,7 @@ int twFileManager_Delete() {
 	if (fm->virtualDirs) twList_Delete(fm->virtualDirs);
 	if (fm->openFiles) twList_Delete(fm->openFiles);
 	if (fm->callbacks) twList_Delete(fm->callbacks);
+	if (fm->checksums) twList_Delete(fm->checksums);
 	if (fm->mtx) twMutex_Unlock(fm->mtx);
 	twMutex_Delete(fm->mtx);
 	TW_FREE(fm);
@@ -545,11 +898,11 @@ twFile * twFileManager_GetOpenFile(const char * thingName, const char * path, co
 			}
 		}
 		/* Check to see if we have been idle */
-		if (twTimeGreaterThan(twAddMilliseconds(tmp->lastFileXferActivity, FILE_XFER_TIMEOUT), now)) {
+		if (twTimeGreaterThan(now, twAddMilliseconds(tmp->lastFileXferActivity, FILE_XFER_TIMEOUT))) {
 			ListEntry * entry = le;
 			le = le->prev;
-			if (tmp->handle) TW_FCLOSE(tmp->handle);
-			twList_Remove(fm->openFiles, entry, FALSE);
+			/* twFile_Delete closes the handle and frees the window and digest */
+			twList_Remove(fm->openFiles, entry, TRUE);
 		}
 		le = twList_Next(fm->openFiles, le);
 	}
@@ -564,7 +917,10 @@ void twFileManager_CloseFile(void * file) {
     TW_LOG(TW_TRACE,"twFileManager_CloseFile: Closing file: %s", (tmp && tmp->name) ? tmp->name : "UNKNOWN");
 	if (!tmp ||!fm) return;
 	if (fm->mtx) twMutex_Lock(fm->mtx);
+	twFileWindow_Delete(tmp->window);
 	if (tmp->handle) TW_FCLOSE(tmp->handle);
+	/* Now that it is all on disk the checksum can be cached */
+	saveDigest(tmp);
 	if (fm->openFiles) {
 		le = twList_Next(fm->openFiles,NULL);
 		while (le && le->value) {
@@ -829,35 +1185,26 @@ twList * twFileManager_ListEntities(const char * entityName, const char * path,
 			TW_LOG(TW_ERROR, "twFileManager_ListEntities: Allocating twFile structure");
 			return NULL;
 		}
-		hnd = twDirectory_IterateEntries(realPath, hnd, &tmp->name, &tmp->size, 
+		/* The name mask is applied before anything is stat'ed */
+		hnd = twDirectory_IterateMatches(realPath, hnd, namemask, returnType, &tmp->name, &tmp->size, 
 											&tmp->lastModified, &tmp->isDir, &tmp->readOnly);
 		while (hnd && tmp && tmp->name) {
-			if ((returnType == LIST_FILES && !tmp->isDir) || (returnType == LIST_DIRS && tmp->isDir) || returnType == LIST_ALL) {
-				if ((IsWildcardMatch(namemask, tmp->name, TRUE)) || ((tmp->isDir && strcmp(tmp->name, ".") && strcmp(tmp->name, "..")))) {
-					/* Add this to our list */
-					TW_LOG(TW_TRACE,"twFileManager_ListEntities: Adding file %s%c%s to list.", path, TW_FILE_DELIM, tmp->name);
-					tmp->realPath = duplicateString(realPath);
-					tmp->virtualPath = duplicateString(fixedPath);
-					twList_Add(list, tmp);
-					tmp = 0;
-				} else {
-					twFile_Delete(tmp);
-					tmp = 0;
-				}
-			} else {
-				twFile_Delete(tmp);
-				tmp = 0;
-			}
+			/* Add this to our list */
+			TW_LOG(TW_TRACE,"twFileManager_ListEntities: Adding file %s%c%s to list.", path, TW_FILE_DELIM, tmp->name);
+			tmp->realPath = duplicateString(realPath);
+			tmp->virtualPath = duplicateString(fixedPath);
+			twList_Add(list, tmp);
 			/* Get ready for the next iteration */
 			tmp = (twFile *)TW_CALLOC(sizeof(twFile), 1);
 			if (!tmp) {
+				twDirectory_EndIteration(hnd);
 				twList_Delete(list);
 				TW_FREE(fixedPath);
 				TW_FREE(realPath);
 				TW_LOG(TW_ERROR, "twFileManager_ListEntities: Allocating twFile structure");
 				return NULL;
 			}
-			hnd = twDirectory_IterateEntries(realPath, hnd, &tmp->name, &tmp->size, 
+			hnd = twDirectory_IterateMatches(realPath, hnd, namemask, returnType, &tmp->name, &tmp->size, 
 				&tmp->lastModified, &tmp->isDir, &tmp->readOnly);
 		}
 		if (tmp) twFile_Delete(tmp);
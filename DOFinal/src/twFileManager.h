@@ -71,6 +71,11 @@ Return:
 */
 typedef void (*file_cb) (char fileRcvd, twFileTransferInfo * info, void * userdata);
 
+/* Read ahead window for files being sent, see twFileManager_ReadBlock */
+struct twFileWindow;
+/* Running checksum of files being received, see twFileManager_UpdateChecksum */
+struct twFileDigest;
+
 /***************************************/
 /* Portable File/Directory data struct */
 /***************************************/
@@ -86,6 +91,8 @@ typedef struct twFile {
 	uint64_t lastFileXferActivity;
 	char * tid;
 	char openForRead;
+	struct twFileWindow * window;
+	struct twFileDigest * digest;
 } twFile;
 
 /*
@@ -176,6 +183,49 @@ Return:
 */
 twFile * twFileManager_GetOpenFile(const char * thingName, const char * path, const char * filename, const char * tid);
 
+/*
+twFileManager_ReadBlock - Reads a block of a file that is being sent.  After each read
+the next FILE_XFER_WINDOW_SIZE blocks are read ahead on a tasker worker thread so that
+sequential requests are answered from memory while the previous response is still on the
+wire.  The most recently requested block is kept until a later one is asked for so a
+request repeated after a reconnect doesn't go back to the disk.
+Parameters:
+	f - (Input) the open file
+	offset - (Input) offset in the file to read from
+	count - (Input) number of bytes to read
+	buffer - (Output) buffer of at least count bytes to read into
+Return:
+	int32_t - the number of bytes read, 0 at the end of the file or -1 if an error occurred
+*/
+int32_t twFileManager_ReadBlock(twFile * f, uint64_t offset, int32_t count, char * buffer);
+
+/*
+twFileManager_UpdateChecksum - Adds a block that has just been written to the running MD5
+checksum of a file being received.  As long as the blocks are written in order, or the last
+block is written again, the checksum of the whole file is available without reading it back.
+Parameters:
+	f - (Input) the open file
+	offset - (Input) offset in the file the block was written at
+	data - (Input) the block
+	length - (Input) length of the block
+Return:
+	Nothing
+*/
+void twFileManager_UpdateChecksum(twFile * f, uint64_t offset, const char * data, int32_t length);
+
+/*
+twFileManager_GetChecksum - Gets the MD5 checksum of a file.  The running checksum of an open
+file that has been written sequentially is used if it covers the whole file, then the cache
+of recent checksums.  Otherwise the file is read and its checksum is added to the cache.
+Parameters:
+	f - (Input) the file if it is open, may be NULL
+	realPath - (Input) the native filesystem path of the file
+	digest - (Output) the 16 byte MD5 digest
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an error was encountered
+*/
+int twFileManager_GetChecksum(twFile * f, char * realPath, unsigned char * digest);
+
 /*
 twFileManager_GetRealPath - Gets the native file system path for a file.
 Parameters:
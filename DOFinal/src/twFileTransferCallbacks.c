@@ -4,6 +4,8 @@
  *  Portable ThingWorx File Transfer
  */
 
+#define TW_LOG_MODULE TW_MODULE_FILE_XFER
+
 #include "twFileManager.h"
 #include "twLogger.h"
 #include "twInfoTable.h"
@@ -11,7 +13,9 @@
 #include "twApi.h"
 #include "stringUtils.h"
 #include "wildcard.h"
-#include "twMD5.h"
+
+/* Infotable shape, row and blob header around the data in a ReadFromBinaryFile response */
+#define READ_RESPONSE_OVERHEAD 128
 
 /********************************/
 /*       Helper Functions       */
@@ -136,6 +140,20 @@ int listVirtualDirsInInfoTable(twInfoTable * it, char fullDetails) {
 	return 0;
 }
 
+/*
+Optional paging inputs for the listing services.  offset is the number of matching entries to
+skip and maxItems the most to return, 0 for no limit.  Entries come back in directory order, so
+pages line up as long as the directory doesn't change in between requests.
+*/
+static void getPage(twInfoTable * params, int32_t * offset, int32_t * maxItems) {
+	*offset = 0;
+	*maxItems = 0;
+	twInfoTable_GetInteger(params, "offset", 0, offset);
+	twInfoTable_GetInteger(params, "maxItems", 0, maxItems);
+	if (*offset < 0) *offset = 0;
+	if (*maxItems < 0) *maxItems = 0;
+}
+
 enum msgCodeEnum twListEntities(const char * entityName, twInfoTable * params, twInfoTable ** content, char files) {
 	twDataShapeEntry * dse = NULL;
 	twDataShape * ds = NULL;
@@ -193,6 +211,10 @@ enum msgCodeEnum twListEntities(const char * entityName, twInfoTable * params, t
 		twFile tmp;
 		int res = 0;
 		char * fullPath = NULL;
+		int32_t offset = 0;
+		int32_t maxItems = 0;
+		int32_t index = 0;
+		char pageFull = FALSE;
 		memset(&tmp, 0, sizeof(twFile));
 		/* Handle the case of "/" */
 		if (strlen(path) == 1 && (path[0] == '/' || path[0] == '\\')) {
@@ -213,57 +235,66 @@ enum msgCodeEnum twListEntities(const char * entityName, twInfoTable * params, t
 			return TWX_SUCCESS;
 		}
 		if (path[strlen(path) - 1] == '/' || path[strlen(path) - 1] == '\\') path[strlen(path) - 1] = 0;
-		hnd = twDirectory_IterateEntries(realPath, hnd, &tmp.name, &tmp.size, 
+		getPage(params, &offset, &maxItems);
+		while (1) {
+			/* Entries before the page don't need to be stat'ed */
+			char skip = (index < offset);
+			hnd = twDirectory_IterateMatches(realPath, hnd, nameMask, files ? LIST_FILES : LIST_DIRS, &tmp.name, skip ? NULL : &tmp.size,
 											&tmp.lastModified, &tmp.isDir, &tmp.readOnly);
-		while (hnd && tmp.name) {
-			if ((files && !tmp.isDir) || (!files && tmp.isDir)) {
-				if ((files && IsWildcardMatch(nameMask, tmp.name, TRUE)) || ((tmp.isDir && strcmp(tmp.name, ".") && strcmp(tmp.name, "..")))) {
-					strcpy(fileType,"F");
-					/* Fill in the info table row for this entry */
-					TW_LOG(TW_TRACE,"twListEntities: Adding file %s%c%s to list.", path, TW_FILE_DELIM, tmp.name);
-					row = twInfoTableRow_Create(twPrimitive_CreateFromString(tmp.name, FALSE));
-					if (!row) {
-						TW_LOG(TW_ERROR, "twListEntities: Error allocating infotable row");
-						TW_FREE(tmp.name);
-						twInfoTable_Delete(*content);
-						*content = NULL;
-						cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
-						if (nameMask) TW_FREE(nameMask);
-						return TWX_INTERNAL_SERVER_ERROR;
-					}
-					fullPath = (char *)TW_CALLOC(strlen(path) + strlen(tmp.name) + 2, 1);
-					if (fullPath) {
-						strcpy(fullPath, path);
-						strcat(fullPath,"/");
-						strcat(fullPath, tmp.name);
-					}
-					twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(fullPath, FALSE));
-					if (files) {
-						twInfoTableRow_AddEntry(row, twPrimitive_CreateFromNumber((double)tmp.size));
-						if (tmp.readOnly) strcat(fileType, "+RO");
-						twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(fileType, TRUE));
-						twInfoTableRow_AddEntry(row, twPrimitive_CreateFromDatetime(tmp.lastModified));
-					} else {
-						twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(path, TRUE));
-					}
-					if (twInfoTable_AddRow(*content, row)) {
-						TW_LOG(TW_ERROR, "twListEntities: Error adding infotable row");
-						twInfoTableRow_Delete(row);
-						twInfoTable_Delete(*content);
-						*content = NULL;
-						cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
-						if (nameMask) TW_FREE(nameMask);
-						return TWX_INTERNAL_SERVER_ERROR;
-					}
-				} else {
-					TW_FREE(tmp.name);
-				}
-			} else TW_FREE(tmp.name);
-			hnd = twDirectory_IterateEntries(realPath, hnd, &tmp.name, &tmp.size, 
-				&tmp.lastModified, &tmp.isDir, &tmp.readOnly);
+			if (!hnd) break;
+			index++;
+			if (skip) {
+				TW_FREE(tmp.name);
+				continue;
+			}
+			strcpy(fileType,"F");
+			/* Fill in the info table row for this entry */
+			TW_LOG(TW_TRACE,"twListEntities: Adding file %s%c%s to list.", path, TW_FILE_DELIM, tmp.name);
+			row = twInfoTableRow_Create(twPrimitive_CreateFromString(tmp.name, FALSE));
+			if (!row) {
+				TW_LOG(TW_ERROR, "twListEntities: Error allocating infotable row");
+				TW_FREE(tmp.name);
+				twDirectory_EndIteration(hnd);
+				twInfoTable_Delete(*content);
+				*content = NULL;
+				cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
+				if (nameMask) TW_FREE(nameMask);
+				return TWX_INTERNAL_SERVER_ERROR;
+			}
+			fullPath = (char *)TW_CALLOC(strlen(path) + strlen(tmp.name) + 2, 1);
+			if (fullPath) {
+				strcpy(fullPath, path);
+				strcat(fullPath,"/");
+				strcat(fullPath, tmp.name);
+			}
+			twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(fullPath, FALSE));
+			if (files) {
+				twInfoTableRow_AddEntry(row, twPrimitive_CreateFromNumber((double)tmp.size));
+				if (tmp.readOnly) strcat(fileType, "+RO");
+				twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(fileType, TRUE));
+				twInfoTableRow_AddEntry(row, twPrimitive_CreateFromDatetime(tmp.lastModified));
+			} else {
+				twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(path, TRUE));
+			}
+			if (twInfoTable_AddRow(*content, row)) {
+				TW_LOG(TW_ERROR, "twListEntities: Error adding infotable row");
+				twInfoTableRow_Delete(row);
+				twDirectory_EndIteration(hnd);
+				twInfoTable_Delete(*content);
+				*content = NULL;
+				cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
+				if (nameMask) TW_FREE(nameMask);
+				return TWX_INTERNAL_SERVER_ERROR;
+			}
+			if (maxItems && index - offset >= maxItems) {
+				/* This page is full */
+				twDirectory_EndIteration(hnd);
+				pageFull = TRUE;
+				break;
+			}
 		}
 		res = twDirectory_GetLastError();
-		if (res != ERROR_NO_MORE_FILES) {
+		if (!pageFull && res != ERROR_NO_MORE_FILES) {
 			TW_LOG(TW_ERROR, "twListEntities: Error iterating thorugh %s.  Error: %d", path, res);
 		}
 	} 
@@ -334,24 +365,31 @@ enum msgCodeEnum twBrowseDirectory(const char * entityName, twInfoTable * params
 			twInfoTableRow * row = 0;
 			TW_DIR hnd = 0;
 			char fileType[8];
+			int32_t offset = 0;
+			int32_t maxItems = 0;
+			int32_t index = 0;
 			twFile * tmp = (twFile *)TW_CALLOC(sizeof(twFile), 1);
-			hnd = twDirectory_IterateEntries(realPath, hnd, &tmp->name, &tmp->size, 
-											   &tmp->lastModified, &tmp->isDir, &tmp->readOnly);
-			while (tmp && hnd) {
-				if (!strcmp(tmp->name,".") || !strcmp(tmp->name,"..")) {
+			getPage(params, &offset, &maxItems);
+			while (tmp) {
+				/* Entries before the page don't need to be stat'ed */
+				char skip = (index < offset);
+				hnd = twDirectory_IterateMatches(realPath, hnd, NULL, LIST_ALL, &tmp->name, skip ? NULL : &tmp->size,
+												 &tmp->lastModified, &tmp->isDir, &tmp->readOnly);
+				if (!hnd) break;
+				index++;
+				if (skip) {
 					TW_FREE(tmp->name);
-					hnd = twDirectory_IterateEntries(realPath, hnd, &tmp->name, &tmp->size, 
-								&tmp->lastModified, &tmp->isDir, &tmp->readOnly);
 					continue;
 				}
 				strcpy(fileType,"F");
 				/* Fill in the info table row for this entry */
-				TW_LOG(TW_TRACE,"twBrowseDirectory: Adding dir %s%c%s to list.", tmp->realPath, TW_FILE_DELIM, tmp->name);
+				TW_LOG(TW_TRACE,"twBrowseDirectory: Adding dir %s%c%s to list.", path, TW_FILE_DELIM, tmp->name);
 				row = twInfoTableRow_Create(twPrimitive_CreateFromString(tmp->name, FALSE));
 				if (!row) {
 					TW_LOG(TW_ERROR, "twBrowseDirectory: Error allocating infotable row");
 					TW_FREE(tmp->name);
 					TW_FREE(tmp);
+					twDirectory_EndIteration(hnd);
 					twInfoTable_Delete(*content);
 					*content = NULL;
 					cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
@@ -365,14 +403,18 @@ enum msgCodeEnum twBrowseDirectory(const char * entityName, twInfoTable * params
 				twInfoTableRow_AddEntry(row, twPrimitive_CreateFromDatetime(tmp->lastModified));
 				if (twInfoTable_AddRow(*content, row)) {
 					TW_LOG(TW_ERROR, "twBrowseDirectory: Error adding infotable row");
+					twDirectory_EndIteration(hnd);
 					twInfoTable_Delete(*content);
 					*content = NULL;
 					cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
 					TW_FREE(tmp);
 					return TWX_INTERNAL_SERVER_ERROR;
 				}
-				hnd = twDirectory_IterateEntries(realPath, hnd, &tmp->name, &tmp->size, 
-					&tmp->lastModified, &tmp->isDir, &tmp->readOnly);
+				if (maxItems && index - offset >= maxItems) {
+					/* This page is full */
+					twDirectory_EndIteration(hnd);
+					break;
+				}
 			}
 			TW_FREE(tmp);
 		}
@@ -540,6 +582,23 @@ enum msgCodeEnum twMoveFile(const char * entityName, twInfoTable * params, twInf
 	return TWX_SUCCESS;
 }
 
+/*
+Blocks go back to the server as a blob in a ReadFromBinaryFile response.  Pick the largest block no
+bigger than FILE_XFER_BLOCK_SIZE that fills the message chunks it is sent in, rather than leaving a
+mostly empty chunk at the end of every block.  Header sizes match twMessages.c.
+*/
+static int32_t getBlockSize() {
+	int32_t blockSize = MESSAGE_CHUNK_SIZE - MSG_HEADER_SIZE - READ_RESPONSE_OVERHEAD;
+	int32_t chunkPayload = MESSAGE_CHUNK_SIZE - MSG_HEADER_SIZE - MULTIPART_MSG_HEADER_SIZE;
+	int32_t chunks = 2;
+	if (blockSize >= FILE_XFER_BLOCK_SIZE) return FILE_XFER_BLOCK_SIZE;
+	while (chunks * chunkPayload - READ_RESPONSE_OVERHEAD <= FILE_XFER_BLOCK_SIZE) {
+		blockSize = chunks * chunkPayload - READ_RESPONSE_OVERHEAD;
+		chunks++;
+	}
+	return blockSize > 0 ? blockSize : FILE_XFER_BLOCK_SIZE;
+}
+
 enum msgCodeEnum twGetTransferInfo(const char * entityName, twInfoTable * params, twInfoTable ** content) {
 	/* Generic function across the board for all enitites */
 	int res;
@@ -561,7 +620,7 @@ enum msgCodeEnum twGetTransferInfo(const char * entityName, twInfoTable * params
 		twDataShape_Delete(ds);
 		return TWX_INTERNAL_SERVER_ERROR;
 	}
-	row = twInfoTableRow_Create(twPrimitive_CreateFromInteger(FILE_XFER_BLOCK_SIZE));
+	row = twInfoTableRow_Create(twPrimitive_CreateFromInteger(getBlockSize()));
 	if (!row) {
 		TW_LOG(TW_ERROR, "GetTransferInfo: Error creating output infotable row");
 		twInfoTable_Delete(*content);
@@ -581,10 +640,14 @@ enum msgCodeEnum twGetTransferInfo(const char * entityName, twInfoTable * params
 }
 
 enum msgCodeEnum twGetFileChecksum(const char * entityName, twInfoTable * params, twInfoTable ** content) {
-	TW_FILE_HANDLE f = 0;
 	twDataShape * ds = NULL;
 	twInfoTableRow * row = NULL;
 	twFile * file = NULL;
+	unsigned char digest[16];
+	char hexHash[48];
+	char hex[4];
+	int i = 0;
+	int res = 0;
 	/* Inputs */ 
 	char * path = NULL;
 	char * realPath = NULL;
@@ -610,72 +673,39 @@ enum msgCodeEnum twGetFileChecksum(const char * entityName, twInfoTable * params
 	/* Perform the function */ 
 	/* Check to see if the file is already open */
 	file = twFileManager_GetOpenFile(entityName, path, NULL, NULL);
-	if (file && file->handle) f = file->handle;
-	else if (twDirectory_FileExists(realPath)) f = TW_FOPEN(realPath,"rb");
-	if (f) {
-		struct md5_state_s md5;
-		char hexHash[48];
-		char hex[4];
-		int i = 0;
-		int bytesRead = 0;
-		md5_byte_t * buffer = (md5_byte_t *)TW_CALLOC(FILE_XFER_MD5_BLOCK_SIZE,1);
-		md5_byte_t digest[16];
-		memset(digest, 0, sizeof (digest));
-		memset(&md5, 0, sizeof(struct md5_state_s));
-		if (!buffer) {
-			TW_LOG(TW_ERROR, "twGetFileChecksum: Error allocating buffer");
-			twInfoTable_Delete(*content);
-			*content = NULL;
-			cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
-			if (!file) TW_FCLOSE(f);
-			return TWX_INTERNAL_SERVER_ERROR;
-		}
-		/* Start from the beginning of the file */
-		TW_FSEEK(f,0,SEEK_SET);
-		md5_init(&md5);
-		bytesRead = TW_FREAD(buffer, 1, FILE_XFER_MD5_BLOCK_SIZE, f);
-		while (bytesRead > 0) {
-			md5_append(&md5, buffer, bytesRead);
-			bytesRead = TW_FREAD(buffer, 1, FILE_XFER_MD5_BLOCK_SIZE, f);
-		}
-		md5_finish(&md5, digest);
-		/* Make sure we didn't have an error */
-		if (TW_FERROR(f)) {
-			TW_LOG(TW_ERROR, "twGetFileChecksum: Error reading from file %s. Bytes Read: %d", realPath, bytesRead);
-			TW_FREE(buffer);
-			twInfoTable_Delete(*content);
-			*content = NULL;
-			cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
-			if (!file) TW_FCLOSE(f);
-			return TWX_INTERNAL_SERVER_ERROR;
-		}
-		/* Only close if we opened it */
-		if (!file) TW_FCLOSE(f);
-		/* Convert the hash to hex */
-		memset(hexHash, 0, 48);
-		memset(hex, 0, 4);
-		for (i = 0; i <16; i++) {
-			snprintf(hex, 3, "%02x", digest[i]);
-			strcat(hexHash, hex);
-		}
-		row = twInfoTableRow_Create(twPrimitive_CreateFromString(hexHash, TRUE));
-		if (!row) {
-			TW_LOG(TW_ERROR, "twGetFileChecksum: Error creating infotable row");
-			twInfoTable_Delete(*content);
-			*content = NULL;
-			cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);	
-			return TWX_INTERNAL_SERVER_ERROR;
-		}
-		twInfoTable_AddRow(*content, row);
-		TW_FREE(buffer);
+	res = twFileManager_GetChecksum(file, realPath, digest);
+	if (res == TW_FILE_NOT_FOUND) {
+		TW_LOG(TW_WARN, "twGetFileChecksum: twFile for %s not found", path);
+		twInfoTable_Delete(*content);
+		*content = NULL;
 		cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);	
-		return TWX_SUCCESS;
+		return TWX_NOT_FOUND;
 	}
-	TW_LOG(TW_WARN, "twGetFileChecksum: twFile for %s not found", path);
-	twInfoTable_Delete(*content);
-	*content = NULL;
+	if (res) {
+		TW_LOG(TW_ERROR, "twGetFileChecksum: Error getting checksum of %s.  Error: %d", realPath, res);
+		twInfoTable_Delete(*content);
+		*content = NULL;
+		cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
+		return TWX_INTERNAL_SERVER_ERROR;
+	}
+	/* Convert the hash to hex */
+	memset(hexHash, 0, 48);
+	memset(hex, 0, 4);
+	for (i = 0; i <16; i++) {
+		snprintf(hex, 3, "%02x", digest[i]);
+		strcat(hexHash, hex);
+	}
+	row = twInfoTableRow_Create(twPrimitive_CreateFromString(hexHash, TRUE));
+	if (!row) {
+		TW_LOG(TW_ERROR, "twGetFileChecksum: Error creating infotable row");
+		twInfoTable_Delete(*content);
+		*content = NULL;
+		cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);	
+		return TWX_INTERNAL_SERVER_ERROR;
+	}
+	twInfoTable_AddRow(*content, row);
 	cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);	
-	return TWX_NOT_FOUND;
+	return TWX_SUCCESS;
 }
 
 enum msgCodeEnum twCreateBinaryFile(const char * entityName, twInfoTable * params, twInfoTable ** content) {
@@ -761,16 +791,8 @@ enum msgCodeEnum twReadFromBinaryFile(const char * entityName, twInfoTable * par
 			TW_FREE(buffer);
 			return TWX_PRECONDITION_FAILED;
 		}
-		res = TW_FSEEK(f->handle, (uint64_t)offset, SEEK_SET);
-		if (res) {
-			TW_LOG(TW_ERROR, "twReadFromBinaryFile: Error seeking in file %s to %llu.  Error: %d", path, offset, twDirectory_GetLastError());
-			twInfoTable_Delete(*content);
-			*content = NULL;
-			cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
-			TW_FREE(buffer);
-			return TWX_INTERNAL_SERVER_ERROR;
-		}
-		res = TW_FREAD(buffer, 1, count, f->handle);
+		/* Usually already read ahead */
+		res = twFileManager_ReadBlock(f, (uint64_t)offset, count, buffer);
 		if (res > 0) {
 			char eof = FALSE;
 			row = twInfoTableRow_Create(twPrimitive_CreateFromNumber(res));
@@ -845,6 +867,7 @@ enum msgCodeEnum twWriteToBinaryFile(const char * entityName, twInfoTable * para
 			return TWX_INTERNAL_SERVER_ERROR;
 		}
 		res = TW_FWRITE(data, 1, count, f->handle);
+		if (res == count) twFileManager_UpdateChecksum(f, (uint64_t)offset, data, count);
 		if (res > 0) {
 			cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
 			return TWX_SUCCESS;
@@ -903,7 +926,8 @@ enum msgCodeEnum twStartFileTransfer(const char * entityName, twInfoTable * para
 	TW_LOG(TW_AUDIT, "FILE TRANSFER STARTED.  File: %s, Mode: %s", realPath, tmp ? tmp : "unknown");
 	strcpy(mode,"rb");
 	if (tmp && !strcmp(tmp,"write")) {
-		strcpy(mode,"a+b");
+		/* Blocks are written at their offsets so a block that is sent again lands in the same place */
+		strcpy(mode,"w+b");
 		TW_FREE(tmp);
 		tmp = NULL;
 		/* 
@@ -933,7 +957,7 @@ enum msgCodeEnum twStartFileTransfer(const char * entityName, twInfoTable * para
 		cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
 		return TWX_INTERNAL_SERVER_ERROR;		
 	}
-	if (!strcmp(tmp, "w+b")) f->openForRead = FALSE;
+	f->openForRead = !strcmp(mode, "rb");
 	cleanUpPaths(&path, &realPath, NULL, NULL, NULL, NULL);
 	return TWX_SUCCESS;
 }
@@ -4,6 +4,8 @@
  *  HTTP Proxy Connection
  */
 
+#define TW_LOG_MODULE TW_MODULE_WEBSOCKET
+
 #include "twHttpProxy.h"
 #include "twDefaultSettings.h"
 #include "base64.h"
@@ -7,6 +7,7 @@
 #include "twInfoTable.h"
 #include "twLogger.h"
 #include "stringUtils.h"
+#include "twArena.h"
 
 #include <string.h>
 
@@ -595,7 +596,7 @@ twInfoTable * twInfoTable_FullCopy(twInfoTable * it) {
 	twInfoTable * res = NULL;
 	twStream * s = NULL;
 	if (!it) return 0;
-	s = twStream_Create();
+	s = twStream_CreateWithCapacity(it->length);
 	if (!s) return NULL;
 	twInfoTable_ToStream(it,s);
 	twStream_Reset(s);
@@ -607,6 +608,8 @@ twInfoTable * twInfoTable_FullCopy(twInfoTable * it) {
 twInfoTable * twInfoTable_ZeroCopy(twInfoTable * it) {
 	twInfoTable * cp = NULL;
 	if (!it) return NULL;
+	/* An infotable in a message arena goes away with the message so it can't be taken over */
+	if (twArena_IsBorrowed(it)) return twInfoTable_FullCopy(it);
 	cp = (twInfoTable *)TW_CALLOC(sizeof(twInfoTable), 1);
 	if (!cp) return NULL;
 	twMutex_Lock(it->mtx);
@@ -0,0 +1,449 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Compiled InfoTable codec for fixed shape rows
+ */
+
+#include "twInfoTableCodec.h"
+#include "twLogger.h"
+#include "twErrors.h"
+
+#include <string.h>
+
+/* Row marker and field count */
+#define ROW_HEADER_SIZE 3
+
+/* Values are big endian on the wire whatever the host order is */
+static void putUint32(char * p, uint32_t v) {
+	p[0] = (char)(v >> 24);
+	p[1] = (char)(v >> 16);
+	p[2] = (char)(v >> 8);
+	p[3] = (char)v;
+}
+
+static void putUint64(char * p, uint64_t v) {
+	putUint32(p, (uint32_t)(v >> 32));
+	putUint32(p + 4, (uint32_t)v);
+}
+
+static void putDouble(char * p, double d) {
+	uint64_t v;
+	memcpy(&v, &d, 8);
+	putUint64(p, v);
+}
+
+static uint32_t getUint32(const char * p) {
+	const unsigned char * u = (const unsigned char *)p;
+	return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+}
+
+static uint64_t getUint64(const char * p) {
+	return ((uint64_t)getUint32(p) << 32) | getUint32(p + 4);
+}
+
+static double getDouble(const char * p) {
+	double d;
+	uint64_t v = getUint64(p);
+	memcpy(&d, &v, 8);
+	return d;
+}
+
+/* Serialized size of a value, not counting its type byte.  0 if the type isn't supported */
+static uint32_t valueLength(enum BaseType type) {
+	switch (type) {
+	case TW_NUMBER:
+	case TW_DATETIME:
+		return 8;
+	case TW_INTEGER:
+		return 4;
+	case TW_BOOLEAN:
+		return 1;
+	case TW_LOCATION:
+		return 24;
+	case TW_STRING:
+		/* Just the short length byte, the contents are added per row */
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+uint32_t twInfoTableCodec_ValueLength(enum BaseType type, const void * value) {
+	uint32_t len = 0;
+	const char * str = NULL;
+	if (type != TW_STRING) return valueLength(type) ? 1 + valueLength(type) : 0;
+	if (value) memcpy(&str, value, sizeof(str));
+	len = str ? (uint32_t)strlen(str) : 0;
+	return 1 + ((len > 127) ? 4 : 1) + len;
+}
+
+static char * encodeValue(char * p, enum BaseType type, const void * value) {
+	*p++ = (char)type;
+	switch (type) {
+	case TW_NUMBER:
+		{
+		double d;
+		memcpy(&d, value, 8);
+		putDouble(p, d);
+		p += 8;
+		break;
+		}
+	case TW_DATETIME:
+		{
+		DATETIME t;
+		memcpy(&t, value, 8);
+		putUint64(p, t);
+		p += 8;
+		break;
+		}
+	case TW_INTEGER:
+		{
+		int32_t n;
+		memcpy(&n, value, 4);
+		putUint32(p, (uint32_t)n);
+		p += 4;
+		break;
+		}
+	case TW_BOOLEAN:
+		*p++ = *(const char *)value;
+		break;
+	case TW_LOCATION:
+		{
+		twLocation loc;
+		memcpy(&loc, value, sizeof(loc));
+		putDouble(p, loc.longitude);
+		putDouble(p + 8, loc.latitude);
+		putDouble(p + 16, loc.elevation);
+		p += 24;
+		break;
+		}
+	case TW_STRING:
+		{
+		const char * str = NULL;
+		uint32_t len = 0;
+		memcpy(&str, value, sizeof(str));
+		len = str ? (uint32_t)strlen(str) : 0;
+		if (len > 127) {
+			putUint32(p, len | 0x80000000);
+			p += 4;
+		} else *p++ = (char)len;
+		if (len) memcpy(p, str, len);
+		p += len;
+		break;
+		}
+	default:
+		break;
+	}
+	return p;
+}
+
+char * twInfoTableCodec_EncodeValue(char * p, enum BaseType type, const void * value) {
+	if (!p || !value) return p;
+	return encodeValue(p, type, value);
+}
+
+twInfoTableCodec * twInfoTableCodec_Create(twDataShape * ds, const uint32_t * offsets, uint32_t rowSize) {
+	twInfoTableCodec * codec = NULL;
+	twStream * s = NULL;
+	ListEntry * le = NULL;
+	uint16_t i = 0;
+	if (!ds || !ds->entries || !offsets || !ds->numEntries || ds->numEntries > 0xFFFF) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Create: NULL or empty data shape or NULL offsets");
+		return NULL;
+	}
+	codec = (twInfoTableCodec *)TW_CALLOC(sizeof(twInfoTableCodec), 1);
+	if (!codec) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Create: Error allocating codec");
+		return NULL;
+	}
+	codec->numFields = (uint16_t)ds->numEntries;
+	codec->rowSize = rowSize;
+	codec->fixedRowLength = ROW_HEADER_SIZE;
+	codec->fields = (twInfoTableCodecField *)TW_CALLOC(sizeof(twInfoTableCodecField), codec->numFields);
+	if (!codec->fields) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Create: Error allocating field list");
+		twInfoTableCodec_Delete(codec);
+		return NULL;
+	}
+	le = twList_Next(ds->entries, NULL);
+	while (le && i < codec->numFields) {
+		twDataShapeEntry * entry = (twDataShapeEntry *)le->value;
+		uint32_t length = entry ? valueLength(entry->type) : 0;
+		if (!length) {
+			TW_LOG(TW_ERROR,"twInfoTableCodec_Create: Field %s has a type the codec doesn't support", (entry && entry->name) ? entry->name : "NULL");
+			twInfoTableCodec_Delete(codec);
+			return NULL;
+		}
+		codec->fields[i].type = entry->type;
+		codec->fields[i].offset = offsets[i];
+		codec->fixedRowLength += 1 + length;
+		if (entry->type == TW_STRING) codec->hasStrings = TRUE;
+		i++;
+		le = twList_Next(ds->entries, le);
+	}
+	if (i != codec->numFields) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Create: Data shape has %d entries but only %d were found", codec->numFields, i);
+		twInfoTableCodec_Delete(codec);
+		return NULL;
+	}
+	/* Serialize the shape once, every table starts with it */
+	s = twStream_Create();
+	if (!s || twDataShape_ToStream(ds, s)) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Create: Error serializing data shape");
+		twStream_Delete(s);
+		twInfoTableCodec_Delete(codec);
+		return NULL;
+	}
+	codec->shapeLength = twStream_GetLength(s);
+	codec->shape = (char *)TW_MALLOC(codec->shapeLength);
+	if (!codec->shape) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Create: Error allocating data shape");
+		twStream_Delete(s);
+		twInfoTableCodec_Delete(codec);
+		return NULL;
+	}
+	memcpy(codec->shape, twStream_GetData(s), codec->shapeLength);
+	twStream_Delete(s);
+	return codec;
+}
+
+void twInfoTableCodec_Delete(twInfoTableCodec * codec) {
+	if (!codec) return;
+	if (codec->fields) TW_FREE(codec->fields);
+	if (codec->shape) TW_FREE(codec->shape);
+	TW_FREE(codec);
+}
+
+int twInfoTableCodec_Encode(twInfoTableCodec * codec, const void * rows, uint32_t numRows, twStream * s) {
+	uint64_t total = 0;
+	uint32_t r = 0;
+	uint16_t i = 0;
+	char * p = NULL;
+	int res = TW_OK;
+	if (!codec || (!rows && numRows) || !s) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Encode: NULL codec, rows or stream");
+		return TW_INVALID_PARAM;
+	}
+	/* Work out the exact size so the whole table is written in place */
+	total = codec->shapeLength + (uint64_t)codec->fixedRowLength * numRows + 1;
+	if (codec->hasStrings) {
+		for (r = 0; r < numRows; r++) {
+			const char * row = (const char *)rows + (size_t)r * codec->rowSize;
+			for (i = 0; i < codec->numFields; i++) {
+				const char * str = NULL;
+				size_t len = 0;
+				if (codec->fields[i].type != TW_STRING) continue;
+				memcpy(&str, row + codec->fields[i].offset, sizeof(str));
+				len = str ? strlen(str) : 0;
+				total += (len > 127) ? len + 3 : len;
+			}
+		}
+	}
+	if (total > 0x7FFFFFFF) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Encode: %u rows are too large to serialize", numRows);
+		return TW_INVALID_PARAM;
+	}
+	res = twStream_Reserve(s, (uint32_t)total);
+	if (res) return res;
+	p = s->ptr;
+	memcpy(p, codec->shape, codec->shapeLength);
+	p += codec->shapeLength;
+	for (r = 0; r < numRows; r++) {
+		const char * row = (const char *)rows + (size_t)r * codec->rowSize;
+		*p++ = 1;
+		*p++ = (char)(codec->numFields >> 8);
+		*p++ = (char)codec->numFields;
+		for (i = 0; i < codec->numFields; i++) {
+			p = encodeValue(p, codec->fields[i].type, row + codec->fields[i].offset);
+		}
+	}
+	/* Terminating row marker */
+	*p++ = 0;
+	s->ptr = p;
+	s->length += (uint32_t)total;
+	return TW_OK;
+}
+
+/* Checks a shape in the stream that wasn't byte for byte the codec's against the codec's fields */
+static int checkShape(twInfoTableCodec * codec, twStream * s) {
+	ListEntry * le = NULL;
+	uint16_t i = 0;
+	int res = TW_OK;
+	twDataShape * ds = twDataShape_CreateFromStream(s);
+	if (!ds) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Decode: Error reading data shape");
+		return TW_ERROR_GETTING_PRIMITIVE;
+	}
+	if (ds->numEntries != codec->numFields) res = TW_DATASHAPE_MISMATCH;
+	le = twList_Next(ds->entries, NULL);
+	while (!res && le) {
+		twDataShapeEntry * entry = (twDataShapeEntry *)le->value;
+		if (!entry || entry->type != codec->fields[i].type) res = TW_DATASHAPE_MISMATCH;
+		i++;
+		le = twList_Next(ds->entries, le);
+	}
+	twDataShape_Delete(ds);
+	if (res) TW_LOG(TW_ERROR,"twInfoTableCodec_Decode: Data shape in stream doesn't match the codec");
+	return res;
+}
+
+int twInfoTableCodec_Decode(twInfoTableCodec * codec, twStream * s, void * rows, uint32_t maxRows, uint32_t * numRows) {
+	const char * p = NULL;
+	const char * end = NULL;
+	uint32_t count = 0;
+	int res = TW_OK;
+	if (!codec || !s || (!rows && maxRows) || !numRows) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Decode: NULL codec, stream, rows or row count");
+		return TW_INVALID_PARAM;
+	}
+	*numRows = 0;
+	end = s->data + s->length;
+	if ((uint32_t)(end - s->ptr) >= codec->shapeLength && !memcmp(s->ptr, codec->shape, codec->shapeLength)) {
+		s->ptr += codec->shapeLength;
+	} else {
+		/* Same fields but the aspects or descriptions may differ */
+		res = checkShape(codec, s);
+		if (res) return res;
+	}
+	p = s->ptr;
+	while (p < end && *p) {
+		char * row = (count < maxRows) ? (char *)rows + (size_t)count * codec->rowSize : NULL;
+		uint16_t i = 0;
+		if ((uint32_t)(end - p) < codec->fixedRowLength) break;
+		if ((((unsigned char)p[1] << 8) | (unsigned char)p[2]) != codec->numFields) {
+			res = TW_DATASHAPE_MISMATCH;
+			break;
+		}
+		p += ROW_HEADER_SIZE;
+		for (i = 0; i < codec->numFields; i++) {
+			twInfoTableCodecField * f = &codec->fields[i];
+			char * value = row ? row + f->offset : NULL;
+			if (p >= end || (enum BaseType)(signed char)*p != f->type) {
+				res = TW_DATASHAPE_MISMATCH;
+				break;
+			}
+			p++;
+			if ((uint32_t)(end - p) < valueLength(f->type)) {
+				res = TW_ERROR_GETTING_PRIMITIVE;
+				break;
+			}
+			switch (f->type) {
+			case TW_NUMBER:
+				if (value) {
+					double d = getDouble(p);
+					memcpy(value, &d, 8);
+				}
+				p += 8;
+				break;
+			case TW_DATETIME:
+				if (value) {
+					DATETIME t = getUint64(p);
+					memcpy(value, &t, 8);
+				}
+				p += 8;
+				break;
+			case TW_INTEGER:
+				if (value) {
+					int32_t n = (int32_t)getUint32(p);
+					memcpy(value, &n, 4);
+				}
+				p += 4;
+				break;
+			case TW_BOOLEAN:
+				if (value) *value = *p;
+				p++;
+				break;
+			case TW_LOCATION:
+				if (value) {
+					twLocation loc;
+					loc.longitude = getDouble(p);
+					loc.latitude = getDouble(p + 8);
+					loc.elevation = getDouble(p + 16);
+					memcpy(value, &loc, sizeof(loc));
+				}
+				p += 24;
+				break;
+			case TW_STRING:
+				{
+				uint32_t len = (unsigned char)*p;
+				char * str = NULL;
+				if (len > 127) {
+					if (end - p < 4) {
+						res = TW_ERROR_GETTING_PRIMITIVE;
+						break;
+					}
+					len = getUint32(p) & 0x7FFFFFFF;
+					p += 4;
+				} else p++;
+				if ((uint32_t)(end - p) < len) {
+					res = TW_ERROR_GETTING_PRIMITIVE;
+					break;
+				}
+				if (value) {
+					str = (char *)TW_MALLOC(len + 1);
+					if (!str) {
+						res = TW_ERROR_ALLOCATING_MEMORY;
+						break;
+					}
+					memcpy(str, p, len);
+					str[len] = 0;
+					memcpy(value, &str, sizeof(str));
+				}
+				p += len;
+				break;
+				}
+			default:
+				break;
+			}
+			/* Stop with i on the bad field, it wasn't set */
+			if (res) break;
+		}
+		if (res) {
+			/* Only the strings before the bad field were set in this row */
+			if (row) {
+				uint16_t j = 0;
+				for (j = 0; j < i; j++) {
+					char * str = NULL;
+					if (codec->fields[j].type != TW_STRING) continue;
+					memcpy(&str, row + codec->fields[j].offset, sizeof(str));
+					TW_FREE(str);
+				}
+			}
+			break;
+		}
+		if (row) (*numRows)++;
+		count++;
+	}
+	if (!res && (p >= end || *p)) {
+		TW_LOG(TW_ERROR,"twInfoTableCodec_Decode: Stream ended before the terminating row marker");
+		res = TW_ERROR_GETTING_PRIMITIVE;
+	}
+	if (res) {
+		if (res == TW_DATASHAPE_MISMATCH) TW_LOG(TW_ERROR,"twInfoTableCodec_Decode: Row %u doesn't match the codec's data shape", count);
+		/* Don't leave half decoded rows behind */
+		twInfoTableCodec_FreeRows(codec, rows, *numRows);
+		*numRows = 0;
+		return res;
+	}
+	/* Skip the terminating marker */
+	s->ptr = (char *)p + 1;
+	if (count > maxRows) TW_LOG(TW_WARN,"twInfoTableCodec_Decode: Skipped %u rows that didn't fit", count - maxRows);
+	return TW_OK;
+}
+
+void twInfoTableCodec_FreeRows(twInfoTableCodec * codec, void * rows, uint32_t numRows) {
+	uint32_t r = 0;
+	uint16_t i = 0;
+	if (!codec || !rows || !codec->hasStrings) return;
+	for (r = 0; r < numRows; r++) {
+		char * row = (char *)rows + (size_t)r * codec->rowSize;
+		for (i = 0; i < codec->numFields; i++) {
+			char * str = NULL;
+			if (codec->fields[i].type != TW_STRING) continue;
+			memcpy(&str, row + codec->fields[i].offset, sizeof(str));
+			if (str) TW_FREE(str);
+			str = NULL;
+			memcpy(row + codec->fields[i].offset, &str, sizeof(str));
+		}
+	}
+}
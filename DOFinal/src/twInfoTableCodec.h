@@ -0,0 +1,151 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Compiled InfoTable codec for fixed shape rows
+ */
+
+#ifndef TW_INFOTABLE_CODEC_H
+#define TW_INFOTABLE_CODEC_H
+
+#include "twOSPort.h"
+#include "twBaseTypes.h"
+#include "twInfoTable.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***************************************/
+/*       Compiled InfoTable Codec      */
+/* A data shape that is known ahead of */
+/* time is compiled once into a list   */
+/* of field types and offsets into a   */
+/* C struct plus the serialized shape. */
+/* Rows are then written and read      */
+/* straight from arrays of structs in  */
+/* one pass, with no primitives, lists */
+/* or allocations per value.  The      */
+/* bytes are the same as               */
+/* twInfoTable_ToStream produces.      */
+/*                                     */
+/* Field types and their C types:      */
+/*   TW_NUMBER    double               */
+/*   TW_INTEGER   int32_t              */
+/*   TW_BOOLEAN   char                 */
+/*   TW_DATETIME  DATETIME             */
+/*   TW_LOCATION  twLocation           */
+/*   TW_STRING    char *               */
+/***************************************/
+
+typedef struct twInfoTableCodecField {
+	enum BaseType type;
+	uint32_t offset;          /* Offset of the value in the row struct */
+} twInfoTableCodecField;
+
+typedef struct twInfoTableCodec {
+	uint16_t numFields;
+	twInfoTableCodecField * fields;
+	uint32_t rowSize;         /* Size of the row struct */
+	uint32_t fixedRowLength;  /* Serialized length of a row without the string contents */
+	char hasStrings;
+	char * shape;             /* The serialized data shape */
+	uint32_t shapeLength;
+} twInfoTableCodec;
+
+/*
+twInfoTableCodec_Create - Compiles a codec for rows of a data shape.  For example, for
+	typedef struct imuSample { DATETIME time; double x_acc; double y_acc; double z_acc; } imuSample;
+the shape has the entries time (TW_DATETIME), x_acc, y_acc and z_acc (TW_NUMBER) and the offsets are
+	{ offsetof(imuSample, time), offsetof(imuSample, x_acc), offsetof(imuSample, y_acc), offsetof(imuSample, z_acc) }
+Parameters:
+	ds - the data shape.  The codec doesn't keep a reference to it.
+	offsets - offset of each data shape entry's value in the row struct, in data shape order
+	rowSize - size of the row struct, sizeof(imuSample) above
+Return:
+	twInfoTableCodec * - pointer to the codec or NULL if the shape has a field type that isn't
+	supported or an error occurred
+*/
+twInfoTableCodec * twInfoTableCodec_Create(twDataShape * ds, const uint32_t * offsets, uint32_t rowSize);
+
+/*
+twInfoTableCodec_Delete - Deletes a codec.
+Parameters:
+	codec - pointer to the codec
+Return:
+	Nothing
+*/
+void twInfoTableCodec_Delete(twInfoTableCodec * codec);
+
+/*
+twInfoTableCodec_Encode - Serializes an array of rows as an InfoTable, byte for byte the same
+as twInfoTable_ToStream would for the same values.  NULL strings are written as empty strings.
+Parameters:
+	codec - pointer to the codec
+	rows - pointer to the first row struct
+	numRows - number of rows
+	s - the stream to append the InfoTable to
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twInfoTableCodec_Encode(twInfoTableCodec * codec, const void * rows, uint32_t numRows, twStream * s);
+
+/*
+twInfoTableCodec_Decode - Parses an InfoTable from a stream into an array of rows.  The data shape
+in the stream must have the codec's field types in the same order.  String fields are
+allocated and must be freed with twInfoTableCodec_FreeRows.
+Parameters:
+	codec - pointer to the codec
+	s - the stream to read the InfoTable from
+	rows - pointer to the first row struct to fill in
+	maxRows - number of row structs available.  Rows beyond this are skipped.
+	numRows - set to the number of rows filled in
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twInfoTableCodec_Decode(twInfoTableCodec * codec, twStream * s, void * rows, uint32_t maxRows, uint32_t * numRows);
+
+/*
+twInfoTableCodec_FreeRows - Frees the strings that twInfoTableCodec_Decode allocated and sets them to NULL.
+Parameters:
+	codec - pointer to the codec
+	rows - pointer to the first row struct
+	numRows - number of rows
+Return:
+	Nothing
+*/
+void twInfoTableCodec_FreeRows(twInfoTableCodec * codec, void * rows, uint32_t numRows);
+
+/***************************************/
+/*     Helper functions that are       */
+/*    typically not directly used      */
+/*     by application developers       */
+/***************************************/
+
+/*
+twInfoTableCodec_ValueLength - Gets the serialized length of a value in an InfoTable row,
+including its type byte.
+Parameters:
+	type - one of the field types above
+	value - pointer to the value as its C type.  Only read for TW_STRING.
+Return:
+	uint32_t - length in bytes or 0 if the type isn't supported
+*/
+uint32_t twInfoTableCodec_ValueLength(enum BaseType type, const void * value);
+
+/*
+twInfoTableCodec_EncodeValue - Writes a value's type byte and big endian value the way
+twPrimitive_ToStream does.
+Parameters:
+	p - where to write.  There must be twInfoTableCodec_ValueLength bytes of room.
+	type - one of the field types above
+	value - pointer to the value as its C type
+Return:
+	char * - pointer just past the value
+*/
+char * twInfoTableCodec_EncodeValue(char * p, enum BaseType type, const void * value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,10 @@
 #include "twOSPort.h"
 #include "twHttpProxy.h"
 #include "stringUtils.h"
+#include "twLogger.h"
+#include "twDefaultSettings.h"
+#include "twDefinitions.h"
+#include "wildcard.h"
 
 #include <time.h>
 #include <sys/timeb.h>
@@ -14,9 +18,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <errno.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 
 #ifndef OS_IOS
 #include <termios.h>
@@ -27,6 +39,49 @@ void LOGGING_FUNCTION( enum LogLevel level, const char * timestamp, const char *
 	printf("[%-5s] %s: %s\n", levelString(level), timestamp, message);
 }
 
+/* Log writer thread, see twLogger.h */
+static pthread_t logWriterThread = 0;
+static sem_t logWriterSem;
+static char logWriterSignal = 0;
+
+void * LogWriterThread(void * params) {
+	struct timespec ts;
+	while (!logWriterSignal) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += (TW_LOGGER_FLUSH_RATE % 1000) * 1000000;
+		ts.tv_sec += TW_LOGGER_FLUSH_RATE / 1000 + ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		sem_timedwait(&logWriterSem, &ts);
+		twLogger_Drain();
+	}
+	return 0;
+}
+
+int twLogger_StartWriter() {
+	logWriterSignal = 0;
+	if (sem_init(&logWriterSem, 0, 0)) return errno;
+	if (pthread_create(&logWriterThread, NULL, LogWriterThread, NULL)) {
+		logWriterThread = 0;
+		sem_destroy(&logWriterSem);
+		return errno;
+	}
+	return 0;
+}
+
+void twLogger_StopWriter() {
+	void * status;
+	if (!logWriterThread) return;
+	logWriterSignal = 1;
+	sem_post(&logWriterSem);
+	pthread_join(logWriterThread, &status);
+	logWriterThread = 0;
+	sem_destroy(&logWriterSem);
+}
+
+void twLogger_WakeWriter() {
+	if (logWriterThread) sem_post(&logWriterSem);
+}
+
 // Time Functions
 char twTimeGreaterThan(DATETIME t1, DATETIME t2) {
 	return (t1 > t2);
@@ -99,7 +154,7 @@ void twMutex_Delete(TW_MUTEX m) {
 	if (!tmp) return;
 	m = 0;
 	pthread_mutex_destroy(tmp);
-	free(tmp);
+	TW_FREE(tmp);
 }
 
 void twMutex_Lock(TW_MUTEX m) {
@@ -172,6 +227,8 @@ int twSocket_Connect(twSocket * s) {
 		}
 	}
 	s->state = OPEN;
+	/* Let the tasker sleep until the server sends us something */
+	twTasker_WatchSocket(s);
 	return res;
 }
 
@@ -193,31 +250,29 @@ int twSocket_Close(twSocket * s) {
 
 int twSocket_Read(twSocket * s, char * buf, int len, int timeout) {
 	int read;
-    fd_set readfds;
-	struct timeval t;
 	if (!s) return -1;
 	/* Check for data so we don't block */
-    FD_ZERO(&readfds);
-    FD_SET(s->sock, &readfds);
-    t.tv_sec = timeout / 1000;
-    t.tv_usec = (timeout % 1000) * 1000;
-    if (select(FD_SETSIZE, &readfds, 0, 0, (timeout < 0) ? 0 : &t) <= 0) return 0;
+	if (!twSocket_WaitFor(s, timeout)) return 0;
 	/* Do our read */
 	read = recv(s->sock, buf, len, 0);
+	if (!read && len > 0) {
+		/* poll said there was something to read, so nothing means the peer closed the connection */
+		s->state = CLOSED;
+		errno = ECONNRESET;
+		return -1;
+	}
 	/*** TW_LOG_HEX(buf, "Rcvd Packet: ", read); ***/
 	return read;
 }
 
 int twSocket_WaitFor(twSocket * s, int timeout) {
-    fd_set readfds;
-	struct timeval t;
+	struct pollfd pfd;
 	if (!s) return -1;
-	/* Check for data so we don't block */
-    FD_ZERO(&readfds);
-    FD_SET(s->sock, &readfds);
-    t.tv_sec = timeout / 1000;
-    t.tv_usec = (timeout % 1000) * 1000;
-    if (select(FD_SETSIZE, &readfds, 0, 0, (timeout < 0) ? 0 : &t) <= 0) return 0;
+	/* poll only looks at our descriptor, select has to scan FD_SETSIZE of them */
+	pfd.fd = s->sock;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, (timeout < 0) ? -1 : timeout) <= 0) return 0;
 	return 1;
 }
 
@@ -227,6 +282,21 @@ int twSocket_Write(twSocket * s, char * buf, int len, int timeout) {
 	return send(s->sock, buf, len, MSG_NOSIGNAL);
 }
 
+int twSocket_WriteV(twSocket * s, twIoVec * vec, int count, int timeout) {
+	struct iovec iov[TW_MAX_IO_VECS];
+	struct msghdr mh;
+	int i = 0;
+	if (!s || !vec || count <= 0 || count > TW_MAX_IO_VECS) return -1;
+	for (i = 0; i < count; i++) {
+		iov[i].iov_base = vec[i].buf;
+		iov[i].iov_len = vec[i].len;
+	}
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = count;
+	return sendmsg(s->sock, &mh, MSG_NOSIGNAL);
+}
+
 int twSocket_Delete(twSocket * s) {
 	if (!s) return -1;
 	twSocket_Close(s);
@@ -299,28 +369,147 @@ int twSocket_GetLastError() {
 /* Tasker Functions */
 pthread_t tickTimerThread = 0;
 char tickSignal = 0;
-int32_t tickRate = TICKS_PER_MSEC;
 unsigned int thread_id = 0;
 
-extern void tickTimerCallback (void * params); /* Defined in tasker.c */
+/*
+The tasker thread sleeps in epoll_wait until the next task is due (timerfd),
+a connected socket is readable or someone calls twTasker_Wake (eventfd)
+*/
+static int epollFd = -1;
+static int timerFd = -1;
+static int wakeFd = -1;
+
+extern uint64_t tickTimerCallback (void * params); /* Defined in tasker.c */
+extern void tickTimerWake (); /* Defined in tasker.c */
+extern void tickTimerWork (); /* Defined in tasker.c */
+
+/* Worker threads each run one ready task per post to workerSem */
+static pthread_t workerThreads[TW_TASKER_WORKER_THREADS > 0 ? TW_TASKER_WORKER_THREADS : 1];
+static int numWorkers = 0;
+static sem_t workerSem;
+
+static int addEventSource(int fd, uint32_t events) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void armTimer(uint64_t nextRunTick) {
+	struct itimerspec its;
+	uint64_t now = twGetSystemMillisecondCount();
+	/* Tasks run once the tick count is past their next run tick */
+	uint64_t delay = (nextRunTick >= now) ? nextRunTick - now + 1 : 1;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = delay / 1000;
+	its.it_value.tv_nsec = (delay % 1000) * 1000000;
+	timerfd_settime(timerFd, 0, &its, NULL);
+}
 
 void * TimerThread(void * params) {
+	struct epoll_event events[3];
+	uint64_t count;
 	while (!tickSignal) {
-		tickTimerCallback(0);
-		twSleepMsec(*(int *)params);
+		int i = 0;
+		int n = 0;
+		armTimer(tickTimerCallback(0));
+		n = epoll_wait(epollFd, events, 3, -1);
+		for (i = 0; i < n; i++) {
+			/* Clear the timer and wake counters.  Socket data is left for the tasks to read */
+			if (events[i].data.fd == timerFd || events[i].data.fd == wakeFd) {
+				if (read(events[i].data.fd, &count, sizeof(count)) < 0) continue;
+			}
+			if (events[i].data.fd != timerFd) tickTimerWake();
+		}
 	}
 	thread_id = 0;
         return 0;
 }
 
+void * WorkerThread(void * params) {
+	while (1) {
+		if (sem_wait(&workerSem)) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (tickSignal) break;
+		tickTimerWork();
+	}
+	return 0;
+}
+
 void twTasker_Start() {
-      pthread_create(&tickTimerThread, NULL, TimerThread, (void *)&tickRate);
+	tickSignal = 0;
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || timerFd < 0 || wakeFd < 0 || addEventSource(timerFd, EPOLLIN) || addEventSource(wakeFd, EPOLLIN)) {
+		TW_LOG(TW_ERROR, "twTasker_Start: Error creating tasker event sources.  Error: %d", errno);
+		return;
+	}
+	if (TW_TASKER_WORKER_THREADS > 0 && !sem_init(&workerSem, 0, 0)) {
+		while (numWorkers < TW_TASKER_WORKER_THREADS) {
+			if (pthread_create(&workerThreads[numWorkers], NULL, WorkerThread, NULL)) {
+				TW_LOG(TW_WARN, "twTasker_Start: Error starting worker thread.  Error: %d", errno);
+				break;
+			}
+			numWorkers++;
+		}
+	}
+	pthread_create(&tickTimerThread, NULL, TimerThread, NULL);
 }
 
 void twTasker_Stop() {
         void * status;
 	tickSignal = 1;
-	pthread_join(tickTimerThread, &status);
+	twTasker_Wake();
+	if (tickTimerThread) pthread_join(tickTimerThread, &status);
+	tickTimerThread = 0;
+	if (TW_TASKER_WORKER_THREADS > 0) {
+		int i;
+		for (i = 0; i < numWorkers; i++) sem_post(&workerSem);
+		for (i = 0; i < numWorkers; i++) pthread_join(workerThreads[i], &status);
+		if (numWorkers) sem_destroy(&workerSem);
+		numWorkers = 0;
+	}
+	if (epollFd >= 0) close(epollFd);
+	if (timerFd >= 0) close(timerFd);
+	if (wakeFd >= 0) close(wakeFd);
+	epollFd = timerFd = wakeFd = -1;
+}
+
+void twTasker_Wake() {
+	uint64_t one = 1;
+	if (wakeFd >= 0 && write(wakeFd, &one, sizeof(one)) < 0) {
+		/* The counter is already non zero, the tasker will wake anyway */
+	}
+}
+
+char twTasker_SignalWorker() {
+	if (!numWorkers) return FALSE;
+	sem_post(&workerSem);
+	return TRUE;
+}
+
+void twTasker_WatchSocket(twSocket * s) {
+	/*
+	Sockets are one shot so unread data or a hang up only wakes the tasker once, instead of
+	on every epoll_wait until someone reads.  Watching the socket again re-arms it.
+	*/
+	uint32_t events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	int res = 0;
+	if (!s || epollFd < 0) return;
+	/* Closed descriptors drop out of the epoll set on their own */
+	res = addEventSource(s->sock, events);
+	if (res && errno == EEXIST) {
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.fd = s->sock;
+		res = epoll_ctl(epollFd, EPOLL_CTL_MOD, s->sock, &ev);
+	}
+	if (res) TW_LOG(TW_WARN, "twTasker_WatchSocket: Error watching socket.  Error: %d", errno);
 }
 
 #ifndef OS_IOS
@@ -352,14 +541,18 @@ char getch()
   return ch;
 }
 
+static void getStatInfo(struct stat * s, uint64_t * size, DATETIME * lastModified, char * isDirectory, char * isReadOnly) {
+	*size = s->st_size;
+	*lastModified = ((DATETIME)s->st_mtim.tv_sec) * 1000 + s->st_mtim.tv_nsec / 1000000;
+	*isDirectory = S_ISDIR(s->st_mode );
+	*isReadOnly = (s->st_mode & S_IWRITE) ? FALSE : TRUE;
+}
+
 int twDirectory_GetFileInfo(char * filename, uint64_t * size, DATETIME * lastModified, char * isDirectory, char * isReadOnly) {
 	struct stat s ;
 	if (!filename || !size || !lastModified || !isDirectory || !isReadOnly) return TW_INVALID_PARAM;
 	if (!stat(filename,&s))  {
-		*size = s.st_size;
-		*lastModified = ((DATETIME)s.st_mtime) * 1000;
-		*isDirectory = S_ISDIR(s.st_mode );
-		*isReadOnly = (s.st_mode & S_IWRITE) ? FALSE : TRUE;
+		getStatInfo(&s, size, lastModified, isDirectory, isReadOnly);
 		return 0;
 	}
 	return errno;
@@ -453,6 +646,30 @@ int twDirectory_DeleteFile(char * name) {
 	return res ? errno : 0;
 }
 
+char * twDirectory_MapFile(char * name, uint64_t * size) {
+	struct stat s;
+	void * addr = NULL;
+	int fd = -1;
+	if (!name || !size) return NULL;
+	*size = 0;
+	fd = open(name, O_RDONLY);
+	if (fd < 0) return NULL;
+	if (fstat(fd, &s) || s.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	addr = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* The mapping stays valid after the descriptor is closed */
+	close(fd);
+	if (addr == MAP_FAILED) return NULL;
+	*size = s.st_size;
+	return (char *)addr;
+}
+
+void twDirectory_UnmapFile(char * addr, uint64_t size) {
+	if (addr && size) munmap(addr, size);
+}
+
 int twDirectory_CreateDirectory(char * name) {
     char opath[256];
     char *p;
@@ -489,6 +706,45 @@ int twDirectory_DeleteDirectory(char * name) {
 	return res ? errno : 0;
 }
 
+TW_DIR twDirectory_IterateMatches(char * dirName, TW_DIR dir, const char * nameMask, char type, char ** name, uint64_t * size,
+								  DATETIME * lastModified, char * isDirectory, char * isReadOnly) {
+	struct dirent * entry = NULL;
+	struct stat s;
+	if (!dirName || !name || !isDirectory) return 0;
+	*name = NULL;
+	if (!dir) {
+		dir = opendir(dirName);
+		if (!dir) return 0;
+	}
+	/* readdir fills its buffer with getdents64 so only the entries we return cost a system call */
+	for (errno = 0; (entry = readdir(dir)) != NULL; errno = 0) {
+		char statDone = FALSE;
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+		if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+			/* The file system doesn't say or we need to follow the link */
+			if (fstatat(dirfd(dir), entry->d_name, &s, 0)) continue;
+			statDone = TRUE;
+			*isDirectory = S_ISDIR(s.st_mode);
+		} else *isDirectory = (entry->d_type == DT_DIR);
+		if (type == LIST_FILES && *isDirectory) continue;
+		if (type == LIST_DIRS && !*isDirectory) continue;
+		if (!*isDirectory && nameMask && !IsWildcardMatch(nameMask, entry->d_name, TRUE)) continue;
+		if (size && lastModified && isReadOnly) {
+			if (!statDone && fstatat(dirfd(dir), entry->d_name, &s, 0)) continue;
+			getStatInfo(&s, size, lastModified, isDirectory, isReadOnly);
+		}
+		*name = duplicateString(entry->d_name);
+		if (!*name) break;
+		return dir;
+	}
+	closedir(dir);
+	return 0;
+}
+
+void twDirectory_EndIteration(TW_DIR dir) {
+	if (dir) closedir(dir);
+}
+
 int twDirectory_GetLastError() {
 	return errno;
 }
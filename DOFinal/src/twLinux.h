@@ -12,6 +12,7 @@
 #include <netdb.h>
 #include <dirent.h>
 #include <stdio.h>
+#include <unistd.h>
 
 /********************************/
 /*      Which TLS Library?      */
@@ -38,11 +39,22 @@ library.
 
 #ifdef DBG_LOGGING
 #define TW_LOGGER_BUF_SIZE 4096 /* Max size of log buffer */
-#define TW_LOG(level, fmt, ...)  twLog(level, fmt, ##__VA_ARGS__)
-#define TW_LOG_HEX(msg, preamble, length)   twLogHexString(msg, preamble, length)
-#define TW_LOG_MSG(msg, preamble)   twLogMessage(msg, preamble)
+/* Levels below this are compiled out, e.g. -DTW_LOG_LEVEL_MIN=TW_WARN */
+#ifndef TW_LOG_LEVEL_MIN
+#define TW_LOG_LEVEL_MIN TW_TRACE
+#endif
+/* Source files define TW_LOG_MODULE before their includes to log under their own runtime level */
+#ifndef TW_LOG_MODULE
+#define TW_LOG_MODULE TW_MODULE_SDK
+#endif
+/* The arguments are only evaluated if the level is enabled */
+#define TW_LOG_ENABLED(level) ((level) >= TW_LOG_LEVEL_MIN && (level) >= twLogLevels[TW_LOG_MODULE])
+#define TW_LOG(level, fmt, ...)  do { if (TW_LOG_ENABLED(level)) twLog(level, fmt, ##__VA_ARGS__); } while (0)
+#define TW_LOG_HEX(msg, preamble, length)   do { if (TW_LOG_ENABLED(TW_TRACE)) twLogHexString(msg, preamble, length); } while (0)
+#define TW_LOG_MSG(msg, preamble)   do { if (TW_LOG_ENABLED(TW_TRACE)) twLogMessage(msg, preamble); } while (0)
 #else
 #define TW_LOGGER_BUF_SIZE 128
+#define TW_LOG_ENABLED(level) 0
 #define TW_LOG(level, fmt, ...)
 #define TW_LOG_HEX(msg, preamble, length)
 #define TW_LOG_MSG(msg, preamble)
@@ -64,10 +76,25 @@ typedef uint64_t DATETIME;
 #define TICKS_PER_MSEC 1
 
 /* Memory */
-#define TW_MALLOC(a) malloc(a)
-#define TW_CALLOC(a, b) calloc(a,b)
-#define TW_REALLOC(a, b) realloc(a, b)
-#define TW_FREE(a) free(a)
+#define TW_SYS_MALLOC(a) malloc(a)
+#define TW_SYS_CALLOC(a, b) calloc(a,b)
+#define TW_SYS_REALLOC(a, b) realloc(a, b)
+#define TW_SYS_FREE(a) free(a)
+#ifdef ENABLE_MSG_ARENA
+#include "twArena.h"
+#define TW_MALLOC(a) twArena_Malloc(a)
+#define TW_CALLOC(a, b) twArena_Calloc(a,b)
+#define TW_REALLOC(a, b) twArena_Realloc(a, b)
+#define TW_FREE(a) twArena_Free(a)
+#else
+#define TW_MALLOC(a) TW_SYS_MALLOC(a)
+#define TW_CALLOC(a, b) TW_SYS_CALLOC(a,b)
+#define TW_REALLOC(a, b) TW_SYS_REALLOC(a, b)
+#define TW_FREE(a) TW_SYS_FREE(a)
+#endif
+#define TW_THREAD_LOCAL __thread
+#define TW_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define TW_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
 
 /* File Transfer */
 #define TW_FOPEN(a,b) fopen(a,b)
@@ -76,6 +103,8 @@ typedef uint64_t DATETIME;
 #define TW_FWRITE(a,b,c,d) fwrite(a,b,c,d)
 #define TW_FSEEK(a,b,c) fseeko(a,b,c)
 #define TW_FERROR(a) ferror(a)
+#define TW_FFLUSH(a) fflush(a)
+#define TW_FSYNC(a) fsync(fileno(a))
 
 #define TW_FILE_HANDLE FILE*
 #define TW_FILE_DELIM '/'
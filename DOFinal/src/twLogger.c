@@ -6,8 +6,10 @@
 
 #include "twLogger.h"
 #include "twOSPort.h"
+#include "twDefaultSettings.h"
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -15,6 +17,18 @@
 
 twLogger * logger_singleton = NULL;
 
+/* Runtime level of each module and the lowest of them */
+char twLogLevels[TW_NUM_LOG_MODULES] = { TW_WARN, TW_WARN, TW_WARN, TW_WARN, TW_WARN, TW_WARN };
+static char minLogLevel = TW_WARN;
+
+#ifdef ENABLE_ASYNC_LOGGING
+/* Bumped when the rings are freed so threads know to register a new one */
+static uint32_t ringGeneration = 1;
+static TW_THREAD_LOCAL twLogRing * threadRing = NULL;
+static TW_THREAD_LOCAL uint32_t threadRingGeneration = 0;
+static void logAsync(twLogger * l, enum LogLevel level, const char * format, va_list va);
+#endif
+
 char * levelString(enum LogLevel level) {
 	switch(level) {
 	case TW_TRACE: 
@@ -47,12 +61,34 @@ twLogger * twLogger_Instance() {
 	temp->buffer = (char *)TW_MALLOC(TW_LOGGER_BUF_SIZE);
 	temp->mtx = twMutex_Create();
 	logger_singleton = temp;
+#ifdef ENABLE_ASYNC_LOGGING
+	temp->ringMtx = twMutex_Create();
+	/* Fall back to logging on the caller's thread if we can't start the writer */
+	if (temp->ringMtx && !twLogger_StartWriter()) temp->async = TRUE;
+#endif
 	return logger_singleton;
 }
 
 int twLogger_Delete() {
 	if (logger_singleton) {
 		twLogger * temp = logger_singleton;
+#ifdef ENABLE_ASYNC_LOGGING
+		if (temp->async) {
+			twLogRing * r = temp->rings;
+			twLogger_StopWriter();
+			/* Write out whatever is left before the rings go away */
+			twLogger_Drain();
+			ringGeneration++;
+			while (r) {
+				twLogRing * next = r->next;
+				TW_SYS_FREE(r->buffer);
+				TW_SYS_FREE(r);
+				r = next;
+			}
+		}
+		if (temp->ringMtx) twMutex_Delete(temp->ringMtx);
+		if (temp->binaryFile) TW_FCLOSE(temp->binaryFile);
+#endif
 		logger_singleton = NULL;
 		TW_FREE(temp->buffer);
 		twMutex_Delete(temp->mtx);
@@ -63,12 +99,26 @@ int twLogger_Delete() {
 
 int twLogger_SetLevel(enum LogLevel level) {
 	twLogger * l = twLogger_Instance();
+	int i;
 	if (l) {
 		l->level = level;
+		for (i = 0; i < TW_NUM_LOG_MODULES; i++) twLogLevels[i] = level;
+		minLogLevel = level;
 		return TW_OK;
 	} else return TW_NULL_OR_INVALID_LOGGER_SINGLETON;
 }
 
+int twLogger_SetModuleLevel(enum twLogModule module, enum LogLevel level) {
+	int i;
+	if (module < 0 || module >= TW_NUM_LOG_MODULES) return TW_INVALID_PARAM;
+	twLogLevels[module] = level;
+	minLogLevel = level;
+	for (i = 0; i < TW_NUM_LOG_MODULES; i++) {
+		if (twLogLevels[i] < minLogLevel) minLogLevel = twLogLevels[i];
+	}
+	return TW_OK;
+}
+
 int twLogger_SetFunction(log_function f) {
 	twLogger * l = twLogger_Instance();
 	if (l) {
@@ -90,7 +140,16 @@ void twLog(enum LogLevel level, const char * format, ... ) {
 	twLogger * l = twLogger_Instance();
 	va_list va;
 
-	if (!l || level < l->level) return;
+	/* TW_LOG has already checked the level of the calling module */
+	if (!l || level < minLogLevel) return;
+#ifdef ENABLE_ASYNC_LOGGING
+	if (l->async) {
+		va_start(va, format);
+		logAsync(l, level, format, va);
+		va_end(va);
+		return;
+	}
+#endif
 	/* prepare the message */
 	if (!l->buffer || !l->mtx) return;
 	twMutex_Lock(l->mtx);
@@ -103,6 +162,398 @@ void twLog(enum LogLevel level, const char * format, ... ) {
 	twMutex_Unlock(l->mtx);
 }
 
+#ifdef ENABLE_ASYNC_LOGGING
+/**************************************/
+/*        Asynchronous logging        */
+/**************************************/
+/* Argument tags in a packed record */
+#define ARG_INT 1
+#define ARG_DOUBLE 2
+#define ARG_PTR 3
+#define ARG_STR 4
+/* Level of a record that only fills out the end of the ring */
+#define RECORD_PAD 0xFF
+#define RECORD_ROUND(x) (((x) + 7) & ~((uint32_t)7))
+#define BINARY_LOG_MAGIC "TWLOGBIN"
+
+typedef struct logRecord {
+	uint32_t size;       /* Including the packed arguments, rounded up to 8 */
+	uint8_t level;
+	uint8_t argCount;
+	uint16_t argsLength;
+	DATETIME timestamp;
+	const char * format;
+} logRecord;
+
+/* One printf conversion */
+typedef struct fmtSpec {
+	const char * start;  /* The '%' */
+	int length;          /* Up to and including the conversion character */
+	char lengthMod;      /* h, H (hh), l, q (ll), L, z, j, t or 0 */
+	char conv;           /* 0 if the conversion isn't supported */
+} fmtSpec;
+
+/* Finds the next conversion in a format string.  Returns NULL when there are no more */
+static const char * nextSpec(const char * p, fmtSpec * spec) {
+	while (*p) {
+		if (*p++ != '%') continue;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+		spec->start = p - 1;
+		spec->lengthMod = 0;
+		while (*p && strchr("-+ #0", *p)) p++;
+		while (*p && strchr("0123456789.*", *p)) p++;
+		if (*p == 'h' || *p == 'l') {
+			spec->lengthMod = *p++;
+			if (*p == spec->lengthMod) {
+				spec->lengthMod = (*p == 'h') ? 'H' : 'q';
+				p++;
+			}
+		} else if (*p && strchr("Lzjtq", *p)) spec->lengthMod = *p++;
+		spec->conv = (*p && strchr("diouxXcfFeEgGaAspn", *p)) ? *p : 0;
+		if (*p) p++;
+		spec->length = p - spec->start;
+		return p;
+	}
+	return NULL;
+}
+
+static char * packValue(char * out, char * end, char tag, void * value, int size) {
+	if (out + 1 + size > end) return NULL;
+	*out++ = tag;
+	memcpy(out, value, size);
+	return out + size;
+}
+
+/* Packs the arguments for format after the record header.  Returns the number of bytes used */
+static uint16_t packArgs(char * out, char * end, const char * format, va_list va, uint8_t * argCount) {
+	char * start = out;
+	fmtSpec spec;
+	const char * p = format;
+	*argCount = 0;
+	while (out && (p = nextSpec(p, &spec)) != NULL && spec.conv) {
+		const char * c;
+		int64_t i = 0;
+		double d = 0;
+		/* '*' width and precision come first */
+		for (c = spec.start; c < spec.start + spec.length; c++) {
+			if (*c != '*') continue;
+			i = va_arg(va, int);
+			if (out) out = packValue(out, end, ARG_INT, &i, sizeof(i));
+			(*argCount)++;
+		}
+		if (!out) break;
+		switch (spec.conv) {
+		case 'd': case 'i':
+			if (spec.lengthMod == 'l') i = va_arg(va, long);
+			else if (spec.lengthMod == 'q') i = va_arg(va, long long);
+			else if (spec.lengthMod == 'z' || spec.lengthMod == 't') i = va_arg(va, ptrdiff_t);
+			else if (spec.lengthMod == 'j') i = va_arg(va, intmax_t);
+			else i = va_arg(va, int);
+			if (spec.lengthMod == 'h') i = (short)i;
+			if (spec.lengthMod == 'H') i = (signed char)i;
+			out = packValue(out, end, ARG_INT, &i, sizeof(i));
+			break;
+		case 'o': case 'u': case 'x': case 'X': case 'c':
+			if (spec.lengthMod == 'l') i = (int64_t)va_arg(va, unsigned long);
+			else if (spec.lengthMod == 'q') i = (int64_t)va_arg(va, unsigned long long);
+			else if (spec.lengthMod == 'z' || spec.lengthMod == 't') i = (int64_t)va_arg(va, size_t);
+			else if (spec.lengthMod == 'j') i = (int64_t)va_arg(va, uintmax_t);
+			else i = va_arg(va, unsigned int);
+			if (spec.lengthMod == 'h') i = (unsigned short)i;
+			if (spec.lengthMod == 'H') i = (unsigned char)i;
+			out = packValue(out, end, ARG_INT, &i, sizeof(i));
+			break;
+		case 's':
+			{
+			const char * str = va_arg(va, const char *);
+			uint16_t len = 0;
+			if (!str) str = "(null)";
+			len = (uint16_t)strnlen(str, 0xFFFF);
+			/* Truncate long strings to what fits */
+			if (out + 1 + sizeof(len) > end) {
+				out = NULL;
+				break;
+			}
+			if (len > end - out - 1 - sizeof(len)) len = end - out - 1 - sizeof(len);
+			*out++ = ARG_STR;
+			memcpy(out, &len, sizeof(len));
+			out += sizeof(len);
+			memcpy(out, str, len);
+			out += len;
+			break;
+			}
+		case 'p': case 'n':
+			{
+			uint64_t ptr = (uint64_t)(uintptr_t)va_arg(va, void *);
+			out = packValue(out, end, ARG_PTR, &ptr, sizeof(ptr));
+			break;
+			}
+		default:
+			if (spec.lengthMod == 'L') d = (double)va_arg(va, long double);
+			else d = va_arg(va, double);
+			out = packValue(out, end, ARG_DOUBLE, &d, sizeof(d));
+			break;
+		}
+		if (out) (*argCount)++;
+	}
+	return out ? (uint16_t)(out - start) : 0;
+}
+
+static const char * unpackValue(const char * in, const char * end, char tag, void * value, int size) {
+	if (!in || in + 1 + size > end || *in != tag) return NULL;
+	memcpy(value, in + 1, size);
+	return in + 1 + size;
+}
+
+/* Rebuilds the message from a packed record into buf */
+static void formatRecord(const char * format, const char * args, const char * argsEnd, char * buf, int length) {
+	fmtSpec spec;
+	const char * p = format;
+	const char * next = NULL;
+	int used = 0;
+	buf[0] = 0;
+	while (used < length - 1) {
+		char specStr[64];
+		int specLen = 0;
+		int n = 0;
+		const char * c;
+		const char * literal = p;
+		int64_t i = 0;
+		next = (args && args < argsEnd) ? nextSpec(p, &spec) : NULL;
+		/* Copy the text up to the conversion, collapsing %% */
+		while (*literal && (!next || literal < spec.start) && used < length - 1) {
+			buf[used++] = *literal;
+			literal += (literal[0] == '%' && literal[1] == '%') ? 2 : 1;
+		}
+		buf[used] = 0;
+		if (!next || used >= length - 1) break;
+		/* Put the '*' values in place and every integer conversion gets ll */
+		for (c = spec.start; c < spec.start + spec.length - 1 && specLen < (int)sizeof(specStr) - 24; c++) {
+			if (*c == '*') {
+				args = unpackValue(args, argsEnd, ARG_INT, &i, sizeof(i));
+				specLen += sprintf(specStr + specLen, "%d", (int)i);
+			} else if (!strchr("hlLzjtq", *c)) specStr[specLen++] = *c;
+		}
+		if (strchr("diouxX", spec.conv)) {
+			specStr[specLen++] = 'l';
+			specStr[specLen++] = 'l';
+		}
+		specStr[specLen++] = spec.conv;
+		specStr[specLen] = 0;
+		if (!args || args >= argsEnd) break;
+		switch (*args) {
+		case ARG_INT:
+			args = unpackValue(args, argsEnd, ARG_INT, &i, sizeof(i));
+			if (spec.conv == 'c') n = snprintf(buf + used, length - used, specStr, (int)i);
+			else n = snprintf(buf + used, length - used, specStr, (long long)i);
+			break;
+		case ARG_DOUBLE:
+			{
+			double d = 0;
+			args = unpackValue(args, argsEnd, ARG_DOUBLE, &d, sizeof(d));
+			n = snprintf(buf + used, length - used, specStr, d);
+			break;
+			}
+		case ARG_PTR:
+			{
+			uint64_t ptr = 0;
+			args = unpackValue(args, argsEnd, ARG_PTR, &ptr, sizeof(ptr));
+			if (spec.conv == 'p') n = snprintf(buf + used, length - used, specStr, (void *)(uintptr_t)ptr);
+			break;
+			}
+		case ARG_STR:
+			{
+			uint16_t len = 0;
+			char * str = NULL;
+			if (args + 1 + sizeof(len) > argsEnd) {
+				args = NULL;
+				break;
+			}
+			memcpy(&len, args + 1, sizeof(len));
+			args += 1 + sizeof(len);
+			if (args + len > argsEnd) {
+				args = NULL;
+				break;
+			}
+			/* Strings aren't terminated in the record, use a precision unless there already is one */
+			if (!strchr(specStr, '.')) {
+				specLen--;
+				specLen += sprintf(specStr + specLen, ".*s");
+				n = snprintf(buf + used, length - used, specStr, (int)len, args);
+			} else {
+				str = (char *)TW_SYS_MALLOC(len + 1);
+				if (str) {
+					memcpy(str, args, len);
+					str[len] = 0;
+					n = snprintf(buf + used, length - used, specStr, str);
+					TW_SYS_FREE(str);
+				}
+			}
+			args += len;
+			break;
+			}
+		default:
+			args = NULL;
+			break;
+		}
+		if (n > 0) used += (n < length - used) ? n : length - used - 1;
+		p = next;
+	}
+	buf[length - 1] = 0;
+}
+
+/* Returns the calling thread's ring, creating it the first time the thread logs */
+static twLogRing * getRing(twLogger * l) {
+	twLogRing * r = NULL;
+	if (threadRing && threadRingGeneration == ringGeneration) return threadRing;
+	/* Use the system allocator directly, the first log may happen inside a message arena */
+	r = (twLogRing *)TW_SYS_CALLOC(sizeof(twLogRing), 1);
+	if (!r) return NULL;
+	r->capacity = TW_LOGGER_RING_SIZE;
+	r->buffer = (char *)TW_SYS_MALLOC(r->capacity);
+	if (!r->buffer) {
+		TW_SYS_FREE(r);
+		return NULL;
+	}
+	twMutex_Lock(l->ringMtx);
+	r->next = l->rings;
+	TW_ATOMIC_STORE(&l->rings, r);
+	twMutex_Unlock(l->ringMtx);
+	threadRing = r;
+	threadRingGeneration = ringGeneration;
+	return r;
+}
+
+static void logAsync(twLogger * l, enum LogLevel level, const char * format, va_list va) {
+	char record[TW_LOGGER_BUF_SIZE];
+	logRecord * rec = (logRecord *)record;
+	twLogRing * r = getRing(l);
+	uint32_t head, tail, pos, atEnd, size, used;
+	if (!r) return;
+	rec->level = (uint8_t)level;
+	rec->timestamp = twGetSystemTime(TRUE);
+	rec->format = format;
+	rec->argsLength = packArgs(record + sizeof(logRecord), record + sizeof(record), format, va, &rec->argCount);
+	rec->size = RECORD_ROUND(sizeof(logRecord) + rec->argsLength);
+	size = rec->size;
+	/* Reserve space.  Records never wrap, the end of the ring is padded out instead */
+	head = TW_ATOMIC_LOAD(&r->head);
+	tail = r->tail;
+	pos = tail & (r->capacity - 1);
+	atEnd = r->capacity - pos;
+	used = tail - head;
+	if (r->capacity - used < size + (size > atEnd ? atEnd : 0)) {
+		r->dropped++;
+		twLogger_WakeWriter();
+		return;
+	}
+	if (size > atEnd) {
+		logRecord * pad = (logRecord *)(r->buffer + pos);
+		pad->size = atEnd;
+		pad->level = RECORD_PAD;
+		tail += atEnd;
+		pos = 0;
+	}
+	memcpy(r->buffer + pos, record, size);
+	TW_ATOMIC_STORE(&r->tail, tail + size);
+	/* The writer checks back every TW_LOGGER_FLUSH_RATE msec, get it sooner if it matters */
+	if (level >= TW_ERROR || (used < r->capacity / 2 && used + size >= r->capacity / 2)) twLogger_WakeWriter();
+}
+
+/* Returns the oldest record in a ring, skipping padding, or NULL if it is empty */
+static logRecord * peekRecord(twLogRing * r) {
+	while (1) {
+		logRecord * rec = NULL;
+		if (r->head == TW_ATOMIC_LOAD(&r->tail)) return NULL;
+		rec = (logRecord *)(r->buffer + (r->head & (r->capacity - 1)));
+		if (rec->level != RECORD_PAD) return rec;
+		TW_ATOMIC_STORE(&r->head, r->head + rec->size);
+	}
+}
+
+static void writeBinaryRecord(twLogger * l, logRecord * rec) {
+	uint32_t size = 0;
+	uint16_t formatLength = (uint16_t)strlen(rec->format);
+	uint64_t timestamp = rec->timestamp;
+	size = sizeof(size) + 4 + sizeof(timestamp) + formatLength + rec->argsLength;
+	TW_FWRITE(&size, 1, sizeof(size), l->binaryFile);
+	TW_FWRITE(&rec->level, 1, 1, l->binaryFile);
+	TW_FWRITE(&rec->argCount, 1, 1, l->binaryFile);
+	TW_FWRITE(&formatLength, 1, sizeof(formatLength), l->binaryFile);
+	TW_FWRITE(&timestamp, 1, sizeof(timestamp), l->binaryFile);
+	TW_FWRITE(rec->format, 1, formatLength, l->binaryFile);
+	TW_FWRITE((char *)rec + sizeof(logRecord), 1, rec->argsLength, l->binaryFile);
+}
+
+#endif
+
+void twLogger_Drain() {
+#ifdef ENABLE_ASYNC_LOGGING
+	char timeStr[80];
+	twLogRing * r = NULL;
+	twLogger * l = logger_singleton;
+	if (!l || !l->async || !l->buffer) return;
+	twMutex_Lock(l->mtx);
+	while (1) {
+		/* Merge the rings oldest record first */
+		twLogRing * oldest = NULL;
+		logRecord * rec = NULL;
+		for (r = TW_ATOMIC_LOAD(&l->rings); r; r = r->next) {
+			logRecord * tmp = peekRecord(r);
+			if (tmp && (!rec || tmp->timestamp < rec->timestamp)) {
+				rec = tmp;
+				oldest = r;
+			}
+		}
+		if (!rec) break;
+		if (l->binaryFile) {
+			writeBinaryRecord(l, rec);
+		} else {
+			formatRecord(rec->format, (char *)rec + sizeof(logRecord), (char *)rec + sizeof(logRecord) + rec->argsLength, l->buffer, TW_LOGGER_BUF_SIZE);
+			twGetTimeString(rec->timestamp, timeStr, "%Y-%m-%d %H:%M:%S", 80, 1, 1);
+			l->f((enum LogLevel)rec->level, timeStr, l->buffer);
+		}
+		TW_ATOMIC_STORE(&oldest->head, oldest->head + rec->size);
+	}
+	for (r = TW_ATOMIC_LOAD(&l->rings); r; r = r->next) {
+		uint32_t dropped = TW_ATOMIC_LOAD(&r->dropped);
+		if (dropped != r->droppedReported) {
+			snprintf(l->buffer, TW_LOGGER_BUF_SIZE, "twLogger: Log ring full.  Dropped %u records", dropped - r->droppedReported);
+			twGetSystemTimeString(timeStr, "%Y-%m-%d %H:%M:%S", 80, 1, 1);
+			if (!l->binaryFile) l->f(TW_WARN, timeStr, l->buffer);
+			r->droppedReported = dropped;
+		}
+	}
+	if (l->binaryFile) fflush(l->binaryFile);
+	twMutex_Unlock(l->mtx);
+#endif
+}
+
+int twLogger_SetBinaryFile(char * filename) {
+#ifdef ENABLE_ASYNC_LOGGING
+	twLogger * l = twLogger_Instance();
+	TW_FILE_HANDLE f = 0;
+	if (!l) return TW_NULL_OR_INVALID_LOGGER_SINGLETON;
+	if (filename) {
+		f = TW_FOPEN(filename, "ab");
+		if (!f) return TW_ERROR_OPENING_LOG_FILE;
+		/* New files get the magic number */
+		if (!ftell(f)) TW_FWRITE(BINARY_LOG_MAGIC, 1, strlen(BINARY_LOG_MAGIC), f);
+	}
+	/* Switch over between records */
+	twMutex_Lock(l->mtx);
+	if (l->binaryFile) TW_FCLOSE(l->binaryFile);
+	l->binaryFile = f;
+	twMutex_Unlock(l->mtx);
+	return TW_OK;
+#else
+	return TW_ASYNC_LOGGING_NOT_ENABLED;
+#endif
+}
+
 /**************************************/
 /*        For Verbose debugging       */
 /**************************************/
@@ -342,7 +793,7 @@ void logRequestBody( twRequestBody * b, char * buf, int32_t maxLength) {
 				le = twList_Next(b->headers, le);
 			}
 		}
-		snprintf(buf, maxLength - 1, "Parameter Type: %s\n", b->params ? "INFOTABLE" : "NONE");
+		snprintf(buf, maxLength - 1, "Parameter Type: %s\n", b->params ? "INFOTABLE" : (b->rawParams ? "INFOTABLE (serialized)" : "NONE"));
 		maxLength = maxLength - strlen(buf);
 		buf = buf + strlen(buf);
 		if (b->params && maxLength > 0) {
@@ -371,7 +822,8 @@ void twLogMessage (void * msg, char * preamble) {
 	char buf[TW_LOGGER_BUF_SIZE];
 	twMessage * m = (twMessage *)msg;
 	int32_t bytesUsed = 0;
-	if (!m) return;	
+	/* Don't build the dump just to throw it away */
+	if (!m || TW_TRACE < minLogLevel) return;
 	memset(buf, 0, TW_LOGGER_BUF_SIZE);
 	/* Append an indicator that we haven't logged the complete message, just in case */
 	strcpy(&buf[TW_LOGGER_BUF_SIZE - 6], "<...>");
@@ -405,7 +857,7 @@ void twLogHexString(const char * msg, char * preamble, int32_t length) {
 	uint16_t size;
 	int32_t newLength = length;
 	twLogger * l = twLogger_Instance();
-	if (!msg || !preamble || !l || !l->isVerbose || TW_TRACE < l->level) return;
+	if (!msg || !preamble || !l || !l->isVerbose || TW_TRACE < minLogLevel) return;
 	/* prepare the message */
 	size = length * 3 + 1;
 	if (size > TW_LOGGER_BUF_SIZE) {
@@ -17,20 +17,88 @@ extern "C" {
 
 typedef void (*log_function) ( enum LogLevel level, const char * timestamp, const char * message);
 
+/***************************************/
+/*          Asynchronous Logging       */
+/* With ENABLE_ASYNC_LOGGING each      */
+/* thread packs its records into its   */
+/* own single producer ring.  Format   */
+/* strings are kept by pointer, so     */
+/* they must be literals, and string   */
+/* arguments are copied.  The log      */
+/* writer thread merges the rings in   */
+/* time order, formats the records and */
+/* calls the logging function.         */
+/***************************************/
+typedef struct twLogRing {
+	char * buffer;
+	uint32_t capacity;
+	uint32_t head;       /* Read position, only changed by the writer */
+	uint32_t tail;       /* Write position, only changed by the owning thread */
+	uint32_t dropped;    /* Records that didn't fit */
+	uint32_t droppedReported;
+	struct twLogRing * next;
+} twLogRing;
+
 typedef struct twLogger {
     enum LogLevel level;
     log_function f;
 	char isVerbose;
 	char * buffer;
 	TW_MUTEX mtx;
+	char async;                 /* TRUE once the log writer thread is running */
+	twLogRing * rings;          /* One per thread that has logged */
+	TW_MUTEX ringMtx;
+	TW_FILE_HANDLE binaryFile;
 } twLogger;
 
 twLogger * twLogger_Instance();
 int twLogger_Delete();
 int twLogger_SetLevel(enum  LogLevel level);
+
+/*
+twLogger_SetModuleLevel - Sets the level for one part of the SDK.  twLogger_SetLevel sets
+all of them.  TW_LOG, TW_LOG_HEX and TW_LOG_MSG check the level of the module they are
+used in before evaluating any of their arguments.
+Parameters:
+	module - the module, see enum twLogModule
+	level - the lowest level to log
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twLogger_SetModuleLevel(enum twLogModule module, enum LogLevel level);
 int twLogger_SetFunction(log_function f);
 int twLogger_SetIsVerbose(char val);
 
+/*
+twLogger_SetBinaryFile - With ENABLE_ASYNC_LOGGING, writes records to a file unformatted
+instead of passing them to the logging function, to be decoded later on a host.  The file
+starts with the 8 bytes "TWLOGBIN" and then holds one record after another:
+	uint32_t size of the record including this field
+	uint8_t level
+	uint8_t argument count
+	uint16_t length of the format string
+	uint64_t time in msec since the epoch
+	the format string, not terminated
+	the arguments, each a one byte tag followed by its value: 1 - int64_t, 2 - double,
+	3 - pointer as uint64_t, 4 - uint16_t length and that many bytes of string
+All values are in host byte order.
+Parameters:
+	filename - the file to append to or NULL to go back to the logging function
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twLogger_SetBinaryFile(char * filename);
+
+/*
+twLogger_Drain - Formats and outputs everything waiting in the log rings.  Called by the log
+writer thread.  Call it directly to make sure everything logged so far has been written.
+Parameters:
+	None
+Return:
+	Nothing
+*/
+void twLogger_Drain();
+
 void twLog(enum LogLevel level, const char * format, ... );
 void twLogHexString(const char * msg, char * preamble, int32_t length);
 void twLogMessage(void * m, char * preamble);
@@ -4,6 +4,8 @@
  *  Portable ThingWorx Binary Messaging layer
  */
 
+#define TW_LOG_MODULE TW_MODULE_MESSAGING
+
 #include "twOSPort.h"
 #include "twMessages.h"
 #include "twLogger.h"
@@ -13,9 +15,6 @@
 #include "twInfoTable.h"
 #include "twApi.h"
 
-#define MSG_HEADER_SIZE 15
-#define MULTIPART_MSG_HEADER_SIZE 6
-
 extern TW_MUTEX twInitMutex;
 
 uint32_t globalRequestId = 0;
@@ -166,6 +165,12 @@ void twMessage_Delete(void * input) {
 	char * type;
 	twMessage * msg = (twMessage *) input;
 	if (!msg) { TW_LOG(TW_ERROR, "twMessage_Delete: NULL msg pointer"); return; }
+	if (msg->arena) {
+		/* The message and everything in it came from the arena */
+		TW_LOG(TW_DEBUG, "twMessage_Delete:  Releasing arena of Message: %d", msg->requestId);
+		twArena_Delete(msg->arena);
+		return;
+	}
 	/* Clean up */
 	/* if there already is a body, free it up */
 	if (msg->type == TW_REQUEST) {
@@ -223,7 +228,6 @@ int twMessage_SetBody(struct twMessage * msg, void * body) {
 }
 
 extern twApi * tw_api;
-#define PERSISTED_MSG_SEPERATOR "!twMsg!"
 
 int twMessage_Send(struct twMessage * msg, struct twWs * ws) {
 	char byte;
@@ -241,112 +245,18 @@ int twMessage_Send(struct twMessage * msg, struct twWs * ws) {
 
 	/* Check to see if offline message store is enabled, we have some queued up messages, and we are online */
 	if (tw_api->offlineMsgEnabled && tw_api->offlineMsgSize && twApi_isConnected()) {
-		int res = 0;
-		/* We are going to have to insert the current session ID into the message */
-		uint32_t session = ws->sessionId;
-		swap4bytes((char *)&session);
-	
 	#if (OFFLINE_MSG_STORE == 1) 
 		/* Memory resident offline message store */
-		if (tw_api->offlineMsgList) {
-			ListEntry * le = NULL;
-			le = twList_Next(tw_api->offlineMsgList, NULL);
-			while (le && le->value) {
-				ListEntry * tmp = le;
-				twStream * ps = (twStream *)le->value;
-				/* Insert our session ID */
-				memcpy(&ps->data[10], (char *)&session, 4);
-				res = twWs_SendMessage(ws, twStream_GetData(ps), twStream_GetLength(ps), 0);
-				tw_api->offlineMsgSize -= ps->length;
-				/* if we have disconnected again stop processing the list, otherwise delete the message */
-				if (res && res == TW_WEBSOCKET_NOT_CONNECTED) break;
-				le = twList_Next(tw_api->offlineMsgList, le);
-				twList_Remove(tw_api->offlineMsgList, tmp, TRUE);
-			}
+		if (tw_api->offlineMsgQueue) {
+			twOfflineMsgQueue_Flush(tw_api->offlineMsgQueue, ws);
+			tw_api->offlineMsgSize = twOfflineMsgQueue_GetSize(tw_api->offlineMsgQueue);
 		}
 	#endif
 	#if (OFFLINE_MSG_STORE == 2)
 		/* Persisted offline message store */
-		if (tw_api->offlineMsgFile) {
-			size_t persistMsgLen = MESSAGE_CHUNK_SIZE + strlen(PERSISTED_MSG_SEPERATOR) + sizeof(s->length);
-			char * buf = (char *) TW_CALLOC(persistMsgLen,1);
-			int32_t bytesRead = 0;
-			int res = 0;
-			char foundMsg = FALSE;
-			uint32_t msgLength = 0;
-			int64_t curPos = 0;
-			TW_FILE_HANDLE f = 0;
-			if (buf) {
-				/* Find the first offline message seperator in the file */
-				f = TW_FOPEN(tw_api->offlineMsgFile, "rb");
-				while (TW_FREAD(buf + curPos, 1, 1, f) == 1) {
-					if (!strstr(buf, PERSISTED_MSG_SEPERATOR)) {
-						if (curPos++ < persistMsgLen) continue;
-						else {
-							TW_LOG(TW_WARN,"twMessage_Send: Couldn't find a persisted message seperator in the offline msg store file");
-							break;
-						}
-					}
-					/* If we are here we have found the separator */
-					foundMsg = TRUE;
-					/* Read in the length */
-					msgLength = 0;
-					if (TW_FREAD(&msgLength, 1, sizeof(uint32_t), f) != sizeof(uint32_t)) {
-						TW_LOG(TW_ERROR,"twMessage_Send: Error reading persisted message length from file");
-						break;
-					}
-					bytesRead = TW_FREAD(buf, 1, msgLength, f);
-					if (bytesRead != msgLength) {
-						TW_LOG(TW_ERROR,"twMessage_Send: Error reading persisted message from file");
-						break;
-					}
-					curPos = TW_FTELL(f);
-					/* Insert our session ID */
-					memcpy(&buf[10], (char *)&session, 4);
-					/* we now have the msg in the buffer.  Send it off */
-					res = twWs_SendMessage(ws, buf, msgLength, 0);
-					if (res && res == TW_WEBSOCKET_NOT_CONNECTED) {
-						/* Back off our current position to point to the beginning of this msg again */
-						curPos = curPos - msgLength - strlen(PERSISTED_MSG_SEPERATOR) + sizeof(s->length);
-						break;
-					}
-					tw_api->offlineMsgSize -= msgLength;
-					/* Rest curPos to check for another message */
-					curPos = 0;
-				}
-				/* Need to clean up our file now */
-				if (tw_api->offlineMsgSize <= 0 || curPos <= 1) {
-					TW_FCLOSE(f);
-					f = TW_FOPEN(tw_api->offlineMsgFile,"w");
-					if (f) TW_FCLOSE(f);
-					tw_api->offlineMsgSize = 0;
-				} else {
-					char * tmpFile = (char *)TW_CALLOC(strlen(tw_api->offlineMsgFile) + 8,1);
-					TW_FILE_HANDLE h = 0;
-					if (tmpFile) {
-						strcpy(tmpFile, tw_api->offlineMsgFile);
-						strcat(tmpFile, ".tmp");
-						h = TW_FOPEN(tmpFile,"wb");
-						if (h) {
-							TW_FSEEK(f, curPos, SEEK_SET);
-							while (bytesRead = TW_FREAD(buf, 1, persistMsgLen, f) > 0) {
-								TW_FWRITE(buf, 1, bytesRead, h);
-							}
-							TW_FCLOSE(f);
-							TW_FCLOSE(h);
-							/* Rename the file */
-							twDirectory_MoveFile(tmpFile, tw_api->offlineMsgFile);
-						} else {
-							TW_LOG(TW_ERROR,"twMessage_Send: Opening file %s", tmpFile);
-						}
-						TW_FREE(tmpFile);
-					} else {
-						TW_LOG(TW_ERROR,"twMessage_Send: Error allocating temp filename");
-						TW_FCLOSE(f);
-					}
-				}
-				TW_FREE(buf);
-			}
+		if (tw_api->offlineMsgStore) {
+			twOfflineMsgStore_Flush(tw_api->offlineMsgStore, ws);
+			tw_api->offlineMsgSize = twOfflineMsgStore_GetSize(tw_api->offlineMsgStore);
 		}
 	#endif
 	}
@@ -367,12 +277,30 @@ int twMessage_Send(struct twMessage * msg, struct twWs * ws) {
 		TW_LOG(TW_ERROR,"twMessage_Send: Unknown message code: %d", msg->code);
 		return TW_INVALID_MSG_TYPE;
 	}
-	/* Create a new stream for the body */
-	bodyStream = twStream_Create();
+	/* 
+	Serialize the body once into a stream sized for the header plus the body.  The header 
+	space is reserved up front so a single part message can be sent straight from this buffer
+	*/
+	bodyStream = twStream_CreateWithCapacity(MSG_HEADER_SIZE + length);
 	if (!bodyStream) {
 		TW_LOG(TW_ERROR, "twMessage_Send: Error allocating stream"); 
 		return TW_ERROR_ALLOCATING_MEMORY; 
 	}
+	twStream_AddBytes(bodyStream, header, MSG_HEADER_SIZE);
+	if (msg->type == TW_REQUEST) {
+		twRequestBody_ToStream((twRequestBody *)msg->body, bodyStream);
+	} else if (msg->type == TW_BIND) {
+		twBindBody_ToStream((twBindBody *)msg->body, bodyStream, ws->gatewayName);
+	} else if (msg->type == TW_AUTH) {
+		twAuthBody_ToStream((twAuthBody *)msg->body, bodyStream);
+	} else if (msg->type >= TW_RESPONSE) {
+		twResponseBody_ToStream((twResponseBody *)msg->body, bodyStream);
+	} 
+	if (twStream_GetLength(bodyStream) - MSG_HEADER_SIZE != length) {
+		TW_LOG(TW_WARN, "twMessage_Send: Precomputed body length %d doesn't match serialized length %d. RequestId %d", 
+			length, twStream_GetLength(bodyStream) - MSG_HEADER_SIZE, msg->requestId);
+		length = twStream_GetLength(bodyStream) - MSG_HEADER_SIZE;
+	}
 	/* Create the header binary representation */
 	header[0] = msg->version;
 	header[1] = (char)msg->code;
@@ -403,30 +331,30 @@ int twMessage_Send(struct twMessage * msg, struct twWs * ws) {
 		chunkInfo[5] = (unsigned char)(MESSAGE_CHUNK_SIZE % 256);
 		memcpy(&header[MSG_HEADER_SIZE], chunkInfo, 6);
 		headerSize += MULTIPART_MSG_HEADER_SIZE;
+	} else {
+		/* Everything fits in one message, fill in the reserved header and send the buffer as is */
+		memcpy(bodyStream->data, header, MSG_HEADER_SIZE);
+		numChunks = 1;
 	}
-	if (msg->type == TW_REQUEST) {
-		twRequestBody_ToStream((twRequestBody *)msg->body, bodyStream);
-	} else if (msg->type == TW_BIND) {
-		twBindBody_ToStream((twBindBody *)msg->body, bodyStream, ws->gatewayName);
-	} else if (msg->type == TW_AUTH) {
-		twAuthBody_ToStream((twAuthBody *)msg->body, bodyStream);
-	} else if (msg->type >= TW_RESPONSE) {
-		twResponseBody_ToStream((twResponseBody *)msg->body, bodyStream);
-	} 
 	/* Start sending the message */
 	bodyBytesRemaining = length;
 	while (chunkNumber <= numChunks) {
 		/* Create a new stream for the body */
 		uint16_t size = effectiveChunkSize;
-		s = twStream_Create();
-		if (!s) {
-			TW_LOG(TW_ERROR, "twMessage_Send: Error allocating stream"); 
-			twStream_Delete(bodyStream);
-			return TW_ERROR_ALLOCATING_MEMORY; 
-		}
-		twStream_AddBytes(s, header, headerSize);
 		if (bodyBytesRemaining <= effectiveChunkSize) size = bodyBytesRemaining;
-		if (msg->multipartMarker) {
+		if (!msg->multipartMarker) {
+			/* The stream is handed off, it may end up in the offline message store */
+			s = bodyStream;
+			bodyStream = NULL;
+		} else {
+			/* Only the chunk headers are copied, the data is sent straight from the body stream */
+			s = twStream_Create();
+			if (!s) {
+				TW_LOG(TW_ERROR, "twMessage_Send: Error allocating stream"); 
+				twStream_Delete(bodyStream);
+				return TW_ERROR_ALLOCATING_MEMORY; 
+			}
+			twStream_AddBytes(s, header, headerSize);
 			/* Adjust the chunk number */
 			s->data[MSG_HEADER_SIZE] = (unsigned char)(chunkNumber/256);
 			s->data[MSG_HEADER_SIZE + 1] = (unsigned char)(chunkNumber%256);
@@ -437,62 +365,50 @@ int twMessage_Send(struct twMessage * msg, struct twWs * ws) {
 				stringToStream(((twRequestBody *)msg->body)->entityName, s);
 			}
 		}
-		/* Add the data */
-		twStream_AddBytes(s,&bodyStream->data[length - bodyBytesRemaining], size);
-		/* Send both streams off to the websocket */
-		res = twWs_SendMessage(ws, twStream_GetData(s), twStream_GetLength(s), 0);
+		if (msg->multipartMarker) {
+			/* Gather the chunk headers and this chunk's slice of the body into one write */
+			twIoVec parts[2];
+			parts[0].buf = twStream_GetData(s);
+			parts[0].len = twStream_GetLength(s);
+			parts[1].buf = &bodyStream->data[MSG_HEADER_SIZE + length - bodyBytesRemaining];
+			parts[1].len = size;
+			res = twWs_SendMessageV(ws, parts, 2, 0);
+		} else res = twWs_SendMessage(ws, twStream_GetData(s), twStream_GetLength(s), 0);
 		if (res) {
 			if (res == TW_WEBSOCKET_NOT_CONNECTED && msg->type == TW_REQUEST) {
-				/* Check to see if offline message store is enabled and we don't exceed its max size */
-				if (tw_api->offlineMsgEnabled && tw_api->offlineMsgSize + twStream_GetLength(s) < OFFLINE_MSG_QUEUE_SIZE) {
+				/* The offline message store needs the whole chunk in one stream */
+				if (msg->multipartMarker) twStream_AddBytes(s, &bodyStream->data[MSG_HEADER_SIZE + length - bodyBytesRemaining], size);
+				/* Check to see if offline message store is enabled */
+				if (tw_api->offlineMsgEnabled) {
 				#if (OFFLINE_MSG_STORE == 1) 
-					/* Memory resident offline message store */
-					if (tw_api->offlineMsgList) {
-						if (twList_Add(tw_api->offlineMsgList, s)) {
+					/* Memory resident offline message store.  The queue enforces its own size limit */
+					if (tw_api->offlineMsgQueue) {
+						res = twOfflineMsgQueue_Write(tw_api->offlineMsgQueue, s);
+						twStream_Delete(s);
+						if (bodyStream) twStream_Delete(bodyStream);
+						if (res) {
 							TW_LOG(TW_ERROR,"twMessage_Send: Error storing message in offline msg queue. RequestId %d", msg->requestId);
-							twStream_Delete(s);
 							return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
-						} else {
-							TW_LOG(TW_DEBUG,"twMessage_Send: Stored message in offline msg queue. RequestId %d", msg->requestId);
-							tw_api->offlineMsgSize += twStream_GetLength(s);
-							return TW_OK;
 						}
+						TW_LOG(TW_DEBUG,"twMessage_Send: Stored message in offline msg queue. RequestId %d", msg->requestId);
+						tw_api->offlineMsgSize = twOfflineMsgQueue_GetSize(tw_api->offlineMsgQueue);
+						return TW_OK;
 					}
 				#endif
 				#if (OFFLINE_MSG_STORE == 2)
 					/* Persisted offline message store */
-					if (tw_api->offlineMsgFile) {
-						size_t sepLength = strlen(PERSISTED_MSG_SEPERATOR);
-						TW_FILE_HANDLE f = TW_FOPEN(tw_api->offlineMsgFile, "a+b");
-						if (!f) {
-							TW_LOG(TW_ERROR,"twMessage_Send: Error opening offline msg file %s", tw_api->offlineMsgFile);
-							twStream_Delete(s);
-							return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
-						}
-						/* Messages are delimited by <PERSISTED_MSG_SEPERATOR><stream length> */
-						/* Write the separator */
-						if (TW_FWRITE(PERSISTED_MSG_SEPERATOR, 1, sepLength, f) != sepLength) {
-							TW_LOG(TW_ERROR,"twMessage_Send: Error storing message in offline msg file. RequestId %d", msg->requestId);
-							TW_FCLOSE(f);
+					if (tw_api->offlineMsgStore && tw_api->offlineMsgSize + twStream_GetLength(s) < OFFLINE_MSG_QUEUE_SIZE) {
+						if (twOfflineMsgStore_Write(tw_api->offlineMsgStore, s)) {
+							TW_LOG(TW_ERROR,"twMessage_Send: Error storing message in offline msg store. RequestId %d", msg->requestId);
 							twStream_Delete(s);
+							if (bodyStream) twStream_Delete(bodyStream);
 							return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
 						}
-						/* Write the length */
-						if (TW_FWRITE(&s->length, 1, sizeof(s->length), f) != sizeof(s->length)) {
-							TW_LOG(TW_ERROR,"twMessage_Send: Error storing message in offline msg file. RequestId %d", msg->requestId);
-							TW_FCLOSE(f);
-							twStream_Delete(s);
-							return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
-						} else {
-							if (TW_FWRITE(s->data, 1, s->length, f) != s->length) {
-								TW_LOG(TW_DEBUG,"twMessage_Send: Error storing message in offline msg file. RequestId %d", msg->requestId);
-							} else {
-								TW_LOG(TW_DEBUG,"twMessage_Send: Stored message in offline msg file. RequestId %d", msg->requestId);
-								tw_api->offlineMsgSize += twStream_GetLength(s);
-							}
-							TW_FCLOSE(f);
-							return TW_OK;
-						}
+						TW_LOG(TW_DEBUG,"twMessage_Send: Stored message in offline msg store. RequestId %d", msg->requestId);
+						tw_api->offlineMsgSize = twOfflineMsgStore_GetSize(tw_api->offlineMsgStore);
+						twStream_Delete(s);
+						if (bodyStream) twStream_Delete(bodyStream);
+						return TW_OK;
 					}
 				#endif
 				}
@@ -501,7 +417,7 @@ int twMessage_Send(struct twMessage * msg, struct twWs * ws) {
 				chunkNumber, numChunks, msg->requestId);
 			else  TW_LOG(TW_ERROR,"twMessage_Send: Error sending Message with RequestId %d", msg->requestId);
 			twStream_Delete(s);
-			twStream_Delete(bodyStream);
+			if (bodyStream) twStream_Delete(bodyStream);
 			return TW_ERROR_SENDING_MSG; 
 		} else {
 			if (msg->multipartMarker) TW_LOG(TW_TRACE,"twMessage_Send: Chunk %d of %d with RequestId %d sent successfully", 
@@ -512,7 +428,7 @@ int twMessage_Send(struct twMessage * msg, struct twWs * ws) {
 		}
 		chunkNumber++;
 	}
-	twStream_Delete(bodyStream);
+	if (bodyStream) twStream_Delete(bodyStream);
 	/* Reset the multipart marker so deleteting the message doesn't get confused */
 	msg->multipartMarker = FALSE;
 	return TW_OK;
@@ -638,6 +554,7 @@ int twRequestBody_Delete(struct twRequestBody * body) {
 	TW_FREE(body->characteristicName);
 	twList_Delete(body->headers);
 	twInfoTable_Delete(body->params);
+	if (body->rawParams) twStream_Delete(body->rawParams);
 	TW_FREE(body);
 	return TW_OK;
 }
@@ -654,6 +571,18 @@ int twRequestBody_SetParams(struct twRequestBody * body, twInfoTable * params) {
 	return TW_OK;
 }
 
+int twRequestBody_SetRawParams(struct twRequestBody * body, twStream * params) {
+	if (!body || body->params || body->rawParams) {
+		TW_LOG(TW_ERROR, "twRequestBody_SetRawParams: NULL body pointer or body already has params"); 
+		return TW_INVALID_PARAM; 
+	}
+	body->rawParams = params; /* We own this pointer now */
+	if (params) {
+		body->length += twStream_GetLength(params);
+	} 
+	return TW_OK;
+}
+
 int twRequestBody_SetEntity(struct twRequestBody * body, enum entityTypeEnum entityType, char * entityName) {
 	if (!body || body->entityName || !entityName) {
 		TW_LOG(TW_ERROR, "twRequestBody_SetEntity: NULL pointer or body already has an entity"); 
@@ -685,7 +614,7 @@ int twRequestBody_AddHeader(struct twRequestBody * body, char * name, char * val
 	hdr = (twHeader *)TW_CALLOC(sizeof(twHeader), 1);
 	hdr->name = duplicateString(name);
 	hdr->value = duplicateString(value);
-	body->length = strlen(name) + 1 + strlen(value) + 1;
+	body->length += strlen(name) + 1 + strlen(value) + 1;
 	twList_Add(body->headers, hdr);
 	body->numHeaders++;
 	return TW_OK;
@@ -715,6 +644,10 @@ int twRequestBody_ToStream(struct twRequestBody * body, twStream * s) {
 		byte = (char)TW_INFOTABLE;
 		twStream_AddBytes(s, &byte, 1);
 		twInfoTable_ToStream(body->params, s);
+	} else if (body->rawParams) {
+		byte = (char)TW_INFOTABLE;
+		twStream_AddBytes(s, &byte, 1);
+		twStream_AddBytes(s, twStream_GetData(body->rawParams), twStream_GetLength(body->rawParams));
 	} else {
 		byte = (char)TW_NOTHING;
 		twStream_AddBytes(s, &byte, 1);
@@ -1010,7 +943,7 @@ int twBindBody_ToStream(struct twBindBody * body, twStream * s, char * gatewayNa
 /* Multipart Body */
 twMultipartBody * twMultipartBody_CreateFromStream(twStream * s, char isRequest) {
 	twMultipartBody * body = (twMultipartBody *)TW_CALLOC(sizeof(twMultipartBody), 1);
-	char tmp[2];
+	unsigned char tmp[2];
 	if (!body || !s) {
 		TW_LOG(TW_ERROR, "twMultipartBody_CreateFromStream: Error allocating body or missing stream input");
 		return NULL;
@@ -1051,41 +984,178 @@ void twMultipartBody_Delete(void * body) {
 **/
 twMultipartMessageStore * mpStore = NULL;
 
-mulitpartMessageStoreEntry * mulitpartMessageStoreEntry_Create(twMessage * msg) {
-	mulitpartMessageStoreEntry * tmp = (mulitpartMessageStoreEntry *)TW_CALLOC(sizeof(mulitpartMessageStoreEntry), 1);
-	twMultipartBody * mpBody = NULL;
-	if (!msg || !msg->body) return NULL;
-	mpBody = (twMultipartBody *)msg->body;
-	/* Make sure the size of this message doesn't exceed our max size */
-	if (mpBody->chunkCount * mpBody->chunkSize > MAX_MESSAGE_SIZE) {
-		TW_LOG(TW_ERROR,"mulitpartMessageStoreEntry_Create: Multipart message would exceed maximum message size");
-		return NULL;
+#define CHUNK_BYTE(id) (((id) - 1) / 8)
+#define CHUNK_BIT(id) (1 << (((id) - 1) % 8))
+
+static uint32_t storeSlot(uint32_t id) {
+	/* Request IDs are sequential so a simple fold spreads them evenly */
+	return (id ^ (id >> 16)) & (mpStore->numSlots - 1);
+}
+
+/* All of the following must be called with the store mutex held */
+static int32_t storeFindSlot(uint32_t id) {
+	uint32_t i = storeSlot(id);
+	while (mpStore->slots[i]) {
+		if (mpStore->slots[i]->id == id) return i;
+		i = (i + 1) & (mpStore->numSlots - 1);
+	}
+	return -1;
+}
+
+static mulitpartMessageStoreEntry * storeRemoveSlot(uint32_t i) {
+	uint32_t mask = mpStore->numSlots - 1;
+	uint32_t j = i;
+	mulitpartMessageStoreEntry * e = mpStore->slots[i];
+	/* Backward shift deletion keeps probe sequences intact without tombstones */
+	while (1) {
+		uint32_t home = 0;
+		j = (j + 1) & mask;
+		if (!mpStore->slots[j]) break;
+		home = storeSlot(mpStore->slots[j]->id);
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			mpStore->slots[i] = mpStore->slots[j];
+			i = j;
+		}
 	}
-	/* We want to store the messages in an ordered array for easy reasembly */
-	tmp->msgs = (twMessage **)TW_CALLOC(sizeof(twMessage *) * mpBody->chunkCount, 1);
-	if (!tmp->msgs) {
-		mulitpartMessageStoreEntry_Delete(tmp);
+	mpStore->slots[i] = NULL;
+	mpStore->count--;
+	return e;
+}
+
+static void removeStale(uint64_t now) {
+	uint32_t i = 0;
+	while (i < mpStore->numSlots) {
+		mulitpartMessageStoreEntry * e = mpStore->slots[i];
+		if (e && twTimeGreaterThan(now, e->expirationTime)) {
+			TW_LOG(TW_INFO,"Removing stale message with Request Id %d", e->id);
+			/* Another entry may be shifted into this slot so look at it again */
+			mulitpartMessageStoreEntry_Delete(storeRemoveSlot(i));
+		} else i++;
+	}
+}
+
+static mulitpartMessageStoreEntry * storeEntryCreate(uint32_t id, const char * header, const char * entityInfo, uint32_t entityInfoLength,
+													 uint16_t chunkCount, uint16_t chunkSize) {
+	mulitpartMessageStoreEntry * e = (mulitpartMessageStoreEntry *)TW_CALLOC(sizeof(mulitpartMessageStoreEntry), 1);
+	if (!e) return NULL;
+	/* Room for every chunk to be parked in its own slot */
+	e->headerLength = MSG_HEADER_SIZE + entityInfoLength;
+	e->capacity = e->headerLength + (uint32_t)chunkCount * chunkSize;
+	e->data = (char *)TW_MALLOC(e->capacity);
+	e->received = (uint8_t *)TW_CALLOC((chunkCount + 7) / 8, 1);
+	e->lengths = (uint16_t *)TW_CALLOC(chunkCount, sizeof(uint16_t));
+	if (!e->data || !e->received || !e->lengths) {
+		mulitpartMessageStoreEntry_Delete(e);
 		return NULL;
 	}
-	tmp->expirationTime = twGetSystemMillisecondCount() + STALE_MSG_CLEANUP_RATE;
-	tmp->id = msg->requestId;
-	tmp->chunksExpected = mpBody->chunkCount;
-	tmp->chunksReceived = 1;
-	tmp->msgs[mpBody->chunkId - 1] = msg; /* CHunk IDs are not zero based */
-	return tmp;
+	memcpy(e->data, header, MSG_HEADER_SIZE);
+	/* The reassembled message goes on as a single part message */
+	e->data[MSG_HEADER_SIZE - 1] = FALSE;
+	if (entityInfoLength) memcpy(e->data + MSG_HEADER_SIZE, entityInfo, entityInfoLength);
+	e->length = e->headerLength;
+	e->expirationTime = twGetSystemMillisecondCount() + STALE_MSG_CLEANUP_RATE;
+	e->id = id;
+	e->chunksExpected = chunkCount;
+	e->chunkSize = chunkSize;
+	e->nextChunk = 1;
+	return e;
 }
 
 void mulitpartMessageStoreEntry_Delete(void * entry) {
-	uint16_t i = 0;
 	mulitpartMessageStoreEntry * tmp = (mulitpartMessageStoreEntry *) entry;
 	if (!tmp) return;
-	for (i = 0; i < tmp->chunksExpected; i++) {
-		if (tmp->msgs[i]) twMessage_Delete(tmp->msgs[i]);
-	}
-	if (tmp->msgs) TW_FREE(tmp->msgs);
+	if (tmp->data) TW_FREE(tmp->data);
+	if (tmp->received) TW_FREE(tmp->received);
+	if (tmp->lengths) TW_FREE(tmp->lengths);
 	TW_FREE(tmp);
 }
 
+/* Copies one chunk into its message's buffer.  Returns the complete message once all chunks are in */
+static twStream * addChunk(const char * header, const char * entityInfo, uint32_t entityInfoLength,
+						   uint16_t chunkId, uint16_t chunkCount, uint16_t chunkSize, const char * data, uint32_t length) {
+	mulitpartMessageStoreEntry * e = NULL;
+	twStream * s = NULL;
+	uint32_t id = 0;
+	int32_t i = 0;
+	memcpy(&id, header + 2, 4);
+	swap4bytes((char *)&id);
+	if (!chunkId || chunkId > chunkCount || length > chunkSize || (uint32_t)chunkCount * chunkSize > MAX_MESSAGE_SIZE) {
+		TW_LOG(TW_ERROR,"twMultipartMessageStore_AddChunk: Invalid chunk %d of %d with %d bytes, chunk size %d. RequestId %d",
+			chunkId, chunkCount, length, chunkSize, id);
+		return NULL;
+	}
+	twMutex_Lock(mpStore->mtx);
+	i = storeFindSlot(id);
+	if (i < 0) {
+		if (mpStore->count >= MAX_MULTIPART_MESSAGES) removeStale(twGetSystemMillisecondCount());
+		if (mpStore->count >= MAX_MULTIPART_MESSAGES) {
+			twMutex_Unlock(mpStore->mtx);
+			TW_LOG(TW_WARN,"twMultipartMessageStore_AddChunk: Already reassembling %d messages. Discarding chunk of RequestId %d",
+				MAX_MULTIPART_MESSAGES, id);
+			return NULL;
+		}
+		e = storeEntryCreate(id, header, entityInfo, entityInfoLength, chunkCount, chunkSize);
+		if (!e) {
+			twMutex_Unlock(mpStore->mtx);
+			TW_LOG(TW_ERROR,"twMultipartMessageStore_AddChunk: Error allocating %d byte buffer for RequestId %d",
+				MSG_HEADER_SIZE + entityInfoLength + chunkCount * chunkSize, id);
+			return NULL;
+		}
+		i = storeSlot(id);
+		while (mpStore->slots[i]) i = (i + 1) & (mpStore->numSlots - 1);
+		mpStore->slots[i] = e;
+		mpStore->count++;
+	} else e = mpStore->slots[i];
+	if (chunkId > e->chunksExpected || length > e->chunkSize) {
+		twMutex_Unlock(mpStore->mtx);
+		TW_LOG(TW_ERROR,"twMultipartMessageStore_AddChunk: Chunk Id %d is greater that expected chunks of %d",
+			chunkId, e->chunksExpected);
+		return NULL;
+	}
+	if (e->received[CHUNK_BYTE(chunkId)] & CHUNK_BIT(chunkId)) {
+		twMutex_Unlock(mpStore->mtx);
+		TW_LOG(TW_DEBUG,"twMultipartMessageStore_AddChunk: Ignoring duplicate chunk %d of RequestId %d", chunkId, id);
+		return NULL;
+	}
+	e->received[CHUNK_BYTE(chunkId)] |= CHUNK_BIT(chunkId);
+	e->chunksReceived++;
+	if (chunkId == e->nextChunk) {
+		memcpy(e->data + e->length, data, length);
+		e->length += length;
+		e->nextChunk++;
+		/* Move down any chunks that were parked waiting for this one */
+		while (e->nextChunk <= e->chunksExpected && (e->received[CHUNK_BYTE(e->nextChunk)] & CHUNK_BIT(e->nextChunk))) {
+			uint16_t n = e->nextChunk - 1;
+			memmove(e->data + e->length, e->data + e->headerLength + (uint32_t)n * e->chunkSize, e->lengths[n]);
+			e->length += e->lengths[n];
+			e->nextChunk++;
+		}
+	} else {
+		/* Park it until the chunks before it arrive.  The in order data never reaches this slot */
+		memcpy(e->data + e->headerLength + (uint32_t)(chunkId - 1) * e->chunkSize, data, length);
+		e->lengths[chunkId - 1] = (uint16_t)length;
+	}
+	if (e->chunksReceived < e->chunksExpected) {
+		twMutex_Unlock(mpStore->mtx);
+		return NULL;
+	}
+	/* If we are here then we have received the entire message */
+	storeRemoveSlot(i);
+	twMutex_Unlock(mpStore->mtx);
+	/* Hand the buffer over to a stream */
+	s = (twStream *)TW_CALLOC(sizeof(twStream), 1);
+	if (s) {
+		s->data = e->data;
+		s->ptr = s->data;
+		s->length = e->length;
+		s->maxlength = e->capacity;
+		s->ownsData = TRUE;
+		e->data = NULL;
+	} else TW_LOG(TW_ERROR,"twMultipartMessageStore_AddChunk: Error allocating stream for RequestId %d", id);
+	mulitpartMessageStoreEntry_Delete(e);
+	return s;
+}
+
 twMultipartMessageStore * twMultipartMessageStore_Instance() {
 	/* Check to see if it already exists */
 	twMutex_Lock(twInitMutex);
@@ -1097,12 +1167,15 @@ twMultipartMessageStore * twMultipartMessageStore_Instance() {
 	if (!mpStore) {
 		TW_LOG(TW_ERROR,"twMultipartMessageStore_Instance: Error allocating multipart message store");
 	} else {
+		/* Keep the table at most half full so probe sequences stay short */
+		mpStore->numSlots = 1;
+		while (mpStore->numSlots < MAX_MULTIPART_MESSAGES * 2) mpStore->numSlots <<= 1;
 		mpStore->mtx = twMutex_Create();
-		mpStore->multipartMessageList = twList_Create(mulitpartMessageStoreEntry_Delete);
-		if (!mpStore->mtx || !mpStore->multipartMessageList) {
+		mpStore->slots = (mulitpartMessageStoreEntry **)TW_CALLOC(sizeof(mulitpartMessageStoreEntry *), mpStore->numSlots);
+		if (!mpStore->mtx || !mpStore->slots) {
 			TW_LOG(TW_ERROR, "twMultipartMessageStore_Instance: Error allocating memory");
 			twMutex_Delete(mpStore->mtx);
-			twList_Delete(mpStore->multipartMessageList);
+			if (mpStore->slots) TW_FREE(mpStore->slots);
 			TW_FREE(mpStore);
 			mpStore = 0;
 		}
@@ -1112,6 +1185,7 @@ twMultipartMessageStore * twMultipartMessageStore_Instance() {
 }
 
 void twMultipartMessageStore_Delete(void * input) {
+	uint32_t i = 0;
 	twMultipartMessageStore * tmp = mpStore;
 	if (!mpStore) return;
 	twMutex_Lock(tmp->mtx);
@@ -1120,108 +1194,91 @@ void twMultipartMessageStore_Delete(void * input) {
 	/*twMutex_Unlock(twInitMutex);*/
 	twMutex_Unlock(tmp->mtx);
 	twMutex_Delete(tmp->mtx);
-	twList_Delete(tmp->multipartMessageList);
+	for (i = 0; i < tmp->numSlots; i++) mulitpartMessageStoreEntry_Delete(tmp->slots[i]);
+	TW_FREE(tmp->slots);
 	TW_FREE(tmp);
 }
 
+twStream * twMultipartMessageStore_AddChunk(const char * data, uint32_t length) {
+	const unsigned char * chunkInfo = (const unsigned char *)data + MSG_HEADER_SIZE;
+	uint32_t offset = MSG_HEADER_SIZE + MULTIPART_MSG_HEADER_SIZE;
+	uint32_t entityInfoLength = 0;
+	unsigned char code = 0;
+	if (!mpStore || !data || length < offset) {
+		TW_LOG(TW_ERROR,"twMultipartMessageStore_AddChunk: No message store found or chunk is too short");
+		return NULL;
+	}
+	code = (unsigned char)data[1];
+	if (code == TWX_GET || code == TWX_PUT || code == TWX_POST || code == TWX_DEL) {
+		/* Requests repeat the entity type and name in every chunk, size it the way streamToString reads it */
+		const unsigned char * name = (const unsigned char *)data + offset + 1;
+		uint32_t nameLength = 0;
+		if (length >= offset + 2) {
+			entityInfoLength = 2;
+			nameLength = name[0];
+			if (nameLength > 127 && length >= offset + 5) {
+				entityInfoLength = 5;
+				nameLength = name[0] * 0x1000000 + name[1] * 0x10000 + name[2] * 0x100 + name[3];
+			}
+		}
+		if (!entityInfoLength || nameLength > length - offset - entityInfoLength) {
+			TW_LOG(TW_ERROR,"twMultipartMessageStore_AddChunk: Chunk is too short for its entity name");
+			return NULL;
+		}
+		entityInfoLength += nameLength;
+	}
+	return addChunk(data, data + offset, entityInfoLength, chunkInfo[0] * 0x100 + chunkInfo[1], chunkInfo[2] * 0x100 + chunkInfo[3],
+		chunkInfo[4] * 0x100 + chunkInfo[5], data + offset + entityInfoLength, length - offset - entityInfoLength);
+}
+
 twMessage * twMultipartMessageStore_AddMessage(twMessage * msg) {
 	/* Returns the complete message if all chunks have been received */
-	ListEntry * le = NULL;
-	uint16_t i = 0;
+	char header[MSG_HEADER_SIZE];
+	uint32_t tmp = 0;
 	twMultipartBody * mp = NULL;
+	twStream * entityInfo = NULL;
 	twStream * s = NULL;
+	twMessage * m = NULL;
 	if (!mpStore || !msg || !msg->body){
 		TW_LOG(TW_ERROR,"twMultipartMessageStore_AddMessage: No message or message store found");
 		return NULL;
 	}
 	mp = (twMultipartBody *)msg->body;
-	twMutex_Lock(mpStore->mtx);
-	le = twList_Next(mpStore->multipartMessageList, NULL);
-	while (le) {
-		twMessage * m = NULL;
-		mulitpartMessageStoreEntry * tmp = (mulitpartMessageStoreEntry *)le->value;
-		if (tmp && tmp->id == msg->requestId) {
-			/* The entry already exists in the list, just add the mesg */
-			if (mp->chunkId > tmp->chunksExpected) {
-				TW_LOG(TW_ERROR,"twMultipartMessageStore_AddMessage: Chunk Id %d is greater that expected chunks of %d",
-					mp->chunkId, tmp->chunksExpected);
-				twMessage_Delete(msg);
-				twMutex_Unlock(mpStore->mtx);
-				return NULL;
-			}
-			/* Put this message where it belongs */
-			tmp->msgs[mp->chunkId - 1] = msg;
-			/* Check to see if we have received all the chunks */
-			for (i = 0; i < tmp->chunksExpected; i++ ) {
-				if (!tmp->msgs[i]) {
-					/* We aren't complete, return a NULL */
-					twMutex_Unlock(mpStore->mtx);
-					return NULL;
-				}
-			}
-			/* If we are here then we have recevied the entire message */
-			m = twMessage_Create(msg->code, msg->requestId);
-			s = twStream_Create();
-			if (!m || !s) {
-				TW_LOG(TW_ERROR,"twMultipartMessageStore_AddMessage: Error allocating memory for complete message");
-				twList_Remove(mpStore->multipartMessageList, le, TRUE);
-				twMutex_Unlock(mpStore->mtx);
-				return NULL;
-			}
-			m->requestId = msg->requestId;
-			m->type = msg->type;
-			m->endpointId = msg->endpointId;
-			m->sessionId = msg->sessionId;
-			/* Reassemble all the chunks */
-			for (i = 0; i < tmp->chunksExpected; i++ ) {
-				/* Need to add the entity info back in for the first chunk */
-				twMultipartBody * b = (twMultipartBody *)tmp->msgs[i]->body;
-				if (m->type == TW_MULTIPART_REQ && i == 0) {
-					char et = b->entityType;
-					twStream_AddBytes(s, &et, 1);
-					stringToStream(b->entityName, s);
-				}
-				twStream_AddBytes(s, b->data, b->length);
-				/* Delete the chunk here to preserve RAM  */
-				TW_LOG(TW_TRACE,"twMultipartMessageStore_AddMessage: Deleting Multipart Chunk %d", i + 1);
-				twMessage_Delete(tmp->msgs[i]);
-				tmp->msgs[i] = 0;
-			}
-			twStream_Reset(s);
-			if (m->type == TW_MULTIPART_REQ) {
-				m->type = TW_REQUEST;
-				m->body = twRequestBody_CreateFromStream(s);
-			} else if (m->type == TW_MULTIPART_RESP) {
-				m->type = TW_RESPONSE;
-				m->body = twResponseBody_CreateFromStream(s);
-			}
-			twMutex_Unlock(mpStore->mtx);
-			twStream_Delete(s);
-			/* Remove this entry from the message store */
-			twList_Remove(mpStore->multipartMessageList, le, TRUE);
-			return m;
+	/* Put back the header and entity info the chunk was decoded from */
+	header[0] = msg->version;
+	header[1] = (char)msg->code;
+	tmp = msg->requestId;
+	swap4bytes((char *)&tmp);
+	memcpy(&header[2], (char *)&tmp, 4);
+	tmp = msg->endpointId;
+	swap4bytes((char *)&tmp);
+	memcpy(&header[6], (char *)&tmp, 4);
+	tmp = msg->sessionId;
+	swap4bytes((char *)&tmp);
+	memcpy(&header[10], (char *)&tmp, 4);
+	header[14] = TRUE;
+	if (msg->type == TW_MULTIPART_REQ) {
+		char et = (char)mp->entityType;
+		entityInfo = twStream_Create();
+		if (!entityInfo) {
+			TW_LOG(TW_ERROR,"twMultipartMessageStore_AddMessage: Error allocating stream");
+			return NULL;
 		}
-		le = twList_Next(mpStore->multipartMessageList, le);
-	}
-	/* If we are here we didn't find an entry with this request id */
-	twList_Add(mpStore->multipartMessageList, mulitpartMessageStoreEntry_Create(msg));
-	twMutex_Unlock(mpStore->mtx);
-	return NULL;
+		twStream_AddBytes(entityInfo, &et, 1);
+		stringToStream(mp->entityName, entityInfo);
+	}
+	s = addChunk(header, entityInfo ? twStream_GetData(entityInfo) : NULL, entityInfo ? twStream_GetLength(entityInfo) : 0,
+		mp->chunkId, mp->chunkCount, mp->chunkSize, mp->data, mp->length);
+	if (entityInfo) twStream_Delete(entityInfo);
+	if (!s) return NULL;
+	m = twMessage_CreateFromStream(s);
+	twStream_Delete(s);
+	return m;
 }
 
 void twMultipartMessageStore_RemoveStaleMessages() {
-	ListEntry * le = NULL;
-	uint64_t now = twGetSystemMillisecondCount();
 	if (!mpStore) return;
 	twMutex_Lock(mpStore->mtx);
-	le = twList_Next(mpStore->multipartMessageList, NULL);
-	while (le) {
-		mulitpartMessageStoreEntry * tmp = (mulitpartMessageStoreEntry *)le->value;
-		if (twTimeGreaterThan(now, tmp->expirationTime)) {
-			TW_LOG(TW_INFO,"Removing stale message with Request Id %d", tmp->id);
-			twList_Remove(mpStore->multipartMessageList, le, TRUE);
-		}
-		le = twList_Next(mpStore->multipartMessageList, le);
-	}
+	removeStale(twGetSystemMillisecondCount());
 	twMutex_Unlock(mpStore->mtx);
 }
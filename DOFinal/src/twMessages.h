@@ -12,6 +12,7 @@
 #include "twBaseTypes.h"
 #include "twInfoTable.h"
 #include "list.h"
+#include "twArena.h"
 
 #ifndef TW_MESSAGES_H
 #define TW_MESSAGES_H
@@ -20,6 +21,9 @@
 extern "C" {
 #endif
 
+#define MSG_HEADER_SIZE 15
+#define MULTIPART_MSG_HEADER_SIZE 6
+
 /***************************************/
 /*    Entities below this line are     */
 /*    typically not directtly used     */
@@ -39,6 +43,8 @@ typedef struct twMessage {
 	char multipartMarker;
 	uint32_t length;
 	void * body;
+	twArena * arena; /* If set the whole message was allocated from this arena */
+	uint64_t queuedTime; /* When the message handler received it, for the dispatch latency stats */
 } twMessage;
 
 twMessage * twMessage_Create(enum msgCodeEnum code, uint32_t reqId); /* Set Reqid to zero to autogenerate ID */
@@ -67,6 +73,7 @@ typedef struct twRequestBody {
 	char numHeaders;
 	twList * headers;
 	twInfoTable * params;
+	twStream * rawParams; /* Already serialized infotable, used instead of params */
 	uint32_t length;
 } twRequestBody;
 
@@ -74,6 +81,7 @@ twRequestBody * twRequestBody_Create();
 twRequestBody * twRequestBody_CreateFromStream(twStream * s);
 int twRequestBody_Delete(struct twRequestBody * body);
 int twRequestBody_SetParams(struct twRequestBody * body, twInfoTable * params);
+int twRequestBody_SetRawParams(struct twRequestBody * body, twStream * params);
 int twRequestBody_SetEntity(struct twRequestBody * body, enum entityTypeEnum entityType, char * entityName);
 int twRequestBody_SetCharateristic(struct twRequestBody * body, enum characteristicEnum characteristicType, char * characteristicName);
 int twRequestBody_AddHeader(struct twRequestBody * body, char * name, char * value);
@@ -147,27 +155,64 @@ typedef struct twMultipartBody {
 twMultipartBody * twMultipartBody_CreateFromStream(twStream * s, char isRequest);
 void twMultipartBody_Delete(void * body);
 
+/**
+* Partially received multipart message.  Chunks are copied straight into one buffer
+* laid out as the equivalent single part message: header, entity info and body.
+* Chunks that arrive in order are copied to their final place, any that arrive early
+* are parked in their own chunkSize slot and moved down once the gap is filled.
+**/
 typedef struct mulitpartMessageStoreEntry {
 	uint64_t expirationTime;
 	uint32_t id;
 	uint16_t chunksExpected;
 	uint16_t chunksReceived;
-	twMessage ** msgs; /* Array of message pointers */
+	uint16_t chunkSize;
+	uint16_t nextChunk;     /* Lowest chunk ID that isn't in its final place yet */
+	uint32_t headerLength;  /* Header and entity info at the start of data */
+	uint32_t length;        /* Bytes in their final place at the start of data */
+	uint32_t capacity;
+	char * data;
+	uint8_t * received;     /* Bitmap of the chunk IDs received so far */
+	uint16_t * lengths;     /* Lengths of the parked chunks */
 } mulitpartMessageStoreEntry;
 
-mulitpartMessageStoreEntry * mulitpartMessageStoreEntry_Create(twMessage * msg);
 void mulitpartMessageStoreEntry_Delete(void * entry);
 
 /**
 * Multipart message cache - this is a singleton 
 **/
 typedef struct twMultipartMessageStore {
-	twList * multipartMessageList;
+	mulitpartMessageStoreEntry ** slots; /* Open addressed on request ID */
+	uint32_t numSlots;
+	uint32_t count;
 	TW_MUTEX mtx;
 } twMultipartMessageStore;
 
 twMultipartMessageStore * twMultipartMessageStore_Instance();
 void twMultipartMessageStore_Delete(void * store);
+
+/*
+twMultipartMessageStore_AddChunk - Copies one serialized chunk of a multipart message, as it
+was received, into the store.  At most MAX_MULTIPART_MESSAGES messages can be reassembled at
+the same time.
+Parameters:
+	data - the serialized chunk, including the message and multipart headers
+	length - length of the chunk in bytes
+Return:
+	twStream * - the complete message serialized as a single part message once the last chunk
+	has arrived, otherwise NULL.  The caller must delete the stream.
+*/
+twStream * twMultipartMessageStore_AddChunk(const char * data, uint32_t length);
+
+/*
+twMultipartMessageStore_AddMessage - Copies the data of a decoded multipart message chunk into
+the store.
+Parameters:
+	msg - the chunk.  The caller still owns it.
+Return:
+	twMessage * - the complete message once the last chunk has arrived, otherwise NULL.  The
+	caller must delete the message.
+*/
 twMessage * twMultipartMessageStore_AddMessage(twMessage * msg);
 void twMultipartMessageStore_RemoveStaleMessages();
 
@@ -4,6 +4,8 @@
  *  Portable ThingWorx Binary Messaging layer
  */
 
+#define TW_LOG_MODULE TW_MODULE_MESSAGING
+
 #include "twConfig.h"
 #include "twOSPort.h"
 #include "twLogger.h"
@@ -33,6 +35,215 @@ void twResponseCallbackStruct_Delete(void * s) {
 	TW_FREE(x);
 }
 
+/* Pending response table helper functions */
+static uint32_t responseSlot(twResponseTable * t, uint32_t requestId) {
+	/* Request IDs are sequential so a simple fold spreads them evenly */
+	return (requestId ^ (requestId >> 16)) & (t->numSlots - 1);
+}
+
+static void responseHeapSwap(twResponseTable * t, uint32_t a, uint32_t b) {
+	twResponseCallbackStruct * tmp = t->expirationHeap[a];
+	t->expirationHeap[a] = t->expirationHeap[b];
+	t->expirationHeap[b] = tmp;
+	t->expirationHeap[a]->heapIndex = a;
+	t->expirationHeap[b]->heapIndex = b;
+}
+
+static void responseHeapUp(twResponseTable * t, uint32_t i) {
+	while (i > 0) {
+		uint32_t parent = (i - 1) / 2;
+		if (!twTimeLessThan(t->expirationHeap[i]->expirationTime, t->expirationHeap[parent]->expirationTime)) break;
+		responseHeapSwap(t, i, parent);
+		i = parent;
+	}
+}
+
+static void responseHeapDown(twResponseTable * t, uint32_t i) {
+	while (1) {
+		uint32_t smallest = i;
+		uint32_t left = 2 * i + 1;
+		uint32_t right = left + 1;
+		if (left < t->count && twTimeLessThan(t->expirationHeap[left]->expirationTime, t->expirationHeap[smallest]->expirationTime)) smallest = left;
+		if (right < t->count && twTimeLessThan(t->expirationHeap[right]->expirationTime, t->expirationHeap[smallest]->expirationTime)) smallest = right;
+		if (smallest == i) break;
+		responseHeapSwap(t, i, smallest);
+		i = smallest;
+	}
+}
+
+twResponseTable * twResponseTable_Create(uint32_t capacity) {
+	twResponseTable * t = (twResponseTable *)TW_CALLOC(sizeof(twResponseTable), 1);
+	if (!t) return NULL;
+	/* Keep the table at most half full so probe sequences stay short */
+	t->capacity = capacity;
+	t->numSlots = 1;
+	while (t->numSlots < capacity * 2) t->numSlots <<= 1;
+	t->slots = (twResponseCallbackStruct **)TW_CALLOC(sizeof(twResponseCallbackStruct *), t->numSlots);
+	t->expirationHeap = (twResponseCallbackStruct **)TW_CALLOC(sizeof(twResponseCallbackStruct *), capacity);
+	t->mtx = twMutex_Create();
+	if (!t->slots || !t->expirationHeap || !t->mtx) {
+		if (t->slots) TW_FREE(t->slots);
+		if (t->expirationHeap) TW_FREE(t->expirationHeap);
+		if (t->mtx) twMutex_Delete(t->mtx);
+		TW_FREE(t);
+		return NULL;
+	}
+	return t;
+}
+
+void twResponseTable_Delete(twResponseTable * t) {
+	uint32_t i = 0;
+	if (!t) return;
+	for (i = 0; i < t->count; i++) twResponseCallbackStruct_Delete(t->expirationHeap[i]);
+	TW_FREE(t->slots);
+	TW_FREE(t->expirationHeap);
+	twMutex_Delete(t->mtx);
+	TW_FREE(t);
+}
+
+int twResponseTable_Add(twResponseTable * t, twResponseCallbackStruct * s) {
+	uint32_t i = 0;
+	if (!t || !s) return TW_INVALID_PARAM;
+	twMutex_Lock(t->mtx);
+	if (t->count >= t->capacity) {
+		twMutex_Unlock(t->mtx);
+		return TW_RESPONSE_TABLE_FULL;
+	}
+	i = responseSlot(t, s->requestId);
+	while (t->slots[i]) i = (i + 1) & (t->numSlots - 1);
+	t->slots[i] = s;
+	s->heapIndex = t->count;
+	t->expirationHeap[t->count++] = s;
+	responseHeapUp(t, s->heapIndex);
+	twMutex_Unlock(t->mtx);
+	return TW_OK;
+}
+
+/* Must be called with the table mutex held.  If entry is not NULL only that exact entry matches */
+static int32_t responseFindSlot(twResponseTable * t, uint32_t requestId, twResponseCallbackStruct * entry) {
+	uint32_t i = responseSlot(t, requestId);
+	while (t->slots[i]) {
+		if (t->slots[i]->requestId == requestId && (!entry || t->slots[i] == entry)) return i;
+		i = (i + 1) & (t->numSlots - 1);
+	}
+	return -1;
+}
+
+twResponseCallbackStruct * twResponseTable_Get(twResponseTable * t, uint32_t requestId) {
+	int32_t i = 0;
+	twResponseCallbackStruct * s = NULL;
+	if (!t) return NULL;
+	twMutex_Lock(t->mtx);
+	i = responseFindSlot(t, requestId, NULL);
+	if (i >= 0) s = t->slots[i];
+	twMutex_Unlock(t->mtx);
+	return s;
+}
+
+/* Must be called with the table mutex held */
+static twResponseCallbackStruct * responseRemoveSlot(twResponseTable * t, uint32_t i) {
+	uint32_t mask = t->numSlots - 1;
+	uint32_t j = i;
+	twResponseCallbackStruct * s = t->slots[i];
+	/* Backward shift deletion keeps probe sequences intact without tombstones */
+	while (1) {
+		uint32_t home = 0;
+		j = (j + 1) & mask;
+		if (!t->slots[j]) break;
+		home = responseSlot(t, t->slots[j]->requestId);
+		if ((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+	t->slots[i] = NULL;
+	/* Take it out of the expiration heap */
+	i = s->heapIndex;
+	t->count--;
+	if (i != t->count) {
+		responseHeapSwap(t, i, t->count);
+		responseHeapDown(t, i);
+		responseHeapUp(t, i);
+	}
+	t->expirationHeap[t->count] = NULL;
+	return s;
+}
+
+twResponseCallbackStruct * twResponseTable_Remove(twResponseTable * t, uint32_t requestId) {
+	int32_t i = 0;
+	twResponseCallbackStruct * s = NULL;
+	if (!t) return NULL;
+	twMutex_Lock(t->mtx);
+	i = responseFindSlot(t, requestId, NULL);
+	if (i >= 0) s = responseRemoveSlot(t, i);
+	twMutex_Unlock(t->mtx);
+	return s;
+}
+
+twResponseCallbackStruct * twResponseTable_RemoveCompleted(twResponseTable * t, uint32_t requestId, DATETIME now, char * pending) {
+	int32_t i = 0;
+	twResponseCallbackStruct * s = NULL;
+	if (pending) *pending = FALSE;
+	if (!t) return NULL;
+	twMutex_Lock(t->mtx);
+	i = responseFindSlot(t, requestId, NULL);
+	if (i >= 0) {
+		/* Received or timed out entries are done, anything else is still in flight */
+		if (t->slots[i]->received || twTimeGreaterThan(now, t->slots[i]->expirationTime)) s = responseRemoveSlot(t, i);
+		else if (pending) *pending = TRUE;
+	}
+	twMutex_Unlock(t->mtx);
+	return s;
+}
+
+twResponseCallbackStruct * twResponseTable_RemoveReceived(twResponseTable * t, uint32_t requestId) {
+	int32_t i = 0;
+	twResponseCallbackStruct * s = NULL;
+	if (!t) return NULL;
+	twMutex_Lock(t->mtx);
+	i = responseFindSlot(t, requestId, NULL);
+	if (i >= 0 && t->slots[i]->received) s = responseRemoveSlot(t, i);
+	twMutex_Unlock(t->mtx);
+	return s;
+}
+
+twResponseCallbackStruct * twResponseTable_Complete(twResponseTable * t, uint32_t requestId, enum msgCodeEnum code, uint32_t sessionId, twInfoTable ** content, char * found) {
+	int32_t i = 0;
+	twResponseCallbackStruct * s = NULL;
+	if (found) *found = FALSE;
+	if (!t || !content) return NULL;
+	twMutex_Lock(t->mtx);
+	i = responseFindSlot(t, requestId, NULL);
+	if (i >= 0) {
+		if (found) *found = TRUE;
+		if (t->slots[i]->cb) {
+			/* The caller runs the callback so the entry must be out of reach of the cleanup */
+			s = responseRemoveSlot(t, i);
+		} else if (!t->slots[i]->received) {
+			/* Leave it for whoever is waiting on it */
+			t->slots[i]->code = code;
+			t->slots[i]->sessionId = sessionId;
+			t->slots[i]->content = *content;
+			*content = NULL;
+			t->slots[i]->received = TRUE;
+		}
+	}
+	twMutex_Unlock(t->mtx);
+	return s;
+}
+
+twResponseCallbackStruct * twResponseTable_RemoveExpired(twResponseTable * t, DATETIME now) {
+	twResponseCallbackStruct * s = NULL;
+	if (!t) return NULL;
+	twMutex_Lock(t->mtx);
+	if (t->count && twTimeGreaterThan(now, t->expirationHeap[0]->expirationTime)) {
+		s = t->expirationHeap[0];
+		s = responseRemoveSlot(t, responseFindSlot(t, s->requestId, s));
+	}
+	twMutex_Unlock(t->mtx);
+	return s;
+}
+
 /* Send error response helper function */
 void sendErrorResponse(enum msgCodeEnum code, uint32_t id, char * reason) {
 	/* Send an error response */
@@ -49,7 +260,7 @@ void sendErrorResponse(enum msgCodeEnum code, uint32_t id, char * reason) {
 /* Message handler helper function */
 char handleMessage(twMessage * msg) {
 	/* Return a TRUE is we are done with message, FALSE if we want to keep it around */
-	char deleteOnReturn = TRUE;
+	twMessage * complete = NULL;
 	if (msg->multipartMarker) {
 		if (msg->body) {
 			/* Handle Multipart messages */
@@ -60,35 +271,30 @@ char handleMessage(twMessage * msg) {
 				// twMessage_Delete(msg);
 				return TRUE;
 			}
-			deleteOnReturn = FALSE;
-			msg = twMultipartMessageStore_AddMessage(msg);
-			if (!msg) return deleteOnReturn;
+			/* The store copies the chunk so we are done with it either way */
+			complete = twMultipartMessageStore_AddMessage(msg);
+			if (!complete) return TRUE;
+			msg = complete;
 		}
 	} 
 	/* Log this message but make sure we indicate that it was multipart*/
-	if (!deleteOnReturn) msg->multipartMarker = TRUE;
+	if (complete) msg->multipartMarker = TRUE;
 	TW_LOG_MSG(msg, "Recv'd Msg <<<<<<<<<");
-	if (!deleteOnReturn) msg->multipartMarker = FALSE;
+	if (complete) msg->multipartMarker = FALSE;
 	/* Handle the complete message */
 	if (msg->type == TW_REQUEST) {
 		/* See if there is a request handler */
 		twRequestCallbackStruct * cb = 0;
 		TW_LOG(TW_TRACE,"handleMessage: Received Request Message ID: %d", msg->requestId);
-		if (msgHandlerSingleton && msgHandlerSingleton->incomingRequestCallbacks) {
-			ListEntry * le = NULL;
-			twRequestBody * req = NULL;
-			le = twList_Next(msgHandlerSingleton->incomingRequestCallbacks, NULL);
-			req = (twRequestBody *)(msg->body);
-			while (le && !cb) {
-				if (le->value) {
-					twRequestCallbackStruct * tmp = (twRequestCallbackStruct *)(le->value);
-					if ((tmp->entityType == req->entityType) && !strcmp(tmp->entityName, req->entityName) &&
-						(tmp->characteristicType == req->characteristicType) && !strcmp(tmp->characteristicName, req->characteristicName)) {
-							TW_LOG(TW_TRACE,"handleMessage: Callback found for message %d", msg->requestId);
-							tmp->cb(msgHandlerSingleton->ws, msg);
-							break;
-					}
-				}
+		if (msgHandlerSingleton && msgHandlerSingleton->incomingRequestIndex) {
+			twRequestBody * req = (twRequestBody *)(msg->body);
+			if (req && req->entityName && req->characteristicName) {
+				cb = (twRequestCallbackStruct *)twCallbackRegistry_Get(msgHandlerSingleton->incomingRequestIndex, req->entityType, req->entityName,
+					req->characteristicType, req->characteristicName);
+			}
+			if (cb) {
+				TW_LOG(TW_TRACE,"handleMessage: Callback found for message %d", msg->requestId);
+				cb->cb(msgHandlerSingleton->ws, msg);
 			}
 		} 
 		if (!cb) {
@@ -105,35 +311,33 @@ char handleMessage(twMessage * msg) {
 		char FoundCb = FALSE;
 		twResponseBody * b = NULL;
 		TW_LOG(TW_TRACE,"handleMessage: Received Response to Message ID: %d", msg->requestId);
-		if (msgHandlerSingleton->responseCallbackList) {
-			ListEntry * le = twList_Next(msgHandlerSingleton->responseCallbackList, NULL);
-			while (le && !FoundCb) {
-				if (le->value) {
-					twResponseCallbackStruct * tmp = (twResponseCallbackStruct *)(le->value);
-					if (tmp->requestId == msg->requestId) {
-						TW_LOG(TW_TRACE,"handleMessage: Got response for message %d", msg->requestId);
-						FoundCb = TRUE;
-						b = (twResponseBody *)(msg->body);
-						if (b) {
-							tmp->code = msg->code;
-							tmp->content = twInfoTable_ZeroCopy(b->content); /* This content is now owned by tmp */
-							tmp->received = TRUE;
-							tmp->sessionId = msg->sessionId;
-							/* If there is a callback, call it.  Otherwise we expect someone to come pick it up */
-							if (tmp->cb) {
-								tmp->cb(msg->requestId, msg->code, b->reason, tmp->content);
-								/* Remove this from the list */
-								twList_Remove(msgHandlerSingleton->responseCallbackList, le, TRUE);
-							} 
-							TW_LOG(TW_TRACE,"handleMessage: Marked message %d as received", msg->requestId);
-						} else {
-							TW_LOG(TW_ERROR,"handleMessage: NULL response body in message %d", msg->requestId);
-							twList_Remove(msgHandlerSingleton->responseCallbackList, le, TRUE);
-						}
-						break;
-					}
+		if (msgHandlerSingleton->responseTable) {
+			twResponseCallbackStruct * tmp = NULL;
+			b = (twResponseBody *)(msg->body);
+			if (b) {
+				twInfoTable * content = twInfoTable_ZeroCopy(b->content);
+				/* Entries with a callback come back out of the table, anything else is marked as received in place */
+				tmp = twResponseTable_Complete(msgHandlerSingleton->responseTable, msg->requestId, msg->code, msg->sessionId, &content, &FoundCb);
+				if (tmp) {
+					TW_LOG(TW_TRACE,"handleMessage: Got response for message %d", msg->requestId);
+					tmp->code = msg->code;
+					tmp->content = content; /* This content is now owned by tmp */
+					tmp->sessionId = msg->sessionId;
+					tmp->received = TRUE;
+					content = NULL;
+					tmp->cb(msg->requestId, msg->code, b->reason, tmp->content);
+					/* The content was only on loan to the callback */
+					twResponseCallbackStruct_Delete(tmp);
+				} else if (FoundCb) TW_LOG(TW_TRACE,"handleMessage: Marked message %d as received", msg->requestId);
+				/* Nobody took the content */
+				if (content) twInfoTable_Delete(content);
+			} else {
+				tmp = twResponseTable_Remove(msgHandlerSingleton->responseTable, msg->requestId);
+				if (tmp) {
+					FoundCb = TRUE;
+					TW_LOG(TW_ERROR,"handleMessage: NULL response body in message %d", msg->requestId);
+					twResponseCallbackStruct_Delete(tmp);
 				}
-				le = twList_Next(msgHandlerSingleton->responseCallbackList, le);
 			}
 		} 
 		if (!FoundCb) {
@@ -148,30 +352,226 @@ char handleMessage(twMessage * msg) {
 	If this was a multipart message that was reassembled, it isn't in 
 	the message list, so we need to delete it here
 	*/
-	if (!deleteOnReturn) twMessage_Delete(msg);
-	return deleteOnReturn;
+	if (complete) twMessage_Delete(complete);
+	return TRUE;
 }
 
 /* Message handling queue */
 twList * incomingMsgList = NULL;
+/* Emptied batch kept for the next swap */
+static twList * spareMsgList = NULL;
 
-void twMessageHandler_msgHandlerTask(DATETIME now, void * params) {
-	ListEntry * entry = NULL;
-	twMessage * msg = NULL;
+/* Must be called with the handler mutex held.  Records that msg is about to be handled */
+static void countDispatch(twMessageHandler * h, twMessage * msg) {
+	uint64_t now = twGetSystemMillisecondCount();
+	uint32_t latency = (now > msg->queuedTime) ? (uint32_t)(now - msg->queuedTime) : 0;
+	if (h->stats.queueDepth) h->stats.queueDepth--;
+	h->stats.messagesDispatched++;
+	h->stats.lastDispatchLatency = latency;
+	if (latency > h->stats.maxDispatchLatency) h->stats.maxDispatchLatency = latency;
+	h->stats.totalDispatchLatency += latency;
+}
+
+/* Handles a message that has been taken off the queue and frees it.  Never called with the handler mutex held */
+static void dispatchMessage(twMessage * msg) {
 	char deleteMsg = 0;
-	if (incomingMsgList && msgHandlerSingleton) {
-		twMutex_Lock(msgHandlerSingleton->mtx);
-		entry = twList_Next(incomingMsgList, NULL);
-		if (entry && entry->value) {
+#ifdef ENABLE_MSG_ARENA
+	/* Anything that wants to keep part of the message has to copy it out of the arena */
+	twArenaScope scope = twArena_Enter(msg->arena, FALSE);
+	deleteMsg = handleMessage(msg);
+	twArena_Leave(scope);
+#else
+	deleteMsg = handleMessage(msg);
+#endif
+	if (deleteMsg) twMessage_Delete(msg);
+}
+
+#if MSG_HANDLER_LANES > 0 && defined(ENABLE_TASKER)
+#define USE_MSG_LANES
+/* Requests for one entity always go to the same lane so they are handled in order */
+typedef struct msgLane {
+	twMessageHandler * handler;
+	twList * queue;
+	char running;     /* A worker task is draining the queue */
+} msgLane;
+static msgLane msgLanes[MSG_HANDLER_LANES];
+
+/* Runs on a worker thread until its lane is empty */
+static void msgLaneTask(DATETIME now, void * params) {
+	msgLane * lane = (msgLane *)params;
+	twMessageHandler * h = lane->handler;
+	while (1) {
+		twMessage * msg = NULL;
+		ListEntry * entry = NULL;
+		twMutex_Lock(h->mtx);
+		entry = twList_Next(lane->queue, NULL);
+		if (!entry) {
+			lane->running = FALSE;
+			twMutex_Unlock(h->mtx);
+			return;
+		}
+		msg = (twMessage *)entry->value;
+		twList_Remove(lane->queue, entry, FALSE);
+		countDispatch(h, msg);
+		twMutex_Unlock(h->mtx);
+		dispatchMessage(msg);
+	}
+}
+
+/* Hands a request to its entity's lane.  Returns FALSE if the caller should handle the message itself */
+static char queueOnLane(twMessageHandler * h, twMessage * msg) {
+	twRequestBody * req = (twRequestBody *)msg->body;
+	msgLane * lane = NULL;
+	const unsigned char * c = NULL;
+	uint32_t hash = 2166136261u;
+	char startTask = FALSE;
+	if (msg->type != TW_REQUEST || !req || !req->entityName) return FALSE;
+	/* FNV-1a */
+	for (c = (const unsigned char *)req->entityName; *c; c++) {
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	lane = &msgLanes[hash % MSG_HANDLER_LANES];
+	twMutex_Lock(h->mtx);
+	if (!lane->queue) lane->queue = twList_Create(twMessage_Delete);
+	if (!lane->queue || twList_Add(lane->queue, msg)) {
+		twMutex_Unlock(h->mtx);
+		return FALSE;
+	}
+	if (!lane->running) {
+		lane->handler = h;
+		startTask = lane->running = TRUE;
+	}
+	twMutex_Unlock(h->mtx);
+	if (startTask && twTasker_CreateTaskEx(0, 0, msgLaneTask, lane, TW_TASK_ONE_SHOT | TW_TASK_USE_WORKER) < 0) {
+		TW_LOG(TW_WARN,"queueOnLane: Error creating lane task.  Handling the lane here");
+		msgLaneTask(twGetSystemMillisecondCount(), lane);
+	}
+	return TRUE;
+}
+
+/* Drops whatever the lanes haven't handled yet and waits for their tasks to finish */
+static void stopMsgLanes(twMessageHandler * h) {
+	int i = 0;
+	char running = TRUE;
+	if (!h || !h->mtx) return;
+	twMutex_Lock(h->mtx);
+	for (i = 0; i < MSG_HANDLER_LANES; i++) {
+		if (msgLanes[i].queue) twList_Clear(msgLanes[i].queue);
+	}
+	twMutex_Unlock(h->mtx);
+	while (running) {
+		running = FALSE;
+		twMutex_Lock(h->mtx);
+		for (i = 0; i < MSG_HANDLER_LANES; i++) {
+			if (msgLanes[i].running) running = TRUE;
+		}
+		twMutex_Unlock(h->mtx);
+		if (running) twSleepMsec(5);
+	}
+	for (i = 0; i < MSG_HANDLER_LANES; i++) {
+		if (msgLanes[i].queue) twList_Delete(msgLanes[i].queue);
+		msgLanes[i].queue = NULL;
+		msgLanes[i].handler = NULL;
+	}
+}
+#endif
+
+/*
+Takes the queued responses out one at a time and handles them, leaving requests for the
+thread that owns dispatching.  Used when the task is pumped while another thread, or a
+request callback further up this thread's stack, is dispatching.
+*/
+static void completeResponses(twMessageHandler * h) {
+	while (1) {
+		twMessage * msg = NULL;
+		ListEntry * entry = NULL;
+		twMutex_Lock(h->mtx);
+		entry = incomingMsgList ? twList_Next(incomingMsgList, NULL) : NULL;
+		while (entry) {
 			msg = (twMessage *)entry->value;
-			if (msg) {
-				deleteMsg = handleMessage(msg);
-			} else TW_LOG(TW_ERROR,"msgHandlerThread: NULL msg pointer found");
+			if (msg && msg->type == TW_RESPONSE) break;
+			entry = twList_Next(incomingMsgList, entry);
 		}
-		/* Remove this message from the list.  This also frees the message if needed. */
-		twList_Remove(incomingMsgList, entry, deleteMsg);
-		twMutex_Unlock(msgHandlerSingleton->mtx);
+		if (!entry) {
+			twMutex_Unlock(h->mtx);
+			return;
+		}
+		twList_Remove(incomingMsgList, entry, FALSE);
+		countDispatch(h, msg);
+		twMutex_Unlock(h->mtx);
+		dispatchMessage(msg);
+	}
+}
+
+void twMessageHandler_msgHandlerTask(DATETIME now, void * params) {
+	twMessageHandler * h = msgHandlerSingleton;
+	twList * batch = NULL;
+	ListEntry * entry = NULL;
+	if (!h) return;
+	twMutex_Lock(h->mtx);
+	if (h->dispatching) {
+		/* Only one thread handles requests, the rest of us can only pick up responses */
+		twMutex_Unlock(h->mtx);
+		completeResponses(h);
+		return;
+	}
+	if (!incomingMsgList || !incomingMsgList->count) {
+		twMutex_Unlock(h->mtx);
+		return;
+	}
+	/*
+	Swap out everything that is queued and handle it without holding the mutex, so
+	the receive path isn't blocked and callbacks can make blocking requests, which
+	pump this task again to get their responses.
+	*/
+	batch = incomingMsgList;
+	incomingMsgList = spareMsgList ? spareMsgList : twList_Create(twMessage_Delete);
+	spareMsgList = NULL;
+	if (!incomingMsgList) {
+		TW_LOG(TW_ERROR,"msgHandlerThread: Error allocating message queue");
+		incomingMsgList = batch;
+		twMutex_Unlock(h->mtx);
+		return;
+	}
+	h->dispatching = TRUE;
+	twMutex_Unlock(h->mtx);
+	while ((entry = twList_Next(batch, NULL))) {
+		twMessage * msg = (twMessage *)entry->value;
+		/* The batch no longer owns the message */
+		twList_Remove(batch, entry, FALSE);
+		if (!msg) {
+			TW_LOG(TW_ERROR,"msgHandlerThread: NULL msg pointer found");
+			continue;
+		}
+#ifdef USE_MSG_LANES
+		if (queueOnLane(h, msg)) continue;
+#endif
+		twMutex_Lock(h->mtx);
+		countDispatch(h, msg);
+		twMutex_Unlock(h->mtx);
+		dispatchMessage(msg);
+	}
+	twMutex_Lock(h->mtx);
+	h->dispatching = FALSE;
+	if (!spareMsgList) {
+		spareMsgList = batch;
+		batch = NULL;
+	}
+	twMutex_Unlock(h->mtx);
+	if (batch) twList_Delete(batch);
+}
+
+int twMessageHandler_GetStats(twMessageHandler * handler, twMessageHandlerStats * stats) {
+	if (!handler) handler = msgHandlerSingleton;
+	if (!handler || !stats) {
+		TW_LOG(TW_ERROR,"twMessageHandler_GetStats: NULL handler or stats pointer");
+		return TW_NULL_OR_INVALID_MSG_HANDLER;
 	}
+	twMutex_Lock(handler->mtx);
+	*stats = handler->stats;
+	twMutex_Unlock(handler->mtx);
+	return TW_OK;
 }
 
 /* Websocket call back functions */
@@ -203,8 +603,30 @@ int msgHandlerOnBinaryMessage (struct twWs * ws, const char *at, size_t length)
 	twMessage * msg = NULL;
 	twStream * s = NULL;
 	TW_LOG_HEX(at, "msgHandlerOnBinaryMessage: Rcvd Message <<<<\n", length);
-	s = twStream_CreateFromCharArrayZeroCopy(at, length);
+	if (length >= MSG_HEADER_SIZE && at[MSG_HEADER_SIZE - 1]) {
+		/* Multipart chunks are copied straight into the multipart store, only the complete message is decoded */
+		s = twMultipartMessageStore_AddChunk(at, length);
+		if (!s) return 0;
+		at = twStream_GetData(s);
+		length = twStream_GetLength(s);
+	} else s = twStream_CreateFromCharArrayZeroCopy(at, length);
+#ifdef ENABLE_MSG_ARENA
+	{
+		/* Decode the whole message into one arena */
+		twArena * arena = NULL;
+		twArenaScope scope;
+		/* Make sure the logger isn't lazily created inside the arena */
+		twLogger_Instance();
+		arena = twArena_Create(length * MSG_ARENA_SIZE_FACTOR);
+		scope = twArena_Enter(arena, TRUE);
+		msg = twMessage_CreateFromStream(s);
+		twArena_Leave(scope);
+		if (msg) msg->arena = arena;
+		else twArena_Delete(arena);
+	}
+#else
 	msg = twMessage_CreateFromStream(s);
+#endif
 	twStream_Delete(s);
 	/* Create the message from the incoming data */
 	if (!msg) {
@@ -213,14 +635,24 @@ int msgHandlerOnBinaryMessage (struct twWs * ws, const char *at, size_t length)
 		return 1;
 	}
 	TW_LOG(TW_TRACE,"msgHandlerOnBinaryMessage: Received Binary Message ID: %d", msg->requestId);
+	msg->queuedTime = twGetSystemMillisecondCount();
+	twMutex_Lock(msgHandlerSingleton->mtx);
 	if (!incomingMsgList) {
+		twMutex_Unlock(msgHandlerSingleton->mtx);
 		TW_LOG(TW_ERROR, "msgHandlerOnBinaryMessage: NULL incomingMsgList pointer");
 		twMessage_Delete(msg);
 		return 1;
 	}
-	twMutex_Lock(msgHandlerSingleton->mtx);
 	twList_Add(incomingMsgList, msg);
+	msgHandlerSingleton->stats.queueDepth++;
+	if (msgHandlerSingleton->stats.queueDepth > msgHandlerSingleton->stats.maxQueueDepth) {
+		msgHandlerSingleton->stats.maxQueueDepth = msgHandlerSingleton->stats.queueDepth;
+	}
 	twMutex_Unlock(msgHandlerSingleton->mtx);
+#ifdef ENABLE_TASKER
+	/* Get the message handler task to pick it up right away */
+	twTasker_Wake();
+#endif
 	return 0;
 }
 
@@ -251,9 +683,15 @@ twMessageHandler * twMessageHandler_Instance(twWs * ws) {
 		twMessageHandler_Delete(tmp);
 		return NULL;
 	}
-	tmp->responseCallbackList = twList_Create(0);
-	if (!tmp->responseCallbackList) {
-		TW_LOG(TW_ERROR, "twMessageHandler_Instance: Error creating response callback list");
+	tmp->incomingRequestIndex = twCallbackRegistry_Create(0);
+	if (!tmp->incomingRequestIndex) {
+		TW_LOG(TW_ERROR, "twMessageHandler_Instance: Error creating request callback index");
+		twMessageHandler_Delete(tmp);
+		return NULL;
+	}
+	tmp->responseTable = twResponseTable_Create(MAX_PENDING_RESPONSES);
+	if (!tmp->responseTable) {
+		TW_LOG(TW_ERROR, "twMessageHandler_Instance: Error creating response callback table");
 		twMessageHandler_Delete(tmp);
 		return NULL;
 	}
@@ -286,7 +724,7 @@ twMessageHandler * twMessageHandler_Instance(twWs * ws) {
 
 #ifdef ENABLE_TASKER
 	/* Create our task */
-	twTasker_CreateTask(5, &twMessageHandler_msgHandlerTask);
+	twTasker_CreateIoTask(TW_IO_TASK_IDLE_RATE, &twMessageHandler_msgHandlerTask);
 #endif
 
 	msgHandlerSingleton = tmp;
@@ -294,6 +732,10 @@ twMessageHandler * twMessageHandler_Instance(twWs * ws) {
 }
 
 int twMessageHandler_Delete(twMessageHandler * handler) {
+#ifdef USE_MSG_LANES
+	/* Lane tasks use the websocket and the singleton so they have to finish first */
+	stopMsgLanes(handler ? handler : msgHandlerSingleton);
+#endif
 	if (!handler) {
 		handler = msgHandlerSingleton;
 		msgHandlerSingleton = NULL;
@@ -311,10 +753,14 @@ int twMessageHandler_Delete(twMessageHandler * handler) {
 	twMutex_Delete(handler->mtx);
 	/* Delete our lists */
 	twMultipartMessageStore_Delete(0);
+	if (handler->incomingRequestIndex) twCallbackRegistry_Delete(handler->incomingRequestIndex);
 	if (handler->incomingRequestCallbacks) twList_Delete(handler->incomingRequestCallbacks);
-	if (handler->responseCallbackList) twList_Delete(handler->responseCallbackList);
+	if (handler->responseTable) twResponseTable_Delete(handler->responseTable);
 	if (handler->multipartMessageList) twList_Delete(handler->multipartMessageList);
 	if (incomingMsgList) twList_Delete(incomingMsgList);
+	incomingMsgList = NULL;
+	if (spareMsgList) twList_Delete(spareMsgList);
+	spareMsgList = NULL;
 	/* Free up ourself */
 	TW_FREE(handler);
 	handler = NULL;
@@ -324,23 +770,17 @@ int twMessageHandler_Delete(twMessageHandler * handler) {
 
 int twMessageHandler_CleanupOldMessages(twMessageHandler * handler) {
 	twResponseCallbackStruct * r = NULL;
-	ListEntry * le = NULL;
 	uint64_t now = twGetSystemMillisecondCount();
 	if (!handler) handler = msgHandlerSingleton;
-	if (handler && handler->responseCallbackList) {
-		le = twList_Next(handler->responseCallbackList, NULL);
-		while (le) {
-			r = (twResponseCallbackStruct *)le->value;
-			if (twTimeGreaterThan(now, r->expirationTime)) {
-				TW_LOG(TW_INFO,"twMessageHandler_CleanupOldMessages: Message %d timed out", r->requestId);
-				/************
-				if (r->cb) {
-					r->cb(r->requestId, GATEWAY_TIMEOUT, "Message timed out", TW_NOTHING, NULL);
-				} 
-				*************/
-				twList_Remove(handler->responseCallbackList,le, TRUE);
-			}
-			le = twList_Next(handler->responseCallbackList, le);
+	if (handler && handler->responseTable) {
+		/* Entries come out in expiration order so we stop at the first one still live */
+		while ((r = twResponseTable_RemoveExpired(handler->responseTable, now)) != NULL) {
+			TW_LOG(TW_INFO,"twMessageHandler_CleanupOldMessages: Message %d timed out", r->requestId);
+			/* Let asynchronous requesters know they won't be getting an answer */
+			if (r->cb && !r->received) {
+				r->cb(r->requestId, TWX_GATEWAY_TIMEOUT, "Message timed out", NULL);
+			} 
+			twResponseCallbackStruct_Delete(r);
 		}
 	} else return TW_NULL_OR_INVALID_MSG_HANDLER;
 	return TW_OK;
@@ -388,11 +828,16 @@ int twMessageHandler_RegisterRequestCallback(twMessageHandler * handler, message
 	s->characteristicType = characteristicType;
 	s->characteristicName = duplicateString(characteristicName);
 	s->cb = cb;
-	if (!s->entityName || s->characteristicName) {
+	if (!s->entityName || !s->characteristicName) {
 		TW_LOG(TW_ERROR,"twMessageHandler_RegisterRequestCallback: Error duplicating entityName or characteristicName");
 		twRequestCallbackStruct_Delete(s);
 		return TW_INVALID_CALLBACK_STRUCT;
 	}
+	if (twCallbackRegistry_Add(handler->incomingRequestIndex, entityType, s->entityName, characteristicType, s->characteristicName, s)) {
+		TW_LOG(TW_ERROR,"twMessageHandler_RegisterRequestCallback: Error indexing RequestCallback structure");
+		twRequestCallbackStruct_Delete(s);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
 	twList_Add(handler->incomingRequestCallbacks, s);
 	return TW_OK;
 }
@@ -409,7 +854,11 @@ int twMessageHandler_RegisterResponseCallback(twMessageHandler * handler, respon
 	s->cb = cb;
 	s->requestId = requestId;
 	s->expirationTime = expirationTime;
-	twList_Add(handler->responseCallbackList, s);
+	if (twResponseTable_Add(handler->responseTable, s)) {
+		TW_LOG(TW_ERROR,"twMessageHandler_RegisterResponseCallback: Too many requests waiting for a response.  Dropping Id: %d", requestId);
+		TW_FREE(s);
+		return TW_RESPONSE_TABLE_FULL;
+	}
 	return TW_OK;
 }
 
@@ -428,29 +877,17 @@ int twMessageHandler_RegisterPongCallback(twMessageHandler * handler, eventcb cb
 }
 
 twResponseCallbackStruct * twMessageHandler_GetCompletedResponseStruct(twMessageHandler * handler, uint32_t id) {
-	ListEntry * le = NULL;
+	twResponseCallbackStruct * tmp = NULL;
 	if (!handler) handler = msgHandlerSingleton;
 	/* Find the entry but only return it if it has been marked as completed */
 	if (!handler || !id) {
 		TW_LOG(TW_WARN, "twMessageHandler_GetCompletedResponseStruct: NULL Id or MessageHandler");
 		return NULL;
 	}
-	le = twList_Next(handler->responseCallbackList, NULL);
-	while (le) {
-		if (le->value) {
-			twResponseCallbackStruct * tmp = (twResponseCallbackStruct *)(le->value);
-			if (tmp->requestId != id) {
-				le = twList_Next(handler->responseCallbackList, le);
-				continue;
-			}
-			/* Return the callback */
-			if (tmp->received) {
-				TW_LOG(TW_TRACE, "twMessageHandler_GetCompletedResponseStruct: Found Message ID: %d", tmp->requestId);
-				return tmp;
-			} else return NULL;
-		}
-	}
-	return NULL;
+	/* Take it out of the table so the cleanup can't delete it from under the caller */
+	tmp = twResponseTable_RemoveReceived(handler->responseTable, id);
+	if (tmp) TW_LOG(TW_TRACE, "twMessageHandler_GetCompletedResponseStruct: Found Message ID: %d", tmp->requestId);
+	return tmp;
 }
 
 int twMessageHandler_UnegisterRequestCallback(twMessageHandler * handler, enum entityTypeEnum entityType, char * entityName, enum characteristicEnum characteristicType, char * characteristicName) {
@@ -464,36 +901,31 @@ int twMessageHandler_UnegisterRequestCallback(twMessageHandler * handler, enum e
 	while (le) {
 		if (le->value) {
 			twRequestCallbackStruct * tmp = (twRequestCallbackStruct *)(le->value);
-			if (tmp->entityType != entityType || strcmp(entityName, tmp->entityName) || tmp->characteristicType != characteristicType || strcmp(characteristicName, tmp->characteristicName)) {
-				le = twList_Next(handler->incomingRequestCallbacks, le);
-				continue;
+			if (tmp->entityType == entityType && !strcmp(entityName, tmp->entityName) && tmp->characteristicType == characteristicType && !strcmp(characteristicName, tmp->characteristicName)) {
+				/* Delete the entry */
+				twCallbackRegistry_Remove(handler->incomingRequestIndex, entityType, entityName, characteristicType, characteristicName, tmp);
+				twList_Remove(handler->incomingRequestCallbacks, le, TRUE);
+				return TW_OK;
 			}
-			/* Delete the entry */
-			twList_Remove(handler->incomingRequestCallbacks, le, TRUE);
-			return TW_OK;
 		}
+		le = twList_Next(handler->incomingRequestCallbacks, le);
 	}
 	return TW_ERROR_CALLBACK_NOT_FOUND;
 }
 
 int twMessageHandler_UnegisterResponseCallback(twMessageHandler * handler, uint32_t requestId) {
-	ListEntry * le = NULL;
+	twResponseCallbackStruct * tmp = NULL;
 	if (!handler) handler = msgHandlerSingleton;
 	/* Find the entry but only return it if it has been marked as completed */
 	if (!handler || !requestId) {
 		TW_LOG(TW_WARN, "twMessageHandler_UnegisterResponseCallback: NULL Id or MessageHandler");
 		return TW_INVALID_PARAM;
 	}
-	le = twList_Next(handler->responseCallbackList, NULL);
-	while (le) {
-		if (le->value) {
-			twResponseCallbackStruct * tmp = (twResponseCallbackStruct *)(le->value);
-			if (tmp->requestId == requestId) {
-				twList_Remove(handler->responseCallbackList, le, TRUE);
-				break;
-			}
-			le = twList_Next(handler->responseCallbackList, le);
-		}
+	tmp = twResponseTable_Remove(handler->responseTable, requestId);
+	if (tmp) {
+		/* Any content has been handed off to whoever picked up the response */
+		TW_FREE(tmp);
+		return TW_OK;
 	}
 	return TW_ERROR_CALLBACK_NOT_FOUND;
 }
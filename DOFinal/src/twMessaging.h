@@ -7,6 +7,7 @@
 #include "twMessages.h"
 #include "twWebsocket.h"
 #include "list.h"
+#include "twCallbackRegistry.h"
 
 #ifndef TW_MESSAGING_H
 #define TW_MESSAGING_H
@@ -45,19 +46,54 @@ typedef struct twResponseCallbackStruct {
 	uint64_t expirationTime;
 	enum msgCodeEnum code;
 	twInfoTable * content;
+	uint32_t heapIndex;
 } twResponseCallbackStruct;
 
+/* Open addressed table of pending responses keyed by request ID */
+typedef struct twResponseTable {
+	uint32_t capacity;
+	uint32_t numSlots;
+	uint32_t count;
+	twResponseCallbackStruct ** slots;
+	twResponseCallbackStruct ** expirationHeap;
+	TW_MUTEX mtx;
+} twResponseTable;
+
+twResponseTable * twResponseTable_Create(uint32_t capacity);
+void twResponseTable_Delete(twResponseTable * t);
+int twResponseTable_Add(twResponseTable * t, twResponseCallbackStruct * s);
+twResponseCallbackStruct * twResponseTable_Get(twResponseTable * t, uint32_t requestId);
+twResponseCallbackStruct * twResponseTable_Remove(twResponseTable * t, uint32_t requestId);
+twResponseCallbackStruct * twResponseTable_RemoveCompleted(twResponseTable * t, uint32_t requestId, DATETIME now, char * pending);
+twResponseCallbackStruct * twResponseTable_RemoveReceived(twResponseTable * t, uint32_t requestId);
+twResponseCallbackStruct * twResponseTable_Complete(twResponseTable * t, uint32_t requestId, enum msgCodeEnum code, uint32_t sessionId, twInfoTable ** content, char * found);
+twResponseCallbackStruct * twResponseTable_RemoveExpired(twResponseTable * t, DATETIME now);
+void twResponseCallbackStruct_Delete(void * s);
+
+/* Incoming message metrics, see twMessageHandler_GetStats */
+typedef struct twMessageHandlerStats {
+	uint32_t queueDepth;          /* Messages received but not dispatched yet */
+	uint32_t maxQueueDepth;
+	uint32_t messagesDispatched;
+	uint32_t lastDispatchLatency; /* Msec from receiving a message to dispatching it */
+	uint32_t maxDispatchLatency;
+	uint64_t totalDispatchLatency;
+} twMessageHandlerStats;
+
 /* Central message handler - this is a singleton */
 typedef struct twMessageHandler {
 	twWs * ws;
-	twList * responseCallbackList;
+	twResponseTable * responseTable;
 	twList * incomingRequestCallbacks;
+	twCallbackRegistry * incomingRequestIndex;
 	twList * multipartMessageList;
 	message_cb defaultRequestCallback;
 	eventcb on_ws_connected;
 	eventcb on_ws_close;
 	eventcb on_ping;
 	eventcb on_pong;
+	twMessageHandlerStats stats;
+	char dispatching;  /* A thread is handling requests, other pumps only handle responses */
 	TW_MUTEX mtx;
 } twMessageHandler;
 
@@ -66,6 +102,18 @@ int twMessageHandler_Delete(twMessageHandler * handler);
 int twMessageHandler_CleanupOldMessages(twMessageHandler * handler);
 void twMessageHandler_msgHandlerTask(DATETIME now, void * params);
 
+/*
+twMessageHandler_GetStats - Gets the incoming queue depth and dispatch latency.  Averaging
+totalDispatchLatency over messagesDispatched and watching maxQueueDepth shows whether the
+handler keeps up with the websocket.
+Parameters:
+	handler - the message handler, NULL for the singleton
+	stats - filled in with a copy of the current stats
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twMessageHandler_GetStats(twMessageHandler * handler, twMessageHandlerStats * stats);
+
 int twMessageHandler_RegisterConnectCallback(twMessageHandler * handler, eventcb cb);
 int twMessageHandler_RegisterCloseCallback(twMessageHandler * handler, eventcb cb);
 int twMessageHandler_RegisterPingCallback(twMessageHandler * handler, eventcb cb);
@@ -74,6 +122,7 @@ int twMessageHandler_RegisterDefaultRequestCallback(twMessageHandler * handler,
 int twMessageHandler_RegisterRequestCallback(twMessageHandler * handler, message_cb cb, enum entityTypeEnum entityType, char * entityName, enum characteristicEnum characteristicType, char * characteristicName);
 int twMessageHandler_RegisterResponseCallback(twMessageHandler * handler, response_cb cb, uint32_t requestId, DATETIME expirationTime); 
 
+/* Takes a received response out of the table.  The caller deletes it with twResponseCallbackStruct_Delete */
 twResponseCallbackStruct * twMessageHandler_GetCompletedResponseStruct(twMessageHandler * handler, uint32_t id);
 int twMessageHandler_UnegisterRequestCallback(twMessageHandler * handler, enum entityTypeEnum entityType, char * entityName, enum characteristicEnum characteristicType, char * characteristicName);
 int twMessageHandler_UnegisterResponseCallback(twMessageHandler * handler, uint32_t requestId); 
@@ -29,6 +29,7 @@ void * mallocByte();
 #define TW_SSL_FREE(a)					returnZero()
 #define TW_SSL_CTX_FREE(a)				returnZero()
 #define TW_SSL_WRITE(a,b,c)				twSocket_Write(a, b, c, 0)
+#define TW_SSL_WRITEV(a,b,c)			twSocket_WriteV(a, b, c, 0)
 #define TW_USE_CERT_FILE(a,b,c)			returnZero()
 #define TW_USE_KEY_FILE(a,b,c,d)		returnZero()
 #define TW_USE_CERT_CHAIN_FILE(a,b,c)	returnZero()
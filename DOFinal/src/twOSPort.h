@@ -30,8 +30,22 @@ enum LogLevel {
 	TW_FORCE,
 	TW_AUDIT
 };
+/* Parts of the SDK that can be given their own log level, see TW_LOG_MODULE */
+enum twLogModule {
+	TW_MODULE_SDK,
+	TW_MODULE_API,
+	TW_MODULE_MESSAGING,
+	TW_MODULE_WEBSOCKET,
+	TW_MODULE_FILE_XFER,
+	TW_MODULE_APP,
+	TW_NUM_LOG_MODULES
+};
+extern char twLogLevels[TW_NUM_LOG_MODULES]; /* Implemented in utils/logger.c */
 extern char * levelString(enum LogLevel level); /* Implemented in utils/logger.c */
 void LOGGING_FUNCTION( enum LogLevel level, const char * timestamp, const char * message );
+int twLogger_StartWriter();
+void twLogger_StopWriter();
+void twLogger_WakeWriter();
 
 /* Time Functions */
 /* Time is represented as a 64 bit value represenitng milliseconds since the epoch */
@@ -67,6 +81,15 @@ typedef struct twSocket {
 	char * proxyPass;
 } twSocket;
 
+/* One piece of a gathered write */
+typedef struct twIoVec {
+	char * buf;
+	int len;
+} twIoVec;
+
+/* Maximum number of pieces in a single gathered write */
+#define TW_MAX_IO_VECS 32
+
 /* MSG_NOSIGNAL is not defined on some implementations */
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
@@ -79,6 +102,7 @@ int twSocket_Close(twSocket * s);
 int twSocket_WaitFor(twSocket * s, int timeout);
 int twSocket_Read(twSocket * s, char * buf, int len, int timeout);
 int twSocket_Write(twSocket * s, char * buf, int len, int timeout);
+int twSocket_WriteV(twSocket * s, twIoVec * vec, int count, int timeout);
 int twSocket_Delete(twSocket * s);
 int twSocket_GetLastError();
 int twSocket_SetProxyInfo(twSocket * s,char * proxyHost, uint16_t proxyPort, char * proxyUser, char * proxyPass);
@@ -86,6 +110,9 @@ int twSocket_SetProxyInfo(twSocket * s,char * proxyHost, uint16_t proxyPort, cha
 /* Thread/Task Functions */
 void twTasker_Start();
 void twTasker_Stop();
+void twTasker_Wake();
+void twTasker_WatchSocket(twSocket * s);
+char twTasker_SignalWorker();
 
 /* File Transfer */
 int twDirectory_GetFileInfo(char * filename, uint64_t * size, DATETIME * lastModified, char * isDirectory, char * isReadOnly);
@@ -97,7 +124,19 @@ int twDirectory_CreateDirectory(char * name);
 int twDirectory_DeleteDirectory(char * name);
 TW_DIR twDirectory_IterateEntries(char * dirName, TW_DIR dir, char ** name, uint64_t * size,
 											   DATETIME * lastModified, char * isDirectory, char * isReadOnly);
+/*
+Returns the next entry in a directory that is of the given type (LIST_ALL, LIST_FILES or
+LIST_DIRS) and, for files, matches nameMask (NULL matches everything).  "." and ".." are
+skipped.  Entries are filtered before they are stat'ed, and size, lastModified and
+isReadOnly may be NULL to skip the stat altogether.  Pass a NULL dir on the first call.
+Returns NULL at the end of the directory.  Call twDirectory_EndIteration to stop early.
+*/
+TW_DIR twDirectory_IterateMatches(char * dirName, TW_DIR dir, const char * nameMask, char type, char ** name, uint64_t * size,
+								  DATETIME * lastModified, char * isDirectory, char * isReadOnly);
+void twDirectory_EndIteration(TW_DIR dir);
 int twDirectory_GetLastError();
+char * twDirectory_MapFile(char * name, uint64_t * size);
+void twDirectory_UnmapFile(char * addr, uint64_t size);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,180 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Memory resident offline message queue
+ */
+
+#define TW_LOG_MODULE TW_MODULE_MESSAGING
+
+#include "twOfflineMsgQueue.h"
+#include "twWebsocket.h"
+#include "twLogger.h"
+#include "twDefaultSettings.h"
+#include "twErrors.h"
+
+#include <string.h>
+
+#define RECORD_LENGTH_SIZE sizeof(uint32_t)
+/* Records start on 4 byte boundaries so the lengths can be read directly */
+#define RECORD_ROUND(x) (((x) + 3) & ~((uint32_t)3))
+#define RECORD_SIZE(len) (RECORD_LENGTH_SIZE + RECORD_ROUND(len))
+/* Marks the rest of the buffer as unused, the next record is at the beginning */
+#define WRAP_MARKER 0xFFFFFFFF
+/* Offset of the session ID in a serialized message header */
+#define SESSION_ID_OFFSET 10
+
+/* Must be called with the queue mutex held.  Returns the offset of the oldest record */
+static uint32_t firstRecord(twOfflineMsgQueue * q) {
+	if (q->capacity - q->head < RECORD_LENGTH_SIZE || *(uint32_t *)(q->buffer + q->head) == WRAP_MARKER) {
+		/* The rest of the buffer was skipped */
+		q->used -= q->capacity - q->head;
+		q->head = 0;
+	}
+	return q->head;
+}
+
+/* Must be called with the queue mutex held */
+static void removeOldest(twOfflineMsgQueue * q) {
+	uint32_t length = 0;
+	if (!q->count) return;
+	length = *(uint32_t *)(q->buffer + firstRecord(q));
+	q->head += RECORD_SIZE(length);
+	q->used -= RECORD_SIZE(length);
+	q->count--;
+	if (!q->count) {
+		q->head = q->tail = q->used = 0;
+	}
+}
+
+/* Must be called with the queue mutex held.  Returns the offset to write at or -1 if there is no room */
+static int64_t reserve(twOfflineMsgQueue * q, uint32_t size) {
+	if (!q->count) q->head = q->tail = q->used = 0;
+	if (q->tail >= q->head && (q->count == 0 || q->tail != q->head)) {
+		uint32_t atEnd = q->capacity - q->tail;
+		if (size <= atEnd) return q->tail;
+		if (size <= q->head) {
+			/* Skip the rest of the buffer and start over at the beginning */
+			if (atEnd >= RECORD_LENGTH_SIZE) *(uint32_t *)(q->buffer + q->tail) = WRAP_MARKER;
+			q->used += atEnd;
+			q->tail = 0;
+			return 0;
+		}
+		return -1;
+	}
+	if (size <= q->head - q->tail) return q->tail;
+	return -1;
+}
+
+twOfflineMsgQueue * twOfflineMsgQueue_Create(uint32_t capacity, char dropOldest) {
+	twOfflineMsgQueue * q = (twOfflineMsgQueue *)TW_CALLOC(sizeof(twOfflineMsgQueue), 1);
+	if (!q) {
+		TW_LOG(TW_ERROR,"twOfflineMsgQueue_Create: Error allocating queue");
+		return NULL;
+	}
+	q->capacity = RECORD_ROUND(capacity);
+	q->dropOldest = dropOldest;
+	q->buffer = (char *)TW_MALLOC(q->capacity);
+	q->mtx = twMutex_Create();
+	if (!q->buffer || !q->mtx) {
+		TW_LOG(TW_ERROR,"twOfflineMsgQueue_Create: Error allocating %u byte buffer or mutex", q->capacity);
+		twOfflineMsgQueue_Delete(q);
+		return NULL;
+	}
+	return q;
+}
+
+void twOfflineMsgQueue_Delete(twOfflineMsgQueue * q) {
+	if (!q) return;
+	if (q->buffer) TW_FREE(q->buffer);
+	if (q->mtx) twMutex_Delete(q->mtx);
+	TW_FREE(q);
+}
+
+int twOfflineMsgQueue_Write(twOfflineMsgQueue * q, twStream * s) {
+	uint32_t length = 0;
+	int64_t offset = -1;
+	if (!q || !s) {
+		TW_LOG(TW_ERROR,"twOfflineMsgQueue_Write: NULL queue or stream");
+		return TW_INVALID_PARAM;
+	}
+	length = twStream_GetLength(s);
+	if (RECORD_SIZE(length) > q->capacity) {
+		TW_LOG(TW_WARN,"twOfflineMsgQueue_Write: Message of %u bytes is larger than the queue", length);
+		return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
+	}
+	twMutex_Lock(q->mtx);
+	offset = reserve(q, RECORD_SIZE(length));
+	/* Records that are being flushed can't be discarded */
+	while (offset < 0 && q->dropOldest && !q->draining && q->count) {
+		TW_LOG(TW_DEBUG,"twOfflineMsgQueue_Write: Queue full.  Discarding oldest message");
+		removeOldest(q);
+		offset = reserve(q, RECORD_SIZE(length));
+	}
+	if (offset < 0) {
+		twMutex_Unlock(q->mtx);
+		TW_LOG(TW_WARN,"twOfflineMsgQueue_Write: Queue full.  Discarding message");
+		return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
+	}
+	*(uint32_t *)(q->buffer + offset) = length;
+	memcpy(q->buffer + offset + RECORD_LENGTH_SIZE, twStream_GetData(s), length);
+	q->tail = (uint32_t)offset + RECORD_SIZE(length);
+	if (q->tail == q->capacity) q->tail = 0;
+	q->used += RECORD_SIZE(length);
+	q->count++;
+	twMutex_Unlock(q->mtx);
+	return TW_OK;
+}
+
+int twOfflineMsgQueue_Flush(twOfflineMsgQueue * q, struct twWs * ws) {
+	twIoVec msgs[OFFLINE_MSG_DRAIN_BATCH];
+	uint32_t session = 0;
+	int res = TW_OK;
+	if (!q || !ws) {
+		TW_LOG(TW_ERROR,"twOfflineMsgQueue_Flush: NULL queue or websocket");
+		return TW_INVALID_PARAM;
+	}
+	/* We are going to have to insert the current session ID into each message */
+	session = ws->sessionId;
+	swap4bytes((char *)&session);
+	twMutex_Lock(q->mtx);
+	if (q->draining) {
+		twMutex_Unlock(q->mtx);
+		return TW_OK;
+	}
+	q->draining = TRUE;
+	while (q->count && !res) {
+		int numMsgs = 0;
+		int sent = 0;
+		uint32_t offset = firstRecord(q);
+		uint32_t remaining = q->count;
+		/* Collect a batch.  Nothing in it can move or be discarded while we are draining */
+		while (remaining && numMsgs < OFFLINE_MSG_DRAIN_BATCH) {
+			uint32_t length = 0;
+			if (q->capacity - offset < RECORD_LENGTH_SIZE || *(uint32_t *)(q->buffer + offset) == WRAP_MARKER) offset = 0;
+			length = *(uint32_t *)(q->buffer + offset);
+			msgs[numMsgs].buf = q->buffer + offset + RECORD_LENGTH_SIZE;
+			msgs[numMsgs].len = length;
+			if (length >= SESSION_ID_OFFSET + sizeof(session)) memcpy(msgs[numMsgs].buf + SESSION_ID_OFFSET, &session, sizeof(session));
+			numMsgs++;
+			remaining--;
+			offset += RECORD_SIZE(length);
+			if (offset == q->capacity) offset = 0;
+		}
+		twMutex_Unlock(q->mtx);
+		res = twWs_SendMessageBatch(ws, msgs, numMsgs, 0, &sent);
+		twMutex_Lock(q->mtx);
+		while (sent--) removeOldest(q);
+	}
+	q->draining = FALSE;
+	twMutex_Unlock(q->mtx);
+	return res;
+}
+
+uint32_t twOfflineMsgQueue_GetSize(twOfflineMsgQueue * q) {
+	uint32_t size = 0;
+	if (!q) return 0;
+	twMutex_Lock(q->mtx);
+	size = q->used;
+	twMutex_Unlock(q->mtx);
+	return size;
+}
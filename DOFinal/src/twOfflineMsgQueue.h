@@ -0,0 +1,100 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Memory resident offline message queue
+ */
+
+#ifndef TW_OFFLINE_MSG_QUEUE_H
+#define TW_OFFLINE_MSG_QUEUE_H
+
+#include "twOSPort.h"
+#include "twBaseTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct twWs;
+
+/***************************************/
+/*  Memory Resident Offline Msg Queue  */
+/* Serialized messages are copied into */
+/* one fixed size ring buffer as       */
+/* <length><message> records.  Records */
+/* never wrap, if one doesn't fit at   */
+/* the end of the buffer it starts     */
+/* over at the beginning.  When the    */
+/* queue is full either the new        */
+/* message or the oldest messages are  */
+/* discarded.                          */
+/***************************************/
+
+typedef struct twOfflineMsgQueue {
+	char * buffer;
+	uint32_t capacity;
+	uint32_t head;        /* Offset of the oldest record */
+	uint32_t tail;        /* Offset the next record is written at */
+	uint32_t used;        /* Bytes in use, including record lengths and unused space skipped at the end */
+	uint32_t count;       /* Number of queued messages */
+	char dropOldest;
+	char draining;        /* Records being sent by twOfflineMsgQueue_Flush are never discarded */
+	TW_MUTEX mtx;
+} twOfflineMsgQueue;
+
+/*
+twOfflineMsgQueue_Create - Creates an empty queue.
+Parameters:
+	capacity - size of the ring buffer in bytes
+	dropOldest - (boolean) if TRUE the oldest messages are discarded to make room for new ones
+	when the queue is full, otherwise new messages are rejected
+Return:
+	twOfflineMsgQueue * - pointer to the queue or NULL if an error occurred
+*/
+twOfflineMsgQueue * twOfflineMsgQueue_Create(uint32_t capacity, char dropOldest);
+
+/*
+twOfflineMsgQueue_Delete - Deletes a queue and any messages still in it.
+Parameters:
+	q - pointer to the queue
+Return:
+	Nothing
+*/
+void twOfflineMsgQueue_Delete(twOfflineMsgQueue * q);
+
+/*
+twOfflineMsgQueue_Write - Copies a serialized message into the queue.
+Parameters:
+	q - pointer to the queue
+	s - stream containing the complete message.  The caller still owns the stream.
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twOfflineMsgQueue_Write(twOfflineMsgQueue * q, twStream * s);
+
+/*
+twOfflineMsgQueue_Flush - Sends all queued messages over the websocket with the websocket's
+current session ID.  Messages are sent in batches of up to OFFLINE_MSG_DRAIN_BATCH using
+twWs_SendMessageBatch and the queue is only locked between batches.  If another thread is
+already flushing the queue this returns immediately.
+Parameters:
+	q - pointer to the queue
+	ws - the websocket to send the messages on
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twOfflineMsgQueue_Flush(twOfflineMsgQueue * q, struct twWs * ws);
+
+/*
+twOfflineMsgQueue_GetSize - Gets the number of bytes in use in the queue.
+Parameters:
+	q - pointer to the queue
+Return:
+	uint32_t - bytes in use
+*/
+uint32_t twOfflineMsgQueue_GetSize(twOfflineMsgQueue * q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
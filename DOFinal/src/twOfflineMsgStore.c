@@ -0,0 +1,339 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Persisted offline message store
+ */
+
+#define TW_LOG_MODULE TW_MODULE_MESSAGING
+
+#include "twOfflineMsgStore.h"
+#include "twWebsocket.h"
+#include "twLogger.h"
+#include "twDefaultSettings.h"
+#include "stringUtils.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define INDEX_MAGIC 0x54574F4D /* "TWOM" */
+#define INDEX_VERSION 1
+#define RECORD_LENGTH_SIZE sizeof(uint32_t)
+/* Offset of the session ID in a serialized message header */
+#define SESSION_ID_OFFSET 10
+
+typedef struct storeIndex {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t firstSegment;
+	uint32_t readOffset;
+	uint32_t lastSegment;
+} storeIndex;
+
+/* Caller must free the returned names */
+static char * getIndexName(twOfflineMsgStore * store, const char * suffix) {
+	char * name = (char *)TW_CALLOC(strlen(store->dir) + strlen("/offline_msgs.") + strlen(suffix) + 1, 1);
+	if (!name) return NULL;
+	sprintf(name, "%s/offline_msgs.%s", store->dir, suffix);
+	return name;
+}
+
+static char * getSegmentName(twOfflineMsgStore * store, uint32_t segment) {
+	char * name = (char *)TW_CALLOC(strlen(store->dir) + strlen("/offline_msgs..seg") + 11, 1);
+	if (!name) return NULL;
+	sprintf(name, "%s/offline_msgs.%u.seg", store->dir, segment);
+	return name;
+}
+
+static char readIndex(twOfflineMsgStore * store, const char * suffix) {
+	storeIndex idx;
+	TW_FILE_HANDLE f = 0;
+	char * name = getIndexName(store, suffix);
+	if (!name) return FALSE;
+	f = TW_FOPEN(name, "rb");
+	TW_FREE(name);
+	if (!f) return FALSE;
+	if (TW_FREAD(&idx, 1, sizeof(idx), f) != sizeof(idx) || idx.magic != INDEX_MAGIC || idx.version != INDEX_VERSION ||
+		idx.lastSegment < idx.firstSegment) {
+		TW_FCLOSE(f);
+		return FALSE;
+	}
+	TW_FCLOSE(f);
+	store->firstSegment = idx.firstSegment;
+	store->readOffset = idx.readOffset;
+	store->lastSegment = idx.lastSegment;
+	return TRUE;
+}
+
+/* Must be called with the store mutex held */
+static int writeIndex(twOfflineMsgStore * store) {
+	storeIndex idx;
+	TW_FILE_HANDLE f = 0;
+	char * tmpName = getIndexName(store, "idx.tmp");
+	char * name = getIndexName(store, "idx");
+	int res = TW_OK;
+	if (!tmpName || !name) {
+		if (tmpName) TW_FREE(tmpName);
+		if (name) TW_FREE(name);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	idx.magic = INDEX_MAGIC;
+	idx.version = INDEX_VERSION;
+	idx.firstSegment = store->firstSegment;
+	idx.readOffset = store->readOffset;
+	idx.lastSegment = store->lastSegment;
+	/* Write a new copy and move it over the old one.  Create falls back to the copy if we die in between */
+	f = TW_FOPEN(tmpName, "wb");
+	if (!f || TW_FWRITE(&idx, 1, sizeof(idx), f) != sizeof(idx) || TW_FFLUSH(f) || TW_FSYNC(f)) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore: Error writing index file %s", tmpName);
+		res = TW_ERROR_WRITING_OFFLINE_MSG_STORE;
+	}
+	if (f) TW_FCLOSE(f);
+	if (!res) twDirectory_MoveFile(tmpName, name);
+	TW_FREE(tmpName);
+	TW_FREE(name);
+	return res;
+}
+
+static uint64_t getSegmentSize(twOfflineMsgStore * store, uint32_t segment) {
+	uint64_t size = 0;
+	DATETIME lastModified;
+	char isDir;
+	char isReadOnly;
+	char * name = getSegmentName(store, segment);
+	if (!name) return 0;
+	if (twDirectory_GetFileInfo(name, &size, &lastModified, &isDir, &isReadOnly)) size = 0;
+	TW_FREE(name);
+	return size;
+}
+
+/* Must be called with the store mutex held.  Makes sure a finished segment is on disk before the index moves past it */
+static void syncSegment(twOfflineMsgStore * store, uint32_t segment) {
+	TW_FILE_HANDLE f = 0;
+	char * name = getSegmentName(store, segment);
+	if (!name) return;
+	f = TW_FOPEN(name, "ab");
+	if (!f || TW_FSYNC(f)) TW_LOG(TW_WARN,"twOfflineMsgStore: Error syncing segment %s", name);
+	if (f) TW_FCLOSE(f);
+	TW_FREE(name);
+}
+
+/* Must be called with the store mutex held */
+static void deleteSegment(twOfflineMsgStore * store, uint32_t segment) {
+	char * name = getSegmentName(store, segment);
+	if (!name) return;
+	TW_LOG(TW_TRACE,"twOfflineMsgStore: Deleting segment %s", name);
+	twDirectory_DeleteFile(name);
+	TW_FREE(name);
+}
+
+twOfflineMsgStore * twOfflineMsgStore_Create(char * dir) {
+	uint32_t i = 0;
+	twOfflineMsgStore * store = NULL;
+	if (!dir) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore_Create: NULL directory");
+		return NULL;
+	}
+	store = (twOfflineMsgStore *)TW_CALLOC(sizeof(twOfflineMsgStore), 1);
+	if (!store) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore_Create: Error allocating store");
+		return NULL;
+	}
+	store->dir = duplicateString(dir);
+	store->mtx = twMutex_Create();
+	store->flushMtx = twMutex_Create();
+	if (!store->dir || !store->mtx || !store->flushMtx) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore_Create: Error allocating directory name or mutex");
+		twOfflineMsgStore_Delete(store);
+		return NULL;
+	}
+	if (!readIndex(store, "idx") && !readIndex(store, "idx.tmp")) {
+		TW_LOG(TW_DEBUG,"twOfflineMsgStore_Create: No index found in %s.  Starting a new store", dir);
+	}
+	/* Work out how much is waiting to be sent */
+	for (i = store->firstSegment; i <= store->lastSegment; i++) {
+		uint64_t size = getSegmentSize(store, i);
+		if (i == store->firstSegment) size = (size > store->readOffset) ? size - store->readOffset : 0;
+		store->size += (uint32_t)size;
+	}
+	store->lastSegmentSize = (uint32_t)getSegmentSize(store, store->lastSegment);
+	if (store->size) TW_LOG(TW_INFO,"twOfflineMsgStore_Create: Found %u bytes of offline messages in segments %u to %u",
+		store->size, store->firstSegment, store->lastSegment);
+	return store;
+}
+
+void twOfflineMsgStore_Delete(twOfflineMsgStore * store) {
+	if (!store) return;
+	if (store->dir) TW_FREE(store->dir);
+	if (store->mtx) twMutex_Delete(store->mtx);
+	if (store->flushMtx) twMutex_Delete(store->flushMtx);
+	TW_FREE(store);
+}
+
+int twOfflineMsgStore_Write(twOfflineMsgStore * store, twStream * s) {
+	TW_FILE_HANDLE f = 0;
+	char * name = NULL;
+	uint32_t length = 0;
+	if (!store || !s) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore_Write: NULL store or stream");
+		return TW_INVALID_PARAM;
+	}
+	length = twStream_GetLength(s);
+	twMutex_Lock(store->mtx);
+	if (store->lastSegmentSize >= OFFLINE_MSG_SEGMENT_SIZE) {
+		/* Roll over to a new segment */
+		syncSegment(store, store->lastSegment);
+		store->lastSegment++;
+		store->lastSegmentSize = 0;
+		writeIndex(store);
+	}
+	name = getSegmentName(store, store->lastSegment);
+	if (!name) {
+		twMutex_Unlock(store->mtx);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	f = TW_FOPEN(name, "ab");
+	if (!f) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore_Write: Error opening segment %s", name);
+		twMutex_Unlock(store->mtx);
+		TW_FREE(name);
+		return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
+	}
+	if (TW_FWRITE(&length, 1, RECORD_LENGTH_SIZE, f) != RECORD_LENGTH_SIZE ||
+		TW_FWRITE(twStream_GetData(s), 1, length, f) != length) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore_Write: Error writing to segment %s", name);
+		TW_FCLOSE(f);
+		twMutex_Unlock(store->mtx);
+		TW_FREE(name);
+		return TW_ERROR_WRITING_OFFLINE_MSG_STORE;
+	}
+	TW_FCLOSE(f);
+	store->lastSegmentSize += RECORD_LENGTH_SIZE + length;
+	store->size += RECORD_LENGTH_SIZE + length;
+	twMutex_Unlock(store->mtx);
+	TW_FREE(name);
+	return TW_OK;
+}
+
+int twOfflineMsgStore_Flush(twOfflineMsgStore * store, struct twWs * ws) {
+	uint32_t session = 0;
+	int res = TW_OK;
+	if (!store || !ws) {
+		TW_LOG(TW_ERROR,"twOfflineMsgStore_Flush: NULL store or websocket");
+		return TW_INVALID_PARAM;
+	}
+	/* We are going to have to insert the current session ID into each message */
+	session = ws->sessionId;
+	swap4bytes((char *)&session);
+	/* The store mutex is only held between sends so writers aren't held up by the network */
+	twMutex_Lock(store->flushMtx);
+	while (1) {
+		uint64_t mapped = 0;
+		uint64_t size = 0;
+		uint64_t end = 0;
+		uint64_t current = 0;
+		uint32_t segment = 0;
+		uint32_t offset = 0;
+		uint32_t sent = 0;
+		char * name = NULL;
+		char * data = NULL;
+		twMutex_Lock(store->mtx);
+		if (!store->size || store->firstSegment > store->lastSegment) {
+			twMutex_Unlock(store->mtx);
+			break;
+		}
+		segment = store->firstSegment;
+		offset = store->readOffset;
+		/* Only the newest segment is still being appended to.  Stop at its end as of now */
+		end = (segment == store->lastSegment) ? store->lastSegmentSize : (uint64_t)-1;
+		twMutex_Unlock(store->mtx);
+		name = getSegmentName(store, segment);
+		if (!name) {
+			res = TW_ERROR_ALLOCATING_MEMORY;
+			break;
+		}
+		data = twDirectory_MapFile(name, &mapped);
+		TW_FREE(name);
+		size = (mapped < end) ? mapped : end;
+		while (offset + RECORD_LENGTH_SIZE <= size) {
+			twIoVec parts[3];
+			uint32_t length = 0;
+			memcpy(&length, data + offset, RECORD_LENGTH_SIZE);
+			if (offset + RECORD_LENGTH_SIZE + length > size) {
+				TW_LOG(TW_WARN,"twOfflineMsgStore_Flush: Discarding truncated message at offset %u of segment %u", offset, segment);
+				break;
+			}
+			parts[0].buf = data + offset + RECORD_LENGTH_SIZE;
+			if (length > SESSION_ID_OFFSET + sizeof(session)) {
+				/* Send the stored message with our session ID spliced into the header */
+				parts[0].len = SESSION_ID_OFFSET;
+				parts[1].buf = (char *)&session;
+				parts[1].len = sizeof(session);
+				parts[2].buf = parts[0].buf + SESSION_ID_OFFSET + sizeof(session);
+				parts[2].len = length - SESSION_ID_OFFSET - sizeof(session);
+				res = twWs_SendMessageV(ws, parts, 3, 0);
+			} else {
+				parts[0].len = length;
+				res = twWs_SendMessageV(ws, parts, 1, 0);
+			}
+			/* If we have disconnected again stop here and pick up from this message next time */
+			if (res == TW_WEBSOCKET_NOT_CONNECTED) break;
+			if (res) TW_LOG(TW_WARN,"twOfflineMsgStore_Flush: Error %d sending offline message.  Discarding it", res);
+			offset += RECORD_LENGTH_SIZE + length;
+			twMutex_Lock(store->mtx);
+			store->size -= (store->size > RECORD_LENGTH_SIZE + length) ? RECORD_LENGTH_SIZE + length : store->size;
+			store->readOffset = offset;
+			/* Checkpoint our position now and then so a crash doesn't replay the whole segment */
+			if (++sent >= OFFLINE_MSG_CHECKPOINT_RATE) {
+				writeIndex(store);
+				sent = 0;
+			}
+			twMutex_Unlock(store->mtx);
+		}
+		twDirectory_UnmapFile(data, mapped);
+		twMutex_Lock(store->mtx);
+		if (res == TW_WEBSOCKET_NOT_CONNECTED) {
+			/* Checkpoint our position */
+			writeIndex(store);
+			twMutex_Unlock(store->mtx);
+			break;
+		}
+		res = TW_OK;
+		/* The segment may have grown and even been rolled over while we were sending */
+		current = (segment == store->lastSegment) ? store->lastSegmentSize : getSegmentSize(store, segment);
+		if (!data && current > offset) {
+			/* Don't throw away messages we couldn't read, try again on the next flush */
+			TW_LOG(TW_ERROR,"twOfflineMsgStore_Flush: Error mapping segment %u", segment);
+			twMutex_Unlock(store->mtx);
+			res = TW_ERROR_READING_OFFLINE_MSG_STORE;
+			break;
+		}
+		if (data && current > size) {
+			/* More messages were written while we were sending, go round again for them */
+			twMutex_Unlock(store->mtx);
+			continue;
+		}
+		/* This whole segment has been sent */
+		deleteSegment(store, segment);
+		store->readOffset = 0;
+		if (segment == store->lastSegment) {
+			/* Everything has been sent, start over with a fresh segment */
+			store->lastSegment++;
+			store->lastSegmentSize = 0;
+			store->size = 0;
+		}
+		store->firstSegment++;
+		writeIndex(store);
+		twMutex_Unlock(store->mtx);
+	}
+	twMutex_Unlock(store->flushMtx);
+	return res;
+}
+
+uint32_t twOfflineMsgStore_GetSize(twOfflineMsgStore * store) {
+	uint32_t size = 0;
+	if (!store) return 0;
+	twMutex_Lock(store->mtx);
+	size = store->size;
+	twMutex_Unlock(store->mtx);
+	return size;
+}
@@ -0,0 +1,105 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Persisted offline message store
+ */
+
+#ifndef TW_OFFLINE_MSG_STORE_H
+#define TW_OFFLINE_MSG_STORE_H
+
+#include "twOSPort.h"
+#include "twBaseTypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct twWs;
+
+/***************************************/
+/*    Persisted Offline Message Store  */
+/* Messages are appended to a series   */
+/* of numbered segment files as        */
+/* <length><message> records.  A small */
+/* index file records the oldest       */
+/* segment, the read offset into it    */
+/* and the newest segment.  Replay     */
+/* maps each segment, sends records    */
+/* from the read offset and deletes    */
+/* whole segments once they have been  */
+/* sent.  Nothing is ever rewritten.   */
+/* The read offset is saved every      */
+/* OFFLINE_MSG_CHECKPOINT_RATE records */
+/* and messages can be written while   */
+/* a flush is sending.                 */
+/***************************************/
+
+typedef struct twOfflineMsgStore {
+	char * dir;
+	uint32_t firstSegment;    /* Oldest segment with unsent messages */
+	uint32_t readOffset;      /* Offset of the first unsent record in firstSegment */
+	uint32_t lastSegment;     /* Segment new messages are appended to */
+	uint32_t lastSegmentSize;
+	uint32_t size;            /* Bytes of unsent records in all segments */
+	TW_MUTEX mtx;
+	TW_MUTEX flushMtx;        /* Held for a whole flush so only one sends at a time */
+} twOfflineMsgStore;
+
+/*
+twOfflineMsgStore_Create - Opens the persisted store in a directory, picking up any
+messages left over from a previous run.
+Parameters:
+	dir - the directory to keep the index and segment files in.  It must exist.
+Return:
+	twOfflineMsgStore * - pointer to the store or NULL if an error occurred
+*/
+twOfflineMsgStore * twOfflineMsgStore_Create(char * dir);
+
+/*
+twOfflineMsgStore_Delete - Closes the store.  Unsent messages stay on disk.
+Parameters:
+	store - pointer to the store
+Return:
+	Nothing
+*/
+void twOfflineMsgStore_Delete(twOfflineMsgStore * store);
+
+/*
+twOfflineMsgStore_Write - Appends a serialized message to the newest segment, starting a new
+segment first if the newest one has reached OFFLINE_MSG_SEGMENT_SIZE.
+Parameters:
+	store - pointer to the store
+	s - stream containing the complete message.  The caller still owns the stream.
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twOfflineMsgStore_Write(twOfflineMsgStore * store, twStream * s);
+
+/*
+twOfflineMsgStore_Flush - Sends all stored messages over the websocket with the websocket's
+current session ID.  Segments that have been completely sent are deleted.  If the websocket
+disconnects the position of the first unsent message is saved and replay resumes there.
+Messages written while the flush is running are sent by it as well.  A segment that can't be
+read is kept and the flush stops with TW_ERROR_READING_OFFLINE_MSG_STORE.
+Parameters:
+	store - pointer to the store
+	ws - the websocket to send the messages on
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twOfflineMsgStore_Flush(twOfflineMsgStore * store, struct twWs * ws);
+
+/*
+twOfflineMsgStore_GetSize - Gets the number of bytes of messages waiting to be sent.
+Parameters:
+	store - pointer to the store
+Return:
+	uint32_t - size of the stored messages in bytes
+*/
+uint32_t twOfflineMsgStore_GetSize(twOfflineMsgStore * store);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,6 +4,8 @@
  *  Metadata browsing and property/service functions
  */
 
+#define TW_LOG_MODULE TW_MODULE_API
+
 #include "twConfig.h"
 #include "twOSPort.h"
 #include "twLogger.h"
@@ -28,19 +30,62 @@ twPropertyDef * twPropertyDef_Create(char * name, enum BaseType type, char * des
 	tmp->description = duplicateString(description);
 	tmp->pushType = duplicateString(pushType);
 	tmp->pushThreshold = pushThreshold;
+	tmp->pushMtx = twMutex_Create();
+	if (!tmp->name || !tmp->pushMtx) {
+		TW_LOG(TW_ERROR,"twPropertyDef_Create: Error allocating memory");
+		twPropertyDef_Delete(tmp);
+		return 0;
+	}
 	return tmp;
 }
 
 void twPropertyDef_Delete(void * input) {
 	if (input) {
 		twPropertyDef * tmp = (twPropertyDef *)input;
-		TW_FREE(tmp->name);
+		if (tmp->name) TW_FREE(tmp->name);
 		if (tmp->description) TW_FREE(tmp->description);
 		if (tmp->pushType) TW_FREE(tmp->pushType);
+		if (tmp->lastPushedValue) twPrimitive_Delete(tmp->lastPushedValue);
+		if (tmp->pushMtx) twMutex_Delete(tmp->pushMtx);
 		TW_FREE(tmp);
 	}
 }
 
+char twPropertyDef_ShouldPush(twPropertyDef * def, twPrimitive * value, twPrimitive * pending) {
+	twPrimitive * last = NULL;
+	char push = TRUE;
+	if (!def || !value) return TRUE;
+	if (!def->pushType || !strcmp(def->pushType, "ALWAYS")) return TRUE;
+	if (!strcmp(def->pushType, "NEVER")) return FALSE;
+	/* VALUE - compare against what is about to be pushed or what we pushed last time */
+	if (value->type == TW_VARIANT && value->val.variant) value = value->val.variant;
+	if (pending && pending->type == TW_VARIANT && pending->val.variant) pending = pending->val.variant;
+	twMutex_Lock(def->pushMtx);
+	last = pending ? pending : def->lastPushedValue;
+	if (last && last->type == value->type) {
+		if (value->typeFamily == TW_NUMBER || value->typeFamily == TW_INTEGER) {
+			double delta = (value->typeFamily == TW_NUMBER) ? value->val.number - last->val.number :
+								(double)value->val.integer - (double)last->val.integer;
+			if (delta < 0) delta = -delta;
+			push = (delta > def->pushThreshold);
+		} else push = (twPrimitive_Compare(value, last) != 0);
+	}
+	twMutex_Unlock(def->pushMtx);
+	return push;
+}
+
+void twPropertyDef_SetPushed(twPropertyDef * def, twPrimitive * value) {
+	twPrimitive * copy = NULL;
+	if (!def || !value || !def->pushType || strcmp(def->pushType, "VALUE")) return;
+	if (value->type == TW_VARIANT && value->val.variant) value = value->val.variant;
+	copy = twPrimitive_FullCopy(value);
+	if (!copy) return;
+	twMutex_Lock(def->pushMtx);
+	twPrimitive_Delete(def->lastPushedValue);
+	def->lastPushedValue = copy;
+	twMutex_Unlock(def->pushMtx);
+}
+
 twProperty * twProperty_Create(char * name, twPrimitive * value, DATETIME timestamp) {
 	twProperty * tmp = NULL;
 	if (!name || !value) {
@@ -27,6 +27,8 @@ typedef struct twPropertyDef {
 	enum BaseType type;
 	char * pushType;
 	double pushThreshold;
+	twPrimitive * lastPushedValue;
+	TW_MUTEX pushMtx;
 } twPropertyDef;
 
 /*
@@ -50,6 +52,31 @@ Return:
 */
 void twPropertyDef_Delete(void * input);
 
+/*
+twPropertyDef_ShouldPush - applies the push type and threshold of a property definition to a new value.
+NEVER never pushes, VALUE pushes only if the value differs from the last pushed value (for TW_NUMBER and
+TW_INTEGER by more than pushThreshold) and ALWAYS, or no push type, always pushes.  The last pushed value
+is not changed, call twPropertyDef_SetPushed once the push has gone out.
+Parameters:
+	def - pointer to the property definition
+	value - the value about to be pushed
+	pending - a value of this property that is going out in the same push and hasn't been set as
+		pushed yet, compared against instead of the last pushed value.  May be NULL.
+Return:
+	char - TRUE if the value should be pushed, FALSE if it should be dropped
+*/
+char twPropertyDef_ShouldPush(twPropertyDef * def, twPrimitive * value, twPrimitive * pending);
+
+/*
+twPropertyDef_SetPushed - keeps a copy of a value as the last pushed value of a VALUE push type property.
+Parameters:
+	def - pointer to the property definition
+	value - the value that was pushed
+Return:
+	Nothing
+*/
+void twPropertyDef_SetPushed(twPropertyDef * def, twPrimitive * value);
+
 /************************/
 /*    Property Values   */
 /************************/
@@ -4,6 +4,8 @@
  *  Service Metadata browsing service functions
  */
 
+#define TW_LOG_MODULE TW_MODULE_API
+
 #include "twConfig.h"
 #include "twOSPort.h"
 #include "twLogger.h"
@@ -0,0 +1,315 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Managed (subscribed) property update queue
+ */
+
+#define TW_LOG_MODULE TW_MODULE_API
+
+#include "twSubscribedProps.h"
+#include "twApi.h"
+#include "twLogger.h"
+#include "stringUtils.h"
+
+#include <string.h>
+
+extern twApi * tw_api;
+
+/* Singleton subscribed property manager */
+twSubscribedPropsMgr * spm = NULL;
+
+/* Approximate number of bytes a queued value adds to the outgoing infotable row */
+static uint32_t queuedPropertySize(twProperty * p) {
+	uint32_t size = 0;
+	if (!p) return 0;
+	size += strlen(p->name) + 1;
+	if (p->value) size += p->value->length + 1;
+	size += sizeof(DATETIME) + 1;
+	size += strlen("GOOD") + 2;
+	return size;
+}
+
+void twSubscribedEntity_Delete(void * entity) {
+	twSubscribedEntity * tmp = (twSubscribedEntity *)entity;
+	if (!tmp) return;
+	if (tmp->queue) twList_Delete(tmp->queue);
+	if (tmp->name) TW_FREE(tmp->name);
+	TW_FREE(tmp);
+}
+
+/* Must be called with the manager mutex held */
+static twSubscribedEntity * getEntity(char * entityName, char create) {
+	twSubscribedEntity * entity = NULL;
+	ListEntry * le = twList_Next(spm->entities, NULL);
+	while (le) {
+		entity = (twSubscribedEntity *)le->value;
+		if (entity && !strcmp(entity->name, entityName)) return entity;
+		le = twList_Next(spm->entities, le);
+	}
+	if (!create) return NULL;
+	entity = (twSubscribedEntity *)TW_CALLOC(sizeof(twSubscribedEntity), 1);
+	if (!entity) return NULL;
+	entity->name = duplicateString(entityName);
+	entity->queue = twList_Create(twProperty_Delete);
+	if (!entity->name || !entity->queue || twList_Add(spm->entities, entity)) {
+		twSubscribedEntity_Delete(entity);
+		return NULL;
+	}
+	return entity;
+}
+
+/* Must be called with the manager mutex held */
+static void removeQueuedValue(twSubscribedEntity * entity, ListEntry * le) {
+	twProperty * p = (twProperty *)le->value;
+	twCallbackRegistry_Remove(spm->foldIndex, TW_THING, entity->name, TW_PROPERTIES, p->name, le);
+	spm->queueSize -= queuedPropertySize(p);
+	twList_Remove(entity->queue, le, TRUE);
+}
+
+/* Must be called with the manager mutex held */
+static void dropOldestValues() {
+	ListEntry * le = twList_Next(spm->entities, NULL);
+	while (le && spm->queueSize > MAX_MANAGED_PROPERTY_Q_SIZE) {
+		twSubscribedEntity * entity = (twSubscribedEntity *)le->value;
+		ListEntry * first = twList_Next(entity->queue, NULL);
+		if (!first) {
+			le = twList_Next(spm->entities, le);
+			continue;
+		}
+		TW_LOG(TW_WARN,"twSubscribedPropsMgr: Queue full.  Discarding value of %s:%s", entity->name, ((twProperty *)first->value)->name);
+		removeQueuedValue(entity, first);
+	}
+}
+
+static int pushComplete(uint32_t id, enum msgCodeEnum code, char * reason, twInfoTable * content) {
+	if (code != TWX_SUCCESS) {
+		TW_LOG(TW_WARN,"twSubscribedPropsMgr: Property update %d failed.  Code: %d %s", id, code, reason ? reason : "");
+	}
+	return 0;
+}
+
+/*
+Must be called with the manager mutex held.  Puts values that couldn't be sent back at the
+head of the entity's queue, ahead of anything queued while they were being sent.
+*/
+static void requeueValues(twSubscribedEntity * entity, twList * values) {
+	twList * newer = entity->queue;
+	ListEntry * le = NULL;
+	entity->queue = values;
+	le = twList_Next(values, NULL);
+	while (le) {
+		ListEntry * next = twList_Next(values, le);
+		twProperty * p = (twProperty *)le->value;
+		if (spm->fold && twCallbackRegistry_Get(spm->foldIndex, TW_THING, entity->name, TW_PROPERTIES, p->name)) {
+			/* A newer value of this property was queued while we were sending */
+			twList_Remove(values, le, TRUE);
+		} else {
+			spm->queueSize += queuedPropertySize(p);
+		}
+		le = next;
+	}
+	/* Move the newer values behind the old ones */
+	le = twList_Next(newer, NULL);
+	while (le) {
+		ListEntry * next = twList_Next(newer, le);
+		twProperty * p = (twProperty *)le->value;
+		twCallbackRegistry_Remove(spm->foldIndex, TW_THING, entity->name, TW_PROPERTIES, p->name, le);
+		twList_Remove(newer, le, FALSE);
+		if (twList_Add(values, p)) {
+			TW_LOG(TW_ERROR,"twSubscribedPropsMgr: Error requeueing value of %s:%s", entity->name, p->name);
+			spm->queueSize -= queuedPropertySize(p);
+			twProperty_Delete(p);
+		}
+		le = next;
+	}
+	twList_Delete(newer);
+	/* Rebuild the fold index over the merged queue */
+	if (spm->fold) {
+		le = twList_Next(values, NULL);
+		while (le) {
+			twProperty * p = (twProperty *)le->value;
+			twCallbackRegistry_Add(spm->foldIndex, TW_THING, entity->name, TW_PROPERTIES, p->name, le);
+			le = twList_Next(values, le);
+		}
+	}
+}
+
+static int pushEntity(twSubscribedEntity * entity, char forceConnect) {
+	twList * values = NULL;
+	twList * empty = NULL;
+	ListEntry * le = NULL;
+	int res = TW_OK;
+	twMutex_Lock(spm->mtx);
+	if (!twList_GetCount(entity->queue)) {
+		twMutex_Unlock(spm->mtx);
+		return TW_OK;
+	}
+	empty = twList_Create(twProperty_Delete);
+	if (!empty) {
+		twMutex_Unlock(spm->mtx);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	/* Swap in an empty queue so new values can be set while we send */
+	values = entity->queue;
+	entity->queue = empty;
+	le = twList_Next(values, NULL);
+	while (le) {
+		twProperty * p = (twProperty *)le->value;
+		twCallbackRegistry_Remove(spm->foldIndex, TW_THING, entity->name, TW_PROPERTIES, p->name, le);
+		spm->queueSize -= queuedPropertySize(p);
+		le = twList_Next(values, le);
+	}
+	twMutex_Unlock(spm->mtx);
+	TW_LOG(TW_TRACE,"twSubscribedPropsMgr: Pushing %d values for %s", twList_GetCount(values), entity->name);
+	res = twApi_PushPropertiesAsync(TW_THING, entity->name, values, pushComplete, -1, forceConnect, NULL);
+	if (res) {
+		/* Keep the values for the next flush.  If the queue is full the oldest get dropped */
+		TW_LOG(TW_WARN,"twSubscribedPropsMgr: Error pushing %d values for %s.  Error: %d", twList_GetCount(values), entity->name, res);
+		twMutex_Lock(spm->mtx);
+		requeueValues(entity, values);
+		twMutex_Unlock(spm->mtx);
+		return res;
+	}
+	twList_Delete(values);
+	return res;
+}
+
+int twSubscribedPropsMgr_Initialize() {
+	twSubscribedPropsMgr * tmp = NULL;
+	if (spm) return TW_OK;
+	tmp = (twSubscribedPropsMgr *)TW_CALLOC(sizeof(twSubscribedPropsMgr), 1);
+	if (!tmp) {
+		TW_LOG(TW_ERROR,"twSubscribedPropsMgr_Initialize: Error allocating manager");
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	tmp->entities = twList_Create(twSubscribedEntity_Delete);
+	tmp->foldIndex = twCallbackRegistry_Create(0);
+	tmp->mtx = twMutex_Create();
+	tmp->fold = MANAGED_PROPERTY_FOLDING;
+	if (!tmp->entities || !tmp->foldIndex || !tmp->mtx) {
+		TW_LOG(TW_ERROR,"twSubscribedPropsMgr_Initialize: Error allocating queue, index or mutex");
+		if (tmp->entities) twList_Delete(tmp->entities);
+		if (tmp->foldIndex) twCallbackRegistry_Delete(tmp->foldIndex);
+		if (tmp->mtx) twMutex_Delete(tmp->mtx);
+		TW_FREE(tmp);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	spm = tmp;
+	return TW_OK;
+}
+
+void twSubscribedPropsMgr_Delete() {
+	twSubscribedPropsMgr * tmp = spm;
+	if (!spm) return;
+	twMutex_Lock(tmp->mtx);
+	spm = NULL;
+	twCallbackRegistry_Delete(tmp->foldIndex);
+	twList_Delete(tmp->entities);
+	twMutex_Unlock(tmp->mtx);
+	twMutex_Delete(tmp->mtx);
+	TW_FREE(tmp);
+}
+
+int twSubscribedPropsMgr_SetFolding(char fold) {
+	if (!spm) return TW_MANAGED_PROP_HANDLER_NOT_INTIALIZED;
+	twMutex_Lock(spm->mtx);
+	spm->fold = fold;
+	twMutex_Unlock(spm->mtx);
+	return TW_OK;
+}
+
+int twSubscribedPropsMgr_SetPropertyValue(char * entityName, char * propertyName, twPrimitive * value, DATETIME timestamp, char pushUpdate) {
+	twSubscribedEntity * entity = NULL;
+	ListEntry * le = NULL;
+	twProperty * p = NULL;
+	char full = FALSE;
+	if (!spm) {
+		twPrimitive_Delete(value);
+		return TW_MANAGED_PROP_HANDLER_NOT_INTIALIZED;
+	}
+	if (!entityName || !propertyName || !value) {
+		TW_LOG(TW_ERROR,"twSubscribedPropsMgr_SetPropertyValue: NULL entityName, propertyName or value");
+		twPrimitive_Delete(value);
+		return TW_INVALID_PARAM;
+	}
+	twMutex_Lock(spm->mtx);
+	entity = getEntity(entityName, TRUE);
+	if (!entity) {
+		twMutex_Unlock(spm->mtx);
+		TW_LOG(TW_ERROR,"twSubscribedPropsMgr_SetPropertyValue: Error allocating queue for %s", entityName);
+		twPrimitive_Delete(value);
+		return TW_ERROR_ALLOCATING_MEMORY;
+	}
+	if (spm->fold) {
+		/* Replace the value in place if this property is already queued */
+		le = (ListEntry *)twCallbackRegistry_Get(spm->foldIndex, TW_THING, entity->name, TW_PROPERTIES, propertyName);
+		if (le) {
+			p = (twProperty *)le->value;
+			spm->queueSize -= queuedPropertySize(p);
+			twPrimitive_Delete(p->value);
+			p->value = value;
+			p->timestamp = timestamp ? timestamp : twGetSystemTime(TRUE);
+			spm->queueSize += queuedPropertySize(p);
+		}
+	}
+	if (!le) {
+		p = twProperty_Create(propertyName, value, timestamp);
+		if (!p || twList_Add(entity->queue, p)) {
+			twMutex_Unlock(spm->mtx);
+			TW_LOG(TW_ERROR,"twSubscribedPropsMgr_SetPropertyValue: Error queueing value of %s:%s", entityName, propertyName);
+			if (p) twProperty_Delete(p);
+			else twPrimitive_Delete(value);
+			return TW_ERROR_ALLOCATING_MEMORY;
+		}
+		spm->queueSize += queuedPropertySize(p);
+		if (spm->fold) {
+			le = entity->queue->last;
+			twCallbackRegistry_Add(spm->foldIndex, TW_THING, entity->name, TW_PROPERTIES, p->name, le);
+		}
+	}
+	full = (spm->queueSize >= MAX_MANAGED_PROPERTY_Q_SIZE);
+	twMutex_Unlock(spm->mtx);
+	if (full) {
+		/* Try to send everything, if we can't then make room */
+		twSubscribedPropsMgr_PushSubscribedProperties(NULL, FALSE);
+		twMutex_Lock(spm->mtx);
+		dropOldestValues();
+		twMutex_Unlock(spm->mtx);
+	} else if (pushUpdate) {
+		twSubscribedPropsMgr_PushSubscribedProperties(entityName, FALSE);
+	}
+	return TW_OK;
+}
+
+int twSubscribedPropsMgr_PushSubscribedProperties(char * entityName, char forceConnect) {
+	ListEntry * le = NULL;
+	int res = TW_OK;
+	if (!spm) return TW_MANAGED_PROP_HANDLER_NOT_INTIALIZED;
+	/* Leave the values queued if there is nowhere for them to go */
+	if (!twApi_isConnected() && !forceConnect && !(tw_api && tw_api->offlineMsgEnabled)) return TW_WEBSOCKET_NOT_CONNECTED;
+	if (entityName) {
+		twSubscribedEntity * entity = NULL;
+		twMutex_Lock(spm->mtx);
+		entity = getEntity(entityName, FALSE);
+		twMutex_Unlock(spm->mtx);
+		if (!entity) return TW_MANAGED_PROPERTY_NOT_FOUND;
+		return pushEntity(entity, forceConnect);
+	}
+	/* Entities are never removed while the manager exists so it's safe to walk the list unlocked */
+	le = twList_Next(spm->entities, NULL);
+	while (le) {
+		int err = pushEntity((twSubscribedEntity *)le->value, forceConnect);
+		if (err) res = err;
+		le = twList_Next(spm->entities, le);
+	}
+	return res;
+}
+
+uint32_t twSubscribedPropsMgr_GetQueueSize() {
+	uint32_t size = 0;
+	if (!spm) return 0;
+	twMutex_Lock(spm->mtx);
+	size = spm->queueSize;
+	twMutex_Unlock(spm->mtx);
+	return size;
+}
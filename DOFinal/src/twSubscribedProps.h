@@ -0,0 +1,114 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Managed (subscribed) property update queue
+ */
+
+#ifndef TW_SUBSCRIBED_PROPS_H
+#define TW_SUBSCRIBED_PROPS_H
+
+#include "twOSPort.h"
+#include "twProperties.h"
+#include "twCallbackRegistry.h"
+#include "list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***************************************/
+/*    Managed Property Update Queue    */
+/* Property values are queued locally  */
+/* and sent to the server in batches   */
+/* as a single call to the service     */
+/*   UpdateSubscribedPropertyValues    */
+/*            per entity               */
+/***************************************/
+
+/* Queued values for a single entity */
+typedef struct twSubscribedEntity {
+	char * name;
+	twList * queue;
+} twSubscribedEntity;
+
+/* Subscribed property manager - this is a singleton */
+typedef struct twSubscribedPropsMgr {
+	twList * entities;
+	twCallbackRegistry * foldIndex;
+	uint32_t queueSize;
+	char fold;
+	TW_MUTEX mtx;
+} twSubscribedPropsMgr;
+
+/*
+twSubscribedPropsMgr_Initialize - creates the subscribed property manager singleton.
+Folding defaults to MANAGED_PROPERTY_FOLDING.
+Parameters:
+	None
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twSubscribedPropsMgr_Initialize();
+
+/*
+twSubscribedPropsMgr_Delete - deletes the subscribed property manager singleton.  Any
+queued values that have not been sent are discarded.
+Parameters:
+	None
+Return:
+	Nothing
+*/
+void twSubscribedPropsMgr_Delete();
+
+/*
+twSubscribedPropsMgr_SetFolding - turns property folding on or off.  When folding
+is on only the most recent value of each property is kept in the queue.
+Parameters:
+	fold - (boolean) TRUE to fold updates to the same property
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twSubscribedPropsMgr_SetFolding(char fold);
+
+/*
+twSubscribedPropsMgr_SetPropertyValue - queues a new value for a property.  If the queue
+grows past MAX_MANAGED_PROPERTY_Q_SIZE all queued values are sent immediately.  If they
+can't be sent the oldest values are discarded to make room.
+Parameters:
+	entityName - the name of the entity the property belongs to
+	propertyName - the name of the property
+	value - pointer to the new value.  The queue owns this pointer.
+	timestamp - timestamp of the new value.  0 uses the current time.
+	pushUpdate - (boolean) send the queued values for this entity immediately
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twSubscribedPropsMgr_SetPropertyValue(char * entityName, char * propertyName, twPrimitive * value, DATETIME timestamp, char pushUpdate);
+
+/*
+twSubscribedPropsMgr_PushSubscribedProperties - sends all queued values to the server.  Each
+entity's values go as one asynchronous UpdateSubscribedPropertyValues request.  Values stay in
+the queue if we are offline, forceConnect is FALSE and the offline message store is disabled, or
+if the request can't be sent.
+Parameters:
+	entityName - the entity to send the values of or NULL to send for all entities
+	forceConnect - (boolean) if in the disconnected state of the duty cycle, force a reconnect to send the message
+Return:
+	int - 0 if successful, positive integral error code (see twErrors.h) if an was encountered
+*/
+int twSubscribedPropsMgr_PushSubscribedProperties(char * entityName, char forceConnect);
+
+/*
+twSubscribedPropsMgr_GetQueueSize - gets the approximate size of the queued values.
+Parameters:
+	None
+Return:
+	uint32_t - size of the queued values in bytes
+*/
+uint32_t twSubscribedPropsMgr_GetQueueSize();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
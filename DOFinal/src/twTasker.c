@@ -9,61 +9,280 @@
 #include "twOSPort.h"
 #include "twTasker.h"
 
-twTask twTasks[TW_MAX_TASKS];
-int lastTaskRun = 0;
+/* Task states */
+#define TASK_FREE 0
+#define TASK_SCHEDULED 1
+#define TASK_READY 2     /* Waiting for a worker thread */
+#define TASK_RUNNING 3
 
-void twTaskerInitialize() {
+/* Task slots, indexed by task id.  Grown as needed */
+static twTask * twTasks = NULL;
+static int numTasks = 0;
+/* Ids of the scheduled tasks as a min heap on nextRunTick */
+static int * heap = NULL;
+static int heapSize = 0;
+/* Ids of the tasks waiting for a worker thread, oldest first */
+static int * ready = NULL;
+static int readyHead = 0;
+static int readyCount = 0;
+static TW_MUTEX taskerMutex = NULL;
+
+/* Task ids handed out carry the slot's generation in the upper bits so an id
+   kept after its task is gone can't remove whatever reuses the slot */
+#define TASK_SLOT_BITS 16
+#define TASK_MAX_SLOTS (1 << TASK_SLOT_BITS)
+#define TASK_GEN_MASK 0x7FFF
+#define TASK_HANDLE(slot) ((twTasks[slot].generation << TASK_SLOT_BITS) | (slot))
+#define TASK_SLOT(handle) ((handle) & (TASK_MAX_SLOTS - 1))
+#define TASK_GEN(handle) (((handle) >> TASK_SLOT_BITS) & TASK_GEN_MASK)
+
+void twTasker_Initialize() {
+	twTasker_Start();
+}
+
+/* All of the following must be called with the tasker mutex held */
+static void heapSwap(int a, int b) {
+	int tmp = heap[a];
+	heap[a] = heap[b];
+	heap[b] = tmp;
+	twTasks[heap[a]].heapIndex = a;
+	twTasks[heap[b]].heapIndex = b;
+}
+
+static void siftUp(int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (twTasks[heap[parent]].nextRunTick <= twTasks[heap[i]].nextRunTick) break;
+		heapSwap(i, parent);
+		i = parent;
+	}
+}
+
+static void siftDown(int i) {
+	while (1) {
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+		if (left < heapSize && twTasks[heap[left]].nextRunTick < twTasks[heap[smallest]].nextRunTick) smallest = left;
+		if (right < heapSize && twTasks[heap[right]].nextRunTick < twTasks[heap[smallest]].nextRunTick) smallest = right;
+		if (smallest == i) break;
+		heapSwap(i, smallest);
+		i = smallest;
+	}
+}
+
+static void schedule(int id) {
+	twTasks[id].state = TASK_SCHEDULED;
+	twTasks[id].heapIndex = heapSize;
+	heap[heapSize++] = id;
+	siftUp(heapSize - 1);
+}
+
+static void unschedule(int id) {
+	int i = twTasks[id].heapIndex;
+	heapSize--;
+	if (i != heapSize) {
+		heapSwap(i, heapSize);
+		siftUp(i);
+		siftDown(twTasks[heap[i]].heapIndex);
+	}
+	twTasks[id].heapIndex = -1;
+}
+
+static void freeTask(int id) {
+	twTasks[id].func = NULL;
+	twTasks[id].params = NULL;
+	twTasks[id].runTimeIntervalMsec = 0;
+	twTasks[id].nextRunTick = 0;
+	twTasks[id].flags = 0;
+	twTasks[id].removed = FALSE;
+	twTasks[id].heapIndex = -1;
+	twTasks[id].state = TASK_FREE;
+	/* Invalidate any ids still held for the old task */
+	twTasks[id].generation = (twTasks[id].generation + 1) & TASK_GEN_MASK;
+}
+
+/* Puts a task that has just run back in the heap or frees it */
+static void finishTask(int id, uint64_t lastRunTick) {
+	if (twTasks[id].removed || (twTasks[id].flags & TW_TASK_ONE_SHOT)) {
+		freeTask(id);
+		return;
+	}
+	twTasks[id].nextRunTick = lastRunTick + twTasks[id].runTimeIntervalMsec * TICKS_PER_MSEC;
+	schedule(id);
+}
+
+static char growTasks() {
 	int i;
-	for (i = 0; i < TW_MAX_TASKS; i++) {
-		twTasks[i].func = NULL;
+	int newSize = numTasks ? numTasks * 2 : TW_TASKER_INITIAL_SIZE;
+	twTask * newTasks = NULL;
+	int * newHeap = NULL;
+	int * newReady = NULL;
+	/* The slot has to fit in the low bits of the id */
+	if (newSize > TASK_MAX_SLOTS) newSize = TASK_MAX_SLOTS;
+	if (newSize <= numTasks) return FALSE;
+	newTasks = (twTask *)TW_REALLOC(twTasks, newSize * sizeof(twTask));
+	if (!newTasks) return FALSE;
+	twTasks = newTasks;
+	newHeap = (int *)TW_REALLOC(heap, newSize * sizeof(int));
+	if (!newHeap) return FALSE;
+	heap = newHeap;
+	newReady = (int *)TW_CALLOC(newSize, sizeof(int));
+	if (!newReady) return FALSE;
+	/* Unwrap the ready ring into the new one */
+	for (i = 0; i < readyCount; i++) newReady[i] = ready[(readyHead + i) % numTasks];
+	if (ready) TW_FREE(ready);
+	ready = newReady;
+	readyHead = 0;
+	for (i = numTasks; i < newSize; i++) {
+		twTasks[i].generation = 0;
+		freeTask(i);
 	}
-	twTasker_Start();
+	numTasks = newSize;
+	return TRUE;
 }
 
 uint64_t tickCount = 0;
 uint8_t tickInProgress;
-void tickTimerCallback (void * params) {
-	int count = 0;
-	int i = lastTaskRun;
+/* Runs the tasks that are due and returns the tick at which the next one is due */
+uint64_t tickTimerCallback (void * params) {
+	uint64_t nextRunTick = (uint64_t)-1;
 	/*tickCount++;*/
-	if (tickInProgress) return;
+	if (tickInProgress || !taskerMutex) return 0;
 	tickInProgress = 1;
 	tickCount = twGetSystemMillisecondCount();
-	while (count < TW_MAX_TASKS) {
-		uint64_t now = twGetSystemMillisecondCount();
-		if (twTasks[i].func != 0 && tickCount > twTasks[i].nextRunTick) {
-			twTasks[i].func(now, params);
-			twTasks[i].nextRunTick = tickCount + twTasks[i].runTimeIntervalMsec * TICKS_PER_MSEC;
+	twMutex_Lock(taskerMutex);
+	while (heapSize && tickCount > twTasks[heap[0]].nextRunTick) {
+		int id = heap[0];
+		twTaskFunction func = twTasks[id].func;
+		void * taskParams = twTasks[id].params;
+		unschedule(id);
+		if (twTasks[id].flags & TW_TASK_USE_WORKER) {
+			ready[(readyHead + readyCount) % numTasks] = id;
+			readyCount++;
+			twTasks[id].state = TASK_READY;
+			if (twTasker_SignalWorker()) continue;
+			/* No workers, run it here */
+			readyCount--;
 		}
-		lastTaskRun = i++;
-		if (i == TW_MAX_TASKS) i = 0;
-		count++;
+		twTasks[id].state = TASK_RUNNING;
+		twMutex_Unlock(taskerMutex);
+		func(twGetSystemMillisecondCount(), taskParams);
+		twMutex_Lock(taskerMutex);
+		finishTask(id, tickCount);
 	}
+	if (heapSize) nextRunTick = twTasks[heap[0]].nextRunTick;
+	twMutex_Unlock(taskerMutex);
 	tickInProgress = 0;
+	/* With nothing to do check back once a second */
+	if (nextRunTick == (uint64_t)-1) nextRunTick = tickCount + 1000 * TICKS_PER_MSEC;
+	return nextRunTick;
 }
 
-int twTasker_CreateTask(uint32_t runTimeIntervalMsec, twTaskFunction func) {
+/* Called on the tasker thread when it is woken by network activity or twTasker_Wake */
+void tickTimerWake () {
 	int i;
-	/* Find and empty slot */
-	for (i = 0; i < TW_MAX_TASKS; i++) {
-		if (twTasks[i].func == 0) {
-			twTasks[i].func = func;
-			twTasks[i].runTimeIntervalMsec = runTimeIntervalMsec;
-			twTasks[i].nextRunTick = 0;
-			return i;
+	if (!taskerMutex) return;
+	twMutex_Lock(taskerMutex);
+	for (i = 0; i < heapSize; i++) {
+		twTask * t = &twTasks[heap[i]];
+		if ((t->flags & TW_TASK_RUN_ON_WAKE) && t->nextRunTick) {
+			t->nextRunTick = 0;
+			siftUp(i);
 		}
 	}
-	/* Didn't find an open slot */
-	return TW_MAX_TASKS_EXCEEDED;
+	twMutex_Unlock(taskerMutex);
 }
 
-int twTasker_RemoveTask(int id) {
-	if (id < TW_MAX_TASKS) {
-		twTasks[id].func = NULL;
-		twTasks[id].runTimeIntervalMsec = 0;
-		twTasks[id].nextRunTick = 0;
+/* Called on a worker thread each time it is signalled */
+void tickTimerWork () {
+	int id;
+	twTaskFunction func = NULL;
+	void * taskParams = NULL;
+	if (!taskerMutex) return;
+	twMutex_Lock(taskerMutex);
+	if (!readyCount) {
+		twMutex_Unlock(taskerMutex);
+		return;
+	}
+	id = ready[readyHead];
+	readyHead = (readyHead + 1) % numTasks;
+	readyCount--;
+	if (twTasks[id].removed) {
+		freeTask(id);
+		twMutex_Unlock(taskerMutex);
+		return;
 	}
-	/* Didn't the task slot */
-	return TW_TASK_NOT_FOUND;
-} 
+	func = twTasks[id].func;
+	taskParams = twTasks[id].params;
+	twTasks[id].state = TASK_RUNNING;
+	twMutex_Unlock(taskerMutex);
+	func(twGetSystemMillisecondCount(), taskParams);
+	twMutex_Lock(taskerMutex);
+	/* Slow tasks are rescheduled from when they finished so they don't back up */
+	finishTask(id, twGetSystemMillisecondCount());
+	twMutex_Unlock(taskerMutex);
+	/* Let the tasker pick up the new deadline */
+	twTasker_Wake();
+}
+
+int twTasker_CreateTaskEx(uint32_t firstRunMsec, uint32_t runTimeIntervalMsec, twTaskFunction func, void * params, char flags) {
+	int i;
+	if (!func) return -1;
+	if (!taskerMutex) taskerMutex = twMutex_Create();
+	if (!taskerMutex) return -1;
+	twMutex_Lock(taskerMutex);
+	/* Find an empty slot */
+	for (i = 0; i < numTasks; i++) {
+		if (twTasks[i].state == TASK_FREE) break;
+	}
+	if (i == numTasks && !growTasks()) {
+		twMutex_Unlock(taskerMutex);
+		TW_LOG(TW_ERROR,"twTasker_CreateTask: Error allocating task");
+		return -1;
+	}
+	twTasks[i].runTimeIntervalMsec = runTimeIntervalMsec;
+	twTasks[i].nextRunTick = firstRunMsec ? twGetSystemMillisecondCount() + firstRunMsec * TICKS_PER_MSEC : 0;
+	twTasks[i].func = func;
+	twTasks[i].params = params;
+	twTasks[i].flags = flags;
+	twTasks[i].removed = FALSE;
+	schedule(i);
+	twMutex_Unlock(taskerMutex);
+	/* Let the tasker pick up the new deadline */
+	twTasker_Wake();
+	return TASK_HANDLE(i);
+}
 
+int twTasker_CreateTask(uint32_t runTimeIntervalMsec, twTaskFunction func) {
+	return twTasker_CreateTaskEx(0, runTimeIntervalMsec, func, NULL, 0);
+}
+
+int twTasker_CreateIoTask(uint32_t runTimeIntervalMsec, twTaskFunction func) {
+	return twTasker_CreateTaskEx(0, runTimeIntervalMsec, func, NULL, TW_TASK_RUN_ON_WAKE);
+}
+
+int twTasker_CreateTimer(uint32_t delayMsec, twTaskFunction func, void * params) {
+	return twTasker_CreateTaskEx(delayMsec, 0, func, params, TW_TASK_ONE_SHOT);
+}
+
+int twTasker_RemoveTask(int handle) {
+	int id = TASK_SLOT(handle);
+	if (!taskerMutex) return TW_TASK_NOT_FOUND;
+	twMutex_Lock(taskerMutex);
+	if (handle < 0 || id >= numTasks || twTasks[id].generation != TASK_GEN(handle) ||
+		twTasks[id].state == TASK_FREE || twTasks[id].removed) {
+		/* Didn't find the task, or it has already gone and the slot was reused */
+		twMutex_Unlock(taskerMutex);
+		return TW_TASK_NOT_FOUND;
+	}
+	if (twTasks[id].state == TASK_SCHEDULED) {
+		unschedule(id);
+		freeTask(id);
+	} else {
+		/* Freed when it comes off the ready queue or finishes running */
+		twTasks[id].removed = TRUE;
+	}
+	twMutex_Unlock(taskerMutex);
+	return TW_OK;
+}
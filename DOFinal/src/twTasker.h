@@ -17,8 +17,9 @@ extern "C" {
 /*       Tasker           */
 /**************************/
 /*
-twTaskFunction - function signature of a task.  Called in round robin
-fashion.  Task functions MUST return in a cooperative fashion.
+twTaskFunction - function signature of a task.  Called when the task is due.
+Task functions MUST return in a cooperative fashion.  Tasks created with
+TW_TASK_USE_WORKER run on the worker threads and may take longer.
 Parameters:
 	sys_msecs - the current non-rollover 64 bit msec counter value.  On a platform
 	            with millisecond datetime capabilities, this will be the current date/time
@@ -31,37 +32,91 @@ typedef void (*twTaskFunction) (uint64_t sys_msecs, void * params);
 /**************************/
 /*        Tasks           */
 /**************************/
+/* Task flags */
+#define TW_TASK_ONE_SHOT 0x01     /* Run once and then remove the task */
+#define TW_TASK_RUN_ON_WAKE 0x02  /* Also run whenever the tasker is woken by network activity */
+#define TW_TASK_USE_WORKER 0x04   /* Run on a worker thread instead of the tasker thread */
+
 typedef struct twTask {
    uint32_t runTimeIntervalMsec; 
    uint64_t nextRunTick; 
    twTaskFunction func;
+   void * params;
+   char flags;
+   char state;       /* Free, scheduled, waiting for a worker or running */
+   char removed;     /* Removed while it was waiting for a worker or running */
+   int heapIndex;    /* Position in the deadline heap while scheduled */
+   uint16_t generation; /* Bumped each time the slot is freed, part of the task id */
 } twTask;
 
 /*
-twTasker_Initialize - intializes the tasker.  Task functions are called
-in round robin fashion at a rate defined when the tasjks are added
+twTasker_Initialize - intializes the tasker.  Tasks are kept in a heap ordered by
+the time they are next due.  The tasker thread sleeps until the earliest one is
+due and runs it, or hands it to a worker thread.
 Parameters:
-	now - the current DATETIME
-	params - void pointer to the params of the function
+	None
 Return:
 	Nothing
 */
 void twTasker_Initialize();
 
 /*
-twTasker_CreateTask - adds a new task to the tasker
+twTasker_CreateTask - adds a new periodic task to the tasker.  The task is run right away
+and then every runTimeIntervalMsec.
 Parameters:
 	runTimeIntervalMsec - period (in msec) at whcih to call this task
 	func - pointer to the function to call when executing the task
 Return:
-	int - the id of the resulting task
+	int - the id of the resulting task or -1 if it could not be created
 */
 int twTasker_CreateTask(uint32_t runTimeIntervalMsec, twTaskFunction func);
 
 /*
-twTasker_RemoveTask - removes a task from the tasker
+twTasker_CreateIoTask - adds a new task to the tasker that is also run as soon as the
+tasker is woken by data arriving on the watched socket (see twTasker_WatchSocket) or
+by twTasker_Wake.  Use this for tasks that service the network so they don't have to
+poll at a high rate.
+Parameters:
+	runTimeIntervalMsec - period (in msec) at which to call this task when there is no network activity
+	func - pointer to the function to call when executing the task
+Return:
+	int - the id of the resulting task or -1 if it could not be created
+*/
+int twTasker_CreateIoTask(uint32_t runTimeIntervalMsec, twTaskFunction func);
+
+/*
+twTasker_CreateTimer - adds a one shot timer to the tasker.  The task is removed
+after it has run.
+Parameters:
+	delayMsec - time (in msec) to wait before calling the function
+	func - pointer to the function to call
+	params - passed to the function when it is called
+Return:
+	int - the id of the resulting task or -1 if it could not be created
+*/
+int twTasker_CreateTimer(uint32_t delayMsec, twTaskFunction func, void * params);
+
+/*
+twTasker_CreateTaskEx - adds a new task to the tasker.
+Parameters:
+	firstRunMsec - time (in msec) to wait before the first call to the task
+	runTimeIntervalMsec - period (in msec) at which to call this task.  Ignored for one shot tasks
+	func - pointer to the function to call when executing the task
+	params - passed to the function each time it is called
+	flags - combination of TW_TASK_ONE_SHOT, TW_TASK_RUN_ON_WAKE and TW_TASK_USE_WORKER.
+	If no worker threads are running TW_TASK_USE_WORKER tasks run on the tasker thread.
+Return:
+	int - the id of the resulting task or -1 if it could not be created
+*/
+int twTasker_CreateTaskEx(uint32_t firstRunMsec, uint32_t runTimeIntervalMsec, twTaskFunction func, void * params, char flags);
+
+/*
+twTasker_RemoveTask - removes a task from the tasker.  A task that is currently running
+is allowed to finish but is not run again.  Ids are not reused, so removing a task
+that has already gone (e.g. a one shot task that has run) fails with TW_TASK_NOT_FOUND
+and leaves any newer task alone.
 Parameters:
-	id - id of the task to remove
+	id - id of the task to remove, as returned when it was created
 Return:
 	int - zero if successful, non-zero if an error occurred
 */
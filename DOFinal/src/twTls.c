@@ -4,9 +4,14 @@
  *  Portable twTLS Client  abstraction layer
  */
 
+#define TW_LOG_MODULE TW_MODULE_WEBSOCKET
+
 #include "twOSPort.h"
 #include "twLogger.h"
 #include "twTls.h"
+#include "twDefaultSettings.h"
+
+#include <string.h>
 
 
 int twTlsClient_Create(const char * host, int16_t port, uint32_t options, twTlsClient ** client) {
@@ -133,6 +138,40 @@ int twTlsClient_Write(twTlsClient * t, char * buf, int len, int timeout) {
 	return res;
 }
 
+int twTlsClient_WriteV(twTlsClient * t, twIoVec * vec, int count, int timeout) {
+	int res = -1;
+#ifndef TW_SSL_WRITEV
+	char stackBuf[TLS_COALESCE_BUFFER_SIZE];
+	char * buf = stackBuf;
+	int len = 0;
+	int i = 0;
+#endif
+	if (!t || !t->ssl || !t->mtx || !vec) return -1;
+#ifdef TW_SSL_WRITEV
+	/* The TLS library can gather the pieces itself */
+	twMutex_Lock(t->mtx);
+	res = TW_SSL_WRITEV(t->ssl, vec, count);
+	twMutex_Unlock(t->mtx);
+#else
+	/* Coalesce the pieces so they go out as a single TLS record */
+	for (i = 0; i < count; i++) len += vec[i].len;
+	if (len > TLS_COALESCE_BUFFER_SIZE) {
+		buf = (char *)TW_MALLOC(len);
+		if (!buf) return -1;
+	}
+	len = 0;
+	for (i = 0; i < count; i++) {
+		memcpy(buf + len, vec[i].buf, vec[i].len);
+		len += vec[i].len;
+	}
+	twMutex_Lock(t->mtx);
+	res = TW_SSL_WRITE(t->ssl, buf, len);
+	twMutex_Unlock(t->mtx);
+	if (buf != stackBuf) TW_FREE(buf);
+#endif
+	return res;
+}
+
 int twTlsClient_Delete(twTlsClient * t) {
 	if (!t || !t->mtx) return TW_INVALID_PARAM;
 	twTlsClient_Close(t);
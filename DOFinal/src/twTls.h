@@ -37,6 +37,7 @@ int twTlsClient_Reconnect(twTlsClient* t, const char * host, int16_t port);
 int twTlsClient_Close(twTlsClient * t);
 int twTlsClient_Read(twTlsClient * t, char * buf, int len, int timeout);
 int twTlsClient_Write(twTlsClient * t, char * buf, int len, int timeout);
+int twTlsClient_WriteV(twTlsClient * t, twIoVec * vec, int count, int timeout);
 int twTlsClient_Delete(twTlsClient * t);
 
 void twTlsClient_SetSelfSignedOk(twTlsClient * t);
@@ -4,6 +4,8 @@
  *  Portable Websocket Client  abstraction layer
  */
 
+#define TW_LOG_MODULE TW_MODULE_WEBSOCKET
+
 #include "twOSPort.h"
 #include "twWebsocket.h"
 #include "twErrors.h"
@@ -38,7 +40,8 @@ signed char isLittleEndian = NOT_SET;
 * Websocket helper functions
 **/
 int sendCtlFrame(twWs * ws, unsigned char type, char * msg);
-int sendDataFrame(twWs * ws, char * msg, uint16_t length, char isContinuation, char isFinal, char isText);
+unsigned char makeFrameHeader(char * frameHeader, uint16_t length, char isContinuation, char isFinal, char isText);
+int sendDataFrame(twWs * ws, twIoVec * parts, int count, uint16_t length, char isContinuation, char isFinal, char isText);
 int validateAcceptKey(twWs * ws, const char * header_value);
 int32_t handleDataFrame(http_parser* parser, const char *at, size_t length, char isText, char isContinuation);
 
@@ -271,7 +274,8 @@ int twWs_Create(char * host, uint16_t port, char * resource, char * api_key, cha
 	ws->messagePtr = ws->messageBuffer;
 	/* Need 2X the max frame size to handle parsing */
 	ws->frameSize = frameSize;
-	ws->frameBuffer = (char *)TW_CALLOC((frameSize + WS_HEADER_MAX_SIZE), 1);
+	ws->frameBufferSize = 2 * (frameSize + WS_HEADER_MAX_SIZE);
+	ws->frameBuffer = (char *)TW_CALLOC(ws->frameBufferSize, 1);
 	if (!ws->frameBuffer) {
 		TW_LOG(TW_ERROR, "twWs_Create: Error allocating storage for websocket resource");
 		twWs_Delete(ws);
@@ -596,11 +600,28 @@ int twWs_RegisterPongCallback(twWs * ws, ws_data_cb cb) {
 	return TW_OK;
 }
 
+/* Returns the size of the frame at the start of buf including its header, or 0 if the header isn't all there yet */
+static uint64_t getFrameLength(const char * buf, uint32_t length) {
+	const unsigned char * b = (const unsigned char *)buf;
+	uint64_t payload = 0;
+	uint32_t headerSize = 2;
+	uint32_t i = 0;
+	if (length < 2) return 0;
+	/* Same rules as the parser */
+	if (b[1] == 126) headerSize = 4;
+	else if (b[1] > 126) headerSize = WS_HEADER_MAX_SIZE;
+	if (length < headerSize) return 0;
+	if (headerSize == 2) payload = b[1];
+	else for (i = 2; i < headerSize; i++) payload = payload * 256 + b[i];
+	return headerSize + payload;
+}
+
 /* Receive function for single threaded environments - does not return the data */
 int twWs_Receive(twWs * ws, uint32_t timeout) {
 	int32_t bytesRead = 0;
 	int32_t bytesParsed = 0;
-	int32_t size = WS_HEADER_MAX_SIZE;
+	uint32_t buffered = 0;
+	char * frame = NULL;
 
 	if (!ws) { 
 		TW_LOG(TW_ERROR, "twWs_Receive: NULL ws pointer"); 
@@ -612,58 +633,79 @@ int twWs_Receive(twWs * ws, uint32_t timeout) {
 	}
 	twMutex_Lock(ws->recvMutex);
 	/**** 
-	// We never want to read past frame data into another frame
-	// so read only the maximum size of a ws header first and then
-	// receive whatever remaining bytes are left in the frame.  The
-	// reamining bytes are held in the parser's content_length field 
-
-	// If we are not already receiving the frame content read just enough for the header
-	// else read the number of bytes left in the frame content
+	// Read as much as the socket has and we have room for, then parse every
+	// complete frame in the buffer.  Frames are always handed to the parser
+	// whole so it never holds on to a pointer into the buffer between calls.
+	// Whatever is left of the next frame is moved to the start of the buffer
+	// and picked up on the next call.
 	****/
-	if (ws->parser->state == 103 || ws->parser->state == 104) size = (int32_t)ws->parser->content_length;
-	bytesRead = twTlsClient_Read(ws->connection, ws->frameBufferPtr, size, 5);
-	if (bytesRead > 0) {
-		TW_LOG(TW_TRACE,"twWs_Receive: Read %d bytes into 0x%x", bytesRead, ws->frameBufferPtr);
-		bytesParsed = http_parser_execute(ws->parser, ws->settings, ws->frameBufferPtr, bytesRead);
-		if (bytesParsed == bytesRead) {
-			TW_LOG(TW_TRACE,"twWs_Receive: Parsed %d bytes out of %d", bytesParsed, bytesRead);
-			ws->frameBufferPtr = ws->frameBufferPtr + bytesRead;
-			/* If we are at the beginning of a frame, reset our pointer to the beginning */
-			if ((ws->parser->state == 101) || (ws->parser->state != 102 && ws->parser->state != 103 && ws->parser->state != 104)) {
-				ws->frameBufferPtr = ws->frameBuffer;
-			} 
-			if (ws->frameBufferPtr > ws->frameBuffer + ws->frameSize) {
-				TW_LOG(TW_ERROR,"twWs_Receive: BUFFER OVERRUN!  Something has gone terribly wrong.  Resetting buffer");
-				ws->frameBufferPtr = ws->frameBuffer;
-			}
-			bytesRead = 0;
-			twMutex_Unlock(ws->recvMutex);
-			return TW_OK;
-		} else {
-			if (bytesRead) TW_LOG(TW_WARN,"twWs_Receive: Only parsed %d bytes out of %d", bytesParsed, bytesRead);
+	bytesRead = twTlsClient_Read(ws->connection, ws->frameBufferPtr, ws->frameBufferSize - (ws->frameBufferPtr - ws->frameBuffer), timeout);
+	if (bytesRead < 0) {
+		TW_LOG(TW_WARN,"twWs_Receive: Error reading from socket.  Error: %d", twSocket_GetLastError());
+		ws->isConnected = FALSE;
+		if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
+		twMutex_Unlock(ws->recvMutex);
+		restartSocket(ws);
+		return TW_ERROR_READING_FROM_WEBSOCKET;
+	}
+	/* The tasker only hears about the socket once per read, let it know about the next data */
+	twTasker_WatchSocket(ws->connection->connection);
+	if (!bytesRead) {
+		twMutex_Unlock(ws->recvMutex);
+		return TW_OK;
+	}
+	TW_LOG(TW_TRACE,"twWs_Receive: Read %d bytes into 0x%x", bytesRead, ws->frameBufferPtr);
+	ws->frameBufferPtr += bytesRead;
+	frame = ws->frameBuffer;
+	while (ws->isConnected) {
+		uint32_t available = ws->frameBufferPtr - frame;
+		uint64_t length = getFrameLength(frame, available);
+		if (length > ws->frameBufferSize) {
+			TW_LOG(TW_ERROR,"twWs_Receive: Frame of %llu bytes is larger than the %u byte receive buffer", 
+				(unsigned long long)length, ws->frameBufferSize);
+			ws->isConnected = FALSE;
+			if (ws->on_ws_close) ws->on_ws_close(ws, "Frame Too Large", strlen("Frame Too Large"));
 			twMutex_Unlock(ws->recvMutex);
+			restartSocket(ws);
 			return TW_ERROR_PARSING_WEBSOCKET_DATA;
 		}
-	} else {
-		if (bytesRead < 0) {
-			TW_LOG(TW_WARN,"twWs_Receive: Error reading from socket.  Error: %d", twSocket_GetLastError());
-			ws->isConnected = FALSE;
-			if (ws && ws->on_ws_close) ws->on_ws_close(ws, "Socket Error", strlen("Socket Error"));
+		if (!length || length > available) break;
+		bytesParsed = http_parser_execute(ws->parser, ws->settings, frame, (size_t)length);
+		if (bytesParsed != (int32_t)length) {
+			TW_LOG(TW_WARN,"twWs_Receive: Only parsed %d bytes out of %d", bytesParsed, (int32_t)length);
+			ws->frameBufferPtr = ws->frameBuffer;
 			twMutex_Unlock(ws->recvMutex);
-			restartSocket(ws);
-			return TW_ERROR_READING_FROM_WEBSOCKET;
+			return TW_ERROR_PARSING_WEBSOCKET_DATA;
 		}
-		twMutex_Unlock(ws->recvMutex);
-		return TW_OK;
+		frame += length;
 	}
+	/* Keep the start of the next frame for the next call */
+	buffered = ws->frameBufferPtr - frame;
+	if (buffered && frame != ws->frameBuffer) memmove(ws->frameBuffer, frame, buffered);
+	ws->frameBufferPtr = ws->frameBuffer + buffered;
+	TW_LOG(TW_TRACE,"twWs_Receive: Parsed %d bytes, %d left for the next frame", (int32_t)(frame - ws->frameBuffer), buffered);
+	twMutex_Unlock(ws->recvMutex);
+	return TW_OK;
 }
 
 
 int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText) {
+	twIoVec vec;
+	vec.buf = buf;
+	vec.len = length;
+	return twWs_SendMessageV(ws, &vec, 1, isText);
+}
+
+int twWs_SendMessageV(twWs * ws, twIoVec * parts, int count, char isText) {
 
-	char * ptr = buf;
+	twIoVec frameParts[TW_MAX_IO_VECS];
+	uint32_t length = 0;
+	uint32_t sent = 0;
+	int part = 0;
+	int offset = 0;
 	char framesSent = 0;
 	int res = -1;
+	int i = 0;
 
 	/* Do some status checks */
 	if (!ws) { 
@@ -675,8 +717,12 @@ int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText) {
 		return TW_WEBSOCKET_NOT_CONNECTED; 
 	}
 
-	/* Make sure we have a message and it fits in a frame */
-	if (!buf) { TW_LOG(TW_ERROR, "twWs_SendMessage: NULL msg pointer"); return -1; }
+	/* Make sure we have a message and it fits in a frame.  One vector is reserved for the frame header */
+	if (!parts || count <= 0 || count >= TW_MAX_IO_VECS) { TW_LOG(TW_ERROR, "twWs_SendMessage: NULL msg pointer or invalid part count %d", count); return -1; }
+	for (i = 0; i < count; i++) {
+		if (!parts[i].buf && parts[i].len) { TW_LOG(TW_ERROR, "twWs_SendMessage: NULL msg pointer"); return -1; }
+		length += parts[i].len;
+	}
 	if (length == 0) { TW_LOG(TW_ERROR, "twWs_SendMessage: Message length is 0.  Not sending"); return -1; }
 	if (ws->messageChunkSize < length) { 
 		TW_LOG(TW_ERROR, "twWs_SendMessage: Frame of length %d is too large.  Max frame size is %u", 
@@ -685,38 +731,98 @@ int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText) {
 	}
 
 	twMutex_Lock(ws->sendMessageMutex);
-	while (length > 0) {
-		if (length > ws->frameSize) {
-			if (framesSent) res = sendDataFrame(ws, ptr, length, 1, 0, isText); /* Continuation, not Final */
-			else {
-				res = sendDataFrame(ws, ptr, length, 0, 0, isText); /* Not Continuation, not Final */
+	while (sent < length) {
+		/* Gather the next frame's worth of data from the parts */
+		uint16_t frameLength = (length - sent > ws->frameSize) ? ws->frameSize : (uint16_t)(length - sent);
+		uint16_t gathered = 0;
+		int numFrameParts = 0;
+		while (gathered < frameLength) {
+			int n = parts[part].len - offset;
+			if (n > frameLength - gathered) n = frameLength - gathered;
+			if (n > 0) {
+				frameParts[numFrameParts].buf = parts[part].buf + offset;
+				frameParts[numFrameParts].len = n;
+				numFrameParts++;
+				gathered += n;
+				offset += n;
 			}
-			if (res != 0) {
-				TW_LOG(TW_ERROR, "twWs_SendMessage: Error sending frame %d. Error code: %d", framesSent, twSocket_GetLastError());
-				twMutex_Unlock(ws->sendMessageMutex);
-				return res;
+			if (offset >= parts[part].len) {
+				part++;
+				offset = 0;
 			}
-			framesSent++;
-			ptr = ptr + ws->frameSize;
-			length = length - ws->frameSize;
-		} else {
-			if (framesSent) res = sendDataFrame(ws, ptr, length, 1, 1, isText); /* Continuation, Final */
-			else {
-				res = sendDataFrame(ws, ptr, length, 0, 1, isText); /* Not Continuation, not Final */
-			}
-			if (res != 0) {
-				TW_LOG(TW_ERROR, "twWs_SendMessage: Error sending frame %d. Error code: %d", framesSent, twSocket_GetLastError());
+		}
+		res = sendDataFrame(ws, frameParts, numFrameParts, frameLength, framesSent ? 1 : 0, (sent + frameLength == length), isText);
+		if (res != 0) {
+			TW_LOG(TW_ERROR, "twWs_SendMessage: Error sending frame %d. Error code: %d", framesSent, twSocket_GetLastError());
+			twMutex_Unlock(ws->sendMessageMutex);
+			return res;
+		}
+		framesSent++;
+		sent += frameLength;
+	}
+	TW_LOG(TW_DEBUG,"twWs_SendMessage: Sent %d bytes using %d frames.", sent, framesSent);
+	if (TW_LOG_ENABLED(TW_TRACE)) {
+		for (i = 0; i < count; i++) TW_LOG_HEX(parts[i].buf, "Sent Message >>>>\n", parts[i].len);
+	}
+	twMutex_Unlock(ws->sendMessageMutex);
+	return TW_OK;
+}
+
+int twWs_SendMessageBatch(twWs * ws, twIoVec * msgs, int count, char isText, int * sent) {
+
+	char headers[TW_MAX_IO_VECS / 2][WS_HEADER_MAX_SIZE];
+	twIoVec vec[TW_MAX_IO_VECS];
+	int numVecs = 0;
+	int bytesToWrite = 0;
+	int bytesWritten = 0;
+	int res = TW_OK;
+	int i = 0;
+
+	if (sent) *sent = 0;
+	if (!ws || !msgs || !sent) { 
+		TW_LOG(TW_ERROR, "twWs_SendMessageBatch: NULL input parameter"); 
+		return TW_INVALID_PARAM; 
+	}
+	if (!ws->isConnected) { 
+		TW_LOG(TW_WARN, "twWs_SendMessageBatch: Not connected"); 
+		return TW_WEBSOCKET_NOT_CONNECTED; 
+	}
+
+	for (i = 0; i < count; i++) {
+		if (msgs[i].len > ws->frameSize || msgs[i].len == 0) {
+			/* Messages that need more than one frame go on their own */
+			res = twWs_SendMessage(ws, msgs[i].buf, msgs[i].len, isText);
+			if (res) return res;
+			*sent = i + 1;
+			continue;
+		}
+		/* Each message is a single final frame, gather the header and the payload */
+		vec[numVecs].buf = headers[numVecs / 2];
+		vec[numVecs].len = makeFrameHeader(headers[numVecs / 2], (uint16_t)msgs[i].len, 0, 1, isText);
+		vec[numVecs + 1] = msgs[i];
+		bytesToWrite += vec[numVecs].len + msgs[i].len;
+		numVecs += 2;
+		if (numVecs + 2 > TW_MAX_IO_VECS || i + 1 == count || msgs[i + 1].len > ws->frameSize || msgs[i + 1].len == 0) {
+			/* Send everything gathered so far in one write */
+			twMutex_Lock(ws->sendMessageMutex);
+			twMutex_Lock(ws->sendFrameMutex);
+			bytesWritten = twTlsClient_WriteV(ws->connection, vec, numVecs, 100);
+			if (bytesWritten != bytesToWrite) {
+				TW_LOG(TW_WARN,"twWs_SendMessageBatch: Error writing to socket.  Error: %d", twSocket_GetLastError());
+				ws->isConnected = FALSE;
+				twMutex_Unlock(ws->sendFrameMutex);
 				twMutex_Unlock(ws->sendMessageMutex);
-				return res;
+				restartSocket(ws);
+				return TW_ERROR_WRITING_TO_WEBSOCKET;
 			}
-			framesSent++;
-			ptr = ptr + length;
-			length = 0;
+			twMutex_Unlock(ws->sendFrameMutex);
+			twMutex_Unlock(ws->sendMessageMutex);
+			TW_LOG(TW_DEBUG,"twWs_SendMessageBatch: Sent %d messages, %d bytes in one write.", numVecs / 2, bytesToWrite);
+			*sent = i + 1;
+			numVecs = 0;
+			bytesToWrite = 0;
 		}
 	}
-	TW_LOG(TW_DEBUG,"twWs_SendMessage: Sent %d bytes using %d frames.", ptr - buf, framesSent);
-	TW_LOG_HEX(buf, "Sent Message >>>>\n", ptr - buf);
-	twMutex_Unlock(ws->sendMessageMutex);
 	return TW_OK;
 }
 
@@ -788,13 +894,36 @@ int sendCtlFrame(twWs * ws, unsigned char type, char * msg) {
 	return res;
 }
 
-int sendDataFrame(twWs * ws, char * msg, uint16_t length, char isContinuation, char isFinal, char isText) {
+unsigned char makeFrameHeader(char * frameHeader, uint16_t length, char isContinuation, char isFinal, char isText) {
+	unsigned char headerLength = 6;
+	char type = 0x02;  /* Default to Binary complete frame */
+	/* Figure out the type */
+	if (isText) type = 0x01;
+	if (isContinuation) type = 0x00;
+	if (isFinal) type = type | 0x80;
+	/* Prep the header */
+	memset(frameHeader,0,WS_HEADER_MAX_SIZE);
+	frameHeader[0] = type;
+	/* Set up the length */
+	if (length < 126) frameHeader[1] = 0x80 + length;
+	else {
+		headerLength = 8;
+		frameHeader[1] = (char)0xFE; /* (char)(0x80 + 126); */
+		frameHeader[2] = (char)(length / 0x100);
+		frameHeader[3] = (char)(length % 0x100);
+	} 
+	/* Masking is set to 0x00 so nothing else to do */
+	return headerLength;
+}
+
+int sendDataFrame(twWs * ws, twIoVec * parts, int count, uint16_t length, char isContinuation, char isFinal, char isText) {
 
 	int bytesToWrite = 0;
 	int bytesWritten = 0;
-	char frameHeader[12];
-	unsigned char headerLength = 6;
-	char type = 0x02;  /* Default to Binary complete frame */
+	char frameHeader[WS_HEADER_MAX_SIZE];
+	unsigned char headerLength = 0;
+	twIoVec vec[TW_MAX_IO_VECS];
+	int i = 0;
 
 	/* Do some status checks */
 	if (!ws) { 
@@ -807,7 +936,7 @@ int sendDataFrame(twWs * ws, char * msg, uint16_t length, char isContinuation, c
 	}
 
 	/* Make sure we have a message and it fits in a frame */
-	if (!msg) { TW_LOG(TW_ERROR, "sendDataFrame: NULL msg pointer"); return -1; }
+	if (!parts || count <= 0 || count >= TW_MAX_IO_VECS) { TW_LOG(TW_ERROR, "sendDataFrame: NULL msg pointer or invalid part count %d", count); return -1; }
 	if (ws->frameSize < length) { 
 		TW_LOG(TW_WARN, "sendDataFrame: Frame of length %d is too large.  Max frame size is %u", 
 		length, ws->frameSize); 
@@ -815,25 +944,13 @@ int sendDataFrame(twWs * ws, char * msg, uint16_t length, char isContinuation, c
 	}
 
 	twMutex_Lock(ws->sendFrameMutex);
-	/* Figure out the type */
-	if (isText) type = 0x01;
-	if (isContinuation) type = 0x00;
-	if (isFinal) type = type | 0x80;
-	/* Prep the header */
-	memset(frameHeader,0,12);
-	frameHeader[0] = type;
-	/* Set up the length */
-	if (length < 126) frameHeader[1] = 0x80 + length;
-	else {
-		headerLength = 8;
-		frameHeader[1] = (char)0xFE; /* (char)(0x80 + 126); */
-		frameHeader[2] = (char)(length / 0x100);
-		frameHeader[3] = (char)(length % 0x100);
-	} 
-	/* Masking is set to 0x00 so nothing else to do */
+	headerLength = makeFrameHeader(frameHeader, length, isContinuation, isFinal, isText);
 	bytesToWrite = headerLength + length;
-	bytesWritten += twTlsClient_Write(ws->connection, frameHeader, headerLength, 100);
-	bytesWritten += twTlsClient_Write(ws->connection, msg, length, 100);
+	/* Send the header and the payload in one write */
+	vec[0].buf = frameHeader;
+	vec[0].len = headerLength;
+	for (i = 0; i < count; i++) vec[i + 1] = parts[i];
+	bytesWritten = twTlsClient_WriteV(ws->connection, vec, count + 1, 100);
 
 	if (bytesWritten != bytesToWrite) {
 		TW_LOG(TW_WARN,"sendDataFrame: Error writing to socket.  Error: %d", twSocket_GetLastError());
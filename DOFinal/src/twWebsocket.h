@@ -64,8 +64,9 @@ typedef struct twWs{
 	uint16_t frameSize;
 	char * messageBuffer;
 	char * messagePtr;
-	char * frameBuffer;
-	char * frameBufferPtr;
+	char * frameBuffer;      /* Read ahead buffer, whole frames are parsed from the start of it */
+	char * frameBufferPtr;   /* End of the bytes read but not parsed yet */
+	uint32_t frameBufferSize;
 	char * host;
 	uint16_t port;
 	char * api_key;
@@ -220,7 +221,9 @@ int twWs_RegisterPongCallback(twWs * ws, ws_data_cb cb);
 /*
 twWs_Receive - check the websocket for data and drive the state machine of the websocket.  
 	This function must be called on a regular basis.  No data is returned as the data
-	is delivered thorugh the state machine callback functions.
+	is delivered thorugh the state machine callback functions.  Everything the socket has
+	is read in one go and every complete frame is delivered.  The start of an incomplete 
+	frame is kept for the next call.
 Parameters:
 	ws - the websocket structure to operate on
 	timeout - time (in msec) to wait for data on the socket
@@ -242,6 +245,35 @@ Return:
 */
 int twWs_SendMessage(twWs * ws, char * buf, uint32_t length, char isText);
 
+/*
+twWs_SendMessageV - send a message that is split over several buffers over the websocket.
+	The buffers are gathered into frames and each frame is written to the socket in a
+	single call, so nothing has to be copied into a contiguous buffer first.
+Parameters:
+	ws - the websocket structure to operate on
+	parts - array of buffers that make up the message, in order
+	count - number of buffers.  Must be less than TW_MAX_IO_VECS
+	isText - boolean, if TRU send as a text message, if FALSE send as binary
+Return:
+	int - 0 if success, non-zero if a failure occured.
+*/
+int twWs_SendMessageV(twWs * ws, twIoVec * parts, int count, char isText);
+
+/*
+twWs_SendMessageBatch - send a batch of messages over the websocket.  Messages that fit in a
+	single frame are gathered together so many of them go out in one write.  Larger messages
+	are sent on their own with twWs_SendMessage.
+Parameters:
+	ws - the websocket structure to operate on
+	msgs - array of buffers, each holding one complete message
+	count - number of messages
+	isText - boolean, if TRU send as a text message, if FALSE send as binary
+	sent - pointer that receives the number of messages from the start of the batch that were sent
+Return:
+	int - 0 if success, non-zero if a failure occured.
+*/
+int twWs_SendMessageBatch(twWs * ws, twIoVec * msgs, int count, char isText, int * sent);
+
 /*
 twWs_SendPing - send a Ping message over the websocket.  Message data MUST be NULL terminated.
 Parameters:
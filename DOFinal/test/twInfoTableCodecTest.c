@@ -0,0 +1,158 @@
+/*
+ *  Copyright (C) 2014 ThingWorx Inc.
+ *
+ *  Decode tests for the compiled InfoTable codec
+ *
+ *  Encodes two rows with a short and a long (4 byte length) string, then decodes the
+ *  whole table and the table cut off at every byte of its rows.  A truncated table has to fail without
+ *  freeing a string the decode didn't set and without leaving any rows behind.
+ *  The encoded table is also compared with twInfoTable_ToStream of the same rows and
+ *  parsed back with twInfoTable_CreateFromStream.
+ *  Exits with 0 if all the tests pass.
+ *
+ *  Build from DOFinal/test:
+ *    gcc -std=gnu99 -g -fsanitize=address -I../src twInfoTableCodecTest.c ../src/[a-z]*.c -lpthread -lm -o twInfoTableCodecTest
+ */
+
+#include "twInfoTableCodec.h"
+#include "twInfoTable.h"
+#include "twLogger.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LONG_STRING_LENGTH 300
+
+typedef struct noteRow {
+	DATETIME time;
+	char * name;
+	char * note;
+} noteRow;
+
+/* Anything the decode didn't set keeps this, freeing it would crash */
+static char * untouched = "untouched";
+
+static int failures = 0;
+
+static void check(int ok, const char * what, uint32_t length) {
+	if (ok) return;
+	printf("FAILED: %s (stream length %u)\n", what, length);
+	failures++;
+}
+
+static twDataShape * createShape() {
+	twDataShape * ds = twDataShape_Create(twDataShapeEntry_Create("time", NULL, TW_DATETIME));
+	twDataShape_AddEntry(ds, twDataShapeEntry_Create("name", NULL, TW_STRING));
+	twDataShape_AddEntry(ds, twDataShapeEntry_Create("note", NULL, TW_STRING));
+	return ds;
+}
+
+/* Builds the rows as a twInfoTable, the way they would be sent without the codec */
+static twInfoTable * createInfoTable(const noteRow * rows, int numRows) {
+	twInfoTable * it = twInfoTable_Create(createShape());
+	int i = 0;
+	for (i = 0; it && i < numRows; i++) {
+		twInfoTableRow * row = twInfoTableRow_Create(twPrimitive_CreateFromDatetime(rows[i].time));
+		twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(rows[i].name, TRUE));
+		twInfoTableRow_AddEntry(row, twPrimitive_CreateFromString(rows[i].note, TRUE));
+		twInfoTable_AddRow(it, row);
+	}
+	return it;
+}
+
+static int rowMatches(twInfoTable * it, int32_t row, const noteRow * expected) {
+	DATETIME time = 0;
+	char * name = NULL;
+	char * note = NULL;
+	int ok = !twInfoTable_GetDatetime(it, "time", row, &time) && !twInfoTable_GetString(it, "name", row, &name) &&
+		!twInfoTable_GetString(it, "note", row, &note) && time == expected->time &&
+		!strcmp(name, expected->name) && !strcmp(note, expected->note);
+	if (name) TW_FREE(name);
+	if (note) TW_FREE(note);
+	return ok;
+}
+
+int main() {
+	twDataShape * ds = NULL;
+	twInfoTableCodec * codec = NULL;
+	twStream * encoded = NULL;
+	const uint32_t offsets[] = { offsetof(noteRow, time), offsetof(noteRow, name), offsetof(noteRow, note) };
+	char longNote[LONG_STRING_LENGTH + 1];
+	noteRow in[2];
+	noteRow out[2];
+	uint32_t numRows = 0;
+	uint32_t length = 0;
+	int res = 0;
+	int i = 0;
+	twLogger_SetLevel(TW_FORCE);
+	memset(longNote, 'n', LONG_STRING_LENGTH);
+	longNote[LONG_STRING_LENGTH] = 0;
+	in[0].time = 1000;
+	in[0].name = "first";
+	in[0].note = "short";
+	in[1].time = 2000;
+	in[1].name = "second";
+	in[1].note = longNote;
+	ds = createShape();
+	codec = twInfoTableCodec_Create(ds, offsets, sizeof(noteRow));
+	twDataShape_Delete(ds);
+	encoded = twStream_Create();
+	if (!codec || !encoded || twInfoTableCodec_Encode(codec, in, 2, encoded)) {
+		printf("FAILED: Error creating the codec or encoding the rows\n");
+		return 1;
+	}
+	/* The whole table */
+	length = twStream_GetLength(encoded);
+	{
+		twStream * s = twStream_CreateFromCharArrayZeroCopy(twStream_GetData(encoded), length);
+		res = twInfoTableCodec_Decode(codec, s, out, 2, &numRows);
+		check(res == TW_OK && numRows == 2, "decoding the whole table", length);
+		if (!res && numRows == 2) {
+			check(out[0].time == 1000 && !strcmp(out[0].name, "first") && !strcmp(out[0].note, "short"), "first row", length);
+			check(out[1].time == 2000 && !strcmp(out[1].name, "second") && !strcmp(out[1].note, longNote), "second row", length);
+		}
+		twInfoTableCodec_FreeRows(codec, out, numRows);
+		twStream_Delete(s);
+	}
+	/* The same bytes as twInfoTable_ToStream, and readable by twInfoTable_CreateFromStream */
+	length = twStream_GetLength(encoded);
+	{
+		twInfoTable * it = createInfoTable(in, 2);
+		twStream * s = twStream_Create();
+		check(it && s && !twInfoTable_ToStream(it, s), "serializing the twInfoTable", length);
+		check(twStream_GetLength(s) == length && !memcmp(twStream_GetData(s), twStream_GetData(encoded), length),
+			"encoded table differs from twInfoTable_ToStream", length);
+		twInfoTable_Delete(it);
+		twStream_Delete(s);
+		s = twStream_CreateFromCharArrayZeroCopy(twStream_GetData(encoded), length);
+		it = twInfoTable_CreateFromStream(s);
+		check(it && it->rows && it->rows->count == 2, "parsing the encoded table with twInfoTable_CreateFromStream", length);
+		if (it && it->rows && it->rows->count == 2) {
+			check(rowMatches(it, 0, &in[0]), "first row from twInfoTable_CreateFromStream", length);
+			check(rowMatches(it, 1, &in[1]), "second row from twInfoTable_CreateFromStream", length);
+		}
+		if (it) twInfoTable_Delete(it);
+		twStream_Delete(s);
+	}
+	/* Every truncation of the rows, including ones in the long string and its length */
+	for (length = codec->shapeLength; length < (uint32_t)twStream_GetLength(encoded); length++) {
+		twStream * s = twStream_CreateFromCharArrayZeroCopy(twStream_GetData(encoded), length);
+		for (i = 0; i < 2; i++) out[i].name = out[i].note = untouched;
+		numRows = 99;
+		res = twInfoTableCodec_Decode(codec, s, out, 2, &numRows);
+		check(res != TW_OK, "truncated table decoded", length);
+		check(numRows == 0, "rows left behind", length);
+		/* FreeRows NULLs the strings of rows that were decoded before the error */
+		check(out[1].note == untouched || out[1].note == NULL, "string left from a truncated table", length);
+		twStream_Delete(s);
+	}
+	twStream_Delete(encoded);
+	twInfoTableCodec_Delete(codec);
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}